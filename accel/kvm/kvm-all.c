@@ -648,7 +648,10 @@ static bool kvm_slot_get_dirty_log(KVMState *s, KVMSlot *slot)
     return ret == 0;
 }
 
-/* Should be with all slots_lock held for the address spaces. */
+/*
+ * Should be with all slots_lock held for the address spaces.  The rings of
+ * several vCPUs can be reaped in parallel, so the bit is set atomically.
+ */
 static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
                                      uint32_t slot_id, uint64_t offset)
 {
@@ -667,7 +670,7 @@ static void kvm_dirty_ring_mark_page(KVMState *s, uint32_t as_id,
         return;
     }
 
-    set_bit(offset, mem->dirty_bmap);
+    set_bit_atomic(offset, mem->dirty_bmap);
 }
 
 static bool dirty_gfn_is_dirtied(struct kvm_dirty_gfn *gfn)
@@ -740,6 +743,66 @@ static uint32_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
     return count;
 }
 
+/* Reaps the vCPUs of the current parallel reap until none is left */
+static uint32_t kvm_dirty_ring_reap_some(KVMState *s)
+{
+    struct KVMDirtyRingReaper *r = &s->reaper;
+    uint32_t total = 0;
+    unsigned i;
+
+    while ((i = qatomic_fetch_inc(&r->next_cpu)) < r->cpus->len) {
+        total += kvm_dirty_ring_reap_one(s, g_ptr_array_index(r->cpus, i));
+    }
+
+    return total;
+}
+
+static void *kvm_dirty_ring_reap_helper_thread(void *data)
+{
+    KVMState *s = data;
+    struct KVMDirtyRingReaper *r = &s->reaper;
+
+    rcu_register_thread();
+
+    while (true) {
+        qemu_sem_wait(&r->helper_sem);
+        qatomic_add(&r->helper_total, kvm_dirty_ring_reap_some(s));
+        qemu_sem_post(&r->helper_done);
+    }
+
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+/*
+ * Must be with slots_lock held.  Reaps the rings of all vCPUs together
+ * with the helper threads, which run without taking the lock themselves.
+ */
+static uint32_t kvm_dirty_ring_reap_parallel(KVMState *s)
+{
+    struct KVMDirtyRingReaper *r = &s->reaper;
+    CPUState *cpu;
+    uint32_t total, i;
+
+    g_ptr_array_set_size(r->cpus, 0);
+    CPU_FOREACH(cpu) {
+        g_ptr_array_add(r->cpus, cpu);
+    }
+    r->next_cpu = 0;
+    r->helper_total = 0;
+
+    for (i = 0; i < r->nr_helpers; i++) {
+        qemu_sem_post(&r->helper_sem);
+    }
+    total = kvm_dirty_ring_reap_some(s);
+    for (i = 0; i < r->nr_helpers; i++) {
+        qemu_sem_wait(&r->helper_done);
+    }
+
+    return total + qatomic_read(&r->helper_total);
+}
+
 /* Must be with slots_lock held */
 static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
 {
@@ -751,6 +814,8 @@ static uint64_t kvm_dirty_ring_reap_locked(KVMState *s, CPUState* cpu)
 
     if (cpu) {
         total = kvm_dirty_ring_reap_one(s, cpu);
+    } else if (s->reaper.nr_helpers) {
+        total = kvm_dirty_ring_reap_parallel(s);
     } else {
         CPU_FOREACH(cpu) {
             total += kvm_dirty_ring_reap_one(s, cpu);
@@ -1491,6 +1556,20 @@ static void *kvm_dirty_ring_reaper_thread(void *data)
 static void kvm_dirty_ring_reaper_init(KVMState *s)
 {
     struct KVMDirtyRingReaper *r = &s->reaper;
+    uint32_t i;
+
+    if (s->kvm_dirty_ring_reap_threads > 1) {
+        r->nr_helpers = s->kvm_dirty_ring_reap_threads - 1;
+        r->cpus = g_ptr_array_new();
+        qemu_sem_init(&r->helper_sem, 0);
+        qemu_sem_init(&r->helper_done, 0);
+        r->helper_thr = g_new0(QemuThread, r->nr_helpers);
+        for (i = 0; i < r->nr_helpers; i++) {
+            qemu_thread_create(&r->helper_thr[i], "kvm-reap-helper",
+                               kvm_dirty_ring_reap_helper_thread,
+                               s, QEMU_THREAD_JOINABLE);
+        }
+    }
 
     qemu_thread_create(&r->reaper_thr, "kvm-reaper",
                        kvm_dirty_ring_reaper_thread,
@@ -3727,6 +3806,39 @@ static void kvm_set_dirty_ring_size(Object *obj, Visitor *v,
     s->kvm_dirty_ring_size = value;
 }
 
+static void kvm_get_dirty_ring_reap_threads(Object *obj, Visitor *v,
+                                            const char *name, void *opaque,
+                                            Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value = s->kvm_dirty_ring_reap_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void kvm_set_dirty_ring_reap_threads(Object *obj, Visitor *v,
+                                            const char *name, void *opaque,
+                                            Error **errp)
+{
+    KVMState *s = KVM_STATE(obj);
+    uint32_t value;
+
+    if (s->fd != -1) {
+        error_setg(errp, "Cannot set properties after the accelerator has been initialized");
+        return;
+    }
+
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value) {
+        error_setg(errp, "dirty-ring-reap-threads must be at least 1.");
+        return;
+    }
+
+    s->kvm_dirty_ring_reap_threads = value;
+}
+
 static char *kvm_get_device(Object *obj,
                             Error **errp G_GNUC_UNUSED)
 {
@@ -3757,6 +3869,7 @@ static void kvm_accel_instance_init(Object *obj)
     /* KVM dirty ring is by default off */
     s->kvm_dirty_ring_size = 0;
     s->kvm_dirty_ring_with_bitmap = false;
+    s->kvm_dirty_ring_reap_threads = 1;
     s->kvm_eager_split_size = 0;
     s->notify_vmexit = NOTIFY_VMEXIT_OPTION_RUN;
     s->notify_window = 0;
@@ -3804,6 +3917,12 @@ static void kvm_accel_class_init(ObjectClass *oc, void *data)
     object_class_property_set_description(oc, "dirty-ring-size",
         "Size of KVM dirty page ring buffer (default: 0, i.e. use bitmap)");
 
+    object_class_property_add(oc, "dirty-ring-reap-threads", "uint32",
+        kvm_get_dirty_ring_reap_threads, kvm_set_dirty_ring_reap_threads,
+        NULL, NULL);
+    object_class_property_set_description(oc, "dirty-ring-reap-threads",
+        "Number of threads that collect the KVM dirty rings (default: 1)");
+
     object_class_property_add_str(oc, "device", kvm_get_device, kvm_set_device);
     object_class_property_set_description(oc, "device",
         "Path to the device node to use (default: /dev/kvm)");
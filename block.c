@@ -1824,6 +1824,12 @@ QemuOptsList bdrv_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "always accept other writers (default: off)",
         },
+        {
+            .name = BDRV_OPT_CHILD_STATS,
+            .type = QEMU_OPT_BOOL,
+            .help = "collect statistics about the requests sent to the "
+                    "children (default: off)",
+        },
         { /* end of list */ }
     },
 };
@@ -1884,6 +1890,7 @@ static int bdrv_open_common(BlockDriverState *bs, BlockBackend *file,
     assert(drv != NULL);
 
     bs->force_share = qemu_opt_get_bool(opts, BDRV_OPT_FORCE_SHARE, false);
+    bs->child_stats = qemu_opt_get_bool(opts, BDRV_OPT_CHILD_STATS, false);
 
     if (bs->force_share && (bs->open_flags & BDRV_O_RDWR)) {
         error_setg(errp,
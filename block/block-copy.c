@@ -33,6 +33,14 @@
 #define BLOCK_COPY_MAX_BUFFER (1 * MiB)
 #define BLOCK_COPY_MAX_MEM (128 * MiB)
 #define BLOCK_COPY_MAX_WORKERS 64
+/*
+ * Write-zeroes tasks and skipped unallocated areas don't need a buffer, so
+ * they may be much larger than a buffered copy.  Block-status is queried for
+ * up to BLOCK_COPY_STATUS_LOOKAHEAD bytes at once, and the result is reused
+ * for the following tasks.
+ */
+#define BLOCK_COPY_MAX_WRITE_ZEROES (256 * MiB)
+#define BLOCK_COPY_STATUS_LOOKAHEAD (1 * GiB)
 #define BLOCK_COPY_SLICE_TIME 100000000ULL /* ns */
 #define BLOCK_COPY_CLUSTER_SIZE_DEFAULT (1 << 16)
 
@@ -61,6 +69,13 @@ typedef struct BlockCopyCallState {
 
     /* Fields whose state changes throughout the execution */
     bool finished; /* atomic */
+    /*
+     * Cached result of the last block-status query.  Only accessed by the
+     * coroutine running block_copy_dirty_clusters().
+     */
+    int64_t status_offset;
+    int64_t status_bytes;
+    int status_ret;
     QemuCoSleep sleep; /* TODO: protect API with a lock */
     bool cancelled; /* atomic */
     /* To reference all call states from BlockCopyState */
@@ -101,8 +116,10 @@ typedef struct BlockCopyTask {
     /*
      * Generally, req is protected by lock in BlockCopyState, Still req.offset
      * is only set on task creation, so may be read concurrently after creation.
-     * req.bytes is changed at most once, and need only protecting the case of
-     * parallel read while updating @bytes value in block_copy_task_shrink().
+     * req.bytes is changed at most twice, before the task starts copying:
+     * first by block_copy_task_shrink(), then by block_copy_task_grow().  Both
+     * update it under the lock, so it need only be protected against parallel
+     * reads during these two calls.
      */
     BlockReq req;
 } BlockCopyTask;
@@ -247,6 +264,46 @@ static void coroutine_fn block_copy_task_shrink(BlockCopyTask *task,
     reqlist_shrink_req(&task->req, new_bytes);
 }
 
+/*
+ * block_copy_task_grow
+ *
+ * Extend the task by the dirty area directly following it, so that it covers
+ * at most @max_bytes.  Only makes sense for tasks that don't need a bounce
+ * buffer.
+ */
+static void coroutine_fn block_copy_task_grow(BlockCopyTask *task,
+                                              int64_t max_bytes)
+{
+    BlockCopyState *s = task->s;
+    int64_t offset, bytes;
+
+    QEMU_LOCK_GUARD(&s->lock);
+    if (max_bytes <= task->req.bytes ||
+        !bdrv_dirty_bitmap_next_dirty_area(s->copy_bitmap, task_end(task),
+                                           task->req.offset + max_bytes,
+                                           max_bytes - task->req.bytes,
+                                           &offset, &bytes) ||
+        offset != task_end(task))
+    {
+        return;
+    }
+
+    bytes = QEMU_ALIGN_UP(bytes, s->cluster_size);
+
+    /* region is dirty, so no existent tasks possible in it */
+    assert(!reqlist_find_conflict(&s->reqs, offset, bytes));
+
+    bdrv_reset_dirty_bitmap(s->copy_bitmap, offset, bytes);
+    s->in_flight_bytes += bytes;
+    task->req.bytes += bytes;
+}
+
+/* Size of the bounce buffer that the task needs */
+static int64_t block_copy_task_mem(BlockCopyTask *task)
+{
+    return task->method == COPY_WRITE_ZEROES ? 0 : task->req.bytes;
+}
+
 static void coroutine_fn block_copy_task_end(BlockCopyTask *task, int ret)
 {
     QEMU_LOCK_GUARD(&task->s->lock);
@@ -458,7 +515,7 @@ static coroutine_fn int block_copy_task_run(AioTaskPool *pool,
 
     aio_task_pool_wait_slot(pool);
     if (aio_task_pool_status(pool) < 0) {
-        co_put_to_shres(task->s->mem, task->req.bytes);
+        co_put_to_shres(task->s->mem, block_copy_task_mem(task));
         block_copy_task_end(task, -ECANCELED);
         g_free(task);
         return -ECANCELED;
@@ -589,7 +646,7 @@ static coroutine_fn int block_copy_task_entry(AioTask *task)
             progress_work_done(s->progress, t->req.bytes);
         }
     }
-    co_put_to_shres(s->mem, t->req.bytes);
+    co_put_to_shres(s->mem, block_copy_task_mem(t));
     block_copy_task_end(t, ret);
 
     if (s->discard_source && ret == 0) {
@@ -634,6 +691,35 @@ int block_copy_block_status(BlockCopyState *s, int64_t offset, int64_t bytes,
     return ret;
 }
 
+/*
+ * Like block_copy_block_status(), but query up to BLOCK_COPY_STATUS_LOOKAHEAD
+ * bytes at once and serve the following tasks from the cached result.
+ *
+ * This is safe because the cached status is only used for areas that are
+ * still dirty in the copy bitmap when the task is created, and source data
+ * in such areas doesn't change: writes to the source go through
+ * copy-before-write, which copies (and thus cleans) the affected area first.
+ */
+static coroutine_fn GRAPH_RDLOCK
+int block_copy_block_status_cached(BlockCopyCallState *call_state,
+                                   int64_t offset, int64_t end, int64_t *pnum)
+{
+    BlockCopyState *s = call_state->s;
+
+    if (offset < call_state->status_offset ||
+        offset >= call_state->status_offset + call_state->status_bytes)
+    {
+        int64_t bytes = MIN(end - offset, BLOCK_COPY_STATUS_LOOKAHEAD);
+
+        call_state->status_ret = block_copy_block_status(s, offset, bytes,
+                                                    &call_state->status_bytes);
+        call_state->status_offset = offset;
+    }
+
+    *pnum = call_state->status_offset + call_state->status_bytes - offset;
+    return call_state->status_ret;
+}
+
 /*
  * Check if the cluster starting at offset is allocated or not.
  * return via pnum the number of contiguous clusters sharing this allocation.
@@ -764,14 +850,17 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
 
         found_dirty = true;
 
-        ret = block_copy_block_status(s, task->req.offset, task->req.bytes,
-                                      &status_bytes);
+        ret = block_copy_block_status_cached(call_state, task->req.offset, end,
+                                             &status_bytes);
         assert(ret >= 0); /* never fail */
         if (status_bytes < task->req.bytes) {
             block_copy_task_shrink(task, status_bytes);
         }
         if (qatomic_read(&s->skip_unallocated) &&
             !(ret & BDRV_BLOCK_ALLOCATED)) {
+            /* Skip the whole unallocated area at once */
+            block_copy_task_grow(task, MIN(status_bytes,
+                                           end - task->req.offset));
             block_copy_task_end(task, 0);
             trace_block_copy_skip_range(s, task->req.offset, task->req.bytes);
             offset = task_end(task);
@@ -781,6 +870,10 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
         }
         if (ret & BDRV_BLOCK_ZERO) {
             task->method = COPY_WRITE_ZEROES;
+            block_copy_task_grow(task,
+                MIN(MIN_NON_ZERO(BLOCK_COPY_MAX_WRITE_ZEROES,
+                                 call_state->max_chunk),
+                    MIN(status_bytes, end - task->req.offset)));
         }
 
         if (!call_state->ignore_ratelimit) {
@@ -798,7 +891,7 @@ block_copy_dirty_clusters(BlockCopyCallState *call_state)
 
         trace_block_copy_process(s, task->req.offset);
 
-        co_get_from_shres(s->mem, task->req.bytes);
+        co_get_from_shres(s->mem, block_copy_task_mem(task));
 
         offset = task_end(task);
         bytes = end - offset;
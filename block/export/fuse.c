@@ -29,6 +29,7 @@
 #include "qapi/qapi-commands-block.h"
 #include "qemu/main-loop.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/iothread.h"
 
 #include <fuse.h>
 #include <fuse_lowlevel.h>
@@ -44,15 +45,48 @@
 /* Prevent overly long bounce buffer allocations */
 #define FUSE_MAX_BOUNCE_BYTES (MIN(BDRV_REQUEST_MAX_BYTES, 64 * 1024 * 1024))
 
+/* Number of request buffers a queue keeps around for reuse */
+#define FUSE_QUEUE_MAX_FREE_BUFS 16
 
-typedef struct FuseExport {
+typedef struct FuseExport FuseExport;
+
+/*
+ * A queue reads requests from the FUSE session FD in its AioContext and
+ * processes each of them in a coroutine.  With multiple queues, all of them
+ * read from the same (non-blocking) FD, so whichever iothread is ready first
+ * takes the next request.
+ */
+typedef struct FuseQueue {
+    FuseExport *exp;
+    AioContext *ctx;
+    /* Holds a reference, NULL if @ctx is the export's AioContext */
+    IOThread *iothread;
+
+    /* Request buffers that can be reused, only accessed in @ctx */
+    void *free_bufs[FUSE_QUEUE_MAX_FREE_BUFS];
+    unsigned int nb_free_bufs;
+} FuseQueue;
+
+typedef struct FuseRequest {
+    FuseQueue *q;
+    struct fuse_buf buf;
+} FuseRequest;
+
+struct FuseExport {
     BlockExport common;
 
     struct fuse_session *fuse_session;
-    struct fuse_buf fuse_buf;
     unsigned int in_flight; /* atomic */
     bool mounted, fd_handler_set_up;
 
+    /*
+     * If @iothread_queues is false, there is a single queue that follows the
+     * AioContext of the export
+     */
+    FuseQueue *queues;
+    size_t num_queues;
+    bool iothread_queues;
+
     char *mountpoint;
     bool writable;
     bool growable;
@@ -62,13 +96,14 @@ typedef struct FuseExport {
     mode_t st_mode;
     uid_t st_uid;
     gid_t st_gid;
-} FuseExport;
+};
 
 static GHashTable *exports;
 static const struct fuse_lowlevel_ops fuse_ops;
 
 static void fuse_export_shutdown(BlockExport *exp);
 static void fuse_export_delete(BlockExport *exp);
+static void fuse_export_free_queues(FuseExport *exp);
 
 static void init_exports_table(void);
 
@@ -79,14 +114,30 @@ static void read_from_fuse_export(void *opaque);
 static bool is_regular_file(const char *path, Error **errp);
 
 
+/**
+ * Install or remove the FUSE session FD handler in the AioContexts of all
+ * queues.
+ */
+static void fuse_export_set_fd_handlers(FuseExport *exp, bool enable)
+{
+    int fd = fuse_session_fd(exp->fuse_session);
+    size_t i;
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        aio_set_fd_handler(q->ctx, fd,
+                           enable ? read_from_fuse_export : NULL,
+                           NULL, NULL, NULL, q);
+    }
+    exp->fd_handler_set_up = enable;
+}
+
 static void fuse_export_drained_begin(void *opaque)
 {
     FuseExport *exp = opaque;
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       NULL, NULL, NULL, NULL, NULL);
-    exp->fd_handler_set_up = false;
+    fuse_export_set_fd_handlers(exp, false);
 }
 
 static void fuse_export_drained_end(void *opaque)
@@ -95,11 +146,11 @@ static void fuse_export_drained_end(void *opaque)
 
     /* Refresh AioContext in case it changed */
     exp->common.ctx = blk_get_aio_context(exp->common.blk);
+    if (!exp->iothread_queues) {
+        exp->queues[0].ctx = exp->common.ctx;
+    }
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    fuse_export_set_fd_handlers(exp, true);
 }
 
 static bool fuse_export_drained_poll(void *opaque)
@@ -121,10 +172,45 @@ static int fuse_export_create(BlockExport *blk_exp,
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
     BlockExportOptionsFuse *args = &blk_exp_args->u.fuse;
+    strList *iothreads;
+    size_t i;
     int ret;
 
     assert(blk_exp_args->type == BLOCK_EXPORT_TYPE_FUSE);
 
+    if (args->iothreads) {
+        for (iothreads = args->iothreads; iothreads;
+             iothreads = iothreads->next) {
+            exp->num_queues++;
+        }
+        exp->queues = g_new0(FuseQueue, exp->num_queues);
+        for (i = 0, iothreads = args->iothreads; iothreads;
+             i++, iothreads = iothreads->next) {
+            IOThread *iothread = iothread_by_id(iothreads->value);
+
+            if (!iothread) {
+                error_setg(errp, "iothread \"%s\" not found",
+                           iothreads->value);
+                fuse_export_free_queues(exp);
+                return -ENOENT;
+            }
+            object_ref(OBJECT(iothread));
+            exp->queues[i] = (FuseQueue) {
+                .exp = exp,
+                .ctx = iothread_get_aio_context(iothread),
+                .iothread = iothread,
+            };
+        }
+        exp->iothread_queues = true;
+    } else {
+        exp->queues = g_new0(FuseQueue, 1);
+        exp->queues[0] = (FuseQueue) {
+            .exp = exp,
+            .ctx = exp->common.ctx,
+        };
+        exp->num_queues = 1;
+    }
+
     /* For growable and writable exports, take the RESIZE permission */
     if (args->growable || blk_exp_args->writable) {
         uint64_t blk_perm, blk_shared_perm;
@@ -134,6 +220,7 @@ static int fuse_export_create(BlockExport *blk_exp,
         ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
                            blk_shared_perm, errp);
         if (ret < 0) {
+            fuse_export_free_queues(exp);
             return ret;
         }
     }
@@ -269,10 +356,18 @@ static int setup_fuse_export(FuseExport *exp, const char *mountpoint,
 
     g_hash_table_insert(exports, g_strdup(mountpoint), NULL);
 
-    aio_set_fd_handler(exp->common.ctx,
-                       fuse_session_fd(exp->fuse_session),
-                       read_from_fuse_export, NULL, NULL, NULL, exp);
-    exp->fd_handler_set_up = true;
+    /*
+     * With multiple queues, all of them are woken up when a request arrives,
+     * but only one gets it.  The others must not block in read().
+     */
+    if (!g_unix_set_fd_nonblocking(fuse_session_fd(exp->fuse_session), true,
+                                   NULL)) {
+        error_setg(errp, "Failed to make FUSE FD non-blocking");
+        ret = -EIO;
+        goto fail;
+    }
+
+    fuse_export_set_fd_handlers(exp, true);
 
     return 0;
 
@@ -281,34 +376,76 @@ fail:
     return ret;
 }
 
+/**
+ * Release a request, keeping its buffer around for the next one if the queue
+ * does not have enough spare buffers yet.
+ */
+static void fuse_request_free(FuseRequest *req)
+{
+    FuseQueue *q = req->q;
+    FuseExport *exp = q->exp;
+
+    if (q->nb_free_bufs < FUSE_QUEUE_MAX_FREE_BUFS) {
+        q->free_bufs[q->nb_free_bufs++] = req->buf.mem;
+    } else {
+        /* Allocated by libfuse */
+        free(req->buf.mem);
+    }
+    g_free(req);
+
+    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
+        aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
+    }
+
+    blk_exp_unref(&exp->common);
+}
+
+/**
+ * Process a single request.  The request handlers in fuse_ops are all called
+ * from here and may therefore yield.
+ */
+static void coroutine_fn fuse_co_process_request(void *opaque)
+{
+    FuseRequest *req = opaque;
+
+    fuse_session_process_buf(req->q->exp->fuse_session, &req->buf);
+    fuse_request_free(req);
+}
+
 /**
  * Callback to be invoked when the FUSE session FD can be read from.
  * (This is basically the FUSE event loop.)
  */
 static void read_from_fuse_export(void *opaque)
 {
-    FuseExport *exp = opaque;
+    FuseQueue *q = opaque;
+    FuseExport *exp = q->exp;
+    FuseRequest *req;
+    Coroutine *co;
     int ret;
 
     blk_exp_ref(&exp->common);
 
     qatomic_inc(&exp->in_flight);
 
+    req = g_new(FuseRequest, 1);
+    *req = (FuseRequest) {
+        .q = q,
+        /* libfuse allocates a new buffer if this is NULL */
+        .buf.mem = q->nb_free_bufs ? q->free_bufs[--q->nb_free_bufs] : NULL,
+    };
+
     do {
-        ret = fuse_session_receive_buf(exp->fuse_session, &exp->fuse_buf);
+        ret = fuse_session_receive_buf(exp->fuse_session, &req->buf);
     } while (ret == -EINTR);
-    if (ret < 0) {
-        goto out;
-    }
-
-    fuse_session_process_buf(exp->fuse_session, &exp->fuse_buf);
-
-out:
-    if (qatomic_fetch_dec(&exp->in_flight) == 1) {
-        aio_wait_kick(); /* wake AIO_WAIT_WHILE() */
+    if (ret <= 0) {
+        /* -EAGAIN if another queue has taken the request */
+        fuse_request_free(req);
+        return;
     }
 
-    blk_exp_unref(&exp->common);
+    co = qemu_coroutine_create(fuse_co_process_request, req);
+    qemu_coroutine_enter(co);
 }
 
 static void fuse_export_shutdown(BlockExport *blk_exp)
@@ -319,10 +456,7 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
         fuse_session_exit(exp->fuse_session);
 
         if (exp->fd_handler_set_up) {
-            aio_set_fd_handler(exp->common.ctx,
-                               fuse_session_fd(exp->fuse_session),
-                               NULL, NULL, NULL, NULL, NULL);
-            exp->fd_handler_set_up = false;
+            fuse_export_set_fd_handlers(exp, false);
         }
     }
 
@@ -335,6 +469,29 @@ static void fuse_export_shutdown(BlockExport *blk_exp)
     }
 }
 
+/**
+ * Free the queues with their request buffers and drop the references to
+ * their iothreads.
+ */
+static void fuse_export_free_queues(FuseExport *exp)
+{
+    size_t i;
+
+    for (i = 0; i < exp->num_queues; i++) {
+        FuseQueue *q = &exp->queues[i];
+
+        while (q->nb_free_bufs) {
+            free(q->free_bufs[--q->nb_free_bufs]);
+        }
+        if (q->iothread) {
+            object_unref(OBJECT(q->iothread));
+        }
+    }
+    g_free(exp->queues);
+    exp->queues = NULL;
+    exp->num_queues = 0;
+}
+
 static void fuse_export_delete(BlockExport *blk_exp)
 {
     FuseExport *exp = container_of(blk_exp, FuseExport, common);
@@ -347,7 +504,7 @@ static void fuse_export_delete(BlockExport *blk_exp)
         fuse_session_destroy(exp->fuse_session);
     }
 
-    free(exp->fuse_buf.mem);
+    fuse_export_free_queues(exp);
     g_free(exp->mountpoint);
 }
 
@@ -374,6 +531,11 @@ static bool is_regular_file(const char *path, Error **errp)
     return true;
 }
 
+/*
+ * All request handlers below are called from fuse_co_process_request() and
+ * may yield.
+ */
+
 /**
  * A chance to set change some parameters supplied to FUSE_INIT.
  */
@@ -403,21 +565,24 @@ static void fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
 /**
  * Let clients get file attributes (i.e., stat() the file).
  */
-static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
-                         struct fuse_file_info *fi)
+static void coroutine_fn fuse_getattr(fuse_req_t req, fuse_ino_t inode,
+                                      struct fuse_file_info *fi)
 {
     struct stat statbuf;
     int64_t length, allocated_blocks;
     time_t now = time(NULL);
     FuseExport *exp = fuse_req_userdata(req);
 
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
         fuse_reply_err(req, -length);
         return;
     }
 
-    allocated_blocks = bdrv_get_allocated_file_size(blk_bs(exp->common.blk));
+    WITH_GRAPH_RDLOCK_GUARD() {
+        allocated_blocks =
+            bdrv_co_get_allocated_file_size(blk_bs(exp->common.blk));
+    }
     if (allocated_blocks <= 0) {
         allocated_blocks = DIV_ROUND_UP(length, 512);
     } else {
@@ -441,48 +606,24 @@ static void fuse_getattr(fuse_req_t req, fuse_ino_t inode,
     fuse_reply_attr(req, &statbuf, 1.);
 }
 
-static int fuse_do_truncate(const FuseExport *exp, int64_t size,
-                            bool req_zero_write, PreallocMode prealloc)
+static int coroutine_fn fuse_co_do_truncate(const FuseExport *exp, int64_t size,
+                                            bool req_zero_write,
+                                            PreallocMode prealloc)
 {
-    uint64_t blk_perm, blk_shared_perm;
     BdrvRequestFlags truncate_flags = 0;
-    bool add_resize_perm;
-    int ret, ret_check;
 
-    /* Growable and writable exports have a permanent RESIZE permission */
-    add_resize_perm = !exp->growable && !exp->writable;
+    /*
+     * Only writable exports can be resized, and those have a permanent
+     * RESIZE permission
+     */
+    assert(exp->writable);
 
     if (req_zero_write) {
         truncate_flags |= BDRV_REQ_ZERO_WRITE;
     }
 
-    if (add_resize_perm) {
-
-        if (!qemu_in_main_thread()) {
-            /* Changing permissions like below only works in the main thread */
-            return -EPERM;
-        }
-
-        blk_get_perm(exp->common.blk, &blk_perm, &blk_shared_perm);
-
-        ret = blk_set_perm(exp->common.blk, blk_perm | BLK_PERM_RESIZE,
-                           blk_shared_perm, NULL);
-        if (ret < 0) {
-            return ret;
-        }
-    }
-
-    ret = blk_truncate(exp->common.blk, size, true, prealloc,
-                       truncate_flags, NULL);
-
-    if (add_resize_perm) {
-        /* Must succeed, because we are only giving up the RESIZE permission */
-        ret_check = blk_set_perm(exp->common.blk, blk_perm,
-                                 blk_shared_perm, &error_abort);
-        assert(ret_check == 0);
-    }
-
-    return ret;
+    return blk_co_truncate(exp->common.blk, size, true, prealloc,
+                           truncate_flags, NULL);
 }
 
 /**
@@ -493,8 +634,9 @@ static int fuse_do_truncate(const FuseExport *exp, int64_t size,
  * without allow_other cannot be given a different UID or GID, and
  * they cannot be given non-owner access.
  */
-static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
-                         int to_set, struct fuse_file_info *fi)
+static void coroutine_fn fuse_setattr(fuse_req_t req, fuse_ino_t inode,
+                                      struct stat *statbuf, int to_set,
+                                      struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int supported_attrs;
@@ -538,7 +680,8 @@ static void fuse_setattr(fuse_req_t req, fuse_ino_t inode, struct stat *statbuf,
             return;
         }
 
-        ret = fuse_do_truncate(exp, statbuf->st_size, true, PREALLOC_MODE_OFF);
+        ret = fuse_co_do_truncate(exp, statbuf->st_size, true,
+                                  PREALLOC_MODE_OFF);
         if (ret < 0) {
             fuse_reply_err(req, -ret);
             return;
@@ -573,8 +716,9 @@ static void fuse_open(fuse_req_t req, fuse_ino_t inode,
 /**
  * Handle client reads from the exported image.
  */
-static void fuse_read(fuse_req_t req, fuse_ino_t inode,
-                      size_t size, off_t offset, struct fuse_file_info *fi)
+static void coroutine_fn fuse_read(fuse_req_t req, fuse_ino_t inode,
+                                   size_t size, off_t offset,
+                                   struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
@@ -591,7 +735,7 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
      * Clients will expect short reads at EOF, so we have to limit
      * offset+size to the image length.
      */
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
         fuse_reply_err(req, -length);
         return;
@@ -607,7 +751,7 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
         return;
     }
 
-    ret = blk_pread(exp->common.blk, offset, size, buf, 0);
+    ret = blk_co_pread(exp->common.blk, offset, size, buf, 0);
     if (ret >= 0) {
         fuse_reply_buf(req, buf, size);
     } else {
@@ -620,8 +764,9 @@ static void fuse_read(fuse_req_t req, fuse_ino_t inode,
 /**
  * Handle client writes to the exported image.
  */
-static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
-                       size_t size, off_t offset, struct fuse_file_info *fi)
+static void coroutine_fn fuse_write(fuse_req_t req, fuse_ino_t inode,
+                                    const char *buf, size_t size, off_t offset,
+                                    struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int64_t length;
@@ -642,7 +787,7 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
      * Clients will expect short writes at EOF, so we have to limit
      * offset+size to the image length.
      */
-    length = blk_getlength(exp->common.blk);
+    length = blk_co_getlength(exp->common.blk);
     if (length < 0) {
         fuse_reply_err(req, -length);
         return;
@@ -650,7 +795,8 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 
     if (offset + size > length) {
         if (exp->growable) {
-            ret = fuse_do_truncate(exp, offset + size, true, PREALLOC_MODE_OFF);
+            ret = fuse_co_do_truncate(exp, offset + size, true,
+                                      PREALLOC_MODE_OFF);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
@@ -660,7 +806,7 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
         }
     }
 
-    ret = blk_pwrite(exp->common.blk, offset, size, buf, 0);
+    ret = blk_co_pwrite(exp->common.blk, offset, size, buf, 0);
     if (ret >= 0) {
         fuse_reply_write(req, size);
     } else {
@@ -671,9 +817,9 @@ static void fuse_write(fuse_req_t req, fuse_ino_t inode, const char *buf,
 /**
  * Let clients perform various fallocate() operations.
  */
-static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
-                           off_t offset, off_t length,
-                           struct fuse_file_info *fi)
+static void coroutine_fn fuse_fallocate(fuse_req_t req, fuse_ino_t inode,
+                                        int mode, off_t offset, off_t length,
+                                        struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int64_t blk_len;
@@ -684,7 +830,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         return;
     }
 
-    blk_len = blk_getlength(exp->common.blk);
+    blk_len = blk_co_getlength(exp->common.blk);
     if (blk_len < 0) {
         fuse_reply_err(req, -blk_len);
         return;
@@ -705,14 +851,14 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
 
         if (offset > blk_len) {
             /* No preallocation needed here */
-            ret = fuse_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
+            ret = fuse_co_do_truncate(exp, offset, true, PREALLOC_MODE_OFF);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
                 return;
             }
         }
 
-        ret = fuse_do_truncate(exp, offset + length, true,
+        ret = fuse_co_do_truncate(exp, offset + length, true,
                                PREALLOC_MODE_FALLOC);
     }
 #ifdef CONFIG_FALLOCATE_PUNCH_HOLE
@@ -725,7 +871,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
 
-            ret = blk_pwrite_zeroes(exp->common.blk, offset, size,
+            ret = blk_co_pwrite_zeroes(exp->common.blk, offset, size,
                                     BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK);
             if (ret == -ENOTSUP) {
                 /*
@@ -744,7 +890,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
     else if (mode & FALLOC_FL_ZERO_RANGE) {
         if (!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > blk_len) {
             /* No need for zeroes, we are going to write them ourselves */
-            ret = fuse_do_truncate(exp, offset + length, false,
+            ret = fuse_co_do_truncate(exp, offset + length, false,
                                    PREALLOC_MODE_OFF);
             if (ret < 0) {
                 fuse_reply_err(req, -ret);
@@ -755,7 +901,7 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
         do {
             int size = MIN(length, BDRV_REQUEST_MAX_BYTES);
 
-            ret = blk_pwrite_zeroes(exp->common.blk,
+            ret = blk_co_pwrite_zeroes(exp->common.blk,
                                     offset, size, 0);
             offset += size;
             length -= size;
@@ -772,13 +918,13 @@ static void fuse_fallocate(fuse_req_t req, fuse_ino_t inode, int mode,
 /**
  * Let clients fsync the exported image.
  */
-static void fuse_fsync(fuse_req_t req, fuse_ino_t inode, int datasync,
-                       struct fuse_file_info *fi)
+static void coroutine_fn fuse_fsync(fuse_req_t req, fuse_ino_t inode,
+                                    int datasync, struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
     int ret;
 
-    ret = blk_flush(exp->common.blk);
+    ret = blk_co_flush(exp->common.blk);
     fuse_reply_err(req, ret < 0 ? -ret : 0);
 }
 
@@ -786,8 +932,8 @@ static void fuse_fsync(fuse_req_t req, fuse_ino_t inode, int datasync,
  * Called before an FD to the exported image is closed.  (libfuse
  * notes this to be a way to return last-minute errors.)
  */
-static void fuse_flush(fuse_req_t req, fuse_ino_t inode,
-                        struct fuse_file_info *fi)
+static void coroutine_fn fuse_flush(fuse_req_t req, fuse_ino_t inode,
+                                    struct fuse_file_info *fi)
 {
     fuse_fsync(req, inode, 1, fi);
 }
@@ -796,8 +942,9 @@ static void fuse_flush(fuse_req_t req, fuse_ino_t inode,
 /**
  * Let clients inquire allocation status.
  */
-static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
-                       int whence, struct fuse_file_info *fi)
+static void coroutine_fn fuse_lseek(fuse_req_t req, fuse_ino_t inode,
+                                    off_t offset, int whence,
+                                    struct fuse_file_info *fi)
 {
     FuseExport *exp = fuse_req_userdata(req);
 
@@ -810,8 +957,8 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
         int64_t pnum;
         int ret;
 
-        ret = bdrv_block_status_above(blk_bs(exp->common.blk), NULL,
-                                      offset, INT64_MAX, &pnum, NULL, NULL);
+        ret = blk_co_block_status_above(exp->common.blk, NULL, offset,
+                                        INT64_MAX, &pnum, NULL, NULL);
         if (ret < 0) {
             fuse_reply_err(req, -ret);
             return;
@@ -829,7 +976,7 @@ static void fuse_lseek(fuse_req_t req, fuse_ino_t inode, off_t offset,
              * and @blk_len (the client-visible EOF).
              */
 
-            blk_len = blk_getlength(exp->common.blk);
+            blk_len = blk_co_getlength(exp->common.blk);
             if (blk_len < 0) {
                 fuse_reply_err(req, -blk_len);
                 return;
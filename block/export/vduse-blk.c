@@ -14,7 +14,10 @@
 #include <sys/eventfd.h>
 
 #include "qapi/error.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qapi-visit-common.h"
 #include "block/export.h"
+#include "sysemu/iothread.h"
 #include "qemu/error-report.h"
 #include "util/block-helpers.h"
 #include "subprojects/libvduse/libvduse.h"
@@ -30,26 +33,54 @@ typedef struct VduseBlkExport {
     VirtioBlkHandler handler;
     VduseDev *dev;
     uint16_t num_queues;
+
+    /*
+     * With iothread-vq-mapping, each virtqueue is processed in the AioContext
+     * of the IOThread it is mapped to.  Otherwise @vq_aio_context is NULL and
+     * all virtqueues follow export.ctx.
+     */
+    IOThreadVirtQueueMappingList *iothread_vq_mapping_list;
+    AioContext **vq_aio_context;
+
     char *recon_file;
     unsigned int inflight; /* atomic */
+    unsigned int *vq_inflight; /* atomic, per virtqueue */
     bool vqs_started;
 } VduseBlkExport;
 
 typedef struct VduseBlkReq {
     VduseVirtqElement elem;
     VduseVirtq *vq;
+    uint16_t vq_index;
 } VduseBlkReq;
 
-static void vduse_blk_inflight_inc(VduseBlkExport *vblk_exp)
+static uint16_t vduse_blk_vq_index(VduseBlkExport *vblk_exp, VduseVirtq *vq)
+{
+    for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
+        if (vduse_dev_get_queue(vblk_exp->dev, i) == vq) {
+            return i;
+        }
+    }
+    g_assert_not_reached();
+}
+
+static void vduse_blk_inflight_inc(VduseBlkExport *vblk_exp, uint16_t vq_index)
 {
+    qatomic_inc(&vblk_exp->vq_inflight[vq_index]);
+
     if (qatomic_fetch_inc(&vblk_exp->inflight) == 0) {
         /* Prevent export from being deleted */
         blk_exp_ref(&vblk_exp->export);
     }
 }
 
-static void vduse_blk_inflight_dec(VduseBlkExport *vblk_exp)
+static void vduse_blk_inflight_dec(VduseBlkExport *vblk_exp, uint16_t vq_index)
 {
+    if (qatomic_fetch_dec(&vblk_exp->vq_inflight[vq_index]) == 1) {
+        /* Wake vduse_blk_disable_queue() */
+        aio_wait_kick();
+    }
+
     if (qatomic_fetch_dec(&vblk_exp->inflight) == 1) {
         /* Wake AIO_WAIT_WHILE() */
         aio_wait_kick();
@@ -79,36 +110,48 @@ static void coroutine_fn vduse_blk_virtio_process_req(void *opaque)
     struct iovec *out_iov = elem->out_sg;
     unsigned in_num = elem->in_num;
     unsigned out_num = elem->out_num;
+    uint16_t vq_index = req->vq_index;
     int in_len;
 
     in_len = virtio_blk_process_req(handler, in_iov,
                                     out_iov, in_num, out_num);
     if (in_len < 0) {
         free(req);
+        vduse_blk_inflight_dec(vblk_exp, vq_index);
         return;
     }
 
     vduse_blk_req_complete(req, in_len);
-    vduse_blk_inflight_dec(vblk_exp);
+    vduse_blk_inflight_dec(vblk_exp, vq_index);
 }
 
 static void vduse_blk_vq_handler(VduseDev *dev, VduseVirtq *vq)
 {
     VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
+    uint16_t vq_index = vduse_blk_vq_index(vblk_exp, vq);
 
     while (1) {
         VduseBlkReq *req;
 
+        /*
+         * Account for the request before popping it: with iothread-vq-mapping
+         * this runs in an IOThread while vduse_blk_drained_poll() is called
+         * from the main loop, which must not see a popped request that isn't
+         * in flight yet.
+         */
+        vduse_blk_inflight_inc(vblk_exp, vq_index);
+
         req = vduse_queue_pop(vq, sizeof(VduseBlkReq));
         if (!req) {
+            vduse_blk_inflight_dec(vblk_exp, vq_index);
             break;
         }
         req->vq = vq;
+        req->vq_index = vq_index;
 
         Coroutine *co =
             qemu_coroutine_create(vduse_blk_virtio_process_req, req);
 
-        vduse_blk_inflight_inc(vblk_exp);
         qemu_coroutine_enter(co);
     }
 }
@@ -128,6 +171,68 @@ static void on_vduse_vq_kick(void *opaque)
     vduse_blk_vq_handler(dev, vq);
 }
 
+/* Returns the AioContext in which @vq is processed */
+static AioContext *vduse_blk_vq_aio_context(VduseBlkExport *vblk_exp,
+                                            VduseVirtq *vq)
+{
+    if (vblk_exp->vq_aio_context) {
+        return vblk_exp->vq_aio_context[vduse_blk_vq_index(vblk_exp, vq)];
+    }
+
+    return vblk_exp->export.ctx;
+}
+
+/* Context: BH in the AioContext of the virtqueue */
+static void vduse_blk_attach_vq_bh(void *opaque)
+{
+    VduseVirtq *vq = opaque;
+
+    aio_set_fd_handler(qemu_get_current_aio_context(), vduse_queue_get_fd(vq),
+                       on_vduse_vq_kick, NULL, NULL, NULL, vq);
+    /* Make sure we don't miss any kick after reconnecting */
+    eventfd_write(vduse_queue_get_fd(vq), 1);
+}
+
+/* Context: BH in the AioContext of the virtqueue */
+static void vduse_blk_detach_vq_bh(void *opaque)
+{
+    VduseVirtq *vq = opaque;
+
+    aio_set_fd_handler(qemu_get_current_aio_context(), vduse_queue_get_fd(vq),
+                       NULL, NULL, NULL, NULL, NULL);
+}
+
+/*
+ * Runs @fn for @vq in the AioContext of the virtqueue.  With
+ * iothread-vq-mapping, that is an IOThread that may be processing the
+ * virtqueue concurrently, so its fd handler must not be changed from here.
+ */
+static void vduse_blk_run_in_vq_context(VduseBlkExport *vblk_exp,
+                                        VduseVirtq *vq, void (*fn)(void *))
+{
+    AioContext *ctx = vduse_blk_vq_aio_context(vblk_exp, vq);
+
+    if (ctx == qemu_get_current_aio_context()) {
+        fn(vq);
+    } else {
+        aio_wait_bh_oneshot(ctx, fn, vq);
+    }
+}
+
+static void vduse_blk_attach_vq(VduseBlkExport *vblk_exp, VduseVirtq *vq)
+{
+    vduse_blk_run_in_vq_context(vblk_exp, vq, vduse_blk_attach_vq_bh);
+}
+
+static void vduse_blk_detach_vq(VduseBlkExport *vblk_exp, VduseVirtq *vq)
+{
+    if (vduse_queue_get_fd(vq) < 0) {
+        return;
+    }
+
+    vduse_blk_run_in_vq_context(vblk_exp, vq, vduse_blk_detach_vq_bh);
+}
+
 static void vduse_blk_enable_queue(VduseDev *dev, VduseVirtq *vq)
 {
     VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
@@ -136,23 +241,22 @@ static void vduse_blk_enable_queue(VduseDev *dev, VduseVirtq *vq)
         return; /* vduse_blk_drained_end() will start vqs later */
     }
 
-    aio_set_fd_handler(vblk_exp->export.ctx, vduse_queue_get_fd(vq),
-                       on_vduse_vq_kick, NULL, NULL, NULL, vq);
-    /* Make sure we don't miss any kick after reconnecting */
-    eventfd_write(vduse_queue_get_fd(vq), 1);
+    vduse_blk_attach_vq(vblk_exp, vq);
 }
 
 static void vduse_blk_disable_queue(VduseDev *dev, VduseVirtq *vq)
 {
     VduseBlkExport *vblk_exp = vduse_dev_get_priv(dev);
-    int fd = vduse_queue_get_fd(vq);
+    uint16_t vq_index = vduse_blk_vq_index(vblk_exp, vq);
 
-    if (fd < 0) {
-        return;
-    }
+    vduse_blk_detach_vq(vblk_exp, vq);
 
-    aio_set_fd_handler(vblk_exp->export.ctx, fd,
-                       NULL, NULL, NULL, NULL, NULL);
+    /*
+     * libvduse resets the virtqueue when this returns, so requests popped
+     * from it must not complete later
+     */
+    AIO_WAIT_WHILE_UNLOCKED(vduse_blk_vq_aio_context(vblk_exp, vq),
+                            qatomic_read(&vblk_exp->vq_inflight[vq_index]) > 0);
 }
 
 static const VduseOps vduse_blk_ops = {
@@ -216,9 +320,10 @@ static void vduse_blk_resize(void *opaque)
 
 static void vduse_blk_stop_virtqueues(VduseBlkExport *vblk_exp)
 {
+    /* In-flight requests are waited for by vduse_blk_drained_poll() */
     for (uint16_t i = 0; i < vblk_exp->num_queues; i++) {
         VduseVirtq *vq = vduse_dev_get_queue(vblk_exp->dev, i);
-        vduse_blk_disable_queue(vblk_exp->dev, vq);
+        vduse_blk_detach_vq(vblk_exp, vq);
     }
 
     vblk_exp->vqs_started = false;
@@ -265,6 +370,19 @@ static const BlockDevOps vduse_block_ops = {
     .drained_poll  = vduse_blk_drained_poll,
 };
 
+static void vduse_blk_vq_aio_context_cleanup(VduseBlkExport *vblk_exp)
+{
+    if (vblk_exp->iothread_vq_mapping_list) {
+        iothread_vq_mapping_cleanup(vblk_exp->iothread_vq_mapping_list);
+        qapi_free_IOThreadVirtQueueMappingList(
+            vblk_exp->iothread_vq_mapping_list);
+        vblk_exp->iothread_vq_mapping_list = NULL;
+    }
+
+    g_free(vblk_exp->vq_aio_context);
+    vblk_exp->vq_aio_context = NULL;
+}
+
 static int vduse_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
                                 Error **errp)
 {
@@ -304,7 +422,29 @@ static int vduse_blk_exp_create(BlockExport *exp, BlockExportOptions *opts,
             return -EINVAL;
         }
     }
+
+    if (vblk_opts->iothread_vq_mapping) {
+        if (opts->iothread) {
+            error_setg(errp, "iothread and iothread-vq-mapping cannot be set "
+                       "at the same time");
+            return -EINVAL;
+        }
+
+        vblk_exp->vq_aio_context = g_new(AioContext *, num_queues);
+        if (!iothread_vq_mapping_apply(vblk_opts->iothread_vq_mapping,
+                                       vblk_exp->vq_aio_context,
+                                       num_queues, errp)) {
+            g_free(vblk_exp->vq_aio_context);
+            vblk_exp->vq_aio_context = NULL;
+            return -EINVAL;
+        }
+        vblk_exp->iothread_vq_mapping_list =
+            QAPI_CLONE(IOThreadVirtQueueMappingList,
+                       vblk_opts->iothread_vq_mapping);
+    }
+
     vblk_exp->num_queues = num_queues;
+    vblk_exp->vq_inflight = g_new0(unsigned int, num_queues);
     vblk_exp->handler.blk = exp->blk;
     vblk_exp->handler.serial = g_strdup(vblk_opts->serial ?: "");
     vblk_exp->handler.logical_block_size = logical_block_size;
@@ -384,6 +524,8 @@ err:
     g_free(vblk_exp->recon_file);
 err_dev:
     g_free(vblk_exp->handler.serial);
+    g_free(vblk_exp->vq_inflight);
+    vduse_blk_vq_aio_context_cleanup(vblk_exp);
     return ret;
 }
 
@@ -403,6 +545,8 @@ static void vduse_blk_exp_delete(BlockExport *exp)
     }
     g_free(vblk_exp->recon_file);
     g_free(vblk_exp->handler.serial);
+    g_free(vblk_exp->vq_inflight);
+    vduse_blk_vq_aio_context_cleanup(vblk_exp);
 }
 
 /* Called with exp->ctx acquired */
@@ -3652,6 +3652,16 @@ static int coroutine_fn raw_co_pwrite_zeroes(
 static int coroutine_fn
 raw_co_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
+    BDRVRawState *s = bs->opaque;
+    struct stat st;
+
+    /* Writes don't update the times of device nodes */
+    if (fstat(s->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        bdi->generation = st.st_ctime * NANOSECONDS_PER_SECOND;
+#ifdef CONFIG_LINUX
+        bdi->generation += st.st_ctim.tv_nsec;
+#endif
+    }
     return 0;
 }
 
@@ -37,6 +37,7 @@
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "sysemu/replay.h"
 
 /* Maximum bounce buffer for copy-on-read and write zeroes, in bytes */
@@ -1760,6 +1761,59 @@ static int bdrv_pad_request(BlockDriverState *bs,
     return 0;
 }
 
+static unsigned bdrv_child_stats_bucket(uint64_t value, unsigned nb_buckets)
+{
+    return value ? MIN(64 - clz64(value), nb_buckets - 1) : 0;
+}
+
+/*
+ * Returns the start time of the request to be passed to bdrv_child_stats_end,
+ * or -1 if the parent of @child does not collect statistics (the default).
+ */
+static int64_t bdrv_child_stats_begin(BdrvChild *child)
+{
+    BdrvChildStats *stats = &child->stats;
+    BlockDriverState *parent = child->opaque;
+    unsigned in_flight;
+
+    if (!child->klass->parent_is_bds || !parent->child_stats) {
+        return -1;
+    }
+
+    in_flight = qatomic_fetch_inc(&stats->in_flight) + 1;
+
+    stat64_max(&stats->in_flight_peak, in_flight);
+    stat64_add(&stats->queue_depth[bdrv_child_stats_bucket(in_flight,
+                                        BDRV_CHILD_STATS_DEPTH_BUCKETS)], 1);
+
+    return get_clock();
+}
+
+static void bdrv_child_stats_end(BdrvChild *child, BdrvChildStatsOp op,
+                                 int64_t start_ns, int64_t bytes, int ret)
+{
+    BdrvChildStats *stats = &child->stats;
+    uint64_t latency_ns;
+
+    if (start_ns < 0) {
+        return;
+    }
+
+    latency_ns = get_clock() - start_ns;
+    qatomic_dec(&stats->in_flight);
+
+    if (ret < 0) {
+        stat64_add(&stats->failed_ops[op], 1);
+        return;
+    }
+
+    stat64_add(&stats->ops[op], 1);
+    stat64_add(&stats->bytes[op], bytes);
+    stat64_add(&stats->total_time_ns[op], latency_ns);
+    stat64_add(&stats->latency[op][bdrv_child_stats_bucket(latency_ns,
+                                        BDRV_CHILD_STATS_LATENCY_BUCKETS)], 1);
+}
+
 int coroutine_fn bdrv_co_preadv(BdrvChild *child,
     int64_t offset, int64_t bytes, QEMUIOVector *qiov,
     BdrvRequestFlags flags)
@@ -1776,6 +1830,8 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     BlockDriverState *bs = child->bs;
     BdrvTrackedRequest req;
     BdrvRequestPadding pad;
+    int64_t stats_bytes = bytes;
+    int64_t start_ns;
     int ret;
     IO_CODE();
 
@@ -1803,6 +1859,7 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     }
 
     bdrv_inc_in_flight(bs);
+    start_ns = bdrv_child_stats_begin(child);
 
     /* Don't do copy-on-read if we read data before write operation */
     if (qatomic_read(&bs->copy_on_read)) {
@@ -1823,6 +1880,8 @@ int coroutine_fn bdrv_co_preadv_part(BdrvChild *child,
     bdrv_padding_finalize(&pad);
 
 fail:
+    bdrv_child_stats_end(child, BDRV_CHILD_STATS_READ, start_ns, stats_bytes,
+                         ret);
     bdrv_dec_in_flight(bs);
 
     return ret;
@@ -2224,6 +2283,8 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     BdrvTrackedRequest req;
     uint64_t align = bs->bl.request_alignment;
     BdrvRequestPadding pad;
+    int64_t stats_bytes = bytes;
+    int64_t start_ns;
     int ret;
     bool padded = false;
     IO_CODE();
@@ -2276,6 +2337,7 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
     }
 
     bdrv_inc_in_flight(bs);
+    start_ns = bdrv_child_stats_begin(child);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_WRITE);
 
     if (flags & BDRV_REQ_ZERO_WRITE) {
@@ -2303,6 +2365,8 @@ int coroutine_fn bdrv_co_pwritev_part(BdrvChild *child,
 
 out:
     tracked_request_end(&req);
+    bdrv_child_stats_end(child, BDRV_CHILD_STATS_WRITE, start_ns, stats_bytes,
+                         ret);
     bdrv_dec_in_flight(bs);
 
     return ret;
@@ -3074,6 +3138,8 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
     BdrvTrackedRequest req;
     int ret;
     int64_t max_pdiscard;
+    int64_t stats_bytes = bytes;
+    int64_t start_ns;
     int head, tail, align;
     BlockDriverState *bs = child->bs;
     IO_CODE();
@@ -3115,6 +3181,7 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
     tail = (offset + bytes) % align;
 
     bdrv_inc_in_flight(bs);
+    start_ns = bdrv_child_stats_begin(child);
     tracked_request_begin(&req, bs, offset, bytes, BDRV_TRACKED_DISCARD);
 
     ret = bdrv_co_write_req_prepare(child, offset, bytes, &req, 0);
@@ -3185,6 +3252,8 @@ int coroutine_fn bdrv_co_pdiscard(BdrvChild *child, int64_t offset,
 out:
     bdrv_co_write_req_finish(child, req.offset, req.bytes, &req, ret);
     tracked_request_end(&req);
+    bdrv_child_stats_end(child, BDRV_CHILD_STATS_DISCARD, start_ns, stats_bytes,
+                         ret);
     bdrv_dec_in_flight(bs);
     return ret;
 }
@@ -13,6 +13,7 @@
 
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/main-loop.h"
 #include "qemu/coroutine.h"
 #include "qemu/range.h"
 #include "trace.h"
@@ -24,11 +25,25 @@
 #include "qemu/ratelimit.h"
 #include "qemu/bitmap.h"
 #include "qemu/memalign.h"
+#include "qemu/stats64.h"
+#include "qemu/units.h"
 
 #define MAX_IN_FLIGHT 16
 #define MAX_IO_BYTES (1 << 20) /* 1 Mb */
 #define DEFAULT_MIRROR_BUF_SIZE (MAX_IN_FLIGHT * MAX_IO_BYTES)
 
+/* Limits and tunables of the adaptive mode, see mirror_adapt() */
+#define MIRROR_ADAPT_BUF_SIZE (64 * MiB)
+#define MIRROR_ADAPT_MAX_IN_FLIGHT 64
+#define MIRROR_ADAPT_MAX_IO_BYTES (16 * MiB)
+#define MIRROR_ADAPT_WINDOW_NS (500 * SCALE_MS)
+/* Throughput changes below this many percent are considered noise */
+#define MIRROR_ADAPT_TOLERANCE 5
+/* Back off if the average latency exceeds the minimum by this factor */
+#define MIRROR_ADAPT_LATENCY_FACTOR 4
+/* Switch to active mode after falling behind for this many windows */
+#define MIRROR_ADAPT_BEHIND_WINDOWS 10
+
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
  */
@@ -38,6 +53,35 @@ typedef struct MirrorBuffer {
 
 typedef struct MirrorOp MirrorOp;
 
+/* State of the controller of the adaptive mode */
+typedef struct MirrorAdaptState {
+    /* Measurements of the current window */
+    int64_t window_start_ns;
+    uint64_t window_bytes;
+    uint64_t window_latency_ns;
+    unsigned window_ops;
+
+    /* Bytes written by the guest, updated by the mirror_top node */
+    Stat64 guest_bytes;
+    uint64_t last_guest_bytes;
+
+    /* Throughput of the previous window, 0 to start a new baseline */
+    uint64_t last_throughput;
+    uint64_t min_latency_ns;
+    int64_t last_dirty_count;
+
+    /* The knob that is currently being tuned and the direction per knob */
+    bool tune_io_bytes;
+    int in_flight_dir;
+    int io_bytes_dir;
+
+    unsigned behind_windows;
+    bool switched_to_active;
+
+    /* Reported by query-block-jobs, protected by the job mutex */
+    MirrorAdaptiveInfo info;
+} MirrorAdaptState;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     BlockBackend *target;
@@ -94,6 +138,15 @@ typedef struct MirrorBlockJob {
     bool prepared;
     bool in_drain;
     bool base_ro;
+
+    /*
+     * Upper limits for the number of background requests in flight and
+     * their size.  These are constant unless @adaptive is set.
+     */
+    unsigned max_in_flight;
+    int64_t max_io_bytes;
+    bool adaptive;
+    MirrorAdaptState adapt;
 } MirrorBlockJob;
 
 typedef struct MirrorBDSOpaque {
@@ -115,6 +168,8 @@ struct MirrorOp {
     bool is_pseudo_op;
     bool is_active_write;
     bool is_in_flight;
+    /* Time the copy was started, for the adaptive mode */
+    int64_t start_ns;
     CoQueue waiting_requests;
     Coroutine *co;
     MirrorOp *waiting_for_op;
@@ -224,6 +279,12 @@ static void coroutine_fn mirror_iteration_done(MirrorOp *op, int ret)
         if (!s->initial_zeroing_ongoing) {
             job_progress_update(&s->common.job, op->bytes);
         }
+        if (op->start_ns) {
+            s->adapt.window_bytes += op->bytes;
+            s->adapt.window_latency_ns +=
+                qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - op->start_ns;
+            s->adapt.window_ops++;
+        }
     }
     qemu_iovec_destroy(&op->qiov);
 
@@ -396,6 +457,9 @@ static void coroutine_fn mirror_co_read(void *opaque)
     s->in_flight++;
     s->bytes_in_flight += op->bytes;
     op->is_in_flight = true;
+    if (s->adaptive) {
+        op->start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
     trace_mirror_one_iteration(s, op->offset, op->bytes);
 
     WITH_GRAPH_RDLOCK_GUARD() {
@@ -488,7 +552,6 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
     /* At least the first dirty chunk is mirrored in one iteration. */
     int nb_chunks = 1;
     bool write_zeroes_ok = bdrv_can_write_zeroes_with_unmap(blk_bs(s->target));
-    int max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
 
     bdrv_graph_co_rdlock();
     source = s->mirror_top_bs->backing->bs;
@@ -577,9 +640,9 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
                                              &io_bytes, NULL, NULL);
         }
         if (ret < 0) {
-            io_bytes = MIN(nb_chunks * s->granularity, max_io_bytes);
+            io_bytes = MIN(nb_chunks * s->granularity, s->max_io_bytes);
         } else if (ret & BDRV_BLOCK_DATA) {
-            io_bytes = MIN(io_bytes, max_io_bytes);
+            io_bytes = MIN(io_bytes, s->max_io_bytes);
         }
 
         io_bytes -= io_bytes % s->granularity;
@@ -600,7 +663,7 @@ static void coroutine_fn GRAPH_UNLOCKED mirror_iteration(MirrorBlockJob *s)
             }
         }
 
-        while (s->in_flight >= MAX_IN_FLIGHT) {
+        while (s->in_flight >= s->max_in_flight) {
             trace_mirror_yield_in_flight(s, offset, s->in_flight);
             mirror_wait_for_free_in_flight_slot(s);
         }
@@ -924,6 +987,202 @@ static int coroutine_fn mirror_flush(MirrorBlockJob *s)
     return ret;
 }
 
+static void mirror_switch_to_active_bh(void *opaque)
+{
+    MirrorBlockJob *s = opaque;
+
+    GLOBAL_STATE_CODE();
+
+    /* Like mirror_change(), this relies on copy_mode being written under BQL */
+    if (qatomic_cmpxchg(&s->copy_mode, MIRROR_COPY_MODE_BACKGROUND,
+                        MIRROR_COPY_MODE_WRITE_BLOCKING) ==
+        MIRROR_COPY_MODE_BACKGROUND)
+    {
+        trace_mirror_adapt_switch_to_active(s);
+    }
+
+    WITH_JOB_LOCK_GUARD() {
+        job_unref_locked(&s->common.job);
+    }
+}
+
+static void mirror_adapt_update_info(MirrorBlockJob *s, uint64_t throughput,
+                                     uint64_t latency_ns, uint64_t guest_rate)
+{
+    WITH_JOB_LOCK_GUARD() {
+        s->adapt.info = (MirrorAdaptiveInfo) {
+            .chunk_size         = s->max_io_bytes,
+            .max_in_flight      = s->max_in_flight,
+            .throughput         = throughput,
+            .latency_ns         = latency_ns,
+            .guest_write_rate   = guest_rate,
+            .switched_to_active = s->adapt.switched_to_active,
+        };
+    }
+}
+
+/*
+ * Doubles (@dir > 0) or halves (@dir < 0) the request size if @io_bytes is
+ * true, or the number of requests in flight otherwise.  Returns false if the
+ * value is already at its limit.
+ */
+static bool mirror_adapt_apply(MirrorBlockJob *s, bool io_bytes, int dir)
+{
+    if (io_bytes) {
+        int64_t max = MIN(s->buf_size, MIRROR_ADAPT_MAX_IO_BYTES);
+        int64_t val = dir > 0 ? MIN(s->max_io_bytes * 2, max)
+                              : MAX(s->max_io_bytes / 2, s->granularity);
+
+        if (dir > 0 ? val <= s->max_io_bytes : val >= s->max_io_bytes) {
+            return false;
+        }
+        s->max_io_bytes = val;
+
+        /* The latency of a request depends on its size, start over */
+        s->adapt.min_latency_ns = 0;
+    } else {
+        unsigned val = dir > 0 ? MIN(s->max_in_flight * 2,
+                                     MIRROR_ADAPT_MAX_IN_FLIGHT)
+                               : MAX(s->max_in_flight / 2, 1);
+
+        if (val == s->max_in_flight) {
+            return false;
+        }
+        s->max_in_flight = val;
+    }
+    return true;
+}
+
+/*
+ * Hill climbing on the two knobs, one at a time: keep changing a knob in the
+ * same direction as long as throughput improves, revert the last change and
+ * turn to the other knob when it gets worse.
+ */
+static void mirror_adapt_step(MirrorBlockJob *s, uint64_t throughput,
+                              uint64_t latency_ns)
+{
+    MirrorAdaptState *a = &s->adapt;
+    int *dir;
+
+    if (latency_ns > a->min_latency_ns * MIRROR_ADAPT_LATENCY_FACTOR &&
+        mirror_adapt_apply(s, false, -1))
+    {
+        /*
+         * Requests are queueing up somewhere below us, so more parallelism
+         * only makes guest requests wait longer.
+         */
+        a->in_flight_dir = -1;
+        a->last_throughput = 0;
+        return;
+    }
+
+    if (a->last_throughput) {
+        uint64_t last = a->last_throughput;
+
+        if (throughput * 100 < last * (100 - MIRROR_ADAPT_TOLERANCE)) {
+            dir = a->tune_io_bytes ? &a->io_bytes_dir : &a->in_flight_dir;
+            mirror_adapt_apply(s, a->tune_io_bytes, -*dir);
+            *dir = -*dir;
+            a->tune_io_bytes = !a->tune_io_bytes;
+            a->last_throughput = 0;
+            return;
+        }
+        if (throughput * 100 <= last * (100 + MIRROR_ADAPT_TOLERANCE)) {
+            /* No measurable effect, try the other knob */
+            a->tune_io_bytes = !a->tune_io_bytes;
+        }
+    }
+
+    a->last_throughput = throughput;
+    dir = a->tune_io_bytes ? &a->io_bytes_dir : &a->in_flight_dir;
+    if (!mirror_adapt_apply(s, a->tune_io_bytes, *dir)) {
+        *dir = -*dir;
+    }
+}
+
+/*
+ * In background mode, a guest that keeps writing at least as fast as we can
+ * copy means that the job never converges.  Switch to active mode in this
+ * case, which makes guest writes wait for the target but guarantees that the
+ * dirty bitmap eventually becomes clean.
+ */
+static void mirror_adapt_check_progress(MirrorBlockJob *s, int64_t cnt,
+                                        uint64_t throughput,
+                                        uint64_t guest_rate)
+{
+    MirrorAdaptState *a = &s->adapt;
+
+    if (a->switched_to_active ||
+        qatomic_read(&s->copy_mode) != MIRROR_COPY_MODE_BACKGROUND)
+    {
+        return;
+    }
+
+    if (cnt > 0 && cnt >= a->last_dirty_count &&
+        guest_rate > 0 && guest_rate >= throughput)
+    {
+        a->behind_windows++;
+    } else {
+        a->behind_windows = 0;
+    }
+    a->last_dirty_count = cnt;
+
+    if (a->behind_windows >= MIRROR_ADAPT_BEHIND_WINDOWS) {
+        a->switched_to_active = true;
+        WITH_JOB_LOCK_GUARD() {
+            job_ref_locked(&s->common.job);
+        }
+        aio_bh_schedule_oneshot(qemu_get_aio_context(),
+                                mirror_switch_to_active_bh, s);
+    }
+}
+
+/*
+ * Called periodically from mirror_run() in adaptive mode.  Once per window,
+ * evaluates the copy throughput, the latency of the copy requests and the
+ * rate of guest writes, and adjusts the request size and the number of
+ * requests in flight accordingly.
+ */
+static void coroutine_fn mirror_adapt(MirrorBlockJob *s, int64_t cnt)
+{
+    MirrorAdaptState *a = &s->adapt;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t elapsed_us = (now - a->window_start_ns) / SCALE_US;
+    uint64_t guest_bytes, guest_rate, throughput;
+    uint64_t latency_ns = 0;
+
+    if (now - a->window_start_ns < MIRROR_ADAPT_WINDOW_NS) {
+        return;
+    }
+
+    guest_bytes = stat64_get(&a->guest_bytes);
+    guest_rate = (guest_bytes - a->last_guest_bytes) * 1000000 / elapsed_us;
+    throughput = a->window_bytes * 1000000 / elapsed_us;
+
+    if (a->window_ops) {
+        latency_ns = a->window_latency_ns / a->window_ops;
+        if (!a->min_latency_ns || latency_ns < a->min_latency_ns) {
+            a->min_latency_ns = latency_ns;
+        }
+    }
+
+    /* Measurements are only meaningful while there is enough work to do */
+    if (a->window_ops && cnt > 0) {
+        mirror_adapt_step(s, throughput, latency_ns);
+    }
+    mirror_adapt_check_progress(s, cnt, throughput, guest_rate);
+
+    trace_mirror_adapt(s, throughput, latency_ns, guest_rate,
+                       s->max_in_flight, s->max_io_bytes);
+    mirror_adapt_update_info(s, throughput, latency_ns, guest_rate);
+
+    a->window_start_ns = now;
+    a->window_bytes = 0;
+    a->window_latency_ns = 0;
+    a->window_ops = 0;
+    a->last_guest_bytes = guest_bytes;
+}
+
 static int coroutine_fn mirror_run(Job *job, Error **errp)
 {
     MirrorBlockJob *s = container_of(job, MirrorBlockJob, common.job);
@@ -1011,6 +1270,16 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
     s->max_iov = MIN(bs->bl.max_iov, target_bs->bl.max_iov);
     bdrv_graph_co_rdunlock();
 
+    s->max_in_flight = MAX_IN_FLIGHT;
+    s->max_io_bytes = MAX(s->buf_size / MAX_IN_FLIGHT, MAX_IO_BYTES);
+    if (s->adaptive) {
+        s->max_io_bytes = MIN(s->max_io_bytes,
+                              MIN(s->buf_size, MIRROR_ADAPT_MAX_IO_BYTES));
+        s->adapt.in_flight_dir = 1;
+        s->adapt.io_bytes_dir = 1;
+        mirror_adapt_update_info(s, 0, 0, 0);
+    }
+
     s->buf = qemu_try_blockalign(bs, s->buf_size);
     if (s->buf == NULL) {
         ret = -ENOMEM;
@@ -1032,6 +1301,8 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
      * accessing it.
      */
     mirror_top_opaque->job = s;
+    s->adapt.window_start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    s->adapt.last_guest_bytes = stat64_get(&s->adapt.guest_bytes);
 
     assert(!s->dbi);
     s->dbi = bdrv_dirty_iter_new(s->dirty_bitmap);
@@ -1059,6 +1330,10 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
                                    s->bytes_in_flight + cnt +
                                    s->active_write_bytes_in_flight);
 
+        if (s->adaptive) {
+            mirror_adapt(s, cnt);
+        }
+
         /* Note that even when no rate limit is applied we need to yield
          * periodically with no pending I/O so that bdrv_drain_all() returns.
          * We do so every BLKOCK_JOB_SLICE_TIME nanoseconds, or when there is
@@ -1069,7 +1344,7 @@ static int coroutine_fn mirror_run(Job *job, Error **errp)
         }
         if (delta < BLOCK_JOB_SLICE_TIME &&
             iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight >= MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, cnt, s->buf_free_count, s->in_flight);
                 mirror_wait_for_free_in_flight_slot(s);
@@ -1298,6 +1573,13 @@ static void mirror_query(BlockJob *job, BlockJobInfo *info)
     info->u.mirror = (BlockJobInfoMirror) {
         .actively_synced = qatomic_read(&s->actively_synced),
     };
+
+    if (s->adaptive) {
+        WITH_JOB_LOCK_GUARD() {
+            info->u.mirror.adaptive = g_memdup2(&s->adapt.info,
+                                                sizeof(s->adapt.info));
+        }
+    }
 }
 
 static const BlockJobDriver mirror_job_driver = {
@@ -1557,6 +1839,10 @@ bdrv_mirror_top_do_write(BlockDriverState *bs, MirrorMethod method,
         abort();
     }
 
+    if (s->job && s->job->adaptive) {
+        stat64_add(&s->job->adapt.guest_bytes, bytes);
+    }
+
     if (!copy_to_target && s->job && s->job->dirty_bitmap) {
         qatomic_set(&s->job->actively_synced, false);
         bdrv_set_dirty_bitmap(s->job->dirty_bitmap, offset, bytes);
@@ -1722,7 +2008,7 @@ static BlockJob *mirror_start_job(
                              bool is_none_mode, BlockDriverState *base,
                              bool auto_complete, const char *filter_node_name,
                              bool is_mirror, MirrorCopyMode copy_mode,
-                             bool base_ro,
+                             bool adaptive, bool base_ro,
                              Error **errp)
 {
     MirrorBlockJob *s;
@@ -1746,7 +2032,7 @@ static BlockJob *mirror_start_job(
     }
 
     if (buf_size == 0) {
-        buf_size = DEFAULT_MIRROR_BUF_SIZE;
+        buf_size = adaptive ? MIRROR_ADAPT_BUF_SIZE : DEFAULT_MIRROR_BUF_SIZE;
     }
 
     bdrv_graph_rdlock_main_loop();
@@ -1887,6 +2173,7 @@ static BlockJob *mirror_start_job(
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->adaptive = adaptive;
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -2013,7 +2300,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name,
-                  MirrorCopyMode copy_mode, Error **errp)
+                  MirrorCopyMode copy_mode, bool adaptive, Error **errp)
 {
     bool is_none_mode;
     BlockDriverState *base;
@@ -2036,7 +2323,8 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                      speed, granularity, buf_size, backing_mode, zero_target,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
-                     filter_node_name, true, copy_mode, false, errp);
+                     filter_node_name, true, copy_mode, adaptive, false,
+                     errp);
 }
 
 BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
@@ -2065,7 +2353,7 @@ BlockJob *commit_active_start(const char *job_id, BlockDriverState *bs,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
                      filter_node_name, false, MIRROR_COPY_MODE_BACKGROUND,
-                     base_read_only, errp);
+                     false, base_read_only, errp);
     if (!job) {
         goto error_restore_flags;
     }
@@ -0,0 +1,189 @@
+/*
+ * Per-child request statistics for query-stats
+ *
+ * Every BdrvChild of a node opened with child-stats=on counts the requests
+ * that the node sends to the child node (see BdrvChildStats), so comparing
+ * the latency of a node's children with the latency of the requests that the
+ * node itself receives shows how much latency the node adds.  Nodes without
+ * child-stats=on are not reported.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block_int.h"
+#include "qapi/qapi-types-stats.h"
+#include "sysemu/stats.h"
+
+static const char *const block_stats_op_names[BDRV_CHILD_STATS__MAX] = {
+    [BDRV_CHILD_STATS_READ]     = "read",
+    [BDRV_CHILD_STATS_WRITE]    = "write",
+    [BDRV_CHILD_STATS_DISCARD]  = "discard",
+};
+
+/*
+ * Iterates over all statistics of a child in the order of the schema.
+ * @value is NULL when only the schema is needed.
+ */
+typedef void BlockStatsFunc(const char *name, StatsType type, bool has_unit,
+                            StatsUnit unit, int exponent, const Stat64 *value,
+                            unsigned nb_values, void *opaque);
+
+static void block_stats_foreach(BdrvChildStats *stats, BlockStatsFunc *fn,
+                                void *opaque)
+{
+    Stat64 in_flight;
+    int op;
+
+    for (op = 0; op < BDRV_CHILD_STATS__MAX; op++) {
+        const char *op_name = block_stats_op_names[op];
+        g_autofree char *ops = g_strdup_printf("%s-operations", op_name);
+        g_autofree char *failed_ops =
+            g_strdup_printf("%s-failed-operations", op_name);
+        g_autofree char *bytes = g_strdup_printf("%s-bytes", op_name);
+        g_autofree char *total_time =
+            g_strdup_printf("%s-total-time", op_name);
+        g_autofree char *latency = g_strdup_printf("%s-latency", op_name);
+
+        fn(ops, STATS_TYPE_CUMULATIVE, false, 0, 0,
+           stats ? &stats->ops[op] : NULL, 1, opaque);
+        fn(failed_ops, STATS_TYPE_CUMULATIVE, false, 0, 0,
+           stats ? &stats->failed_ops[op] : NULL, 1, opaque);
+        fn(bytes, STATS_TYPE_CUMULATIVE, true, STATS_UNIT_BYTES, 0,
+           stats ? &stats->bytes[op] : NULL, 1, opaque);
+        fn(total_time, STATS_TYPE_CUMULATIVE, true, STATS_UNIT_SECONDS, -9,
+           stats ? &stats->total_time_ns[op] : NULL, 1, opaque);
+        fn(latency, STATS_TYPE_LOG2_HISTOGRAM, true, STATS_UNIT_SECONDS, -9,
+           stats ? stats->latency[op] : NULL,
+           BDRV_CHILD_STATS_LATENCY_BUCKETS, opaque);
+    }
+
+    fn("queue-depth", STATS_TYPE_LOG2_HISTOGRAM, false, 0, 0,
+       stats ? stats->queue_depth : NULL, BDRV_CHILD_STATS_DEPTH_BUCKETS,
+       opaque);
+
+    if (stats) {
+        stat64_init(&in_flight, qatomic_read(&stats->in_flight));
+    }
+    fn("in-flight", STATS_TYPE_INSTANT, false, 0, 0,
+       stats ? &in_flight : NULL, 1, opaque);
+    fn("in-flight-peak", STATS_TYPE_PEAK, false, 0, 0,
+       stats ? &stats->in_flight_peak : NULL, 1, opaque);
+}
+
+typedef struct BlockStatsValues {
+    strList *names;
+    StatsList *list;
+    StatsList **tail;
+} BlockStatsValues;
+
+static void block_stats_add_value(const char *name, StatsType type,
+                                  bool has_unit, StatsUnit unit, int exponent,
+                                  const Stat64 *value, unsigned nb_values,
+                                  void *opaque)
+{
+    BlockStatsValues *values = opaque;
+    Stats *stats;
+
+    if (!apply_str_list_filter(name, values->names)) {
+        return;
+    }
+
+    stats = g_new0(Stats, 1);
+    stats->name = g_strdup(name);
+    stats->value = g_new0(StatsValue, 1);
+
+    if (type == STATS_TYPE_LOG2_HISTOGRAM) {
+        uint64List **tail = &stats->value->u.list;
+        unsigned i;
+
+        stats->value->type = QTYPE_QLIST;
+        for (i = 0; i < nb_values; i++) {
+            QAPI_LIST_APPEND(tail, stat64_get(&value[i]));
+        }
+    } else {
+        stats->value->type = QTYPE_QNUM;
+        stats->value->u.scalar = stat64_get(value);
+    }
+
+    QAPI_LIST_APPEND(values->tail, stats);
+}
+
+static void block_stats_cb(StatsResultList **result, StatsTarget target,
+                           strList *names, strList *targets, Error **errp)
+{
+    BlockDriverState *bs = NULL;
+    BdrvChild *child;
+
+    if (target != STATS_TARGET_BLOCK_NODE) {
+        return;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    while ((bs = bdrv_next_all_states(bs))) {
+        if (!bs->child_stats ||
+            !apply_str_list_filter(bs->node_name, targets)) {
+            continue;
+        }
+
+        QLIST_FOREACH(child, &bs->children, next) {
+            BlockStatsValues values = { .names = names };
+            StatsResult *entry;
+
+            values.tail = &values.list;
+            block_stats_foreach(&child->stats, block_stats_add_value,
+                                &values);
+            if (!values.list) {
+                continue;
+            }
+
+            entry = g_new0(StatsResult, 1);
+            entry->provider = STATS_PROVIDER_BLOCK;
+            entry->node_name = g_strdup(bs->node_name);
+            entry->child = g_strdup(child->name);
+            entry->stats = values.list;
+            QAPI_LIST_PREPEND(*result, entry);
+        }
+    }
+}
+
+static void block_stats_add_schema(const char *name, StatsType type,
+                                   bool has_unit, StatsUnit unit, int exponent,
+                                   const Stat64 *value, unsigned nb_values,
+                                   void *opaque)
+{
+    StatsSchemaValueList ***tail = opaque;
+    StatsSchemaValue *schema = g_new0(StatsSchemaValue, 1);
+
+    schema->name = g_strdup(name);
+    schema->type = type;
+    schema->has_unit = has_unit;
+    schema->unit = unit;
+    schema->exponent = exponent;
+    if (exponent) {
+        schema->has_base = true;
+        schema->base = 10;
+    }
+
+    QAPI_LIST_APPEND(*tail, schema);
+}
+
+static void block_stats_schemas_cb(StatsSchemaList **result, Error **errp)
+{
+    StatsSchemaValueList *stats_list = NULL;
+    StatsSchemaValueList **tail = &stats_list;
+
+    block_stats_foreach(NULL, block_stats_add_schema, &tail);
+    add_stats_schema(result, STATS_PROVIDER_BLOCK, STATS_TARGET_BLOCK_NODE,
+                     stats_list);
+}
+
+static void block_stats_init(void)
+{
+    add_stats_callbacks(STATS_PROVIDER_BLOCK, block_stats_cb,
+                        block_stats_schemas_cb);
+}
+
+block_init(block_stats_init);
@@ -37,6 +37,12 @@
 #define NVME_QUEUE_SIZE 128
 #define NVME_DOORBELL_SIZE 4096
 
+/*
+ * Maximum number of bounce buffers (of max_transfer bytes each) that are kept
+ * DMA-mapped for unaligned requests
+ */
+#define NVME_MAX_BOUNCE_BUFS 16
+
 /*
  * We have to leave one slot empty as that is the full queue case where
  * head == tail + 1.
@@ -49,7 +55,12 @@ typedef struct BDRVNVMeState BDRVNVMeState;
 #define INDEX_ADMIN     0
 #define INDEX_IO(n)     (1 + n)
 
-/* This driver shares a single MSIX IRQ for the admin and I/O queues */
+/*
+ * This driver shares a single MSIX IRQ for the admin queue and the I/O queue
+ * of the node's AioContext.  The I/O queues of other threads each have their
+ * own vector (n for INDEX_IO(n)), so that completions are processed in the
+ * AioContext that submitted the requests.
+ */
 enum {
     MSIX_SHARED_IRQ_IDX = 0,
     MSIX_IRQ_COUNT = 1
@@ -79,6 +90,17 @@ typedef struct {
     BDRVNVMeState   *s;
     int             index;
 
+    /*
+     * AioContext that processes completions.  For the admin queue and
+     * INDEX_IO(0) this follows the node's AioContext, the other I/O queues
+     * are bound to the AioContext that created them.
+     */
+    AioContext      *aio_context;
+
+    /* Only for I/O queues other than INDEX_IO(0), 0 otherwise */
+    unsigned        irq_vector;
+    EventNotifier   irq_notifier;
+
     /* Fields protected by BQL */
     uint8_t     *prp_list_pages;
 
@@ -106,10 +128,21 @@ struct BDRVNVMeState {
     } *doorbells;
     /* The submission/completion queue pairs.
      * [0]: admin queue.
-     * [1..]: io queues.
+     * [1]: io queue of the node's AioContext.
+     * [2..]: io queues of other AioContexts, created on first use.
+     *
+     * The array has room for INDEX_IO(max_io_queues) entries and is never
+     * reallocated, so that other threads can look up their queue without
+     * locking.  New queues are published by incrementing @queue_count.
      */
     NVMeQueuePair **queues;
     unsigned queue_count;
+    unsigned max_io_queues;
+
+    /* Serializes the creation of I/O queues for other AioContexts */
+    CoMutex queue_create_lock;
+    /* Set if the controller refused to create another I/O queue */
+    bool queue_create_failed;
     size_t page_size;
     /* How many uint32_t elements does each doorbell entry take. */
     size_t doorbell_scale;
@@ -131,6 +164,15 @@ struct BDRVNVMeState {
     /* Total size of mapped qiov, accessed under dma_map_lock */
     int dma_map_count;
 
+    /*
+     * Bounce buffers with a fixed DMA mapping, so that unaligned requests
+     * don't need a temporary mapping.  Free buffers are chained through
+     * their first bytes.
+     */
+    QemuMutex bounce_lock;
+    void *bounce_free;
+    unsigned nb_bounce_bufs;
+
     /* PCI address (required for nvme_refresh_filename()) */
     char *device;
 
@@ -143,6 +185,7 @@ struct BDRVNVMeState {
 
 #define NVME_BLOCK_OPT_DEVICE "device"
 #define NVME_BLOCK_OPT_NAMESPACE "namespace"
+#define NVME_BLOCK_OPT_QUEUES "queues"
 
 static void nvme_process_completion_bh(void *opaque);
 
@@ -160,6 +203,11 @@ static QemuOptsList runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "NVMe namespace",
         },
+        {
+            .name = NVME_BLOCK_OPT_QUEUES,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Maximum number of I/O queue pairs (default: 1)",
+        },
         { /* end of list */ }
     },
 };
@@ -195,6 +243,14 @@ static void nvme_free_queue(NVMeQueue *q)
 static void nvme_free_queue_pair(NVMeQueuePair *q)
 {
     trace_nvme_free_queue_pair(q->index, q, &q->cq, &q->sq);
+    if (q->irq_vector) {
+        aio_set_event_notifier(q->aio_context, &q->irq_notifier,
+                               NULL, NULL, NULL);
+        qemu_vfio_pci_set_irq(q->s->vfio, VFIO_PCI_MSIX_IRQ_INDEX,
+                              q->irq_vector, NULL, NULL);
+        event_notifier_cleanup(&q->irq_notifier);
+        aio_context_unref(q->aio_context);
+    }
     if (q->completion_bh) {
         qemu_bh_delete(q->completion_bh);
     }
@@ -246,6 +302,7 @@ static NVMeQueuePair *nvme_create_queue_pair(BDRVNVMeState *s,
     qemu_mutex_init(&q->lock);
     q->s = s;
     q->index = idx;
+    q->aio_context = aio_context;
     qemu_co_queue_init(&q->free_req_queue);
     q->completion_bh = aio_bh_new(aio_context, nvme_process_completion_bh, q);
     r = qemu_vfio_dma_map(s->vfio, q->prp_list_pages, bytes,
@@ -344,7 +401,7 @@ static void nvme_put_free_req_locked(NVMeQueuePair *q, NVMeRequest *req)
 static void nvme_wake_free_req_locked(NVMeQueuePair *q)
 {
     if (!qemu_co_queue_empty(&q->free_req_queue)) {
-        replay_bh_schedule_oneshot_event(q->s->aio_context,
+        replay_bh_schedule_oneshot_event(q->aio_context,
                 nvme_free_req_queue_cb, q);
     }
 }
@@ -510,6 +567,29 @@ static void nvme_submit_command(NVMeQueuePair *q, NVMeRequest *req,
     defer_call(nvme_deferred_fn, q);
 }
 
+typedef struct {
+    Coroutine *co;
+    int ret;
+    AioContext *ctx;
+} NVMeCoData;
+
+static void nvme_rw_cb_bh(void *opaque)
+{
+    NVMeCoData *data = opaque;
+    qemu_coroutine_enter(data->co);
+}
+
+static void nvme_rw_cb(void *opaque, int ret)
+{
+    NVMeCoData *data = opaque;
+    data->ret = ret;
+    if (!data->co) {
+        /* The rw coroutine hasn't yielded, don't try to enter. */
+        return;
+    }
+    replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
+}
+
 static void nvme_admin_cmd_sync_cb(void *opaque, int ret)
 {
     int *pret = opaque;
@@ -517,7 +597,12 @@ static void nvme_admin_cmd_sync_cb(void *opaque, int ret)
     aio_wait_kick();
 }
 
-static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
+/*
+ * In coroutine context, this must be called in the node's AioContext, which
+ * processes the completions of the admin queue.
+ */
+static int coroutine_mixed_fn nvme_admin_cmd_sync(BlockDriverState *bs,
+                                                  NvmeCmd *cmd)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q = s->queues[INDEX_ADMIN];
@@ -528,6 +613,23 @@ static int nvme_admin_cmd_sync(BlockDriverState *bs, NvmeCmd *cmd)
     if (!req) {
         return -EBUSY;
     }
+
+    if (qemu_in_coroutine()) {
+        NVMeCoData data = {
+            .ctx = aio_context,
+            .ret = -EINPROGRESS,
+        };
+
+        assert(qemu_get_current_aio_context() == aio_context);
+        nvme_submit_command(q, req, cmd, nvme_rw_cb, &data);
+
+        data.co = qemu_coroutine_self();
+        while (data.ret == -EINPROGRESS) {
+            qemu_coroutine_yield();
+        }
+        return data.ret;
+    }
+
     nvme_submit_command(q, req, cmd, nvme_admin_cmd_sync_cb, &ret);
 
     AIO_WAIT_WHILE(aio_context, ret == -EINPROGRESS);
@@ -547,7 +649,7 @@ static bool nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
     NvmeLBAF *lbaf;
     uint16_t oncs;
     int r;
-    uint64_t iova;
+    uint64_t iova = 0;
     NvmeCmd cmd = {
         .opcode = NVME_ADM_CMD_IDENTIFY,
         .cdw10 = cpu_to_le32(0x1),
@@ -620,23 +722,30 @@ static bool nvme_identify(BlockDriverState *bs, int namespace, Error **errp)
     ret = true;
     s->blkshift = lbaf->ds;
 out:
-    qemu_vfio_dma_unmap(s->vfio, id);
+    if (iova) {
+        qemu_vfio_dma_release_temporary(s->vfio, iova);
+    }
 
     return ret;
 }
 
-static void nvme_poll_queue(NVMeQueuePair *q)
+static bool nvme_queue_has_completion(NVMeQueuePair *q)
 {
     const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
     NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
 
-    trace_nvme_poll_queue(q->s, q->index);
     /*
-     * Do an early check for completions. q->lock isn't needed because
-     * nvme_process_completion() only runs in the event loop thread and
-     * cannot race with itself.
+     * q->lock isn't needed because nvme_process_completion() only runs in
+     * the event loop thread and cannot race with itself.
      */
-    if ((le16_to_cpu(cqe->status) & 0x1) == q->cq_phase) {
+    return (le16_to_cpu(cqe->status) & 0x1) != q->cq_phase;
+}
+
+static void nvme_poll_queue(NVMeQueuePair *q)
+{
+    trace_nvme_poll_queue(q->s, q->index);
+    /* Do an early check for completions */
+    if (!nvme_queue_has_completion(q)) {
         return;
     }
 
@@ -647,11 +756,17 @@ static void nvme_poll_queue(NVMeQueuePair *q)
     qemu_mutex_unlock(&q->lock);
 }
 
+/* Number of queues that share the IRQ and the AioContext of the node */
+static unsigned nvme_shared_queue_count(BDRVNVMeState *s)
+{
+    return MIN(qatomic_read(&s->queue_count), INDEX_IO(1));
+}
+
 static void nvme_poll_queues(BDRVNVMeState *s)
 {
     int i;
 
-    for (i = 0; i < s->queue_count; i++) {
+    for (i = 0; i < nvme_shared_queue_count(s); i++) {
         nvme_poll_queue(s->queues[i]);
     }
 }
@@ -666,25 +781,44 @@ static void nvme_handle_event(EventNotifier *n)
     nvme_poll_queues(s);
 }
 
-static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
+/*
+ * Creates the I/O queue pair with the next free index, whose completions are
+ * processed in @aio_context.  The caller must add the queue to s->queues.
+ */
+static NVMeQueuePair *coroutine_mixed_fn
+nvme_add_io_queue(BlockDriverState *bs, AioContext *aio_context, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     unsigned n = s->queue_count;
+    unsigned irq_vector = n - INDEX_IO(0);
     NVMeQueuePair *q;
     NvmeCmd cmd;
     unsigned queue_size = NVME_QUEUE_SIZE;
 
     assert(n <= UINT16_MAX);
-    q = nvme_create_queue_pair(s, bdrv_get_aio_context(bs),
-                               n, queue_size, errp);
+    assert(n < INDEX_IO(s->max_io_queues));
+    q = nvme_create_queue_pair(s, aio_context, n, queue_size, errp);
     if (!q) {
-        return false;
+        return NULL;
+    }
+    if (irq_vector) {
+        if (event_notifier_init(&q->irq_notifier, 0)) {
+            error_setg(errp, "Failed to init event notifier");
+            goto out_error;
+        }
+        if (qemu_vfio_pci_set_irq(s->vfio, VFIO_PCI_MSIX_IRQ_INDEX,
+                                  irq_vector, &q->irq_notifier, errp)) {
+            event_notifier_cleanup(&q->irq_notifier);
+            goto out_error;
+        }
+        aio_context_ref(aio_context);
+        q->irq_vector = irq_vector;
     }
     cmd = (NvmeCmd) {
         .opcode = NVME_ADM_CMD_CREATE_CQ,
         .dptr.prp1 = cpu_to_le64(q->cq.iova),
         .cdw10 = cpu_to_le32(((queue_size - 1) << 16) | n),
-        .cdw11 = cpu_to_le32(NVME_CQ_IEN | NVME_CQ_PC),
+        .cdw11 = cpu_to_le32(NVME_CQ_IEN | NVME_CQ_PC | (irq_vector << 16)),
     };
     if (nvme_admin_cmd_sync(bs, &cmd)) {
         error_setg(errp, "Failed to create CQ io queue [%u]", n);
@@ -700,13 +834,10 @@ static bool nvme_add_io_queue(BlockDriverState *bs, Error **errp)
         error_setg(errp, "Failed to create SQ io queue [%u]", n);
         goto out_error;
     }
-    s->queues = g_renew(NVMeQueuePair *, s->queues, n + 1);
-    s->queues[n] = q;
-    s->queue_count++;
-    return true;
+    return q;
 out_error:
     nvme_free_queue_pair(q);
-    return false;
+    return NULL;
 }
 
 static bool nvme_poll_cb(void *opaque)
@@ -716,16 +847,8 @@ static bool nvme_poll_cb(void *opaque)
                                     irq_notifier[MSIX_SHARED_IRQ_IDX]);
     int i;
 
-    for (i = 0; i < s->queue_count; i++) {
-        NVMeQueuePair *q = s->queues[i];
-        const size_t cqe_offset = q->cq.head * NVME_CQ_ENTRY_BYTES;
-        NvmeCqe *cqe = (NvmeCqe *)&q->cq.queue[cqe_offset];
-
-        /*
-         * q->lock isn't needed because nvme_process_completion() only runs in
-         * the event loop thread and cannot race with itself.
-         */
-        if ((le16_to_cpu(cqe->status) & 0x1) != q->cq_phase) {
+    for (i = 0; i < nvme_shared_queue_count(s); i++) {
+        if (nvme_queue_has_completion(s->queues[i])) {
             return true;
         }
     }
@@ -740,8 +863,128 @@ static void nvme_poll_ready(EventNotifier *e)
     nvme_poll_queues(s);
 }
 
+static void nvme_queue_handle_event(EventNotifier *n)
+{
+    NVMeQueuePair *q = container_of(n, NVMeQueuePair, irq_notifier);
+
+    trace_nvme_handle_event(q->s);
+    event_notifier_test_and_clear(n);
+    nvme_poll_queue(q);
+}
+
+static bool nvme_queue_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    NVMeQueuePair *q = container_of(e, NVMeQueuePair, irq_notifier);
+
+    return nvme_queue_has_completion(q);
+}
+
+static void nvme_queue_poll_ready(EventNotifier *e)
+{
+    NVMeQueuePair *q = container_of(e, NVMeQueuePair, irq_notifier);
+
+    nvme_poll_queue(q);
+}
+
+static NVMeQueuePair *nvme_find_io_queue(BDRVNVMeState *s, AioContext *ctx)
+{
+    unsigned n = qatomic_load_acquire(&s->queue_count);
+    unsigned i;
+
+    for (i = INDEX_IO(1); i < n; i++) {
+        if (s->queues[i]->aio_context == ctx) {
+            return s->queues[i];
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Creates an I/O queue pair for the current AioContext, so that requests
+ * from this thread are submitted and completed without involving the thread
+ * of the node's AioContext.
+ */
+static coroutine_fn NVMeQueuePair *nvme_co_add_thread_queue(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    NVMeQueuePair *q;
+    Error *local_err = NULL;
+
+    QEMU_LOCK_GUARD(&s->queue_create_lock);
+
+    /* Another coroutine of this AioContext may have been faster */
+    q = nvme_find_io_queue(s, ctx);
+    if (q || s->queue_create_failed ||
+        s->queue_count >= INDEX_IO(s->max_io_queues)) {
+        return q;
+    }
+
+    /* Admin commands complete in the node's AioContext */
+    aio_co_reschedule_self(s->aio_context);
+    q = nvme_add_io_queue(bs, ctx, &local_err);
+    aio_co_reschedule_self(ctx);
+
+    if (!q) {
+        trace_nvme_add_thread_queue_failed(s, error_get_pretty(local_err));
+        error_free(local_err);
+        qatomic_set(&s->queue_create_failed, true);
+        return NULL;
+    }
+
+    trace_nvme_add_thread_queue(s, q->index, ctx);
+    aio_set_event_notifier(ctx, &q->irq_notifier, nvme_queue_handle_event,
+                           nvme_queue_poll_cb, nvme_queue_poll_ready);
+    s->queues[s->queue_count] = q;
+    qatomic_store_release(&s->queue_count, s->queue_count + 1);
+    return q;
+}
+
+/* Returns the I/O queue pair to use for a request from the current thread */
+static coroutine_fn NVMeQueuePair *nvme_get_io_queue(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    AioContext *ctx = qemu_get_current_aio_context();
+    NVMeQueuePair *q;
+
+    if (ctx == s->aio_context) {
+        return s->queues[INDEX_IO(0)];
+    }
+
+    q = nvme_find_io_queue(s, ctx);
+    if (!q && !qatomic_read(&s->queue_create_failed) &&
+        qatomic_read(&s->queue_count) < INDEX_IO(s->max_io_queues)) {
+        q = nvme_co_add_thread_queue(bs);
+    }
+
+    /* Fall back to submitting to the queue of the node's AioContext */
+    return q ?: s->queues[INDEX_IO(0)];
+}
+
+/*
+ * Asks the controller for @s->max_io_queues I/O queue pairs.  The controller
+ * may allocate fewer, in which case creating further queues fails later and
+ * the requests of the remaining threads use the queue of the node's
+ * AioContext.
+ */
+static void nvme_set_queue_count(BlockDriverState *bs)
+{
+    BDRVNVMeState *s = bs->opaque;
+    NvmeCmd cmd = {
+        .opcode = NVME_ADM_CMD_SET_FEATURES,
+        .cdw10 = cpu_to_le32(NVME_NUMBER_OF_QUEUES),
+        .cdw11 = cpu_to_le32(((s->max_io_queues - 1) << 16) |
+                             (s->max_io_queues - 1)),
+    };
+
+    if (s->max_io_queues > 1 && nvme_admin_cmd_sync(bs, &cmd)) {
+        s->max_io_queues = 1;
+    }
+}
+
 static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
-                     Error **errp)
+                     unsigned max_io_queues, Error **errp)
 {
     BDRVNVMeState *s = bs->opaque;
     NVMeQueuePair *q;
@@ -755,6 +998,8 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
 
     qemu_co_mutex_init(&s->dma_map_lock);
     qemu_co_queue_init(&s->dma_flush_queue);
+    qemu_mutex_init(&s->bounce_lock);
+    qemu_co_mutex_init(&s->queue_create_lock);
     s->device = g_strdup(device);
     s->nsid = namespace;
     s->aio_context = bdrv_get_aio_context(bs);
@@ -833,8 +1078,23 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         goto out;
     }
 
+    /*
+     * Every I/O queue but the first needs its own interrupt vector and
+     * doorbell.
+     */
+    ret = qemu_vfio_pci_get_irq_count(s->vfio, VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    if (ret < 0) {
+        goto out;
+    }
+    max_io_queues = MIN(max_io_queues, MAX(ret, 1));
+    max_io_queues = MIN(max_io_queues,
+                        MAX(NVME_DOORBELL_SIZE /
+                            (sizeof(*s->doorbells) * s->doorbell_scale), 2)
+                        - INDEX_IO(0));
+    s->max_io_queues = max_io_queues;
+
     /* Set up admin queue. */
-    s->queues = g_new(NVMeQueuePair *, 1);
+    s->queues = g_new0(NVMeQueuePair *, INDEX_IO(s->max_io_queues));
     q = nvme_create_queue_pair(s, aio_context, 0, NVME_QUEUE_SIZE, errp);
     if (!q) {
         ret = -EINVAL;
@@ -865,8 +1125,9 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
         }
     }
 
-    ret = qemu_vfio_pci_init_irq(s->vfio, s->irq_notifier,
-                                 VFIO_PCI_MSIX_IRQ_INDEX, errp);
+    ret = qemu_vfio_pci_init_irqs(s->vfio, s->irq_notifier,
+                                  VFIO_PCI_MSIX_IRQ_INDEX, s->max_io_queues,
+                                  errp);
     if (ret) {
         goto out;
     }
@@ -881,9 +1142,14 @@ static int nvme_init(BlockDriverState *bs, const char *device, int namespace,
     }
 
     /* Set up command queues. */
-    if (!nvme_add_io_queue(bs, errp)) {
+    nvme_set_queue_count(bs);
+    q = nvme_add_io_queue(bs, aio_context, errp);
+    if (!q) {
         ret = -EIO;
+        goto out;
     }
+    s->queues[INDEX_IO(0)] = q;
+    s->queue_count++;
 out:
     if (regs) {
         qemu_vfio_pci_unmap_bar(s->vfio, 0, (void *)regs, 0, sizeof(NvmeBar));
@@ -956,6 +1222,8 @@ static void nvme_close(BlockDriverState *bs)
         nvme_free_queue_pair(s->queues[i]);
     }
     g_free(s->queues);
+    nvme_free_bounce_bufs(s);
+    qemu_mutex_destroy(&s->bounce_lock);
     aio_set_event_notifier(bdrv_get_aio_context(bs),
                            &s->irq_notifier[MSIX_SHARED_IRQ_IDX],
                            NULL, NULL, NULL);
@@ -973,6 +1241,7 @@ static int nvme_open(BlockDriverState *bs, QDict *options, int flags,
     const char *device;
     QemuOpts *opts;
     int namespace;
+    uint64_t max_io_queues;
     int ret;
     BDRVNVMeState *s = bs->opaque;
 
@@ -988,7 +1257,14 @@ static int nvme_open(BlockDriverState *bs, QDict *options, int flags,
     }
 
     namespace = qemu_opt_get_number(opts, NVME_BLOCK_OPT_NAMESPACE, 1);
-    ret = nvme_init(bs, device, namespace, errp);
+    max_io_queues = qemu_opt_get_number(opts, NVME_BLOCK_OPT_QUEUES, 1);
+    if (max_io_queues < 1 || max_io_queues > UINT16_MAX) {
+        error_setg(errp, "'" NVME_BLOCK_OPT_QUEUES "' must be between 1 and %d",
+                   UINT16_MAX);
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+    ret = nvme_init(bs, device, namespace, max_io_queues, errp);
     qemu_opts_del(opts);
     if (ret) {
         goto fail;
@@ -1034,25 +1310,31 @@ static int nvme_probe_blocksizes(BlockDriverState *bs, BlockSizes *bsz)
 }
 
 /* Called with s->dma_map_lock */
-static coroutine_fn int nvme_cmd_unmap_qiov(BlockDriverState *bs,
-                                            QEMUIOVector *qiov)
+static coroutine_fn void nvme_cmd_unmap_qiov(BlockDriverState *bs,
+                                             QEMUIOVector *qiov,
+                                             const uint64_t *iovas)
 {
-    int r = 0;
     BDRVNVMeState *s = bs->opaque;
+    int i;
+
+    for (i = 0; i < qiov->niov; i++) {
+        qemu_vfio_dma_release_temporary(s->vfio, iovas[i]);
+    }
 
     s->dma_map_count -= qiov->size;
-    if (!s->dma_map_count && !qemu_co_queue_empty(&s->dma_flush_queue)) {
-        r = qemu_vfio_dma_reset_temporary(s->vfio);
-        if (!r) {
-            qemu_co_queue_restart_all(&s->dma_flush_queue);
-        }
+    if (!qemu_co_queue_empty(&s->dma_flush_queue)) {
+        /* The released mappings can be reclaimed now */
+        qemu_co_queue_restart_all(&s->dma_flush_queue);
     }
-    return r;
 }
 
-/* Called with s->dma_map_lock */
+/*
+ * Called with s->dma_map_lock.  Stores the IOVA of each element of @qiov in
+ * @iovas, which must be passed to nvme_cmd_unmap_qiov() after the request.
+ */
 static coroutine_fn int nvme_cmd_map_qiov(BlockDriverState *bs, NvmeCmd *cmd,
-                                          NVMeRequest *req, QEMUIOVector *qiov)
+                                          NVMeRequest *req, QEMUIOVector *qiov,
+                                          uint64_t *iovas)
 {
     BDRVNVMeState *s = bs->opaque;
     uint64_t *pagelist = req->prp_list_page;
@@ -1092,20 +1374,17 @@ try_map:
         }
         if (r == -ENOMEM && retry) {
             /*
-             * We exhausted the DMA mappings available for our container:
-             * recycle the volatile IOVA mappings.
+             * We exhausted the DMA mappings available for our container even
+             * after vfio-helpers reclaimed the released temporary mappings:
+             * wait for other requests to release theirs.
              */
             retry = false;
             trace_nvme_dma_flush_queue_wait(s);
-            if (s->dma_map_count) {
-                trace_nvme_dma_map_flush(s);
-                qemu_co_queue_wait(&s->dma_flush_queue, &s->dma_map_lock);
-            } else {
-                r = qemu_vfio_dma_reset_temporary(s->vfio);
-                if (r) {
-                    goto fail;
-                }
+            if (!s->dma_map_count) {
+                goto fail;
             }
+            trace_nvme_dma_map_flush(s);
+            qemu_co_queue_wait(&s->dma_flush_queue, &s->dma_map_lock);
             errp = &local_err;
 
             goto try_map;
@@ -1114,6 +1393,7 @@ try_map:
             goto fail;
         }
 
+        iovas[i] = iova;
         for (j = 0; j < qiov->iov[i].iov_len / s->page_size; j++) {
             pagelist[entries++] = cpu_to_le64(iova + j * s->page_size);
         }
@@ -1146,38 +1426,65 @@ try_map:
     }
     return 0;
 fail:
-    /* No need to unmap [0 - i) iovs even if we've failed, since we don't
-     * increment s->dma_map_count. This is okay for fixed mapping memory areas
-     * because they are already mapped before calling this function; for
-     * temporary mappings, a later nvme_cmd_(un)map_qiov will reclaim by
-     * calling qemu_vfio_dma_reset_temporary when necessary. */
+    /* Release the mappings of the [0 - i) iovs that were mapped already */
+    while (--i >= 0) {
+        qemu_vfio_dma_release_temporary(s->vfio, iovas[i]);
+    }
     if (local_err) {
         error_reportf_err(local_err, "Cannot map buffer for DMA: ");
     }
     return r;
 }
 
-typedef struct {
-    Coroutine *co;
-    int ret;
-    AioContext *ctx;
-} NVMeCoData;
+/*
+ * Returns a DMA-mapped bounce buffer of s->max_transfer bytes, or NULL if
+ * all of them are in use.
+ */
+static void *nvme_get_bounce_buf(BDRVNVMeState *s)
+{
+    size_t size = QEMU_ALIGN_UP(s->max_transfer, qemu_real_host_page_size());
+    void *buf;
 
-static void nvme_rw_cb_bh(void *opaque)
+    QEMU_LOCK_GUARD(&s->bounce_lock);
+    if (s->bounce_free) {
+        buf = s->bounce_free;
+        s->bounce_free = *(void **)buf;
+        return buf;
+    }
+    if (s->nb_bounce_bufs >= NVME_MAX_BOUNCE_BUFS) {
+        return NULL;
+    }
+
+    buf = qemu_try_memalign(qemu_real_host_page_size(), size);
+    if (!buf) {
+        return NULL;
+    }
+    if (qemu_vfio_dma_map(s->vfio, buf, size, false, NULL, NULL)) {
+        qemu_vfree(buf);
+        return NULL;
+    }
+    s->nb_bounce_bufs++;
+    return buf;
+}
+
+static void nvme_put_bounce_buf(BDRVNVMeState *s, void *buf)
 {
-    NVMeCoData *data = opaque;
-    qemu_coroutine_enter(data->co);
+    QEMU_LOCK_GUARD(&s->bounce_lock);
+    *(void **)buf = s->bounce_free;
+    s->bounce_free = buf;
 }
 
-static void nvme_rw_cb(void *opaque, int ret)
+static void nvme_free_bounce_bufs(BDRVNVMeState *s)
 {
-    NVMeCoData *data = opaque;
-    data->ret = ret;
-    if (!data->co) {
-        /* The rw coroutine hasn't yielded, don't try to enter. */
-        return;
+    while (s->bounce_free) {
+        void *buf = s->bounce_free;
+
+        s->bounce_free = *(void **)buf;
+        qemu_vfio_dma_unmap(s->vfio, buf);
+        qemu_vfree(buf);
+        s->nb_bounce_bufs--;
     }
-    replay_bh_schedule_oneshot_event(data->ctx, nvme_rw_cb_bh, data);
+    assert(s->nb_bounce_bufs == 0);
 }
 
 static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
@@ -1188,8 +1495,9 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
 {
     int r;
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
+    g_autofree uint64_t *iovas = g_new(uint64_t, qiov->niov);
 
     uint32_t cdw12 = (((bytes >> s->blkshift) - 1) & 0xFFFF) |
                        (flags & BDRV_REQ_FUA ? 1 << 30 : 0);
@@ -1201,7 +1509,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
         .cdw12 = cpu_to_le32(cdw12),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1211,7 +1519,7 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
     assert(req);
 
     qemu_co_mutex_lock(&s->dma_map_lock);
-    r = nvme_cmd_map_qiov(bs, &cmd, req, qiov);
+    r = nvme_cmd_map_qiov(bs, &cmd, req, qiov, iovas);
     qemu_co_mutex_unlock(&s->dma_map_lock);
     if (r) {
         nvme_put_free_req_and_wake(ioq, req);
@@ -1225,11 +1533,8 @@ static coroutine_fn int nvme_co_prw_aligned(BlockDriverState *bs,
     }
 
     qemu_co_mutex_lock(&s->dma_map_lock);
-    r = nvme_cmd_unmap_qiov(bs, qiov);
+    nvme_cmd_unmap_qiov(bs, qiov, iovas);
     qemu_co_mutex_unlock(&s->dma_map_lock);
-    if (r) {
-        return r;
-    }
 
     trace_nvme_rw_done(s, is_write, offset, bytes, data.ret);
     return data.ret;
@@ -1260,7 +1565,8 @@ static coroutine_fn int nvme_co_prw(BlockDriverState *bs,
 {
     BDRVNVMeState *s = bs->opaque;
     int r;
-    QEMU_AUTO_VFREE uint8_t *buf = NULL;
+    uint8_t *buf;
+    bool pooled;
     QEMUIOVector local_qiov;
     size_t len = QEMU_ALIGN_UP(bytes, qemu_real_host_page_size());
     assert(QEMU_IS_ALIGNED(offset, s->page_size));
@@ -1272,7 +1578,11 @@ static coroutine_fn int nvme_co_prw(BlockDriverState *bs,
     }
     s->stats.unaligned_accesses++;
     trace_nvme_prw_buffered(s, offset, bytes, qiov->niov, is_write);
-    buf = qemu_try_memalign(qemu_real_host_page_size(), len);
+    buf = nvme_get_bounce_buf(s);
+    pooled = buf;
+    if (!buf) {
+        buf = qemu_try_memalign(qemu_real_host_page_size(), len);
+    }
 
     if (!buf) {
         return -ENOMEM;
@@ -1287,6 +1597,11 @@ static coroutine_fn int nvme_co_prw(BlockDriverState *bs,
     if (!r && !is_write) {
         qemu_iovec_from_buf(qiov, 0, buf, bytes);
     }
+    if (pooled) {
+        nvme_put_bounce_buf(s, buf);
+    } else {
+        qemu_vfree(buf);
+    }
     return r;
 }
 
@@ -1309,14 +1624,14 @@ static coroutine_fn int nvme_co_pwritev(BlockDriverState *bs,
 static coroutine_fn int nvme_co_flush(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
     NvmeCmd cmd = {
         .opcode = NVME_CMD_FLUSH,
         .nsid = cpu_to_le32(s->nsid),
     };
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1340,7 +1655,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
                                               BdrvRequestFlags flags)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
     uint32_t cdw12;
 
@@ -1367,7 +1682,7 @@ static coroutine_fn int nvme_co_pwrite_zeroes(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1403,9 +1718,11 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
                                          int64_t bytes)
 {
     BDRVNVMeState *s = bs->opaque;
-    NVMeQueuePair *ioq = s->queues[INDEX_IO(0)];
+    NVMeQueuePair *ioq = nvme_get_io_queue(bs);
     NVMeRequest *req;
-    QEMU_AUTO_VFREE NvmeDsmRange *buf = NULL;
+    NvmeDsmRange *buf;
+    bool pooled;
+    uint64_t iova;
     QEMUIOVector local_qiov;
     int ret;
 
@@ -1417,7 +1734,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     };
 
     NVMeCoData data = {
-        .ctx = bdrv_get_aio_context(bs),
+        .ctx = qemu_get_current_aio_context(),
         .ret = -EINPROGRESS,
     };
 
@@ -1435,7 +1752,11 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     assert(QEMU_IS_ALIGNED(offset, 1UL << s->blkshift));
     assert((bytes >> s->blkshift) <= UINT32_MAX);
 
-    buf = qemu_try_memalign(s->page_size, s->page_size);
+    buf = nvme_get_bounce_buf(s);
+    pooled = buf;
+    if (!buf) {
+        buf = qemu_try_memalign(s->page_size, s->page_size);
+    }
     if (!buf) {
         return -ENOMEM;
     }
@@ -1451,7 +1772,7 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     assert(req);
 
     qemu_co_mutex_lock(&s->dma_map_lock);
-    ret = nvme_cmd_map_qiov(bs, &cmd, req, &local_qiov);
+    ret = nvme_cmd_map_qiov(bs, &cmd, req, &local_qiov, &iova);
     qemu_co_mutex_unlock(&s->dma_map_lock);
 
     if (ret) {
@@ -1469,17 +1790,18 @@ static int coroutine_fn nvme_co_pdiscard(BlockDriverState *bs,
     }
 
     qemu_co_mutex_lock(&s->dma_map_lock);
-    ret = nvme_cmd_unmap_qiov(bs, &local_qiov);
+    nvme_cmd_unmap_qiov(bs, &local_qiov, &iova);
     qemu_co_mutex_unlock(&s->dma_map_lock);
 
-    if (ret) {
-        goto out;
-    }
-
     ret = data.ret;
     trace_nvme_dsm_done(s, offset, bytes, ret);
 out:
     qemu_iovec_destroy(&local_qiov);
+    if (pooled) {
+        nvme_put_bounce_buf(s, buf);
+    } else {
+        qemu_vfree(buf);
+    }
     return ret;
 
 }
@@ -1547,7 +1869,7 @@ static void nvme_detach_aio_context(BlockDriverState *bs)
 {
     BDRVNVMeState *s = bs->opaque;
 
-    for (unsigned i = 0; i < s->queue_count; i++) {
+    for (unsigned i = 0; i < nvme_shared_queue_count(s); i++) {
         NVMeQueuePair *q = s->queues[i];
 
         qemu_bh_delete(q->completion_bh);
@@ -1569,9 +1891,10 @@ static void nvme_attach_aio_context(BlockDriverState *bs,
                            nvme_handle_event, nvme_poll_cb,
                            nvme_poll_ready);
 
-    for (unsigned i = 0; i < s->queue_count; i++) {
+    for (unsigned i = 0; i < nvme_shared_queue_count(s); i++) {
         NVMeQueuePair *q = s->queues[i];
 
+        q->aio_context = new_context;
         q->completion_bh =
             aio_bh_new(new_context, nvme_process_completion_bh, q);
     }
@@ -1609,6 +1932,7 @@ static BlockStatsSpecific *nvme_get_specific_stats(BlockDriverState *bs)
         .completion_errors = s->stats.completion_errors,
         .aligned_accesses = s->stats.aligned_accesses,
         .unaligned_accesses = s->stats.unaligned_accesses,
+        .io_queues = qatomic_read(&s->queue_count) - INDEX_IO(0),
     };
 
     return stats;
@@ -1617,6 +1941,7 @@ static BlockStatsSpecific *nvme_get_specific_stats(BlockDriverState *bs)
 static const char *const nvme_strong_runtime_opts[] = {
     NVME_BLOCK_OPT_DEVICE,
     NVME_BLOCK_OPT_NAMESPACE,
+    NVME_BLOCK_OPT_QUEUES,
 
     NULL
 };
@@ -819,14 +819,16 @@ get_cluster_table(BlockDriverState *bs, uint64_t offset,
  * alloc_compressed_cluster_offset
  *
  * For a given offset on the virtual disk, allocate a new compressed cluster
- * and put the host offset of the cluster into *host_offset. If a cluster is
- * already allocated at the offset, return an error.
+ * and put the host offset of the cluster into *host_offset and the new L2
+ * entry into *l2_entry. If a cluster is already allocated at the offset,
+ * return an error.
  *
  * Return 0 on success and -errno in error cases
  */
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs, uint64_t offset,
-                                      int compressed_size, uint64_t *host_offset)
+                                      int compressed_size, uint64_t *host_offset,
+                                      uint64_t *l2_entry)
 {
     BDRVQcow2State *s = bs->opaque;
     int l2_index, ret;
@@ -881,6 +883,53 @@ qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs, uint64_t offset,
     qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
 
     *host_offset = cluster_offset & s->cluster_offset_mask;
+    *l2_entry = cluster_offset;
+    return 0;
+}
+
+/*
+ * Let the unallocated guest cluster at @offset reference the existing
+ * compressed cluster described by @l2_entry, taking an additional reference
+ * on the host clusters that hold its data. Like for
+ * qcow2_alloc_compressed_cluster_offset(), it is an error if the guest
+ * cluster is already allocated.
+ *
+ * Return 0 on success and -errno in error cases
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_link_compressed_cluster(BlockDriverState *bs, uint64_t offset,
+                              uint64_t l2_entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int l2_index, ret;
+    uint64_t *l2_slice;
+
+    assert(qcow2_get_cluster_type(bs, l2_entry) == QCOW2_CLUSTER_COMPRESSED);
+
+    ret = get_cluster_table(bs, offset, &l2_slice, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (get_l2_entry(s, l2_slice, l2_index) & L2E_OFFSET_MASK) {
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        return -EIO;
+    }
+
+    ret = qcow2_ref_compressed_cluster(bs, l2_entry);
+    if (ret < 0) {
+        qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+        return ret;
+    }
+
+    BLKDBG_CO_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
+    qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_slice);
+    set_l2_entry(s, l2_slice, l2_index, l2_entry);
+    if (has_subclusters(s)) {
+        set_l2_bitmap(s, l2_slice, l2_index, 0);
+    }
+    qcow2_cache_put(s->l2_table_cache, (void **) &l2_slice);
+
     return 0;
 }
 
@@ -1621,7 +1670,11 @@ do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
     if (*host_offset == INV_OFFSET) {
         int64_t cluster_offset =
-            qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
+            qcow2_extents_alloc(bs, guest_offset, nb_clusters);
+        if (cluster_offset == 0) {
+            cluster_offset =
+                qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
+        }
         if (cluster_offset < 0) {
             return cluster_offset;
         }
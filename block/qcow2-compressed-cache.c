@@ -0,0 +1,302 @@
+/*
+ * Cache of decompressed qcow2 clusters
+ *
+ * Reading any part of a compressed cluster requires reading and
+ * decompressing the whole cluster.  Guests usually read compressed images
+ * (e.g. golden images that were created with 'qemu-img convert -c') in
+ * requests that are much smaller than a cluster, so without a cache the same
+ * cluster is decompressed again and again.
+ *
+ * Entries are keyed by the host offset of the compressed data.  Compressed
+ * data is never modified in place, so an entry stays valid until the host
+ * clusters containing the compressed data are freed and possibly reused, at
+ * which point qcow2_compressed_cache_forget_cluster() drops it.  Because a
+ * cluster can be freed while a request is still decompressing its old content,
+ * every invalidation also bumps a generation number, and a cluster is only
+ * inserted if no invalidation happened since the caller made sure (under
+ * s->lock) that the compressed data is still in use.
+ *
+ * The cache is accessed from the read path without holding s->lock, so it
+ * has its own lock.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/iov.h"
+#include "qemu/lockable.h"
+#include "qemu/memalign.h"
+#include "qemu/queue.h"
+#include "qemu/thread.h"
+#include "qcow2.h"
+#include "trace.h"
+
+typedef struct Qcow2CompressedCacheEntry {
+    uint64_t coffset;
+    int csize;
+    void *data;
+
+    QTAILQ_ENTRY(Qcow2CompressedCacheEntry) next;
+} Qcow2CompressedCacheEntry;
+
+typedef struct Qcow2CompressedCacheClusterRefs {
+    uint64_t cluster_offset;
+    GSList *entries;
+} Qcow2CompressedCacheClusterRefs;
+
+struct Qcow2CompressedCache {
+    QemuMutex lock;
+
+    /* Host offset of the compressed data -> Qcow2CompressedCacheEntry */
+    GHashTable *entries;
+
+    /*
+     * Host cluster offset -> Qcow2CompressedCacheClusterRefs listing all
+     * entries whose compressed data is (partially) stored in that cluster
+     */
+    GHashTable *by_cluster;
+
+    /* Most recently used entry first */
+    QTAILQ_HEAD(, Qcow2CompressedCacheEntry) lru;
+
+    unsigned nb_entries;
+    unsigned max_entries;
+
+    /* Incremented on every invalidation */
+    uint64_t generation;
+};
+
+static void qcow2_compressed_cache_cluster_refs_free(gpointer opaque)
+{
+    Qcow2CompressedCacheClusterRefs *refs = opaque;
+
+    g_slist_free(refs->entries);
+    g_free(refs);
+}
+
+Qcow2CompressedCache *qcow2_compressed_cache_new(BlockDriverState *bs,
+                                                 uint64_t size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c;
+
+    if (size < s->cluster_size) {
+        return NULL;
+    }
+
+    c = g_new0(Qcow2CompressedCache, 1);
+    qemu_mutex_init(&c->lock);
+    c->entries = g_hash_table_new(g_int64_hash, g_int64_equal);
+    c->by_cluster = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL,
+                            qcow2_compressed_cache_cluster_refs_free);
+    QTAILQ_INIT(&c->lru);
+    c->max_entries = MIN(size / s->cluster_size, UINT_MAX);
+
+    return c;
+}
+
+/* Called with c->lock held */
+static void qcow2_compressed_cache_remove(BDRVQcow2State *s,
+                                          Qcow2CompressedCache *c,
+                                          Qcow2CompressedCacheEntry *e)
+{
+    uint64_t cluster_offset;
+
+    for (cluster_offset = start_of_cluster(s, e->coffset);
+         cluster_offset < e->coffset + e->csize;
+         cluster_offset += s->cluster_size)
+    {
+        Qcow2CompressedCacheClusterRefs *refs;
+
+        refs = g_hash_table_lookup(c->by_cluster, &cluster_offset);
+        refs->entries = g_slist_remove(refs->entries, e);
+        if (!refs->entries) {
+            g_hash_table_remove(c->by_cluster, &cluster_offset);
+        }
+    }
+
+    g_hash_table_remove(c->entries, &e->coffset);
+    QTAILQ_REMOVE(&c->lru, e, next);
+    c->nb_entries--;
+
+    qemu_vfree(e->data);
+    g_free(e);
+}
+
+/* Called with c->lock held */
+static void qcow2_compressed_cache_remove_all(BDRVQcow2State *s,
+                                              Qcow2CompressedCache *c)
+{
+    Qcow2CompressedCacheEntry *e, *next;
+
+    QTAILQ_FOREACH_SAFE(e, &c->lru, next, next) {
+        qcow2_compressed_cache_remove(s, c, e);
+    }
+    assert(c->nb_entries == 0);
+}
+
+void qcow2_compressed_cache_free(Qcow2CompressedCache *c)
+{
+    Qcow2CompressedCacheEntry *e, *next;
+
+    if (!c) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(e, &c->lru, next, next) {
+        qemu_vfree(e->data);
+        g_free(e);
+    }
+
+    g_hash_table_destroy(c->entries);
+    g_hash_table_destroy(c->by_cluster);
+    qemu_mutex_destroy(&c->lock);
+    g_free(c);
+}
+
+void qcow2_compressed_cache_clear(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+
+    if (c) {
+        QEMU_LOCK_GUARD(&c->lock);
+        qcow2_compressed_cache_remove_all(s, c);
+        c->generation++;
+    }
+}
+
+/*
+ * Copies @bytes bytes at @offset_in_cluster of the decompressed cluster whose
+ * compressed data is stored at @coffset into @qiov at @qiov_offset.
+ *
+ * Returns true on a cache hit, false if the caller needs to decompress the
+ * cluster itself.
+ */
+bool qcow2_compressed_cache_read(BlockDriverState *bs, uint64_t coffset,
+                                 int csize, uint64_t offset_in_cluster,
+                                 uint64_t bytes, QEMUIOVector *qiov,
+                                 size_t qiov_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2CompressedCacheEntry *e;
+
+    if (!c) {
+        return false;
+    }
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    e = g_hash_table_lookup(c->entries, &coffset);
+    if (!e || e->csize != csize) {
+        trace_qcow2_compressed_cache_miss(bs, coffset);
+        return false;
+    }
+
+    QTAILQ_REMOVE(&c->lru, e, next);
+    QTAILQ_INSERT_HEAD(&c->lru, e, next);
+
+    qemu_iovec_from_buf(qiov, qiov_offset, e->data + offset_in_cluster, bytes);
+    trace_qcow2_compressed_cache_hit(bs, coffset);
+    return true;
+}
+
+/*
+ * Returns the current generation of the cache.  Must be called with s->lock
+ * held at a point where the compressed data to be inserted is known to be in
+ * use by the image.
+ */
+uint64_t qcow2_compressed_cache_generation(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+
+    QEMU_LOCK_GUARD(&c->lock);
+    return c->generation;
+}
+
+/*
+ * Adds the decompressed cluster @data, whose compressed data is stored at
+ * @coffset, to the cache.  Takes ownership of @data, which must have been
+ * allocated with qemu_blockalign().  @generation is the value returned by
+ * qcow2_compressed_cache_generation() before the compressed data was read.
+ */
+void qcow2_compressed_cache_insert(BlockDriverState *bs, uint64_t coffset,
+                                   int csize, void *data, uint64_t generation)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2CompressedCacheEntry *e;
+    uint64_t cluster_offset;
+
+    assert(c);
+    QEMU_LOCK_GUARD(&c->lock);
+
+    if (generation != c->generation) {
+        /* The compressed data may have been freed after it was read */
+        qemu_vfree(data);
+        return;
+    }
+
+    if (g_hash_table_contains(c->entries, &coffset)) {
+        /* Another request decompressed the same cluster concurrently */
+        qemu_vfree(data);
+        return;
+    }
+
+    if (c->nb_entries >= c->max_entries) {
+        qcow2_compressed_cache_remove(s, c, QTAILQ_LAST(&c->lru));
+    }
+
+    e = g_new(Qcow2CompressedCacheEntry, 1);
+    *e = (Qcow2CompressedCacheEntry) {
+        .coffset = coffset,
+        .csize = csize,
+        .data = data,
+    };
+    g_hash_table_insert(c->entries, &e->coffset, e);
+    QTAILQ_INSERT_HEAD(&c->lru, e, next);
+    c->nb_entries++;
+
+    for (cluster_offset = start_of_cluster(s, coffset);
+         cluster_offset < coffset + csize;
+         cluster_offset += s->cluster_size)
+    {
+        Qcow2CompressedCacheClusterRefs *refs;
+
+        refs = g_hash_table_lookup(c->by_cluster, &cluster_offset);
+        if (!refs) {
+            refs = g_new0(Qcow2CompressedCacheClusterRefs, 1);
+            refs->cluster_offset = cluster_offset;
+            g_hash_table_insert(c->by_cluster, &refs->cluster_offset, refs);
+        }
+        refs->entries = g_slist_prepend(refs->entries, e);
+    }
+}
+
+/*
+ * Drops all entries whose compressed data is (partially) stored in the host
+ * cluster at @cluster_offset.  Must be called whenever the refcount of a host
+ * cluster drops to zero, because it may be reused for new data afterwards.
+ */
+void qcow2_compressed_cache_forget_cluster(BlockDriverState *bs,
+                                           uint64_t cluster_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2CompressedCache *c = s->compressed_cache;
+    Qcow2CompressedCacheClusterRefs *refs;
+
+    if (!c) {
+        return;
+    }
+
+    QEMU_LOCK_GUARD(&c->lock);
+
+    c->generation++;
+    while ((refs = g_hash_table_lookup(c->by_cluster, &cluster_offset))) {
+        /* Removing the last entry frees @refs */
+        qcow2_compressed_cache_remove(s, c, refs->entries->data);
+    }
+}
@@ -0,0 +1,286 @@
+/*
+ * Deduplication of compressed qcow2 clusters
+ *
+ * Compressed clusters are never modified in place and may legitimately be
+ * referenced by more than one L2 entry (this is how internal snapshots share
+ * them), so an identical compressed cluster can be reused for any number of
+ * guest clusters by just taking another reference on its host clusters.
+ *
+ * The index maps the SHA-256 digest of the uncompressed cluster data to the
+ * L2 entry of a compressed cluster with that content.  It only lives in
+ * memory and is filled as compressed clusters are written, which is what
+ * 'qemu-img convert -c --dedup' needs.  Every hit is verified against the
+ * data on disk before it is used, so neither a digest collision nor a stale
+ * entry can ever result in wrong data being referenced.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "crypto/hash.h"
+#include "qemu/memalign.h"
+#include "qcow2.h"
+#include "trace.h"
+
+/* Upper limit for the number of clusters the index remembers */
+#define QCOW2_DEDUP_MAX_ENTRIES (1 << 20)
+
+typedef struct Qcow2DedupEntry {
+    uint8_t digest[QCOW2_DEDUP_DIGEST_SIZE];
+    uint64_t l2_entry;
+
+    /* References from Qcow2DedupIndex.by_digest and by_cluster */
+    unsigned refcnt;
+} Qcow2DedupEntry;
+
+typedef struct Qcow2DedupClusterRefs {
+    uint64_t cluster_offset;
+    GSList *entries;
+} Qcow2DedupClusterRefs;
+
+struct Qcow2DedupIndex {
+    /* Digest of the uncompressed data -> Qcow2DedupEntry */
+    GHashTable *by_digest;
+
+    /*
+     * Host cluster offset -> Qcow2DedupClusterRefs listing all entries whose
+     * compressed data is (partially) stored in that host cluster.  Used to
+     * drop entries when their host clusters are freed and may be reused.
+     */
+    GHashTable *by_cluster;
+};
+
+static guint qcow2_dedup_digest_hash(gconstpointer key)
+{
+    guint hash;
+
+    /* The digest is uniformly distributed already */
+    memcpy(&hash, key, sizeof(hash));
+    return hash;
+}
+
+static gboolean qcow2_dedup_digest_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, QCOW2_DEDUP_DIGEST_SIZE);
+}
+
+static void qcow2_dedup_entry_unref(gpointer opaque)
+{
+    Qcow2DedupEntry *e = opaque;
+
+    assert(e->refcnt > 0);
+    if (--e->refcnt == 0) {
+        g_free(e);
+    }
+}
+
+static void qcow2_dedup_cluster_refs_free(gpointer opaque)
+{
+    Qcow2DedupClusterRefs *refs = opaque;
+
+    g_slist_free_full(refs->entries, qcow2_dedup_entry_unref);
+    g_free(refs);
+}
+
+Qcow2DedupIndex *qcow2_dedup_index_new(void)
+{
+    Qcow2DedupIndex *idx = g_new0(Qcow2DedupIndex, 1);
+
+    idx->by_digest = g_hash_table_new_full(qcow2_dedup_digest_hash,
+                                           qcow2_dedup_digest_equal,
+                                           NULL, qcow2_dedup_entry_unref);
+    idx->by_cluster = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                            NULL,
+                                            qcow2_dedup_cluster_refs_free);
+    return idx;
+}
+
+void qcow2_dedup_index_free(Qcow2DedupIndex *idx)
+{
+    if (!idx) {
+        return;
+    }
+
+    g_hash_table_destroy(idx->by_digest);
+    g_hash_table_destroy(idx->by_cluster);
+    g_free(idx);
+}
+
+void qcow2_dedup_clear(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->dedup) {
+        g_hash_table_remove_all(s->dedup->by_digest);
+        g_hash_table_remove_all(s->dedup->by_cluster);
+    }
+}
+
+static uint64_t qcow2_dedup_lookup(BDRVQcow2State *s, const uint8_t *digest)
+{
+    Qcow2DedupEntry *e = g_hash_table_lookup(s->dedup->by_digest, digest);
+
+    return e ? e->l2_entry : 0;
+}
+
+static void qcow2_dedup_remove(BDRVQcow2State *s, const uint8_t *digest,
+                               uint64_t l2_entry)
+{
+    if (qcow2_dedup_lookup(s, digest) == l2_entry) {
+        g_hash_table_remove(s->dedup->by_digest, digest);
+    }
+}
+
+void qcow2_dedup_insert(BlockDriverState *bs, const uint8_t *digest,
+                        uint64_t l2_entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupIndex *idx = s->dedup;
+    Qcow2DedupEntry *e;
+    uint64_t coffset, cluster_offset;
+    int csize;
+
+    if (g_hash_table_size(idx->by_digest) >= QCOW2_DEDUP_MAX_ENTRIES ||
+        g_hash_table_contains(idx->by_digest, digest))
+    {
+        return;
+    }
+
+    e = g_new(Qcow2DedupEntry, 1);
+    memcpy(e->digest, digest, QCOW2_DEDUP_DIGEST_SIZE);
+    e->l2_entry = l2_entry;
+    e->refcnt = 1;
+    g_hash_table_insert(idx->by_digest, e->digest, e);
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+    for (cluster_offset = start_of_cluster(s, coffset);
+         cluster_offset < coffset + csize;
+         cluster_offset += s->cluster_size)
+    {
+        Qcow2DedupClusterRefs *refs;
+
+        refs = g_hash_table_lookup(idx->by_cluster, &cluster_offset);
+        if (!refs) {
+            refs = g_new0(Qcow2DedupClusterRefs, 1);
+            refs->cluster_offset = cluster_offset;
+            g_hash_table_insert(idx->by_cluster, &refs->cluster_offset, refs);
+        }
+        refs->entries = g_slist_prepend(refs->entries, e);
+        e->refcnt++;
+    }
+}
+
+void qcow2_dedup_forget_cluster(BlockDriverState *bs, uint64_t cluster_offset)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2DedupClusterRefs *refs;
+    GSList *l;
+
+    if (!s->dedup) {
+        return;
+    }
+
+    refs = g_hash_table_lookup(s->dedup->by_cluster, &cluster_offset);
+    if (!refs) {
+        return;
+    }
+
+    for (l = refs->entries; l; l = l->next) {
+        Qcow2DedupEntry *e = l->data;
+
+        if (g_hash_table_lookup(s->dedup->by_digest, e->digest) == e) {
+            g_hash_table_remove(s->dedup->by_digest, e->digest);
+        }
+    }
+    g_hash_table_remove(s->dedup->by_cluster, &cluster_offset);
+}
+
+int qcow2_dedup_hash(BlockDriverState *bs, const void *buf, uint8_t *digest)
+{
+    BDRVQcow2State *s = bs->opaque;
+    size_t digest_len = QCOW2_DEDUP_DIGEST_SIZE;
+
+    if (qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, buf, s->cluster_size,
+                           &digest, &digest_len, NULL) < 0) {
+        return -EIO;
+    }
+    return 0;
+}
+
+/*
+ * Tries to write the cluster in @buf (which must be cluster sized and have
+ * the digest @digest) to the guest cluster at @offset by referencing an
+ * identical compressed cluster that was written before.
+ *
+ * Returns 1 if the guest cluster now references existing data, 0 if the
+ * caller needs to write the cluster itself and -errno on failure.
+ */
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_co_pwrite(BlockDriverState *bs, uint64_t offset, const void *buf,
+                      const uint8_t *digest)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t l2_entry, coffset;
+    uint8_t *cbuf = NULL, *dbuf = NULL;
+    int csize, ret;
+
+    qemu_co_mutex_lock(&s->lock);
+    l2_entry = qcow2_dedup_lookup(s, digest);
+    qemu_co_mutex_unlock(&s->lock);
+
+    if (!l2_entry) {
+        trace_qcow2_dedup_miss(qemu_coroutine_self(), offset);
+        return 0;
+    }
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+
+    cbuf = g_try_malloc(csize);
+    if (!cbuf) {
+        return -ENOMEM;
+    }
+    dbuf = qemu_blockalign(bs, s->cluster_size);
+
+    BLKDBG_CO_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_co_pread(bs->file, coffset, csize, cbuf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (qcow2_co_decompress(bs, dbuf, s->cluster_size, cbuf, csize) < 0 ||
+        memcmp(dbuf, buf, s->cluster_size) != 0)
+    {
+        /* Digest collision or stale entry, don't try it again */
+        trace_qcow2_dedup_mismatch(qemu_coroutine_self(), offset, l2_entry);
+        qemu_co_mutex_lock(&s->lock);
+        qcow2_dedup_remove(s, digest, l2_entry);
+        qemu_co_mutex_unlock(&s->lock);
+        ret = 0;
+        goto out;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    if (qcow2_dedup_lookup(s, digest) != l2_entry) {
+        /* The host clusters were freed while we were reading them */
+        ret = 0;
+    } else {
+        ret = qcow2_link_compressed_cluster(bs, offset, l2_entry);
+        if (ret == -EINVAL) {
+            /* Maximum refcount reached, write a new copy instead */
+            qcow2_dedup_remove(s, digest, l2_entry);
+            ret = 0;
+        } else if (ret == 0) {
+            trace_qcow2_dedup_hit(qemu_coroutine_self(), offset, l2_entry);
+            ret = 1;
+        }
+    }
+
+    qemu_co_mutex_unlock(&s->lock);
+
+out:
+    qemu_vfree(dbuf);
+    g_free(cbuf);
+    return ret;
+}
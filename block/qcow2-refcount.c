@@ -904,6 +904,10 @@ update_refcount(BlockDriverState *bs, int64_t offset, int64_t length,
             if (s->discard_passthrough[type]) {
                 update_refcount_discard(bs, cluster_offset, s->cluster_size);
             }
+
+            /* The cluster may be reused for anything now */
+            qcow2_dedup_forget_cluster(bs, cluster_offset);
+            qcow2_compressed_cache_forget_cluster(bs, cluster_offset);
         }
     }
 
@@ -962,7 +966,108 @@ int qcow2_update_cluster_refcount(BlockDriverState *bs,
 /*********************************************************/
 /* cluster allocation functions */
 
+/*
+ * With the alloc-extent-size option, data clusters for each guest region of
+ * extent_size bytes are allocated from a host extent of the same size that
+ * is reserved for the region the first time it is written to.  Sequential
+ * writes to a fresh image therefore end up contiguous in the image file even
+ * if the guest writes to several regions at once.
+ *
+ * If the protocol driver supports it, the reserved space is also
+ * preallocated, in chunks that double each time the region is written past
+ * the end of the previous one, starting at QCOW2_EXTENT_PREALLOC_MIN.  A
+ * region that is written sequentially thus gets the whole extent
+ * preallocated with few requests, while sparse writes that touch many
+ * regions only once don't preallocate whole extents for each of them.
+ *
+ * Reservations only exist in memory.  The reserved clusters keep a refcount
+ * of 0 until they are actually allocated, so nothing needs to be cleaned up
+ * in the image when QEMU exits; unused preallocated space at the end of the
+ * image file is simply reused the next time the image is written to.
+ */
+
+/* Maximum number of guest regions with an active reservation */
+#define QCOW2_MAX_EXTENTS 64
+
+/* Size of the first preallocated chunk of an extent */
+#define QCOW2_EXTENT_PREALLOC_MIN (1 * MiB)
+
+typedef struct Qcow2Extent {
+    uint64_t guest_region; /* guest offset / extent_size */
+
+    /* [host_next, host_end) is reserved and still free */
+    uint64_t host_next;
+    uint64_t host_end;
+
+    /* [host_next, prealloc_end) is preallocated */
+    uint64_t prealloc_end;
+    uint64_t prealloc_chunk;
 
+    QTAILQ_ENTRY(Qcow2Extent) next;
+} Qcow2Extent;
+
+struct Qcow2ExtentAllocator {
+    uint64_t extent_size;
+
+    /* Most recently used extent first */
+    QTAILQ_HEAD(, Qcow2Extent) lru;
+    unsigned nb_extents;
+
+    /*
+     * Only space from prealloc_start on is preallocated, i.e. the part of
+     * extents that lies past the end of the image file as it was when the
+     * first extent was reserved (0 if unknown yet).  prealloc is cleared
+     * when the protocol driver can't preallocate.
+     */
+    bool prealloc;
+    uint64_t prealloc_start;
+};
+
+/*
+ * Returns the index of the first cluster after the reservation containing
+ * @cluster_index, or 0 if @cluster_index is not reserved.
+ */
+static uint64_t extent_reserved_end(BDRVQcow2State *s, uint64_t cluster_index)
+{
+    uint64_t offset = cluster_index << s->cluster_bits;
+    Qcow2Extent *e;
+
+    if (!s->extents) {
+        return 0;
+    }
+
+    QTAILQ_FOREACH(e, &s->extents->lru, next) {
+        if (offset >= e->host_next && offset < e->host_end) {
+            return e->host_end >> s->cluster_bits;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Makes sure that clusters in [@offset, @offset + @bytes), which have just
+ * been allocated, are not reserved any more.
+ */
+static void extents_consume(BDRVQcow2State *s, uint64_t offset, uint64_t bytes)
+{
+    Qcow2Extent *e;
+
+    if (!s->extents) {
+        return;
+    }
+
+    QTAILQ_FOREACH(e, &s->extents->lru, next) {
+        if (offset + bytes <= e->host_next || offset >= e->host_end) {
+            continue;
+        }
+        if (offset <= e->host_next) {
+            e->host_next = MIN(offset + bytes, e->host_end);
+        } else {
+            /* Only the part before the allocation stays reserved */
+            e->host_end = offset;
+        }
+    }
+}
 
 /* return < 0 if error */
 static int64_t GRAPH_RDLOCK
@@ -981,6 +1086,14 @@ alloc_clusters_noref(BlockDriverState *bs, uint64_t size, uint64_t max)
 retry:
     for(i = 0; i < nb_clusters; i++) {
         uint64_t next_cluster_index = s->free_cluster_index++;
+        uint64_t reserved_end = extent_reserved_end(s, next_cluster_index);
+
+        if (reserved_end) {
+            /* Reserved for the data clusters of a guest region */
+            s->free_cluster_index = reserved_end;
+            goto retry;
+        }
+
         ret = qcow2_get_refcount(bs, next_cluster_index, &refcount);
 
         if (ret < 0) {
@@ -1062,9 +1175,208 @@ int64_t coroutine_fn qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offs
         return ret;
     }
 
+    extents_consume(s, offset, i << s->cluster_bits);
     return i;
 }
 
+static void extent_release(BDRVQcow2State *s, Qcow2ExtentAllocator *a,
+                           Qcow2Extent *e)
+{
+    /* Make the unused part of the extent available for other allocations */
+    if (e->host_next < e->host_end &&
+        (e->host_next >> s->cluster_bits) < s->free_cluster_index)
+    {
+        s->free_cluster_index = e->host_next >> s->cluster_bits;
+    }
+
+    QTAILQ_REMOVE(&a->lru, e, next);
+    a->nb_extents--;
+    g_free(e);
+}
+
+Qcow2ExtentAllocator *qcow2_extents_new(BlockDriverState *bs,
+                                        uint64_t extent_size)
+{
+    Qcow2ExtentAllocator *a;
+
+    if (!extent_size) {
+        return NULL;
+    }
+
+    a = g_new0(Qcow2ExtentAllocator, 1);
+    a->extent_size = extent_size;
+    a->prealloc = true;
+    QTAILQ_INIT(&a->lru);
+
+    return a;
+}
+
+void qcow2_extents_free(BlockDriverState *bs, Qcow2ExtentAllocator *a)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2Extent *e, *next;
+
+    if (!a) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(e, &a->lru, next, next) {
+        extent_release(s, a, e);
+    }
+    g_free(a);
+}
+
+/*
+ * Drops all reservations.  Must be called when the refcounts or the size of
+ * the image file are changed other than by allocating and freeing clusters.
+ */
+void qcow2_extents_release_all(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ExtentAllocator *a = s->extents;
+    Qcow2Extent *e, *next;
+
+    if (!a) {
+        return;
+    }
+
+    QTAILQ_FOREACH_SAFE(e, &a->lru, next, next) {
+        extent_release(s, a, e);
+    }
+    a->prealloc_start = 0;
+}
+
+/*
+ * Makes sure that the clusters at [@offset, @offset + @bytes), which have
+ * just been allocated from extent @e, are preallocated, by preallocating the
+ * next chunk of the extent if they are not.  Failure is not an error, the
+ * space will be allocated by the data writes then.
+ */
+static void coroutine_fn GRAPH_RDLOCK
+extent_prealloc(BlockDriverState *bs, Qcow2Extent *e, uint64_t offset,
+                uint64_t bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ExtentAllocator *a = s->extents;
+    uint64_t start, end;
+    int64_t len;
+    int ret;
+
+    if (!a->prealloc || offset + bytes <= e->prealloc_end) {
+        return;
+    }
+
+    if (!a->prealloc_start) {
+        len = bdrv_co_getlength(bs->file->bs);
+        if (len < 0) {
+            a->prealloc = false;
+            return;
+        }
+        a->prealloc_start = len;
+    }
+
+    /* The new clusters come from the extent, so they end before host_end */
+    start = MAX(offset, e->prealloc_end);
+    e->prealloc_chunk = MAX(e->prealloc_chunk * 2, QCOW2_EXTENT_PREALLOC_MIN);
+    end = MIN(MAX(offset + bytes, start + e->prealloc_chunk), e->host_end);
+    e->prealloc_end = end;
+
+    /*
+     * The range only covers the new clusters, which are not written yet, and
+     * reserved clusters, which are free, so it can safely be zeroed
+     */
+    start = MAX(start, a->prealloc_start);
+    if (start >= end) {
+        return;
+    }
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, start, end - start,
+                                BDRV_REQ_NO_FALLBACK);
+    trace_qcow2_extent_prealloc(bs, start, end - start, ret);
+    if (ret < 0) {
+        a->prealloc = false;
+    }
+}
+
+/*
+ * Allocates up to *@nb_clusters contiguous data clusters for the guest
+ * clusters starting at @guest_offset from the extent reserved for their guest
+ * region.  *@nb_clusters is updated with the number of clusters actually
+ * allocated.
+ *
+ * Returns the host offset of the first allocated cluster, 0 if the clusters
+ * must be allocated by qcow2_alloc_clusters() instead, or -errno.
+ */
+int64_t coroutine_fn GRAPH_RDLOCK
+qcow2_extents_alloc(BlockDriverState *bs, uint64_t guest_offset,
+                    uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2ExtentAllocator *a = s->extents;
+    uint64_t bytes = *nb_clusters << s->cluster_bits;
+    uint64_t region;
+    Qcow2Extent *e;
+    int64_t offset;
+    int64_t ret;
+
+    if (!a || bytes > a->extent_size) {
+        return 0;
+    }
+
+    region = guest_offset / a->extent_size;
+    QTAILQ_FOREACH(e, &a->lru, next) {
+        if (e->guest_region == region) {
+            break;
+        }
+    }
+
+    if (e && e->host_end - e->host_next < bytes) {
+        extent_release(s, a, e);
+        e = NULL;
+    }
+
+    if (!e) {
+        if (a->nb_extents >= QCOW2_MAX_EXTENTS) {
+            extent_release(s, a, QTAILQ_LAST(&a->lru));
+        }
+
+        offset = alloc_clusters_noref(bs, a->extent_size,
+                                      QCOW_MAX_CLUSTER_OFFSET);
+        if (offset < 0) {
+            return offset;
+        }
+
+        e = g_new(Qcow2Extent, 1);
+        *e = (Qcow2Extent) {
+            .guest_region   = region,
+            .host_next      = offset,
+            .host_end       = offset + a->extent_size,
+        };
+        QTAILQ_INSERT_HEAD(&a->lru, e, next);
+        a->nb_extents++;
+        trace_qcow2_extent_reserve(bs, region * a->extent_size, offset,
+                                   a->extent_size);
+    } else {
+        QTAILQ_REMOVE(&a->lru, e, next);
+        QTAILQ_INSERT_HEAD(&a->lru, e, next);
+    }
+
+    /* This moves e->host_next forward */
+    offset = e->host_next;
+    ret = qcow2_alloc_clusters_at(bs, offset, *nb_clusters);
+    if (ret < 0) {
+        return ret;
+    } else if (ret == 0) {
+        /* Something else was allocated in the extent, don't use it any more */
+        extent_release(s, a, e);
+        return 0;
+    }
+
+    *nb_clusters = ret;
+    extent_prealloc(bs, e, offset, ret << s->cluster_bits);
+    return offset;
+}
+
 /* only used to allocate compressed sectors. We try to allocate
    contiguous sectors. size must be <= cluster_size */
 int64_t coroutine_fn GRAPH_RDLOCK qcow2_alloc_bytes(BlockDriverState *bs, int size)
@@ -1205,6 +1517,29 @@ void qcow2_free_any_cluster(BlockDriverState *bs, uint64_t l2_entry,
     }
 }
 
+/*
+ * Takes an additional reference on the host clusters holding the data of the
+ * compressed cluster described by @l2_entry, so that another L2 entry can
+ * point to the same data.
+ */
+int qcow2_ref_compressed_cluster(BlockDriverState *bs, uint64_t l2_entry)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t coffset;
+    int csize, ret;
+
+    qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
+    ret = update_refcount(bs, coffset, csize, 1, false, QCOW2_DISCARD_NEVER);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The refcounts must be on disk before the new L2 entry referencing
+     * the clusters */
+    qcow2_cache_set_dependency(bs, s->l2_table_cache, s->refcount_block_cache);
+    return 0;
+}
+
 int qcow2_write_caches(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -2287,6 +2622,16 @@ calculate_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
         }
     }
 
+    /* compression dictionary */
+    if (s->compression_dict_header.length) {
+        ret = qcow2_inc_refcounts_imrt(bs, res, refcount_table, nb_clusters,
+                                       s->compression_dict_header.offset,
+                                       s->compression_dict_header.length);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
     /* bitmaps */
     ret = qcow2_check_bitmaps_refcounts(bs, res, refcount_table, nb_clusters);
     if (ret < 0) {
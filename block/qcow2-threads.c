@@ -33,6 +33,11 @@
 #include <zstd_errors.h>
 #endif
 
+#ifdef CONFIG_LZ4
+#include <lz4.h>
+#endif
+
+#include "qapi/error.h"
 #include "qcow2.h"
 #include "block/block-io.h"
 #include "block/thread-pool.h"
@@ -66,18 +71,78 @@ qcow2_co_process(BlockDriverState *bs, ThreadPoolFunc *func, void *arg)
  * Compression
  */
 
+struct Qcow2CompressionDict {
+#ifdef CONFIG_ZSTD
+    ZSTD_CDict *zstd_cdict;
+    ZSTD_DDict *zstd_ddict;
+#endif
+    size_t size;
+};
+
 typedef ssize_t (*Qcow2CompressFunc)(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size);
+                                     const void *src, size_t src_size,
+                                     const Qcow2CompressionDict *dict);
 typedef struct Qcow2CompressData {
     void *dest;
     size_t dest_size;
     const void *src;
     size_t src_size;
+    const Qcow2CompressionDict *dict;
     ssize_t ret;
 
     Qcow2CompressFunc func;
 } Qcow2CompressData;
 
+/*
+ * qcow2_compression_dict_new()
+ *
+ * Prepare the dictionary in @data (@len bytes) for compressing and
+ * decompressing clusters with compression type @type.  The dictionary
+ * content is copied, so @data may be freed afterwards.
+ *
+ * Returns: the new dictionary on success
+ *          NULL on failure
+ */
+Qcow2CompressionDict *
+qcow2_compression_dict_new(Qcow2CompressionType type, const void *data,
+                           size_t len, Error **errp)
+{
+    Qcow2CompressionDict *dict;
+
+    switch (type) {
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        dict = g_new0(Qcow2CompressionDict, 1);
+        dict->size = len;
+        dict->zstd_cdict = ZSTD_createCDict(data, len, ZSTD_CLEVEL_DEFAULT);
+        dict->zstd_ddict = ZSTD_createDDict(data, len);
+        if (!dict->zstd_cdict || !dict->zstd_ddict) {
+            error_setg(errp, "Failed to load the zstd compression dictionary");
+            qcow2_compression_dict_free(dict);
+            return NULL;
+        }
+        return dict;
+#endif
+    default:
+        error_setg(errp, "Compression dictionaries are not supported with "
+                   "compression type '%s'", Qcow2CompressionType_str(type));
+        return NULL;
+    }
+}
+
+void qcow2_compression_dict_free(Qcow2CompressionDict *dict)
+{
+    if (!dict) {
+        return;
+    }
+
+#ifdef CONFIG_ZSTD
+    ZSTD_freeCDict(dict->zstd_cdict);
+    ZSTD_freeDDict(dict->zstd_ddict);
+#endif
+    g_free(dict);
+}
+
 /*
  * qcow2_zlib_compress()
  *
@@ -91,7 +156,8 @@ typedef struct Qcow2CompressData {
  *          -EIO    on any other error
  */
 static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
-                                   const void *src, size_t src_size)
+                                   const void *src, size_t src_size,
+                                   const Qcow2CompressionDict *dict)
 {
     ssize_t ret;
     z_stream strm;
@@ -138,7 +204,8 @@ static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
  *          -EIO on fail
  */
 static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size)
+                                     const void *src, size_t src_size,
+                                     const Qcow2CompressionDict *dict)
 {
     int ret;
     z_stream strm;
@@ -180,13 +247,15 @@ static ssize_t qcow2_zlib_decompress(void *dest, size_t dest_size,
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @dict - dictionary to compress with, or NULL
  *
  * Returns: compressed size on success
  *          -ENOMEM destination buffer is not enough to store compressed data
  *          -EIO    on any other error
  */
 static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
-                                   const void *src, size_t src_size)
+                                   const void *src, size_t src_size,
+                                   const Qcow2CompressionDict *dict)
 {
     ssize_t ret;
     size_t zstd_ret;
@@ -205,6 +274,10 @@ static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
     if (!cctx) {
         return -EIO;
     }
+    if (dict && ZSTD_isError(ZSTD_CCtx_refCDict(cctx, dict->zstd_cdict))) {
+        ret = -EIO;
+        goto out;
+    }
     /*
      * Use the zstd streamed interface for symmetry with decompression,
      * where streaming is essential since we don't record the exact
@@ -249,12 +322,14 @@ out:
  *
  * @dest - destination buffer, @dest_size bytes
  * @src - source buffer, @src_size bytes
+ * @dict - dictionary the data was compressed with, or NULL
  *
  * Returns: 0 on success
  *          -EIO on any error
  */
 static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
-                                     const void *src, size_t src_size)
+                                     const void *src, size_t src_size,
+                                     const Qcow2CompressionDict *dict)
 {
     size_t zstd_ret = 0;
     ssize_t ret = 0;
@@ -273,6 +348,10 @@ static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
     if (!dctx) {
         return -EIO;
     }
+    if (dict && ZSTD_isError(ZSTD_DCtx_refDDict(dctx, dict->zstd_ddict))) {
+        ZSTD_freeDCtx(dctx);
+        return -EIO;
+    }
 
     /*
      * The compressed stream from the input buffer may consist of more
@@ -325,12 +404,75 @@ static ssize_t qcow2_zstd_decompress(void *dest, size_t dest_size,
 }
 #endif
 
+#ifdef CONFIG_LZ4
+
+/*
+ * qcow2_lz4_compress()
+ *
+ * Compress @src_size bytes of data into a single LZ4 block
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: compressed size on success
+ *          -ENOMEM destination buffer is not enough to store compressed data
+ */
+static ssize_t qcow2_lz4_compress(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size,
+                                  const Qcow2CompressionDict *dict)
+{
+    int ret;
+
+    assert(src_size <= LZ4_MAX_INPUT_SIZE && dest_size <= INT_MAX);
+
+    ret = LZ4_compress_default(src, dest, src_size, dest_size);
+    if (ret <= 0) {
+        /* LZ4 has no other failure than running out of output space */
+        return -ENOMEM;
+    }
+
+    return ret;
+}
+
+/*
+ * qcow2_lz4_decompress()
+ *
+ * Decompress some data (not more than @src_size bytes) to produce exactly
+ * @dest_size bytes from an LZ4 block
+ *
+ * @dest - destination buffer, @dest_size bytes
+ * @src - source buffer, @src_size bytes
+ *
+ * Returns: 0 on success
+ *          -EIO on any error
+ */
+static ssize_t qcow2_lz4_decompress(void *dest, size_t dest_size,
+                                    const void *src, size_t src_size,
+                                    const Qcow2CompressionDict *dict)
+{
+    int ret;
+
+    assert(src_size <= INT_MAX && dest_size <= INT_MAX);
+
+    /*
+     * The LZ4 block format doesn't record where the block ends, and @src may
+     * contain trailing garbage up to the end of the last sector. Partial
+     * decoding stops as soon as @dest_size bytes have been produced, so the
+     * garbage is never looked at.
+     */
+    ret = LZ4_decompress_safe_partial(src, dest, src_size, dest_size,
+                                      dest_size);
+
+    return ret == dest_size ? 0 : -EIO;
+}
+#endif
+
 static int qcow2_compress_pool_func(void *opaque)
 {
     Qcow2CompressData *data = opaque;
 
     data->ret = data->func(data->dest, data->dest_size,
-                           data->src, data->src_size);
+                           data->src, data->src_size, data->dict);
 
     return 0;
 }
@@ -339,11 +481,13 @@ static ssize_t coroutine_fn
 qcow2_co_do_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                      const void *src, size_t src_size, Qcow2CompressFunc func)
 {
+    BDRVQcow2State *s = bs->opaque;
     Qcow2CompressData arg = {
         .dest = dest,
         .dest_size = dest_size,
         .src = src,
         .src_size = src_size,
+        .dict = s->compression_dict,
         .func = func,
     };
 
@@ -381,6 +525,12 @@ qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
         fn = qcow2_zstd_compress;
         break;
 #endif
+
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        fn = qcow2_lz4_compress;
+        break;
+#endif
     default:
         abort();
     }
@@ -418,6 +568,12 @@ qcow2_co_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
         fn = qcow2_zstd_decompress;
         break;
 #endif
+
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        fn = qcow2_lz4_decompress;
+        break;
+#endif
     default:
         abort();
     }
@@ -73,6 +73,7 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_CRYPTO_HEADER 0x0537be77
 #define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
 #define  QCOW2_EXT_MAGIC_DATA_FILE 0x44415441
+#define  QCOW2_EXT_MAGIC_COMPRESSION_DICT 0x44494354
 
 static int coroutine_fn
 qcow2_co_preadv_compressed(BlockDriverState *bs,
@@ -432,6 +433,44 @@ qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             break;
         }
 
+        case QCOW2_EXT_MAGIC_COMPRESSION_DICT:
+            if (ext.len != sizeof(Qcow2CompressionDictHeaderExtension)) {
+                error_setg(errp, "Compression dictionary header extension "
+                           "size %u, but expected size %zu", ext.len,
+                           sizeof(Qcow2CompressionDictHeaderExtension));
+                return -EINVAL;
+            }
+
+            ret = bdrv_co_pread(bs->file, offset, ext.len,
+                                &s->compression_dict_header, 0);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "Unable to read compression "
+                                 "dictionary header extension");
+                return ret;
+            }
+            s->compression_dict_header.offset =
+                be64_to_cpu(s->compression_dict_header.offset);
+            s->compression_dict_header.length =
+                be64_to_cpu(s->compression_dict_header.length);
+
+            if (!QEMU_IS_ALIGNED(s->compression_dict_header.offset,
+                                 s->cluster_size) ||
+                s->compression_dict_header.offset == 0)
+            {
+                error_setg(errp, "Compression dictionary offset '%" PRIu64
+                           "' is invalid", s->compression_dict_header.offset);
+                return -EINVAL;
+            }
+            if (s->compression_dict_header.length == 0 ||
+                s->compression_dict_header.length >
+                QCOW2_MAX_COMPRESSION_DICT_SIZE)
+            {
+                error_setg(errp, "Compression dictionary size '%" PRIu64
+                           "' is invalid", s->compression_dict_header.length);
+                return -EINVAL;
+            }
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             /* If you add a new feature, make sure to also update the fast
@@ -620,6 +659,13 @@ qcow2_co_check_locked(BlockDriverState *bs, BdrvCheckResult *result,
         return ret;
     }
 
+    if (fix) {
+        /* Repairs may free clusters behind the back of the dedup index */
+        qcow2_dedup_clear(bs);
+        qcow2_compressed_cache_clear(bs);
+        qcow2_extents_release_all(bs);
+    }
+
     ret = qcow2_check_refcounts(bs, &refcount_res, fix);
     qcow2_add_check_result(result, &refcount_res, true);
     if (ret < 0) {
@@ -701,6 +747,9 @@ static const char *const mutable_opts[] = {
     QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
     QCOW2_OPT_REFCOUNT_CACHE_SIZE,
     QCOW2_OPT_CACHE_CLEAN_INTERVAL,
+    QCOW2_OPT_DEDUP,
+    QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+    QCOW2_OPT_ALLOC_EXTENT_SIZE,
     NULL
 };
 
@@ -817,6 +866,24 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_DEDUP,
+            .type = QEMU_OPT_BOOL,
+            .help = "Reuse identical compressed clusters instead of writing "
+                    "them again",
+        },
+        {
+            .name = QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of the cache for decompressed clusters",
+        },
+        {
+            .name = QCOW2_OPT_ALLOC_EXTENT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the image file extents that are reserved and "
+                    "preallocated for newly written guest regions "
+                    "(0 = disabled)",
+        },
         BLOCK_CRYPTO_OPT_DEF_KEY_SECRET("encrypt.",
             "ID of secret providing qcow2 AES key or LUKS passphrase"),
         { /* end of list */ }
@@ -978,6 +1045,9 @@ typedef struct Qcow2ReopenState {
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     bool discard_no_unref;
+    bool dedup;
+    uint64_t compressed_cache_size;
+    uint64_t alloc_extent_size;
     uint64_t cache_clean_interval;
     QCryptoBlockOpenOptions *crypto_opts; /* Disk encryption runtime options */
 } Qcow2ReopenState;
@@ -1157,6 +1227,24 @@ qcow2_update_options_prepare(BlockDriverState *bs, Qcow2ReopenState *r,
         goto fail;
     }
 
+    r->dedup = qemu_opt_get_bool(opts, QCOW2_OPT_DEDUP, false);
+
+    r->compressed_cache_size =
+        qemu_opt_get_size(opts, QCOW2_OPT_COMPRESSED_CACHE_SIZE,
+                          DEFAULT_COMPRESSED_CACHE_SIZE);
+
+    r->alloc_extent_size = qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_EXTENT_SIZE,
+                                             0);
+    if (!QEMU_IS_ALIGNED(r->alloc_extent_size, s->cluster_size) ||
+        r->alloc_extent_size > QCOW2_MAX_ALLOC_EXTENT_SIZE)
+    {
+        error_setg(errp, "'" QCOW2_OPT_ALLOC_EXTENT_SIZE "' must be a "
+                   "multiple of the cluster size (%d) and at most %" PRIu64,
+                   s->cluster_size, (uint64_t) QCOW2_MAX_ALLOC_EXTENT_SIZE);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     switch (s->crypt_method_header) {
     case QCOW_CRYPT_NONE:
         if (encryptfmt) {
@@ -1239,6 +1327,26 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
 
     s->discard_no_unref = r->discard_no_unref;
 
+    if (r->dedup && !s->dedup) {
+        s->dedup = qcow2_dedup_index_new();
+    } else if (!r->dedup && s->dedup) {
+        qcow2_dedup_index_free(s->dedup);
+        s->dedup = NULL;
+    }
+
+    if (s->compressed_cache_size != r->compressed_cache_size) {
+        qcow2_compressed_cache_free(s->compressed_cache);
+        s->compressed_cache = qcow2_compressed_cache_new(bs,
+                                                 r->compressed_cache_size);
+        s->compressed_cache_size = r->compressed_cache_size;
+    }
+
+    if (s->alloc_extent_size != r->alloc_extent_size) {
+        qcow2_extents_free(bs, s->extents);
+        s->extents = qcow2_extents_new(bs, r->alloc_extent_size);
+        s->alloc_extent_size = r->alloc_extent_size;
+    }
+
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
         s->cache_clean_interval = r->cache_clean_interval;
@@ -1278,12 +1386,59 @@ qcow2_update_options(BlockDriverState *bs, QDict *options, int flags,
     return ret;
 }
 
+/*
+ * Members of Qcow2CompressionType may be compiled out, so its values don't
+ * necessarily match the values of the compression type header field.
+ */
+static int qcow2_compression_type_from_header(uint8_t header_value,
+                                              Qcow2CompressionType *type)
+{
+    switch (header_value) {
+    case QCOW2_COMPRESSION_HEADER_ZLIB:
+        *type = QCOW2_COMPRESSION_TYPE_ZLIB;
+        return 0;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_HEADER_ZSTD:
+        *type = QCOW2_COMPRESSION_TYPE_ZSTD;
+        return 0;
+#endif
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_HEADER_LZ4:
+        *type = QCOW2_COMPRESSION_TYPE_LZ4;
+        return 0;
+#endif
+    default:
+        return -ENOTSUP;
+    }
+}
+
+static uint8_t qcow2_compression_type_to_header(Qcow2CompressionType type)
+{
+    switch (type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return QCOW2_COMPRESSION_HEADER_ZLIB;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return QCOW2_COMPRESSION_HEADER_ZSTD;
+#endif
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
+        return QCOW2_COMPRESSION_HEADER_LZ4;
+#endif
+    default:
+        g_assert_not_reached();
+    }
+}
+
 static int validate_compression_type(BDRVQcow2State *s, Error **errp)
 {
     switch (s->compression_type) {
     case QCOW2_COMPRESSION_TYPE_ZLIB:
 #ifdef CONFIG_ZSTD
     case QCOW2_COMPRESSION_TYPE_ZSTD:
+#endif
+#ifdef CONFIG_LZ4
+    case QCOW2_COMPRESSION_TYPE_LZ4:
 #endif
         break;
 
@@ -1314,6 +1469,56 @@ static int validate_compression_type(BDRVQcow2State *s, Error **errp)
     return 0;
 }
 
+/*
+ * Loads the compression dictionary from the image if the image has one and
+ * makes sure that the header extension and the incompatible feature bit agree.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_load_compression_dict(BlockDriverState *bs, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree void *buf = NULL;
+    uint64_t len = s->compression_dict_header.length;
+    int ret;
+
+    if (!(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION_DICT)) {
+        if (len) {
+            error_setg(errp, "Compression dictionary header extension must "
+                       "not be present without the compression dictionary "
+                       "incompatible feature bit");
+            return -EINVAL;
+        }
+        return 0;
+    }
+
+    if (!len) {
+        error_setg(errp, "Compression dictionary incompatible feature bit is "
+                   "set, but the header extension is missing");
+        return -EINVAL;
+    }
+
+    buf = g_try_malloc(len);
+    if (!buf) {
+        error_setg(errp, "Could not allocate compression dictionary");
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, s->compression_dict_header.offset, len, buf,
+                        0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read compression dictionary");
+        return ret;
+    }
+
+    s->compression_dict = qcow2_compression_dict_new(s->compression_type, buf,
+                                                     len, errp);
+    if (!s->compression_dict) {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
 /* Called with s->lock held.  */
 static int coroutine_fn GRAPH_RDLOCK
 qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
@@ -1438,7 +1643,13 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
      * the only valid (default) compression type in that case
      */
     if (header.header_length > offsetof(QCowHeader, compression_type)) {
-        s->compression_type = header.compression_type;
+        ret = qcow2_compression_type_from_header(header.compression_type,
+                                                 &s->compression_type);
+        if (ret < 0) {
+            error_setg(errp, "qcow2: unknown compression type: %u",
+                       header.compression_type);
+            goto fail;
+        }
     } else {
         s->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
     }
@@ -1636,6 +1847,11 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    ret = qcow2_load_compression_dict(bs, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     if (open_data_file && (flags & BDRV_O_NO_IO)) {
         /*
          * Don't open the data file for 'qemu-img info' so that it can be used
@@ -1913,6 +2129,14 @@ qcow2_do_open(BlockDriverState *bs, QDict *options, int flags,
     if (s->refcount_block_cache) {
         qcow2_cache_destroy(s->refcount_block_cache);
     }
+    qcow2_dedup_index_free(s->dedup);
+    s->dedup = NULL;
+    qcow2_compressed_cache_free(s->compressed_cache);
+    s->compressed_cache = NULL;
+    qcow2_extents_free(bs, s->extents);
+    s->extents = NULL;
+    qcow2_compression_dict_free(s->compression_dict);
+    s->compression_dict = NULL;
     qcrypto_block_free(s->crypto);
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
     return ret;
@@ -2807,6 +3031,18 @@ qcow2_do_close(BlockDriverState *bs, bool close_data_file)
     qcow2_cache_destroy(s->l2_table_cache);
     qcow2_cache_destroy(s->refcount_block_cache);
 
+    qcow2_dedup_index_free(s->dedup);
+    s->dedup = NULL;
+
+    qcow2_compressed_cache_free(s->compressed_cache);
+    s->compressed_cache = NULL;
+
+    qcow2_extents_free(bs, s->extents);
+    s->extents = NULL;
+
+    qcow2_compression_dict_free(s->compression_dict);
+    s->compression_dict = NULL;
+
     qcrypto_block_free(s->crypto);
     s->crypto = NULL;
     qapi_free_QCryptoBlockOpenOptions(s->crypto_opts);
@@ -2971,7 +3207,8 @@ int qcow2_update_header(BlockDriverState *bs)
         .autoclear_features     = cpu_to_be64(s->autoclear_features),
         .refcount_order         = cpu_to_be32(s->refcount_order),
         .header_length          = cpu_to_be32(header_length),
-        .compression_type       = s->compression_type,
+        .compression_type       =
+            qcow2_compression_type_to_header(s->compression_type),
     };
 
     /* For older versions, write a shorter header */
@@ -3046,6 +3283,22 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Compression dictionary extension */
+    if (s->compression_dict_header.offset != 0) {
+        Qcow2CompressionDictHeaderExtension dict_header = {
+            .offset = cpu_to_be64(s->compression_dict_header.offset),
+            .length = cpu_to_be64(s->compression_dict_header.length),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION_DICT,
+                             &dict_header, sizeof(dict_header), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /*
      * Feature table.  A mere 8 feature names occupies 392 bytes, and
      * when coupled with the v3 minimum header of 104 bytes plus the
@@ -3081,6 +3334,11 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
                 .name = "extended L2 entries",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR,
+                .name = "compression dictionary",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -3247,6 +3505,57 @@ qcow2_set_up_encryption(BlockDriverState *bs,
     return ret;
 }
 
+/*
+ * Stores the compression dictionary @data in the image and makes @dict, which
+ * must have been created from @data, the active dictionary.  Takes ownership
+ * of @dict.
+ */
+static int coroutine_fn GRAPH_RDLOCK
+qcow2_set_up_compression_dict(BlockDriverState *bs, Qcow2CompressionDict *dict,
+                              const void *data, size_t len, Error **errp)
+{
+    BDRVQcow2State *s = bs->opaque;
+    g_autofree uint8_t *buf = NULL;
+    int64_t offset, clusterlen;
+    int ret;
+
+    assert(!s->compression_dict);
+    s->compression_dict = dict;
+
+    offset = qcow2_alloc_clusters(bs, len);
+    if (offset < 0) {
+        error_setg_errno(errp, -offset, "Cannot allocate clusters for the "
+                         "compression dictionary");
+        return offset;
+    }
+
+    /* Zero fill the tail of the last cluster so it has predictable content */
+    clusterlen = size_to_clusters(s, len) * s->cluster_size;
+    buf = g_malloc0(clusterlen);
+    memcpy(buf, data, len);
+
+    assert(qcow2_pre_write_overlap_check(bs, 0, offset, clusterlen,
+                                         false) == 0);
+    ret = bdrv_co_pwrite(bs->file, offset, clusterlen, buf, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write compression dictionary");
+        return ret;
+    }
+
+    s->compression_dict_header.offset = offset;
+    s->compression_dict_header.length = len;
+    s->incompatible_features |= QCOW2_INCOMPAT_COMPRESSION_DICT;
+
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write compression dictionary "
+                         "header extension");
+        return ret;
+    }
+
+    return 0;
+}
+
 /**
  * Preallocates metadata structures for data clusters between @offset (in the
  * guest disk) and @new_length (which is thus generally the new guest disk
@@ -3522,7 +3831,10 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
     int refcount_order;
     uint64_t *refcount_table;
     int ret;
-    uint8_t compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    Qcow2CompressionType compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
+    g_autofree char *compression_dict = NULL;
+    gsize compression_dict_len = 0;
+    Qcow2CompressionDict *dict = NULL;
 
     assert(create_options->driver == BLOCKDEV_DRIVER_QCOW2);
     qcow2_opts = &create_options->u.qcow2;
@@ -3692,6 +4004,10 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
 #ifdef CONFIG_ZSTD
         case QCOW2_COMPRESSION_TYPE_ZSTD:
             break;
+#endif
+#ifdef CONFIG_LZ4
+        case QCOW2_COMPRESSION_TYPE_LZ4:
+            break;
 #endif
         default:
             error_setg(errp, "Unknown compression type");
@@ -3701,6 +4017,33 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         compression_type = qcow2_opts->compression_type;
     }
 
+    if (qcow2_opts->compression_dictionary) {
+        g_autoptr(GError) gerr = NULL;
+
+        ret = -EINVAL;
+        if (!g_file_get_contents(qcow2_opts->compression_dictionary,
+                                 &compression_dict, &compression_dict_len,
+                                 &gerr)) {
+            error_setg(errp, "Could not read compression dictionary: %s",
+                       gerr->message);
+            goto out;
+        }
+        if (compression_dict_len == 0 ||
+            compression_dict_len > QCOW2_MAX_COMPRESSION_DICT_SIZE) {
+            error_setg(errp, "Compression dictionary must not be empty or "
+                       "larger than %" PRId64 " bytes",
+                       (int64_t) QCOW2_MAX_COMPRESSION_DICT_SIZE);
+            goto out;
+        }
+
+        /* Fails for compression types that don't support dictionaries */
+        dict = qcow2_compression_dict_new(compression_type, compression_dict,
+                                          compression_dict_len, errp);
+        if (!dict) {
+            goto out;
+        }
+    }
+
     /* Create BlockBackend to write to the image */
     blk = blk_co_new_with_bs(bs, BLK_PERM_WRITE | BLK_PERM_RESIZE, BLK_PERM_ALL,
                              errp);
@@ -3724,7 +4067,8 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         .refcount_table_clusters    = cpu_to_be32(1),
         .refcount_order             = cpu_to_be32(refcount_order),
         /* don't deal with endianness since compression_type is 1 byte long */
-        .compression_type           = compression_type,
+        .compression_type           =
+            qcow2_compression_type_to_header(compression_type),
         .header_length              = cpu_to_be32(sizeof(*header)),
     };
 
@@ -3861,6 +4205,20 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
         }
     }
 
+    /* Want a compression dictionary? There you go. */
+    if (dict) {
+        bdrv_graph_co_rdlock();
+        ret = qcow2_set_up_compression_dict(blk_bs(blk), dict,
+                                            compression_dict,
+                                            compression_dict_len, errp);
+        dict = NULL;
+        bdrv_graph_co_rdunlock();
+
+        if (ret < 0) {
+            goto out;
+        }
+    }
+
     blk_co_unref(blk);
     blk = NULL;
 
@@ -3886,6 +4244,7 @@ qcow2_co_create(BlockdevCreateOptions *create_options, Error **errp)
 
     ret = 0;
 out:
+    qcow2_compression_dict_free(dict);
     blk_co_unref(blk);
     bdrv_co_unref(bs);
     bdrv_co_unref(data_bs);
@@ -3945,6 +4304,7 @@ qcow2_co_create_opts(BlockDriver *drv, const char *filename, QemuOpts *opts,
         { BLOCK_OPT_COMPAT_LEVEL,       "version" },
         { BLOCK_OPT_DATA_FILE_RAW,      "data-file-raw" },
         { BLOCK_OPT_COMPRESSION_TYPE,   "compression-type" },
+        { BLOCK_OPT_COMPRESSION_DICT,   "compression-dictionary" },
         { NULL, NULL },
     };
 
@@ -4337,6 +4697,9 @@ qcow2_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
         goto fail;
     }
 
+    /* Resizing may truncate or preallocate the image file behind our back */
+    qcow2_extents_release_all(bs);
+
     old_length = bs->total_sectors * BDRV_SECTOR_SIZE;
     new_l1_size = size_to_l1(s, offset);
 
@@ -4679,8 +5042,10 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
     BDRVQcow2State *s = bs->opaque;
     int ret;
     ssize_t out_len;
-    uint8_t *buf, *out_buf;
-    uint64_t cluster_offset;
+    uint8_t *buf, *out_buf = NULL;
+    uint64_t cluster_offset, l2_entry;
+    uint8_t digest[QCOW2_DEDUP_DIGEST_SIZE];
+    bool dedup = s->dedup;
 
     assert(bytes == s->cluster_size || (bytes < s->cluster_size &&
            (offset + bytes == bs->total_sectors << BDRV_SECTOR_BITS)));
@@ -4692,6 +5057,19 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
     }
     qemu_iovec_to_buf(qiov, qiov_offset, buf, bytes);
 
+    if (dedup) {
+        ret = qcow2_dedup_hash(bs, buf, digest);
+        if (ret < 0) {
+            goto fail;
+        }
+        ret = qcow2_dedup_co_pwrite(bs, offset, buf, digest);
+        if (ret < 0) {
+            goto fail;
+        } else if (ret > 0) {
+            goto success;
+        }
+    }
+
     out_buf = g_malloc(s->cluster_size);
 
     out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
@@ -4710,7 +5088,7 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
 
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_alloc_compressed_cluster_offset(bs, offset, out_len,
-                                                &cluster_offset);
+                                                &cluster_offset, &l2_entry);
     if (ret < 0) {
         qemu_co_mutex_unlock(&s->lock);
         goto fail;
@@ -4727,6 +5105,13 @@ qcow2_co_pwritev_compressed_task(BlockDriverState *bs,
     if (ret < 0) {
         goto fail;
     }
+
+    if (dedup) {
+        /* Only now that the data is on disk, it may be shared */
+        qemu_co_mutex_lock(&s->lock);
+        qcow2_dedup_insert(bs, digest, l2_entry);
+        qemu_co_mutex_unlock(&s->lock);
+    }
 success:
     ret = 0;
 fail:
@@ -4831,9 +5216,39 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
     uint64_t coffset;
     uint8_t *buf, *out_buf;
     int offset_in_cluster = offset_into_cluster(s, offset);
+    bool cache_insert = false;
+    uint64_t cache_generation = 0;
 
     qcow2_parse_compressed_l2_entry(bs, l2_entry, &coffset, &csize);
 
+    if (s->compressed_cache) {
+        uint64_t host_offset;
+        unsigned int cur_bytes = 1;
+        QCow2SubclusterType type;
+
+        if (qcow2_compressed_cache_read(bs, coffset, csize, offset_in_cluster,
+                                        bytes, qiov, qiov_offset)) {
+            return 0;
+        }
+
+        /*
+         * Only cache the cluster if it is still mapped: the compressed data
+         * may have been freed since the L2 lookup and must not end up in the
+         * cache then.
+         */
+        qemu_co_mutex_lock(&s->lock);
+        ret = qcow2_get_host_offset(bs, offset, &cur_bytes, &host_offset,
+                                    &type);
+        if (ret == 0 && type == QCOW2_SUBCLUSTER_COMPRESSED &&
+            host_offset == l2_entry)
+        {
+            cache_insert = true;
+            cache_generation = qcow2_compressed_cache_generation(bs);
+        }
+        qemu_co_mutex_unlock(&s->lock);
+        ret = 0;
+    }
+
     buf = g_try_malloc(csize);
     if (!buf) {
         return -ENOMEM;
@@ -4854,6 +5269,12 @@ qcow2_co_preadv_compressed(BlockDriverState *bs,
 
     qemu_iovec_from_buf(qiov, qiov_offset, out_buf + offset_in_cluster, bytes);
 
+    if (cache_insert) {
+        qcow2_compressed_cache_insert(bs, coffset, csize, out_buf,
+                                      cache_generation);
+        out_buf = NULL;
+    }
+
 fail:
     qemu_vfree(out_buf);
     g_free(buf);
@@ -4875,6 +5296,11 @@ static int GRAPH_RDLOCK make_completely_empty(BlockDriverState *bs)
         uint32_t reftable_clusters;
     } QEMU_PACKED l1_ofs_rt_ofs_cls;
 
+    /* All clusters are freed without going through update_refcount() */
+    qcow2_dedup_clear(bs);
+    qcow2_compressed_cache_clear(bs);
+    qcow2_extents_release_all(bs);
+
     ret = qcow2_cache_empty(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -5024,11 +5450,13 @@ static int GRAPH_RDLOCK qcow2_make_empty(BlockDriverState *bs)
     if (s->qcow_version >= 3 && !s->snapshots && !s->nb_bitmaps &&
         3 + l1_clusters <= s->refcount_block_size &&
         s->crypt_method_header != QCOW_CRYPT_LUKS &&
+        !s->compression_dict_header.length &&
         !has_data_file(bs)) {
         /* The following function only works for qcow2 v3 images (it
          * requires the dirty flag) and only as long as there are no
          * features that reserve extra clusters (such as snapshots,
-         * LUKS header, or persistent bitmaps), because it completely
+         * LUKS header, compression dictionary, or persistent bitmaps),
+         * because it completely
          * empties the image.  Furthermore, the L1 table and three
          * additional clusters (image header, refcount table, one
          * refcount block) have to fit inside one refcount block. It
@@ -5524,8 +5952,8 @@ qcow2_downgrade(BlockDriverState *bs, int target_version,
             return -EINVAL;
         }
         if (ret) {
-            error_setg(errp, "Cannot downgrade an image with zstd compression "
-                       "type and existing compressed clusters");
+            error_setg(errp, "Cannot downgrade an image with non-zlib "
+                       "compression type and existing compressed clusters");
             return -ENOTSUP;
         }
         /*
@@ -6114,6 +6542,12 @@ static QemuOptsList qcow2_create_opts = {
                     "compression",                                      \
             .def_value_str = "zlib"                                     \
         },
+        {                                                               \
+            .name = BLOCK_OPT_COMPRESSION_DICT,                         \
+            .type = QEMU_OPT_STRING,                                    \
+            .help = "File containing a zstd dictionary used for image " \
+                    "cluster compression",                              \
+        },
         QCOW_COMMON_OPTIONS,
         { /* end of list */ }
     }
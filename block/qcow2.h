@@ -128,6 +128,14 @@
 
 #define DEFAULT_CLUSTER_SIZE 65536
 
+#define DEFAULT_COMPRESSED_CACHE_SIZE (4 * MiB)
+
+/* Upper limit for the size of a compression dictionary */
+#define QCOW2_MAX_COMPRESSION_DICT_SIZE (16 * MiB)
+
+/* Upper limit for the alloc-extent-size option */
+#define QCOW2_MAX_ALLOC_EXTENT_SIZE (1 * GiB)
+
 #define QCOW2_OPT_DATA_FILE "data-file"
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -150,6 +158,9 @@
 #define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_DEDUP "dedup"
+#define QCOW2_OPT_COMPRESSED_CACHE_SIZE "compressed-cache-size"
+#define QCOW2_OPT_ALLOC_EXTENT_SIZE "alloc-extent-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -230,12 +241,31 @@ typedef struct QCowSnapshot {
 
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
+typedef struct Qcow2DedupIndex Qcow2DedupIndex;
+typedef struct Qcow2CompressedCache Qcow2CompressedCache;
+typedef struct Qcow2CompressionDict Qcow2CompressionDict;
+typedef struct Qcow2ExtentAllocator Qcow2ExtentAllocator;
+
+/* Size of the SHA-256 digests identifying deduplicated clusters */
+#define QCOW2_DEDUP_DIGEST_SIZE 32
 
 typedef struct Qcow2CryptoHeaderExtension {
     uint64_t offset;
     uint64_t length;
 } QEMU_PACKED Qcow2CryptoHeaderExtension;
 
+typedef struct Qcow2CompressionDictHeaderExtension {
+    uint64_t offset;
+    uint64_t length;
+} QEMU_PACKED Qcow2CompressionDictHeaderExtension;
+
+/* Compression types as stored in the compression_type header field */
+enum {
+    QCOW2_COMPRESSION_HEADER_ZLIB   = 0,
+    QCOW2_COMPRESSION_HEADER_ZSTD   = 1,
+    QCOW2_COMPRESSION_HEADER_LZ4    = 2,
+};
+
 typedef struct Qcow2UnknownHeaderExtension {
     uint32_t magic;
     uint32_t len;
@@ -256,17 +286,21 @@ enum {
     QCOW2_INCOMPAT_DATA_FILE_BITNR  = 2,
     QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
     QCOW2_INCOMPAT_EXTL2_BITNR      = 4,
+    QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR = 5,
     QCOW2_INCOMPAT_DIRTY            = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
     QCOW2_INCOMPAT_CORRUPT          = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
     QCOW2_INCOMPAT_DATA_FILE        = 1 << QCOW2_INCOMPAT_DATA_FILE_BITNR,
     QCOW2_INCOMPAT_COMPRESSION      = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
     QCOW2_INCOMPAT_EXTL2            = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION_DICT =
+        1 << QCOW2_INCOMPAT_COMPRESSION_DICT_BITNR,
 
     QCOW2_INCOMPAT_MASK             = QCOW2_INCOMPAT_DIRTY
                                     | QCOW2_INCOMPAT_CORRUPT
                                     | QCOW2_INCOMPAT_DATA_FILE
                                     | QCOW2_INCOMPAT_COMPRESSION
-                                    | QCOW2_INCOMPAT_EXTL2,
+                                    | QCOW2_INCOMPAT_EXTL2
+                                    | QCOW2_INCOMPAT_COMPRESSION_DICT,
 };
 
 /* Compatible feature bits */
@@ -422,6 +456,27 @@ typedef struct BDRVQcow2State {
      * is to convert the image with the desired compression type set.
      */
     Qcow2CompressionType compression_type;
+
+    /*
+     * Dictionary used for all compressed clusters if the image has the
+     * compression dictionary incompatible feature, NULL otherwise
+     */
+    Qcow2CompressionDictHeaderExtension compression_dict_header;
+    Qcow2CompressionDict *compression_dict;
+
+    /* Index of compressed clusters for deduplication, NULL if disabled */
+    Qcow2DedupIndex *dedup;
+
+    /* Recently decompressed clusters, NULL if disabled */
+    Qcow2CompressedCache *compressed_cache;
+    uint64_t compressed_cache_size;
+
+    /*
+     * Host extents reserved for data clusters of guest regions, NULL if
+     * disabled.  Protected by s->lock.
+     */
+    Qcow2ExtentAllocator *extents;
+    uint64_t alloc_extent_size;
 } BDRVQcow2State;
 
 typedef struct Qcow2COWRegion {
@@ -874,6 +929,15 @@ qcow2_alloc_clusters_at(BlockDriverState *bs, uint64_t offset,
                         int64_t nb_clusters);
 
 int64_t coroutine_fn GRAPH_RDLOCK qcow2_alloc_bytes(BlockDriverState *bs, int size);
+
+Qcow2ExtentAllocator *qcow2_extents_new(BlockDriverState *bs,
+                                        uint64_t extent_size);
+void qcow2_extents_free(BlockDriverState *bs, Qcow2ExtentAllocator *a);
+void qcow2_extents_release_all(BlockDriverState *bs);
+int64_t coroutine_fn GRAPH_RDLOCK
+qcow2_extents_alloc(BlockDriverState *bs, uint64_t guest_offset,
+                    uint64_t *nb_clusters);
+
 void GRAPH_RDLOCK qcow2_free_clusters(BlockDriverState *bs,
                                       int64_t offset, int64_t size,
                                       enum qcow2_discard_type type);
@@ -881,6 +945,9 @@ void GRAPH_RDLOCK
 qcow2_free_any_cluster(BlockDriverState *bs, uint64_t l2_entry,
                        enum qcow2_discard_type type);
 
+int GRAPH_RDLOCK
+qcow2_ref_compressed_cluster(BlockDriverState *bs, uint64_t l2_entry);
+
 int GRAPH_RDLOCK
 qcow2_update_snapshot_refcount(BlockDriverState *bs, int64_t l1_table_offset,
                                int l1_size, int addend);
@@ -939,7 +1006,11 @@ qcow2_alloc_host_offset(BlockDriverState *bs, uint64_t offset,
 
 int coroutine_fn GRAPH_RDLOCK
 qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs, uint64_t offset,
-                                      int compressed_size, uint64_t *host_offset);
+                                      int compressed_size, uint64_t *host_offset,
+                                      uint64_t *l2_entry);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_link_compressed_cluster(BlockDriverState *bs, uint64_t offset,
+                              uint64_t l2_entry);
 void GRAPH_RDLOCK
 qcow2_parse_compressed_l2_entry(BlockDriverState *bs, uint64_t l2_entry,
                                 uint64_t *coffset, int *csize);
@@ -1058,6 +1129,38 @@ bool qcow2_supports_persistent_dirty_bitmap(BlockDriverState *bs);
 uint64_t qcow2_get_persistent_dirty_bitmap_size(BlockDriverState *bs,
                                                 uint32_t cluster_size);
 
+/* qcow2-dedup.c functions */
+Qcow2DedupIndex *qcow2_dedup_index_new(void);
+void qcow2_dedup_index_free(Qcow2DedupIndex *idx);
+void qcow2_dedup_clear(BlockDriverState *bs);
+int qcow2_dedup_hash(BlockDriverState *bs, const void *buf, uint8_t *digest);
+void GRAPH_RDLOCK qcow2_dedup_insert(BlockDriverState *bs,
+                                     const uint8_t *digest, uint64_t l2_entry);
+void qcow2_dedup_forget_cluster(BlockDriverState *bs, uint64_t cluster_offset);
+int coroutine_fn GRAPH_RDLOCK
+qcow2_dedup_co_pwrite(BlockDriverState *bs, uint64_t offset, const void *buf,
+                      const uint8_t *digest);
+
+/* qcow2-compressed-cache.c functions */
+Qcow2CompressedCache *qcow2_compressed_cache_new(BlockDriverState *bs,
+                                                 uint64_t size);
+void qcow2_compressed_cache_free(Qcow2CompressedCache *c);
+void qcow2_compressed_cache_clear(BlockDriverState *bs);
+bool qcow2_compressed_cache_read(BlockDriverState *bs, uint64_t coffset,
+                                 int csize, uint64_t offset_in_cluster,
+                                 uint64_t bytes, QEMUIOVector *qiov,
+                                 size_t qiov_offset);
+uint64_t qcow2_compressed_cache_generation(BlockDriverState *bs);
+void qcow2_compressed_cache_insert(BlockDriverState *bs, uint64_t coffset,
+                                   int csize, void *data, uint64_t generation);
+void qcow2_compressed_cache_forget_cluster(BlockDriverState *bs,
+                                           uint64_t cluster_offset);
+
+/* qcow2-threads.c functions */
+Qcow2CompressionDict *
+qcow2_compression_dict_new(Qcow2CompressionType type, const void *data,
+                           size_t len, Error **errp);
+void qcow2_compression_dict_free(Qcow2CompressionDict *dict);
 ssize_t coroutine_fn
 qcow2_co_compress(BlockDriverState *bs, void *dest, size_t dest_size,
                   const void *src, size_t src_size);
@@ -0,0 +1,969 @@
+/*
+ * Read cache filter driver
+ *
+ * The filter keeps copies of recently read clusters of its child in a cache
+ * file, typically on fast local storage in front of a slow network backend,
+ * and serves reads of these clusters from there.  Writes, write zeroes and
+ * discard requests are passed to the child and drop the affected clusters
+ * from the cache, so the cache never contains data that differs from the
+ * child.  Clusters are evicted in LRU order.
+ *
+ * The list of cached clusters is written to the cache file when the node is
+ * closed or inactivated.  While the node is in use, the cache file is marked
+ * dirty, so that after a crash the cache is discarded instead of trusted.
+ * The header also records the generation of the child (see BlockDriverInfo),
+ * so that the cache is discarded if the child was modified while it was not
+ * attached to the cache, or if such changes can't be detected.
+ *
+ * Cache file layout (all integers big endian):
+ *
+ *   [0, cluster_size)            ReadCacheHeader
+ *   [cluster_size, data_offset)  table: one uint64_t per slot, containing the
+ *                                index of the cached guest cluster plus one,
+ *                                or 0 if the slot is unused
+ *   [data_offset, ...)           slots, cluster_size bytes each
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/lockable.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+#define READ_CACHE_MAGIC        0x5145524443414348ULL /* "QERDCACH" */
+#define READ_CACHE_VERSION      2
+#define READ_CACHE_FLAG_DIRTY   (1 << 0)
+
+#define READ_CACHE_MIN_CLUSTER_SIZE (4 * KiB)
+#define READ_CACHE_MAX_CLUSTER_SIZE (2 * MiB)
+
+/* Maximum number of clusters that are read from the child at once */
+#define READ_CACHE_MAX_FILL 32
+
+#define READ_CACHE_OPT_SIZE         "size"
+#define READ_CACHE_OPT_CLUSTER_SIZE "cluster-size"
+
+typedef struct ReadCacheHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t cluster_size;
+    uint32_t reserved;
+    uint64_t nb_slots;
+    uint64_t image_size;
+    uint64_t generation;
+} QEMU_PACKED ReadCacheHeader;
+
+typedef enum ReadCacheSlotState {
+    READ_CACHE_SLOT_FREE,
+    READ_CACHE_SLOT_FILLING,    /* Data is being written to the slot */
+    READ_CACHE_SLOT_VALID,
+    READ_CACHE_SLOT_DROPPED,    /* Invalidated, but still has users */
+} ReadCacheSlotState;
+
+typedef struct ReadCacheSlot {
+    /* Index of the cached guest cluster, key in BDRVReadCacheState.map */
+    int64_t cluster;
+    ReadCacheSlotState state;
+
+    /* Number of requests accessing the slot data, including the filler */
+    unsigned users;
+
+    /* FILLING and VALID slots are in .lru, FREE slots in .free_slots */
+    QTAILQ_ENTRY(ReadCacheSlot) next;
+} ReadCacheSlot;
+
+typedef struct BDRVReadCacheState {
+    BdrvChild *cache_file;
+
+    uint64_t cluster_size;
+    uint64_t nb_slots;
+    uint64_t data_offset;
+
+    /* Whether the cache file is marked dirty on disk */
+    bool dirty;
+
+    /* Protects everything below */
+    QemuMutex lock;
+
+    ReadCacheSlot *slots;
+    GHashTable *map;
+    QTAILQ_HEAD(, ReadCacheSlot) lru;
+    QTAILQ_HEAD(, ReadCacheSlot) free_slots;
+
+    uint64_t nb_cached;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t invalidations;
+} BDRVReadCacheState;
+
+static QemuOptsList read_cache_runtime_opts = {
+    .name = "read-cache",
+    .head = QTAILQ_HEAD_INITIALIZER(read_cache_runtime_opts.head),
+    .desc = {
+        {
+            .name = READ_CACHE_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of the cached data",
+        },
+        {
+            .name = READ_CACHE_OPT_CLUSTER_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Cache granularity, default 64k",
+        },
+        { /* end of list */ }
+    },
+};
+
+static uint64_t read_cache_slot_offset(BDRVReadCacheState *s,
+                                       ReadCacheSlot *slot)
+{
+    return s->data_offset + (slot - s->slots) * s->cluster_size;
+}
+
+static void read_cache_free_slot(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    assert(slot->users == 0);
+    slot->cluster = -1;
+    slot->state = READ_CACHE_SLOT_FREE;
+    QTAILQ_INSERT_TAIL(&s->free_slots, slot, next);
+}
+
+/* Called with s->lock held */
+static void read_cache_drop_slot(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    assert(slot->state == READ_CACHE_SLOT_FILLING ||
+           slot->state == READ_CACHE_SLOT_VALID);
+
+    g_hash_table_remove(s->map, &slot->cluster);
+    QTAILQ_REMOVE(&s->lru, slot, next);
+    s->nb_cached--;
+
+    if (slot->users) {
+        slot->state = READ_CACHE_SLOT_DROPPED;
+    } else {
+        read_cache_free_slot(s, slot);
+    }
+}
+
+/* Called with s->lock held */
+static void read_cache_put_slot(BDRVReadCacheState *s, ReadCacheSlot *slot)
+{
+    assert(slot->users > 0);
+    if (--slot->users == 0 && slot->state == READ_CACHE_SLOT_DROPPED) {
+        read_cache_free_slot(s, slot);
+    }
+}
+
+/*
+ * Returns the VALID slot caching @cluster with a reference taken, or NULL if
+ * the cluster isn't cached (yet).  Called with s->lock held.
+ */
+static ReadCacheSlot *read_cache_get_slot(BDRVReadCacheState *s,
+                                          int64_t cluster)
+{
+    ReadCacheSlot *slot = g_hash_table_lookup(s->map, &cluster);
+
+    if (!slot || slot->state != READ_CACHE_SLOT_VALID) {
+        return NULL;
+    }
+
+    slot->users++;
+    QTAILQ_REMOVE(&s->lru, slot, next);
+    QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+    return slot;
+}
+
+/*
+ * Allocates a slot for @cluster in FILLING state, with a reference for the
+ * filler, evicting the least recently used cluster if necessary.  Returns
+ * NULL if no slot can be freed up.  Called with s->lock held.
+ */
+static ReadCacheSlot *read_cache_alloc_slot(BDRVReadCacheState *s,
+                                            int64_t cluster)
+{
+    ReadCacheSlot *slot = QTAILQ_FIRST(&s->free_slots);
+
+    if (slot) {
+        QTAILQ_REMOVE(&s->free_slots, slot, next);
+    } else {
+        QTAILQ_FOREACH(slot, &s->lru, next) {
+            if (slot->state == READ_CACHE_SLOT_VALID && !slot->users) {
+                break;
+            }
+        }
+        if (!slot) {
+            return NULL;
+        }
+        read_cache_drop_slot(s, slot);
+        QTAILQ_REMOVE(&s->free_slots, slot, next);
+        s->evictions++;
+    }
+
+    slot->cluster = cluster;
+    slot->state = READ_CACHE_SLOT_FILLING;
+    slot->users = 1;
+    g_hash_table_insert(s->map, &slot->cluster, slot);
+    QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+    s->nb_cached++;
+
+    return slot;
+}
+
+/* Called with s->lock held */
+static void read_cache_invalidate_locked(BDRVReadCacheState *s, int64_t offset,
+                                         int64_t bytes)
+{
+    int64_t first = offset / s->cluster_size;
+    int64_t last = (offset + bytes - 1) / s->cluster_size;
+    int64_t cluster;
+
+    if (last - first >= s->nb_cached) {
+        ReadCacheSlot *slot, *next_slot;
+
+        QTAILQ_FOREACH_SAFE(slot, &s->lru, next, next_slot) {
+            if (slot->cluster >= first && slot->cluster <= last) {
+                read_cache_drop_slot(s, slot);
+                s->invalidations++;
+            }
+        }
+        return;
+    }
+
+    for (cluster = first; cluster <= last; cluster++) {
+        ReadCacheSlot *slot = g_hash_table_lookup(s->map, &cluster);
+
+        if (slot) {
+            read_cache_drop_slot(s, slot);
+            s->invalidations++;
+        }
+    }
+}
+
+static void read_cache_invalidate(BlockDriverState *bs, int64_t offset,
+                                  int64_t bytes)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    if (bytes > 0) {
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            read_cache_invalidate_locked(s, offset, bytes);
+        }
+    }
+}
+
+static void read_cache_invalidate_all(BlockDriverState *bs)
+{
+    read_cache_invalidate(bs, 0, INT64_MAX);
+}
+
+/*
+ * Reads the clusters starting at @offset that aren't cached from the child,
+ * copies the requested part into @qiov and stores the clusters in the cache.
+ * At most the clusters up to the end of the request are read, and not more
+ * than READ_CACHE_MAX_FILL.
+ *
+ * Returns the number of bytes of the request that have been handled, or
+ * -errno on failure.
+ */
+static int64_t coroutine_fn GRAPH_RDLOCK
+read_cache_co_fill(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                   QEMUIOVector *qiov, size_t qiov_offset)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheSlot *slots[READ_CACHE_MAX_FILL];
+    int64_t first = offset / s->cluster_size;
+    int64_t last = (offset + bytes - 1) / s->cluster_size;
+    int64_t start, end, len, handled;
+    uint8_t *buf;
+    int i, nb_clusters, ret;
+
+    last = MIN(last, first + READ_CACHE_MAX_FILL - 1);
+
+    len = bdrv_co_getlength(bs->file->bs);
+    if (len < 0) {
+        return len;
+    }
+
+    qemu_mutex_lock(&s->lock);
+    for (nb_clusters = 0; first + nb_clusters <= last; nb_clusters++) {
+        int64_t cluster = first + nb_clusters;
+
+        if (!g_hash_table_contains(s->map, &cluster)) {
+            slots[nb_clusters] = read_cache_alloc_slot(s, cluster);
+        } else if (nb_clusters == 0) {
+            /* Being filled by another request, read it without caching */
+            slots[nb_clusters] = NULL;
+        } else {
+            break;
+        }
+        s->misses++;
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    start = first * s->cluster_size;
+    end = MIN((first + nb_clusters) * s->cluster_size, len);
+    handled = MIN(end, offset + bytes) - offset;
+
+    buf = qemu_try_blockalign(bs->file->bs, nb_clusters * s->cluster_size);
+    if (!buf) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    ret = bdrv_co_pread(bs->file, start, end - start, buf, 0);
+    if (ret < 0) {
+        goto out;
+    }
+    memset(buf + (end - start), 0, nb_clusters * s->cluster_size -
+                                   (end - start));
+
+    qemu_iovec_from_buf(qiov, qiov_offset, buf + (offset - start), handled);
+
+    for (i = 0; i < nb_clusters; i++) {
+        ReadCacheSlot *slot = slots[i];
+
+        if (!slot) {
+            continue;
+        }
+
+        ret = bdrv_co_pwrite(s->cache_file, read_cache_slot_offset(s, slot),
+                             s->cluster_size, buf + i * s->cluster_size, 0);
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            if (ret < 0) {
+                /* The cache is best effort, the read itself succeeded */
+                trace_read_cache_fill_failed(bs, slot->cluster, ret);
+                if (slot->state == READ_CACHE_SLOT_FILLING) {
+                    read_cache_drop_slot(s, slot);
+                }
+            } else if (slot->state == READ_CACHE_SLOT_FILLING) {
+                slot->state = READ_CACHE_SLOT_VALID;
+            }
+            read_cache_put_slot(s, slot);
+        }
+        slots[i] = NULL;
+    }
+    ret = 0;
+
+out:
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        for (i = 0; i < nb_clusters; i++) {
+            if (slots[i]) {
+                if (slots[i]->state == READ_CACHE_SLOT_FILLING) {
+                    read_cache_drop_slot(s, slots[i]);
+                }
+                read_cache_put_slot(s, slots[i]);
+            }
+        }
+    }
+    qemu_vfree(buf);
+    return ret < 0 ? ret : handled;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_preadv_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          QEMUIOVector *qiov, size_t qiov_offset,
+                          BdrvRequestFlags flags)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t n;
+    int ret;
+
+    while (bytes) {
+        int64_t cluster = offset / s->cluster_size;
+        uint64_t offset_in_cluster = offset % s->cluster_size;
+        ReadCacheSlot *slot;
+
+        WITH_QEMU_LOCK_GUARD(&s->lock) {
+            slot = read_cache_get_slot(s, cluster);
+            if (slot) {
+                s->hits++;
+            }
+        }
+
+        if (!slot) {
+            n = read_cache_co_fill(bs, offset, bytes, qiov, qiov_offset);
+            if (n < 0) {
+                return n;
+            }
+        } else {
+            n = MIN(bytes, s->cluster_size - offset_in_cluster);
+            ret = bdrv_co_preadv_part(s->cache_file,
+                                      read_cache_slot_offset(s, slot) +
+                                      offset_in_cluster,
+                                      n, qiov, qiov_offset, 0);
+
+            WITH_QEMU_LOCK_GUARD(&s->lock) {
+                if (ret < 0 && slot->state == READ_CACHE_SLOT_VALID) {
+                    read_cache_drop_slot(s, slot);
+                }
+                read_cache_put_slot(s, slot);
+            }
+
+            if (ret < 0) {
+                /* Don't fail the guest request because of the cache */
+                trace_read_cache_read_failed(bs, cluster, ret);
+                ret = bdrv_co_preadv_part(bs->file, offset, n, qiov,
+                                          qiov_offset, flags);
+                if (ret < 0) {
+                    return ret;
+                }
+            }
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwritev_part(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                           QEMUIOVector *qiov, size_t qiov_offset,
+                           BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+
+    /*
+     * Invalidate only after the write has completed, so that this catches
+     * any fill that may have read the old data.  Do it even on failure
+     * because the data may have been partially written.
+     */
+    read_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                            int64_t bytes, BdrvRequestFlags flags)
+{
+    int ret;
+
+    ret = bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+    read_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    int ret;
+
+    ret = bdrv_co_pdiscard(bs->file, offset, bytes);
+    read_cache_invalidate(bs, offset, bytes);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+read_cache_co_truncate(BlockDriverState *bs, int64_t offset, bool exact,
+                       PreallocMode prealloc, BdrvRequestFlags flags,
+                       Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int64_t old_len, start;
+    int ret;
+
+    old_len = bdrv_co_getlength(bs->file->bs);
+    if (old_len < 0) {
+        error_setg_errno(errp, -old_len, "Failed to get image length");
+        return old_len;
+    }
+
+    ret = bdrv_co_truncate(bs->file, offset, exact, prealloc, flags, errp);
+
+    /* The cluster containing the old EOF is zero padded in the cache */
+    start = QEMU_ALIGN_DOWN(MIN(offset, old_len), s->cluster_size);
+    read_cache_invalidate(bs, start, INT64_MAX - start);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK read_cache_co_flush(BlockDriverState *bs)
+{
+    /* The cache file is only trusted after a clean shutdown, no need to flush */
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+read_cache_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+/*
+ * Returns the generation of the protocol node below the child, which changes
+ * whenever the child is modified, or 0 if changes can't be detected.
+ */
+static uint64_t GRAPH_RDLOCK read_cache_child_generation(BlockDriverState *bs)
+{
+    BlockDriverState *child = bs->file->bs;
+    BlockDriverInfo bdi;
+
+    while (bdrv_primary_bs(child)) {
+        child = bdrv_primary_bs(child);
+    }
+
+    if (bdrv_get_info(child, &bdi) < 0) {
+        return 0;
+    }
+    return bdi.generation;
+}
+
+static int GRAPH_RDLOCK
+read_cache_write_header(BlockDriverState *bs, bool dirty)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header;
+    int64_t image_size;
+
+    image_size = bdrv_getlength(bs->file->bs);
+    if (image_size < 0) {
+        return image_size;
+    }
+
+    header = (ReadCacheHeader) {
+        .magic          = cpu_to_be64(READ_CACHE_MAGIC),
+        .version        = cpu_to_be32(READ_CACHE_VERSION),
+        .flags          = cpu_to_be32(dirty ? READ_CACHE_FLAG_DIRTY : 0),
+        .cluster_size   = cpu_to_be32(s->cluster_size),
+        .nb_slots       = cpu_to_be64(s->nb_slots),
+        .image_size     = cpu_to_be64(image_size),
+        .generation     = cpu_to_be64(read_cache_child_generation(bs)),
+    };
+
+    return bdrv_pwrite_sync(s->cache_file, 0, sizeof(header), &header, 0);
+}
+
+/* Marks the cache file dirty before the cached data starts to change */
+static int GRAPH_RDLOCK read_cache_mark_dirty(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    int ret;
+
+    if (s->dirty) {
+        return 0;
+    }
+
+    ret = read_cache_write_header(bs, true);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->dirty = true;
+    return 0;
+}
+
+/*
+ * Writes the table of cached clusters and marks the cache file clean, so that
+ * the cache can be used again after the node is reopened.
+ */
+static int GRAPH_RDLOCK read_cache_save(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t table_size = s->nb_slots * sizeof(uint64_t);
+    g_autofree uint64_t *table = NULL;
+    uint64_t i;
+    int ret;
+
+    if (!s->dirty) {
+        return 0;
+    }
+
+    table = g_try_malloc(table_size);
+    if (!table) {
+        return -ENOMEM;
+    }
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        for (i = 0; i < s->nb_slots; i++) {
+            ReadCacheSlot *slot = &s->slots[i];
+
+            table[i] = slot->state == READ_CACHE_SLOT_VALID ?
+                       cpu_to_be64(slot->cluster + 1) : 0;
+        }
+    }
+
+    ret = bdrv_pwrite(s->cache_file, s->cluster_size, table_size, table, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = bdrv_flush(s->cache_file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    ret = read_cache_write_header(bs, false);
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->dirty = false;
+    trace_read_cache_save(bs, s->nb_cached);
+    return 0;
+}
+
+/*
+ * Reads the table of cached clusters from the cache file.  Entries that
+ * don't make sense are ignored, which is safe because the cache is only
+ * loaded from a cleanly closed cache file.
+ */
+static int GRAPH_RDLOCK read_cache_load(BlockDriverState *bs, int64_t len)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    uint64_t table_size = s->nb_slots * sizeof(uint64_t);
+    int64_t nb_clusters = DIV_ROUND_UP(len, s->cluster_size);
+    g_autofree uint64_t *table = NULL;
+    uint64_t i;
+    int ret;
+
+    table = g_try_malloc(table_size);
+    if (!table) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_pread(s->cache_file, s->cluster_size, table_size, table, 0);
+    if (ret < 0) {
+        return ret;
+    }
+
+    for (i = 0; i < s->nb_slots; i++) {
+        ReadCacheSlot *slot = &s->slots[i];
+        uint64_t entry = be64_to_cpu(table[i]);
+
+        if (entry == 0 || entry > nb_clusters) {
+            continue;
+        }
+
+        slot->cluster = entry - 1;
+        if (g_hash_table_contains(s->map, &slot->cluster)) {
+            slot->cluster = -1;
+            continue;
+        }
+
+        QTAILQ_REMOVE(&s->free_slots, slot, next);
+        slot->state = READ_CACHE_SLOT_VALID;
+        g_hash_table_insert(s->map, &slot->cluster, slot);
+        QTAILQ_INSERT_TAIL(&s->lru, slot, next);
+        s->nb_cached++;
+    }
+
+    trace_read_cache_load(bs, s->nb_cached);
+    return 0;
+}
+
+static int GRAPH_RDLOCK
+read_cache_init(BlockDriverState *bs, uint64_t size, int flags, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    ReadCacheHeader header;
+    int64_t len, cache_len;
+    uint64_t generation;
+    bool reuse = false;
+    uint64_t i;
+    int ret;
+
+    len = bdrv_getlength(bs->file->bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "Failed to get image length");
+        return len;
+    }
+
+    cache_len = bdrv_getlength(s->cache_file->bs);
+    if (cache_len < 0) {
+        error_setg_errno(errp, -cache_len, "Failed to get cache file length");
+        return cache_len;
+    }
+
+    generation = read_cache_child_generation(bs);
+
+    if (cache_len >= sizeof(header)) {
+        ret = bdrv_pread(s->cache_file, 0, sizeof(header), &header, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to read cache file header");
+            return ret;
+        }
+
+        reuse = be64_to_cpu(header.magic) == READ_CACHE_MAGIC &&
+                be32_to_cpu(header.version) == READ_CACHE_VERSION &&
+                !(be32_to_cpu(header.flags) & READ_CACHE_FLAG_DIRTY) &&
+                be32_to_cpu(header.cluster_size) == s->cluster_size &&
+                be64_to_cpu(header.image_size) == len &&
+                generation && be64_to_cpu(header.generation) == generation &&
+                (!size || be64_to_cpu(header.nb_slots) ==
+                          size / s->cluster_size);
+    }
+
+    if (reuse) {
+        s->nb_slots = be64_to_cpu(header.nb_slots);
+    } else if (size) {
+        s->nb_slots = size / s->cluster_size;
+    } else {
+        error_setg(errp, "The cache file does not contain a cache for this "
+                   "image, '" READ_CACHE_OPT_SIZE "' must be specified");
+        return -EINVAL;
+    }
+
+    if (s->nb_slots == 0 || s->nb_slots > INT64_MAX / s->cluster_size / 2) {
+        error_setg(errp, "Invalid cache size");
+        return -EINVAL;
+    }
+
+    s->data_offset = QEMU_ALIGN_UP(s->cluster_size +
+                                   s->nb_slots * sizeof(uint64_t),
+                                   s->cluster_size);
+
+    s->slots = g_try_new0(ReadCacheSlot, s->nb_slots);
+    if (!s->slots) {
+        error_setg(errp, "Could not allocate cache metadata");
+        return -ENOMEM;
+    }
+    for (i = 0; i < s->nb_slots; i++) {
+        read_cache_free_slot(s, &s->slots[i]);
+    }
+
+    if (flags & BDRV_O_INACTIVE) {
+        /* The data may still change, read_cache_co_invalidate_cache() starts
+         * with an empty cache */
+        return 0;
+    }
+
+    if (reuse) {
+        ret = read_cache_load(bs, len);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to load the cache table");
+            return ret;
+        }
+    }
+
+    if (cache_len < s->data_offset + s->nb_slots * s->cluster_size) {
+        ret = bdrv_truncate(s->cache_file,
+                            s->data_offset + s->nb_slots * s->cluster_size,
+                            false, PREALLOC_MODE_OFF, 0, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = read_cache_mark_dirty(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update the cache file header");
+        return ret;
+    }
+
+    return 0;
+}
+
+static int GRAPH_UNLOCKED
+read_cache_open(BlockDriverState *bs, QDict *options, int flags, Error **errp)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    QemuOpts *opts;
+    uint64_t size;
+    int ret;
+
+    GLOBAL_STATE_CODE();
+
+    qemu_mutex_init(&s->lock);
+    s->map = g_hash_table_new(g_int64_hash, g_int64_equal);
+    QTAILQ_INIT(&s->lru);
+    QTAILQ_INIT(&s->free_slots);
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The cached data must be updated even if the filter is read-only */
+    if (!qdict_haskey(options, "cache-file")) {
+        qdict_set_default_str(options, "cache-file." BDRV_OPT_READ_ONLY, "off");
+    }
+
+    s->cache_file = bdrv_open_child(NULL, options, "cache-file", bs,
+                                    &child_of_bds, BDRV_CHILD_METADATA,
+                                    false, errp);
+    if (!s->cache_file) {
+        return -EINVAL;
+    }
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    opts = qemu_opts_create(&read_cache_runtime_opts, NULL, 0, &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+
+    size = qemu_opt_get_size(opts, READ_CACHE_OPT_SIZE, 0);
+    s->cluster_size = qemu_opt_get_size(opts, READ_CACHE_OPT_CLUSTER_SIZE,
+                                        64 * KiB);
+    qemu_opts_del(opts);
+
+    if (s->cluster_size < READ_CACHE_MIN_CLUSTER_SIZE ||
+        s->cluster_size > READ_CACHE_MAX_CLUSTER_SIZE ||
+        !is_power_of_2(s->cluster_size))
+    {
+        error_setg(errp, "Cluster size must be a power of two between %d "
+                   "and %d", READ_CACHE_MIN_CLUSTER_SIZE,
+                   READ_CACHE_MAX_CLUSTER_SIZE);
+        return -EINVAL;
+    }
+
+    if (!QEMU_IS_ALIGNED(s->cluster_size,
+                         s->cache_file->bs->bl.request_alignment))
+    {
+        error_setg(errp, "Cluster size is not aligned to the request "
+                   "alignment of the cache file (%" PRIu32 ")",
+                   s->cache_file->bs->bl.request_alignment);
+        return -EINVAL;
+    }
+
+    ret = read_cache_init(bs, size, flags, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+static void read_cache_close(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+
+    GLOBAL_STATE_CODE();
+
+    if (s->slots) {
+        GRAPH_RDLOCK_GUARD_MAINLOOP();
+        read_cache_save(bs);
+    }
+
+    g_hash_table_destroy(s->map);
+    g_free(s->slots);
+    qemu_mutex_destroy(&s->lock);
+}
+
+static int GRAPH_RDLOCK read_cache_inactivate(BlockDriverState *bs)
+{
+    return read_cache_save(bs);
+}
+
+static void coroutine_fn GRAPH_RDLOCK
+read_cache_co_invalidate_cache(BlockDriverState *bs, Error **errp)
+{
+    int ret;
+
+    /* The image may have been modified while we were inactive */
+    read_cache_invalidate_all(bs);
+
+    ret = read_cache_mark_dirty(bs);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to update the cache file header");
+    }
+}
+
+static void read_cache_child_perm(BlockDriverState *bs, BdrvChild *c,
+                                  BdrvChildRole role,
+                                  BlockReopenQueue *reopen_queue,
+                                  uint64_t perm, uint64_t shared,
+                                  uint64_t *nperm, uint64_t *nshared)
+{
+    if (role & BDRV_CHILD_FILTERED) {
+        bdrv_default_perms(bs, c, role, reopen_queue, perm, shared,
+                           nperm, nshared);
+
+        /* Writes that bypass the filter would make the cache stale */
+        *nshared &= ~BLK_PERM_WRITE;
+        return;
+    }
+
+    /* The cache file belongs to us alone */
+    *nperm = BLK_PERM_CONSISTENT_READ;
+    if (!(bdrv_get_flags(bs) & BDRV_O_INACTIVE)) {
+        *nperm |= BLK_PERM_WRITE | BLK_PERM_RESIZE;
+    }
+    *nshared = BLK_PERM_WRITE_UNCHANGED;
+}
+
+static BlockStatsSpecific *read_cache_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVReadCacheState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+    BlockStatsSpecificReadCache *rc = &stats->u.read_cache;
+
+    stats->driver = BLOCKDEV_DRIVER_READ_CACHE;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        *rc = (BlockStatsSpecificReadCache) {
+            .hits               = s->hits,
+            .misses             = s->misses,
+            .evictions          = s->evictions,
+            .invalidations      = s->invalidations,
+            .cached_clusters    = s->nb_cached,
+            .total_clusters     = s->nb_slots,
+        };
+    }
+
+    return stats;
+}
+
+static const char *const read_cache_strong_runtime_opts[] = {
+    READ_CACHE_OPT_CLUSTER_SIZE,
+
+    NULL
+};
+
+static BlockDriver bdrv_read_cache = {
+    .format_name                = "read-cache",
+    .instance_size              = sizeof(BDRVReadCacheState),
+
+    .bdrv_open                  = read_cache_open,
+    .bdrv_close                 = read_cache_close,
+    .bdrv_child_perm            = read_cache_child_perm,
+    .bdrv_inactivate            = read_cache_inactivate,
+    .bdrv_co_invalidate_cache   = read_cache_co_invalidate_cache,
+
+    .bdrv_co_getlength          = read_cache_co_getlength,
+
+    .bdrv_co_preadv_part        = read_cache_co_preadv_part,
+    .bdrv_co_pwritev_part       = read_cache_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes      = read_cache_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = read_cache_co_pdiscard,
+    .bdrv_co_truncate           = read_cache_co_truncate,
+    .bdrv_co_flush              = read_cache_co_flush,
+
+    .bdrv_get_specific_stats    = read_cache_get_specific_stats,
+
+    .strong_runtime_opts        = read_cache_strong_runtime_opts,
+    .is_filter                  = true,
+};
+
+static void bdrv_read_cache_init(void)
+{
+    bdrv_register(&bdrv_read_cache);
+}
+
+block_init(bdrv_read_cache_init);
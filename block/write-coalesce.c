@@ -0,0 +1,373 @@
+/*
+ * Write coalescing filter driver
+ *
+ * While the child already has max-in-flight writes in flight, a new write is
+ * not submitted right away but queued as a batch.  Following writes that
+ * start exactly where a queued batch ends are appended to it, and the batch
+ * is submitted as a single write as soon as an in-flight write completes.
+ * A batch doesn't grow beyond max-bytes.  With an idle child, writes are
+ * passed through immediately, so the filter only adds latency when the
+ * backend is busy anyway.
+ *
+ * Every write request completes only after the write of its batch has
+ * completed, with the result of that write.  So a flush issued by the guest
+ * always comes after all writes it has seen completed, and no write is
+ * reported as done before it is.  Writes with flags (e.g. FUA) are never
+ * merged.  Overlapping writes are serialised, so merging never reorders
+ * writes to the same area.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/block-io.h"
+#include "block/block_int.h"
+#include "block/reqlist.h"
+#include "qapi/error.h"
+#include "qemu/lockable.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/units.h"
+#include "trace.h"
+
+#define WRITE_COALESCE_OPT_MAX_BYTES        "max-bytes"
+#define WRITE_COALESCE_OPT_MAX_IN_FLIGHT    "max-in-flight"
+
+typedef struct WriteCoalesceBatch {
+    /* Area covered by the batch, in BDRVWriteCoalesceState.reqs */
+    BlockReq req;
+
+    QEMUIOVector qiov;
+    unsigned nb_requests;
+
+    bool submitted;
+    bool done;
+    int ret;
+
+    /* Coroutines of the merged requests, waiting for .done */
+    CoQueue waiters;
+    unsigned refcnt;
+} WriteCoalesceBatch;
+
+typedef struct BDRVWriteCoalesceState {
+    uint64_t max_bytes;
+    unsigned max_in_flight;
+
+    /* Protects everything below */
+    CoMutex lock;
+
+    /* Queued and submitted batches */
+    BlockReqList reqs;
+
+    /* Number of writes the child is processing */
+    unsigned in_flight;
+
+    /* Leaders of queued batches, waiting for in_flight to drop */
+    CoQueue queued;
+
+    uint64_t write_requests;
+    uint64_t backend_writes;
+    uint64_t merged_requests;
+} BDRVWriteCoalesceState;
+
+static QemuOptsList write_coalesce_runtime_opts = {
+    .name = "write-coalesce",
+    .head = QTAILQ_HEAD_INITIALIZER(write_coalesce_runtime_opts.head),
+    .desc = {
+        {
+            .name = WRITE_COALESCE_OPT_MAX_BYTES,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum size of a merged write, default 1M",
+        },
+        {
+            .name = WRITE_COALESCE_OPT_MAX_IN_FLIGHT,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of in-flight writes at which new writes start to "
+                    "be queued, default 4",
+        },
+        { /* end of list */ }
+    },
+};
+
+static int write_coalesce_open(BlockDriverState *bs, QDict *options,
+                               int flags, Error **errp)
+{
+    BDRVWriteCoalesceState *s = bs->opaque;
+    QemuOpts *opts;
+    int64_t max_in_flight;
+    int ret;
+
+    ret = bdrv_open_file_child(NULL, options, "file", bs, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    opts = qemu_opts_create(&write_coalesce_runtime_opts, NULL, 0,
+                            &error_abort);
+    if (!qemu_opts_absorb_qdict(opts, options, errp)) {
+        qemu_opts_del(opts);
+        return -EINVAL;
+    }
+
+    s->max_bytes = qemu_opt_get_size(opts, WRITE_COALESCE_OPT_MAX_BYTES,
+                                     1 * MiB);
+    max_in_flight = qemu_opt_get_number(opts, WRITE_COALESCE_OPT_MAX_IN_FLIGHT,
+                                        4);
+    qemu_opts_del(opts);
+
+    if (s->max_bytes == 0 || s->max_bytes > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, "'" WRITE_COALESCE_OPT_MAX_BYTES "' must be between "
+                   "1 and %" PRIu64, (uint64_t)BDRV_REQUEST_MAX_BYTES);
+        return -EINVAL;
+    }
+    if (max_in_flight < 1 || max_in_flight > UINT16_MAX) {
+        error_setg(errp, "'" WRITE_COALESCE_OPT_MAX_IN_FLIGHT "' must be "
+                   "between 1 and %d", UINT16_MAX);
+        return -EINVAL;
+    }
+    s->max_in_flight = max_in_flight;
+
+    qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->queued);
+    QLIST_INIT(&s->reqs);
+
+    GRAPH_RDLOCK_GUARD_MAINLOOP();
+
+    bs->supported_write_flags = BDRV_REQ_WRITE_UNCHANGED |
+        (BDRV_REQ_FUA & bs->file->bs->supported_write_flags);
+
+    bs->supported_zero_flags = BDRV_REQ_WRITE_UNCHANGED |
+        ((BDRV_REQ_FUA | BDRV_REQ_MAY_UNMAP | BDRV_REQ_NO_FALLBACK) &
+            bs->file->bs->supported_zero_flags);
+
+    return 0;
+}
+
+static int64_t coroutine_fn GRAPH_RDLOCK
+write_coalesce_co_getlength(BlockDriverState *bs)
+{
+    return bdrv_co_getlength(bs->file->bs);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+write_coalesce_co_preadv_part(BlockDriverState *bs, int64_t offset,
+                              int64_t bytes, QEMUIOVector *qiov,
+                              size_t qiov_offset, BdrvRequestFlags flags)
+{
+    return bdrv_co_preadv_part(bs->file, offset, bytes, qiov, qiov_offset,
+                               flags);
+}
+
+/* Called with s->lock held */
+static void write_coalesce_batch_unref(WriteCoalesceBatch *batch)
+{
+    if (--batch->refcnt == 0) {
+        qemu_iovec_destroy(&batch->qiov);
+        g_free(batch);
+    }
+}
+
+/*
+ * Returns a queued batch that ends at @offset and can take @bytes more bytes
+ * from @qiov.  Called with s->lock held.
+ */
+static WriteCoalesceBatch *
+write_coalesce_find_batch(BlockDriverState *bs, int64_t offset, int64_t bytes,
+                          QEMUIOVector *qiov)
+{
+    BDRVWriteCoalesceState *s = bs->opaque;
+    uint64_t max_bytes = s->max_bytes;
+    BlockReq *req;
+
+    if (bs->bl.max_transfer) {
+        max_bytes = MIN(max_bytes, bs->bl.max_transfer);
+    }
+
+    QLIST_FOREACH(req, &s->reqs, list) {
+        WriteCoalesceBatch *batch = container_of(req, WriteCoalesceBatch, req);
+
+        if (!batch->submitted && req->offset + req->bytes == offset &&
+            req->bytes + bytes <= max_bytes &&
+            batch->qiov.niov + qiov->niov <= IOV_MAX)
+        {
+            return batch;
+        }
+    }
+
+    return NULL;
+}
+
+/* Called with s->lock held, temporarily drops it */
+static void coroutine_fn GRAPH_RDLOCK
+write_coalesce_submit(BlockDriverState *bs, WriteCoalesceBatch *batch)
+{
+    BDRVWriteCoalesceState *s = bs->opaque;
+    int ret;
+
+    batch->submitted = true;
+    s->in_flight++;
+    s->backend_writes++;
+    trace_write_coalesce_submit(bs, batch->req.offset, batch->req.bytes,
+                                batch->nb_requests);
+
+    qemu_co_mutex_unlock(&s->lock);
+    ret = bdrv_co_pwritev(bs->file, batch->req.offset, batch->req.bytes,
+                          &batch->qiov, 0);
+    qemu_co_mutex_lock(&s->lock);
+
+    s->in_flight--;
+    batch->ret = ret;
+    batch->done = true;
+    reqlist_remove_req(&batch->req);
+    qemu_co_queue_restart_all(&batch->waiters);
+
+    /* Let the oldest queued batch go */
+    qemu_co_queue_next(&s->queued);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+write_coalesce_co_pwritev_part(BlockDriverState *bs, int64_t offset,
+                               int64_t bytes, QEMUIOVector *qiov,
+                               size_t qiov_offset, BdrvRequestFlags flags)
+{
+    BDRVWriteCoalesceState *s = bs->opaque;
+    WriteCoalesceBatch *batch;
+    int ret;
+
+    if (flags) {
+        qemu_co_mutex_lock(&s->lock);
+        reqlist_wait_all(&s->reqs, offset, bytes, &s->lock);
+        s->write_requests++;
+        s->backend_writes++;
+        s->in_flight++;
+        qemu_co_mutex_unlock(&s->lock);
+
+        ret = bdrv_co_pwritev_part(bs->file, offset, bytes, qiov, qiov_offset,
+                                   flags);
+
+        qemu_co_mutex_lock(&s->lock);
+        s->in_flight--;
+        qemu_co_queue_next(&s->queued);
+        qemu_co_mutex_unlock(&s->lock);
+        return ret;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    s->write_requests++;
+
+    /* Don't let a merged write overtake an older write to the same area */
+    reqlist_wait_all(&s->reqs, offset, bytes, &s->lock);
+
+    batch = write_coalesce_find_batch(bs, offset, bytes, qiov);
+    if (batch) {
+        qemu_iovec_concat(&batch->qiov, qiov, qiov_offset, bytes);
+        batch->req.bytes += bytes;
+        batch->nb_requests++;
+        batch->refcnt++;
+        s->merged_requests++;
+
+        while (!batch->done) {
+            qemu_co_queue_wait(&batch->waiters, &s->lock);
+        }
+        goto out;
+    }
+
+    batch = g_new0(WriteCoalesceBatch, 1);
+    reqlist_init_req(&s->reqs, &batch->req, offset, bytes);
+    qemu_iovec_init(&batch->qiov, qiov->niov);
+    qemu_iovec_concat(&batch->qiov, qiov, qiov_offset, bytes);
+    qemu_co_queue_init(&batch->waiters);
+    batch->nb_requests = 1;
+    batch->refcnt = 1;
+
+    while (s->in_flight >= s->max_in_flight) {
+        qemu_co_queue_wait(&s->queued, &s->lock);
+    }
+    write_coalesce_submit(bs, batch);
+
+out:
+    ret = batch->ret;
+    write_coalesce_batch_unref(batch);
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+write_coalesce_co_pwrite_zeroes(BlockDriverState *bs, int64_t offset,
+                                int64_t bytes, BdrvRequestFlags flags)
+{
+    BDRVWriteCoalesceState *s = bs->opaque;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        reqlist_wait_all(&s->reqs, offset, bytes, &s->lock);
+    }
+
+    return bdrv_co_pwrite_zeroes(bs->file, offset, bytes, flags);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+write_coalesce_co_pdiscard(BlockDriverState *bs, int64_t offset, int64_t bytes)
+{
+    BDRVWriteCoalesceState *s = bs->opaque;
+
+    WITH_QEMU_LOCK_GUARD(&s->lock) {
+        reqlist_wait_all(&s->reqs, offset, bytes, &s->lock);
+    }
+
+    return bdrv_co_pdiscard(bs->file, offset, bytes);
+}
+
+static int coroutine_fn GRAPH_RDLOCK
+write_coalesce_co_flush(BlockDriverState *bs)
+{
+    return bdrv_co_flush(bs->file->bs);
+}
+
+static BlockStatsSpecific *
+write_coalesce_get_specific_stats(BlockDriverState *bs)
+{
+    BDRVWriteCoalesceState *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    stats->driver = BLOCKDEV_DRIVER_WRITE_COALESCE;
+    stats->u.write_coalesce = (BlockStatsSpecificWriteCoalesce) {
+        .write_requests     = s->write_requests,
+        .backend_writes     = s->backend_writes,
+        .merged_requests    = s->merged_requests,
+    };
+
+    return stats;
+}
+
+static const char *const write_coalesce_strong_runtime_opts[] = {
+    NULL
+};
+
+static BlockDriver bdrv_write_coalesce = {
+    .format_name                = "write-coalesce",
+    .instance_size              = sizeof(BDRVWriteCoalesceState),
+
+    .bdrv_open                  = write_coalesce_open,
+    .bdrv_child_perm            = bdrv_default_perms,
+
+    .bdrv_co_getlength          = write_coalesce_co_getlength,
+
+    .bdrv_co_preadv_part        = write_coalesce_co_preadv_part,
+    .bdrv_co_pwritev_part       = write_coalesce_co_pwritev_part,
+    .bdrv_co_pwrite_zeroes      = write_coalesce_co_pwrite_zeroes,
+    .bdrv_co_pdiscard           = write_coalesce_co_pdiscard,
+    .bdrv_co_flush              = write_coalesce_co_flush,
+
+    .bdrv_get_specific_stats    = write_coalesce_get_specific_stats,
+
+    .strong_runtime_opts        = write_coalesce_strong_runtime_opts,
+    .is_filter                  = true,
+};
+
+static void bdrv_write_coalesce_init(void)
+{
+    bdrv_register(&bdrv_write_coalesce);
+}
+
+block_init(bdrv_write_coalesce_init);
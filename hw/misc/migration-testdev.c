@@ -0,0 +1,211 @@
+/*
+ * Test device for device state that is saved in parallel
+ *
+ * The device holds a buffer whose contents are derived from the "seed"
+ * property.  With the multifd-device-state migration capability, the
+ * buffer is sent by a migration worker thread over the multifd channels
+ * and loaded by the multifd receive threads.  Otherwise it is part of the
+ * section of the device.  Either way the destination checks the whole
+ * buffer against the seed when it loads the section, so a buffer that is
+ * lost, duplicated or loaded out of order fails the migration.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/error-report.h"
+#include "qemu/module.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "hw/qdev-core.h"
+#include "hw/qdev-properties.h"
+#include "migration/qemu-file-types.h"
+#include "migration/register.h"
+#include "migration/vmstate.h"
+#include "qom/object.h"
+
+#define TYPE_MIGRATION_TESTDEV "migration-testdev"
+OBJECT_DECLARE_SIMPLE_TYPE(MigrationTestDevState, MIGRATION_TESTDEV)
+
+/* Size of the buffers that are sent over the multifd channels */
+#define MIGRATION_TESTDEV_CHUNK (64 * KiB)
+
+struct MigrationTestDevState {
+    DeviceState parent_obj;
+
+    uint32_t size;
+    uint32_t seed;
+    uint8_t *data;
+    /* Bytes received by migration_testdev_load_buffer() */
+    uint32_t loaded;
+};
+
+static void migration_testdev_fill(uint8_t *data, uint32_t size,
+                                   uint32_t seed)
+{
+    uint32_t i;
+
+    for (i = 0; i < size; i += 4) {
+        stl_le_p(data + i, seed ^ (i * 0x9e3779b1u));
+    }
+}
+
+static int migration_testdev_save_thread(SaveDeviceState *ds, void *opaque,
+                                         Error **errp)
+{
+    MigrationTestDevState *s = opaque;
+    uint32_t offset;
+    int ret;
+
+    for (offset = 0; offset < s->size; offset += MIGRATION_TESTDEV_CHUNK) {
+        ret = qemu_savevm_send_device_state(ds, s->data + offset,
+                                            MIN(MIGRATION_TESTDEV_CHUNK,
+                                                s->size - offset),
+                                            errp);
+        if (ret) {
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static void migration_testdev_save(QEMUFile *f, void *opaque)
+{
+    MigrationTestDevState *s = opaque;
+
+    qemu_put_be32(f, s->seed);
+    qemu_put_be32(f, s->size);
+    if (qemu_savevm_device_state_parallel()) {
+        /* Sent by migration_testdev_save_thread() */
+        qemu_put_byte(f, 0);
+    } else {
+        qemu_put_byte(f, 1);
+        qemu_put_buffer(f, s->data, s->size);
+    }
+}
+
+static int migration_testdev_load_buffer(void *opaque, const void *buf,
+                                         size_t len, Error **errp)
+{
+    MigrationTestDevState *s = opaque;
+
+    if (len > s->size - s->loaded) {
+        error_setg(errp, "%s: %zu bytes of state after %" PRIu32 " of %"
+                   PRIu32, TYPE_MIGRATION_TESTDEV, len, s->loaded, s->size);
+        return -EINVAL;
+    }
+
+    memcpy(s->data + s->loaded, buf, len);
+    s->loaded += len;
+    return 0;
+}
+
+static int migration_testdev_load(QEMUFile *f, void *opaque, int version_id)
+{
+    MigrationTestDevState *s = opaque;
+    g_autofree uint8_t *expected = NULL;
+    uint32_t seed, size;
+    int ret;
+
+    seed = qemu_get_be32(f);
+    size = qemu_get_be32(f);
+    if (size != s->size) {
+        error_report("%s: state of %" PRIu32 " bytes, expected %" PRIu32,
+                     TYPE_MIGRATION_TESTDEV, size, s->size);
+        return -EINVAL;
+    }
+    if (qemu_get_byte(f)) {
+        qemu_get_buffer(f, s->data, size);
+        s->loaded = size;
+    }
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+
+    if (s->loaded != size) {
+        error_report("%s: %" PRIu32 " of %" PRIu32 " bytes of state loaded",
+                     TYPE_MIGRATION_TESTDEV, s->loaded, size);
+        return -EINVAL;
+    }
+    s->loaded = 0;
+
+    expected = g_malloc(size);
+    migration_testdev_fill(expected, size, seed);
+    if (memcmp(s->data, expected, size)) {
+        error_report("%s: state does not match seed 0x%" PRIx32,
+                     TYPE_MIGRATION_TESTDEV, seed);
+        return -EINVAL;
+    }
+
+    s->seed = seed;
+    return 0;
+}
+
+static const SaveVMHandlers savevm_migration_testdev = {
+    .save_state = migration_testdev_save,
+    .save_live_complete_precopy_thread = migration_testdev_save_thread,
+    .load_state = migration_testdev_load,
+    .load_state_buffer = migration_testdev_load_buffer,
+};
+
+static void migration_testdev_realize(DeviceState *dev, Error **errp)
+{
+    MigrationTestDevState *s = MIGRATION_TESTDEV(dev);
+
+    if (!s->size || s->size % 4) {
+        error_setg(errp, "%s: size must be a non-zero multiple of 4",
+                   TYPE_MIGRATION_TESTDEV);
+        return;
+    }
+
+    s->data = g_malloc(s->size);
+    migration_testdev_fill(s->data, s->size, s->seed);
+
+    /* Legacy migration interface, the only one with parallel state */
+    register_savevm_live(TYPE_MIGRATION_TESTDEV, VMSTATE_INSTANCE_ID_ANY, 1,
+                         &savevm_migration_testdev, s);
+}
+
+static void migration_testdev_unrealize(DeviceState *dev)
+{
+    MigrationTestDevState *s = MIGRATION_TESTDEV(dev);
+
+    unregister_savevm(NULL, TYPE_MIGRATION_TESTDEV, s);
+    g_free(s->data);
+    s->data = NULL;
+}
+
+static Property migration_testdev_properties[] = {
+    DEFINE_PROP_UINT32("size", MigrationTestDevState, size, 4 * MiB),
+    DEFINE_PROP_UINT32("seed", MigrationTestDevState, seed, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static void migration_testdev_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->desc = "Test device for device state saved in parallel";
+    dc->realize = migration_testdev_realize;
+    dc->unrealize = migration_testdev_unrealize;
+    dc->hotpluggable = false;
+    device_class_set_props(dc, migration_testdev_properties);
+    set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+}
+
+static const TypeInfo migration_testdev_info = {
+    .name          = TYPE_MIGRATION_TESTDEV,
+    .parent        = TYPE_DEVICE,
+    .instance_size = sizeof(MigrationTestDevState),
+    .class_init    = migration_testdev_class_init,
+};
+
+static void migration_testdev_register_types(void)
+{
+    type_register_static(&migration_testdev_info);
+}
+
+type_init(migration_testdev_register_types)
@@ -12,6 +12,7 @@
 #include "qemu/cutils.h"
 #include "qemu/units.h"
 #include "qemu/error-report.h"
+#include "qemu/stats64.h"
 #include <linux/vfio.h>
 #include <sys/ioctl.h>
 
@@ -55,7 +56,7 @@
  */
 #define VFIO_MIG_DEFAULT_DATA_BUFFER_SIZE (1 * MiB)
 
-static int64_t bytes_transferred;
+static Stat64 bytes_transferred;
 
 static const char *mig_state_to_str(enum vfio_device_mig_state state)
 {
@@ -382,7 +383,7 @@ static ssize_t vfio_save_block(QEMUFile *f, VFIOMigration *migration)
     qemu_put_be64(f, VFIO_MIG_FLAG_DEV_DATA_STATE);
     qemu_put_be64(f, data_size);
     qemu_put_buffer(f, migration->data_buffer, data_size);
-    bytes_transferred += data_size;
+    stat64_add(&bytes_transferred, data_size);
 
     trace_vfio_save_block(migration->vbasedev->name, data_size);
 
@@ -633,6 +634,11 @@ static int vfio_save_complete_precopy(QEMUFile *f, void *opaque)
     int ret;
     Error *local_err = NULL;
 
+    /* The device state was sent by vfio_save_complete_precopy_thread() */
+    if (qemu_savevm_device_state_parallel()) {
+        goto out;
+    }
+
     /* We reach here with device state STOP or STOP_COPY only */
     ret = vfio_migration_set_state(vbasedev, VFIO_DEVICE_STATE_STOP_COPY,
                                    VFIO_DEVICE_STATE_STOP, &local_err);
@@ -648,6 +654,7 @@ static int vfio_save_complete_precopy(QEMUFile *f, void *opaque)
         }
     } while (data_size);
 
+out:
     qemu_put_be64(f, VFIO_MIG_FLAG_END_OF_STATE);
     ret = qemu_file_get_error(f);
 
@@ -656,6 +663,54 @@ static int vfio_save_complete_precopy(QEMUFile *f, void *opaque)
     return ret;
 }
 
+/*
+ * Reads the stop-copy device state in a migration worker thread, so that
+ * the state of several devices is read in parallel, and sends it over the
+ * multifd channels.
+ */
+static int vfio_save_complete_precopy_thread(SaveDeviceState *ds,
+                                             void *opaque, Error **errp)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+    ssize_t data_size;
+    int ret;
+
+    /* We reach here with device state STOP or STOP_COPY only */
+    ret = vfio_migration_set_state(vbasedev, VFIO_DEVICE_STATE_STOP_COPY,
+                                   VFIO_DEVICE_STATE_STOP, errp);
+    if (ret) {
+        return ret;
+    }
+
+    while (true) {
+        data_size = read(migration->data_fd, migration->data_buffer,
+                         migration->data_buffer_size);
+        if (data_size < 0) {
+            ret = -errno;
+            error_setg_errno(errp, -ret, "%s: Failed to read device state",
+                             vbasedev->name);
+            break;
+        }
+        if (!data_size) {
+            break;
+        }
+
+        ret = qemu_savevm_send_device_state(ds, migration->data_buffer,
+                                            data_size, errp);
+        if (ret) {
+            break;
+        }
+        stat64_add(&bytes_transferred, data_size);
+
+        trace_vfio_save_block(vbasedev->name, data_size);
+    }
+
+    trace_vfio_save_complete_precopy_thread(vbasedev->name, ret);
+
+    return ret;
+}
+
 static void vfio_save_state(QEMUFile *f, void *opaque)
 {
     VFIODevice *vbasedev = opaque;
@@ -679,6 +734,23 @@ static int vfio_load_setup(QEMUFile *f, void *opaque, Error **errp)
                                     vbasedev->migration->device_state, errp);
 }
 
+static int vfio_load_state_buffer(void *opaque, const void *buf, size_t len,
+                                  Error **errp)
+{
+    VFIODevice *vbasedev = opaque;
+    VFIOMigration *migration = vbasedev->migration;
+    int ret = 0;
+
+    if (qemu_write_full(migration->data_fd, buf, len) != len) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "%s: Failed to load device state",
+                         vbasedev->name);
+    }
+    trace_vfio_load_state_device_data(vbasedev->name, len, ret);
+
+    return ret;
+}
+
 static int vfio_load_cleanup(void *opaque)
 {
     VFIODevice *vbasedev = opaque;
@@ -777,10 +849,12 @@ static const SaveVMHandlers savevm_vfio_handlers = {
     .is_active_iterate = vfio_is_active_iterate,
     .save_live_iterate = vfio_save_iterate,
     .save_live_complete_precopy = vfio_save_complete_precopy,
+    .save_live_complete_precopy_thread = vfio_save_complete_precopy_thread,
     .save_state = vfio_save_state,
     .load_setup = vfio_load_setup,
     .load_cleanup = vfio_load_cleanup,
     .load_state = vfio_load_state,
+    .load_state_buffer = vfio_load_state_buffer,
     .switchover_ack_needed = vfio_switchover_ack_needed,
 };
 
@@ -997,12 +1071,12 @@ static int vfio_block_migration(VFIODevice *vbasedev, Error *err, Error **errp)
 
 int64_t vfio_mig_bytes_transferred(void)
 {
-    return bytes_transferred;
+    return stat64_get(&bytes_transferred);
 }
 
 void vfio_reset_bytes_transferred(void)
 {
-    bytes_transferred = 0;
+    stat64_set(&bytes_transferred, 0);
 }
 
 /*
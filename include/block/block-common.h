@@ -148,6 +148,11 @@ typedef struct BlockDriverInfo {
      * True if this block driver only supports compressed writes
      */
     bool needs_compressed_writes;
+    /*
+     * Changes whenever the data of the node is modified, also by other
+     * processes (e.g. the change time of a file), 0 if unknown
+     */
+    uint64_t generation;
 } BlockDriverInfo;
 
 typedef struct BlockFragInfo {
@@ -257,6 +262,7 @@ typedef enum {
 #define BDRV_OPT_AUTO_READ_ONLY "auto-read-only"
 #define BDRV_OPT_DISCARD        "discard"
 #define BDRV_OPT_FORCE_SHARE    "force-share"
+#define BDRV_OPT_CHILD_STATS    "child-stats"
 
 
 #define BDRV_SECTOR_BITS   9
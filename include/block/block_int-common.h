@@ -56,6 +56,7 @@
 #define BLOCK_OPT_DATA_FILE         "data_file"
 #define BLOCK_OPT_DATA_FILE_RAW     "data_file_raw"
 #define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
+#define BLOCK_OPT_COMPRESSION_DICT  "compression_dictionary"
 #define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
@@ -1011,6 +1012,42 @@ struct BdrvChildClass {
 
 extern const BdrvChildClass child_of_bds;
 
+#define BDRV_CHILD_STATS_LATENCY_BUCKETS 40
+#define BDRV_CHILD_STATS_DEPTH_BUCKETS 16
+
+typedef enum BdrvChildStatsOp {
+    BDRV_CHILD_STATS_READ,
+    BDRV_CHILD_STATS_WRITE,
+    BDRV_CHILD_STATS_DISCARD,
+    BDRV_CHILD_STATS__MAX,
+} BdrvChildStatsOp;
+
+/*
+ * Statistics about the requests that the parent of a BdrvChild sends to the
+ * child node.  They are only collected if the parent node was opened with
+ * child-stats=on, and are updated without taking any lock by whichever thread
+ * submits the request.
+ *
+ * Histograms use logarithmic buckets: bucket 0 counts the value 0, bucket i
+ * counts values in [2^(i-1), 2^i), and the last bucket counts everything
+ * larger.
+ */
+typedef struct BdrvChildStats {
+    Stat64 ops[BDRV_CHILD_STATS__MAX];
+    Stat64 failed_ops[BDRV_CHILD_STATS__MAX];
+    Stat64 bytes[BDRV_CHILD_STATS__MAX];
+    Stat64 total_time_ns[BDRV_CHILD_STATS__MAX];
+
+    /* Latency of successful requests in nanoseconds */
+    Stat64 latency[BDRV_CHILD_STATS__MAX][BDRV_CHILD_STATS_LATENCY_BUCKETS];
+
+    /* Number of requests in flight (including itself) when one is submitted */
+    Stat64 queue_depth[BDRV_CHILD_STATS_DEPTH_BUCKETS];
+
+    unsigned in_flight; /* atomic */
+    Stat64 in_flight_peak;
+} BdrvChildStats;
+
 struct BdrvChild {
     BlockDriverState *bs;
     char *name;
@@ -1044,6 +1081,8 @@ struct BdrvChild {
      */
     bool quiesced_parent;
 
+    BdrvChildStats stats;
+
     QLIST_ENTRY(BdrvChild GRAPH_RDLOCK_PTR) next;
     QLIST_ENTRY(BdrvChild GRAPH_RDLOCK_PTR) next_parent;
 };
@@ -1076,6 +1115,7 @@ struct BlockDriverState {
     bool sg;        /* if true, the device is a /dev/sg* */
     bool probed;    /* if true, format was probed rather than specified */
     bool force_share; /* if true, always allow all shared permissions */
+    bool child_stats; /* if true, collect BdrvChildStats for the children */
     bool implicit;  /* if true, this filter node was automatically inserted */
 
     BlockDriver *drv; /* NULL means no media */
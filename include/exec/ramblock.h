@@ -57,6 +57,12 @@ struct RAMBlock {
      */
     off_t bitmap_offset;
     uint64_t pages_offset;
+    /* bitmap of pages zeroed since the parent incremental checkpoint */
+    unsigned long *file_zero_bmap;
+    /* offset of the block's header in the last incremental checkpoint */
+    uint64_t checkpoint_header_offset;
+    /* used_length when the last incremental checkpoint was written */
+    ram_addr_t checkpoint_used_length;
 
     /* Bitmap of already received pages.  Only used on destination side. */
     unsigned long *receivedmap;
@@ -89,6 +95,13 @@ struct RAMBlock {
      * could not have been valid on the source.
      */
     ram_addr_t postcopy_length;
+    /*
+     * Second mapping of the file backing the RAM block on the destination.
+     * Postcopy writes the received pages there, and maps them into the
+     * guest with UFFDIO_CONTINUE once the whole host page has arrived.
+     * NULL if the RAM block uses UFFDIO_COPY instead.
+     */
+    uint8_t *postcopy_alias;
 };
 #endif
 #endif
@@ -49,6 +49,9 @@ struct QIOChannelSocket {
     socklen_t remoteAddrLen;
     ssize_t zero_copy_queued;
     ssize_t zero_copy_sent;
+    ssize_t zero_copy_flushed;
+    bool zero_copy_copied;
+    Error *zero_copy_err;
 };
 
 
@@ -261,5 +264,43 @@ QIOChannelSocket *
 qio_channel_socket_accept(QIOChannelSocket *ioc,
                           Error **errp);
 
+/**
+ * qio_channel_socket_enable_zero_copy:
+ * @ioc: the socket channel object
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Enable zero-copy writes on a connected socket, for example
+ * one returned by qio_channel_socket_accept(). On success
+ * the channel gains the QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY
+ * feature.
+ *
+ * Zero-copy completions are processed by qio_channel_flush(),
+ * but also whenever a read or write on a non-blocking socket
+ * would block, so that pending completions do not keep the
+ * socket reporting an error condition to the event loop. The
+ * @zero_copy_sent field can therefore catch up with
+ * @zero_copy_queued without an explicit flush.
+ *
+ * Returns: 0 on success, -1 if zero-copy writes are not
+ * supported
+ */
+int
+qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc,
+                                    Error **errp);
+
+/**
+ * qio_channel_socket_reap_zero_copy:
+ * @ioc: the socket channel object
+ *
+ * Process the zero-copy completions that are available without
+ * blocking, so that @zero_copy_sent catches up with them.  Use
+ * qio_channel_yield() with %G_IO_ERR to wait for more of them.
+ *
+ * Errors found this way are reported by the next
+ * qio_channel_flush().
+ */
+void
+qio_channel_socket_reap_zero_copy(QIOChannelSocket *ioc);
+
 
 #endif /* QIO_CHANNEL_SOCKET_H */
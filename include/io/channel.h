@@ -33,6 +33,7 @@ OBJECT_DECLARE_TYPE(QIOChannel, QIOChannelClass,
 #define QIO_CHANNEL_ERR_BLOCK -2
 
 #define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY 0x1
+#define QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK 0x2
 
 #define QIO_CHANNEL_READ_FLAG_MSG_PEEK 0x1
 
@@ -86,6 +87,8 @@ struct QIOChannel {
     Coroutine *read_coroutine;
     AioContext *write_ctx;
     Coroutine *write_coroutine;
+    AioContext *err_ctx;
+    Coroutine *err_coroutine;
     bool follow_coroutine_ctx;
 #ifdef _WIN32
     HANDLE event; /* For use with GSource on Win32 */
@@ -811,9 +814,14 @@ GSource *qio_channel_add_watch_source(QIOChannel *ioc,
  *
  * Yields execution from the current coroutine until the condition
  * indicated by @condition becomes available.  @condition must
- * be either %G_IO_IN or %G_IO_OUT; it cannot contain both.  In
- * addition, no two coroutine can be waiting on the same condition
- * and channel at the same time.
+ * be either %G_IO_IN, %G_IO_OUT or %G_IO_ERR; it cannot contain
+ * more than one.  In addition, no two coroutine can be waiting on
+ * the same condition and channel at the same time.
+ *
+ * A coroutine waiting for %G_IO_ERR shares the read handler of the
+ * channel, so it is also woken up when data is available to read.
+ * It must use the same AioContext as a coroutine that waits for
+ * %G_IO_IN at the same time.
  *
  * This must only be called from coroutine context. It is safe to
  * reenter the coroutine externally while it is waiting; in this
@@ -953,6 +961,10 @@ int coroutine_mixed_fn qio_channel_readv_full_all(QIOChannel *ioc,
  * desired behavior, it's suggested to call qio_channel_flush()
  * before reusing the buffer.
  *
+ * If QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK is passed in
+ * addition, data that can't be queued for zero copy because too
+ * much memory is locked already is copied instead of failing.
+ *
  * Returns: 0 if all bytes were written, or -1 on error
  */
 
@@ -16,6 +16,8 @@
 
 #include "hw/vmstate-if.h"
 
+typedef struct SaveDeviceState SaveDeviceState;
+
 /**
  * struct SaveVMHandlers: handler structure to finely control
  * migration of complex subsystems and devices, such as RAM, block and
@@ -210,6 +212,52 @@ typedef struct SaveVMHandlers {
     void (*state_pending_exact)(void *opaque, uint64_t *must_precopy,
                                 uint64_t *can_postcopy);
 
+    /**
+     * @save_live_complete_precopy_thread
+     *
+     * Saves the final device state from a worker thread at the end of
+     * the precopy phase, in parallel with the other devices.  The state
+     * is passed in buffers to qemu_savevm_send_device_state(), which
+     * transfers them over the multifd channels.
+     *
+     * Only called when qemu_savevm_device_state_parallel() returns true;
+     * the device must then leave that part of the state out of
+     * @save_live_complete_precopy.  The device state sections that
+     * follow in the migration stream are loaded on the destination only
+     * after all the buffers were loaded.
+     *
+     * @ds: handle to pass to qemu_savevm_send_device_state()
+     * @opaque: data pointer passed to register_savevm_live()
+     * @errp: pointer to Error*, to store an error if it happens.
+     *
+     * Returns zero to indicate success and negative for error
+     */
+    int (*save_live_complete_precopy_thread)(SaveDeviceState *ds,
+                                             void *opaque, Error **errp);
+
+    /**
+     * @load_state_buffer
+     *
+     * Loads a buffer sent by @save_live_complete_precopy_thread.  Called
+     * from the multifd receive threads, in parallel with the other
+     * devices, but in the order in which the buffers of this device
+     * were sent.
+     *
+     * There is no ordering with respect to other devices, so this must
+     * only touch the state of this device.  Anything that depends on
+     * other devices belongs in @load_state, which is called for the
+     * sections of the device after all of its buffers were loaded.
+     *
+     * @opaque: data pointer passed to register_savevm_live()
+     * @buf: the buffer
+     * @len: length of @buf
+     * @errp: pointer to Error*, to store an error if it happens.
+     *
+     * Returns zero to indicate success and negative for error
+     */
+    int (*load_state_buffer)(void *opaque, const void *buf, size_t len,
+                             Error **errp);
+
     /**
      * @load_state
      *
@@ -301,4 +349,28 @@ int register_savevm_live(const char *idstr,
  */
 void unregister_savevm(VMStateIf *obj, const char *idstr, void *opaque);
 
+/**
+ * qemu_savevm_device_state_parallel: Check how the final device state
+ * is saved
+ *
+ * Returns true if @save_live_complete_precopy_thread is used at the end
+ * of the current precopy phase.
+ */
+bool qemu_savevm_device_state_parallel(void);
+
+/**
+ * qemu_savevm_send_device_state: Send a buffer of device state
+ *
+ * Queues a copy of @data for one of the multifd channels.
+ *
+ * @ds: handle passed to @save_live_complete_precopy_thread
+ * @data: the buffer
+ * @len: length of @data
+ * @errp: pointer to Error*, to store an error if it happens.
+ *
+ * Returns zero to indicate success and negative for error
+ */
+int qemu_savevm_send_device_state(SaveDeviceState *ds, const void *data,
+                                  size_t len, Error **errp);
+
 #endif
@@ -1194,6 +1194,20 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
 
 bool vmstate_section_needed(const VMStateDescription *vmsd, void *opaque);
 
+/*
+ * Whether VMStateDescriptions are compiled the first time they are used
+ * (the default) or always interpreted field by field.  The stream is the
+ * same either way.
+ */
+void vmstate_set_compiled(bool enabled);
+
+/*
+ * Drops the compiled form of @vmsd and of the descriptions nested in it.
+ * Needed before a VMStateDescription that is not static is freed;
+ * vmstate_unregister() takes care of it.
+ */
+void vmstate_forget_plan(const VMStateDescription *vmsd);
+
 #define  VMSTATE_INSTANCE_ID_ANY  -1
 
 /* Returns: 0 on success, -1 on failure */
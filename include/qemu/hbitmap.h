@@ -261,6 +261,15 @@ void hbitmap_deserialize_finish(HBitmap *hb);
  */
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp);
 
+/**
+ * test_hbitmap_next_accel:
+ *
+ * Switch to the next slower implementation of the word scanning kernels.
+ * Returns false if the generic implementation is in use already.  For use
+ * by unit tests only.
+ */
+bool test_hbitmap_next_accel(void);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -37,6 +37,7 @@ int uffd_change_protection(int uffd_fd, void *addr, uint64_t length,
 int uffd_copy_page(int uffd_fd, void *dst_addr, void *src_addr,
         uint64_t length, bool dont_wake);
 int uffd_zero_page(int uffd_fd, void *addr, uint64_t length, bool dont_wake);
+int uffd_continue_page(int uffd_fd, void *addr, uint64_t length);
 int uffd_wakeup(int uffd_fd, void *addr, uint64_t length);
 int uffd_read_events(int uffd_fd, struct uffd_msg *msgs, int count);
 bool uffd_poll_events(int uffd_fd, int tmo);
@@ -20,11 +20,25 @@ typedef struct VcpuStat {
     DirtyRateVcpu *rates; /* array of dirty rate for each vcpu */
 } VcpuStat;
 
+/*
+ * Measures per-vCPU dirty page rates between two calls of
+ * vcpu_dirty_stat_sample(), for callers that already sync the dirty
+ * log periodically.  Zero-initialize before the first call.
+ */
+typedef struct VcpuDirtySampler {
+    unsigned int gen_id; /* cpu list generation of @pages */
+    int64_t time_ms; /* time of the previous sample */
+    uint64_t *pages; /* dirty pages of each vcpu at @time_ms */
+} VcpuDirtySampler;
+
 int64_t vcpu_calculate_dirtyrate(int64_t calc_time_ms,
                                  VcpuStat *stat,
                                  unsigned int flag,
                                  bool one_shot);
 
+bool vcpu_dirty_stat_sample(VcpuDirtySampler *sampler, VcpuStat *stat);
+void vcpu_dirty_sampler_reset(VcpuDirtySampler *sampler);
+
 void global_dirty_log_change(unsigned int flag,
                              bool start);
 #endif
@@ -15,6 +15,7 @@
 #define IOTHREAD_H
 
 #include "block/aio.h"
+#include "qapi/qapi-types-common.h"
 #include "qemu/thread.h"
 #include "qom/object.h"
 #include "sysemu/event-loop-base.h"
@@ -58,6 +59,17 @@ IOThread *iothread_create(const char *id, Error **errp);
 void iothread_stop(IOThread *iothread);
 void iothread_destroy(IOThread *iothread);
 
+/*
+ * Helpers for devices and exports that map their virtqueues to IOThreads
+ * using the iothread-vq-mapping property.
+ */
+bool iothread_vq_mapping_apply(
+        IOThreadVirtQueueMappingList *iothread_vq_mapping_list,
+        AioContext **vq_aio_context,
+        uint16_t num_queues,
+        Error **errp);
+void iothread_vq_mapping_cleanup(IOThreadVirtQueueMappingList *list);
+
 /*
  * Returns true if executing within IOThread context,
  * false otherwise.
@@ -67,6 +67,18 @@ struct KVMDirtyRingReaper {
     QemuThread reaper_thr;
     volatile uint64_t reaper_iteration; /* iteration number of reaper thr */
     volatile enum KVMDirtyRingReaperState reaper_state; /* reap thr state */
+    /*
+     * Helper threads that reap the rings of different vCPUs in parallel
+     * with the thread that calls kvm_dirty_ring_reap().  That thread holds
+     * the slots lock on their behalf.
+     */
+    uint32_t nr_helpers;
+    QemuThread *helper_thr;
+    QemuSemaphore helper_sem;   /* posted once per helper for each reap */
+    QemuSemaphore helper_done;  /* posted by each helper when done */
+    GPtrArray *cpus;            /* vCPUs of the current reap */
+    unsigned next_cpu;          /* index of the next vCPU to reap */
+    uint32_t helper_total;      /* pages collected by the helpers */
 };
 struct KVMState
 {
@@ -114,6 +126,7 @@ struct KVMState
     } *as;
     uint64_t kvm_dirty_ring_bytes;  /* Size of the per-vcpu dirty ring */
     uint32_t kvm_dirty_ring_size;   /* Number of dirty GFNs per ring */
+    uint32_t kvm_dirty_ring_reap_threads; /* Threads that reap the rings */
     bool kvm_dirty_ring_with_bitmap;
     uint64_t kvm_eager_split_size;  /* Eager Page Splitting chunk size */
     struct KVMDirtyRingReaper reaper;
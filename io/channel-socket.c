@@ -65,6 +65,8 @@ qio_channel_socket_new(void)
     sioc->fd = -1;
     sioc->zero_copy_queued = 0;
     sioc->zero_copy_sent = 0;
+    sioc->zero_copy_flushed = 0;
+    sioc->zero_copy_copied = true;
 
     ioc = QIO_CHANNEL(sioc);
     qio_channel_set_feature(ioc, QIO_CHANNEL_FEATURE_SHUTDOWN);
@@ -164,15 +166,8 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
-#ifdef QEMU_MSG_ZEROCOPY
-    int ret, v = 1;
-    ret = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v));
-    if (ret == 0) {
-        /* Zero copy available on host */
-        qio_channel_set_feature(QIO_CHANNEL(ioc),
-                                QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
-    }
-#endif
+    /* Zero copy is optional for connecting sockets, ignore errors */
+    qio_channel_socket_enable_zero_copy(ioc, NULL);
 
     qio_channel_set_feature(QIO_CHANNEL(ioc),
                             QIO_CHANNEL_FEATURE_READ_MSG_PEEK);
@@ -421,6 +416,28 @@ qio_channel_socket_accept(QIOChannelSocket *ioc,
     return NULL;
 }
 
+int
+qio_channel_socket_enable_zero_copy(QIOChannelSocket *ioc,
+                                    Error **errp)
+{
+#ifdef QEMU_MSG_ZEROCOPY
+    int v = 1;
+
+    if (setsockopt(ioc->fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) < 0) {
+        error_setg_errno(errp, errno, "Unable to enable zero copy");
+        return -1;
+    }
+
+    /* Zero copy available on host */
+    qio_channel_set_feature(QIO_CHANNEL(ioc),
+                            QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+    return 0;
+#else
+    error_setg(errp, "Zero copy not supported on this host");
+    return -1;
+#endif
+}
+
 static void qio_channel_socket_init(Object *obj)
 {
     QIOChannelSocket *ioc = QIO_CHANNEL_SOCKET(obj);
@@ -448,9 +465,16 @@ static void qio_channel_socket_finalize(Object *obj)
         close(ioc->fd);
         ioc->fd = -1;
     }
+    error_free(ioc->zero_copy_err);
 }
 
 
+#ifndef QEMU_MSG_ZEROCOPY
+void qio_channel_socket_reap_zero_copy(QIOChannelSocket *sioc)
+{
+}
+#endif /* QEMU_MSG_ZEROCOPY */
+
 #ifndef WIN32
 static void qio_channel_socket_copy_fds(struct msghdr *msg,
                                         int **fds, size_t *nfds)
@@ -498,6 +522,99 @@ static void qio_channel_socket_copy_fds(struct msghdr *msg,
 }
 
 
+#ifdef QEMU_MSG_ZEROCOPY
+/*
+ * Process zero copy completion notifications from the socket error queue.
+ * With @block, wait until all queued writes have completed, otherwise only
+ * process the notifications that are already available.
+ *
+ * Returns -1 on error, 0 otherwise.
+ */
+static int qio_channel_socket_read_errqueue(QIOChannelSocket *sioc,
+                                            bool block, Error **errp)
+{
+    QIOChannel *ioc = QIO_CHANNEL(sioc);
+    struct msghdr msg = {};
+    struct sock_extended_err *serr;
+    struct cmsghdr *cm;
+    char control[CMSG_SPACE(sizeof(*serr))];
+    int received;
+
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    memset(control, 0, sizeof(control));
+
+    while (sioc->zero_copy_sent < sioc->zero_copy_queued) {
+        received = recvmsg(sioc->fd, &msg, MSG_ERRQUEUE);
+        if (received < 0) {
+            switch (errno) {
+            case EAGAIN:
+                if (!block) {
+                    return 0;
+                }
+                /* Nothing on errqueue, wait until something is available */
+                qio_channel_wait(ioc, G_IO_ERR);
+                continue;
+            case EINTR:
+                continue;
+            default:
+                error_setg_errno(errp, errno,
+                                 "Unable to read errqueue");
+                return -1;
+            }
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (cm->cmsg_level != SOL_IP   && cm->cmsg_type != IP_RECVERR &&
+            cm->cmsg_level != SOL_IPV6 && cm->cmsg_type != IPV6_RECVERR) {
+            error_setg_errno(errp, EPROTOTYPE,
+                             "Wrong cmsg in errqueue");
+            return -1;
+        }
+
+        serr = (void *) CMSG_DATA(cm);
+        if (serr->ee_errno != SO_EE_ORIGIN_NONE) {
+            error_setg_errno(errp, serr->ee_errno,
+                             "Error on socket");
+            return -1;
+        }
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            error_setg_errno(errp, serr->ee_origin,
+                             "Error not from zero copy");
+            return -1;
+        }
+        if (serr->ee_data < serr->ee_info) {
+            error_setg_errno(errp, serr->ee_origin,
+                             "Wrong notification bounds");
+            return -1;
+        }
+
+        /* No errors, count successfully finished sendmsg()*/
+        sioc->zero_copy_sent += serr->ee_data - serr->ee_info + 1;
+
+        /* Remember if any sendmsg() succeeded using zero copy */
+        if (serr->ee_code != SO_EE_CODE_ZEROCOPY_COPIED) {
+            sioc->zero_copy_copied = false;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Also called when a non-blocking read or write would block.  Pending zero
+ * copy notifications make the socket poll with an error condition, which
+ * would keep waking up coroutines waiting for it, so consume them here.
+ */
+void qio_channel_socket_reap_zero_copy(QIOChannelSocket *sioc)
+{
+    if (sioc->zero_copy_sent < sioc->zero_copy_queued &&
+        !sioc->zero_copy_err) {
+        qio_channel_socket_read_errqueue(sioc, false, &sioc->zero_copy_err);
+    }
+}
+#endif /* QEMU_MSG_ZEROCOPY */
+
 static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
                                         const struct iovec *iov,
                                         size_t niov,
@@ -533,6 +650,7 @@ static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
     ret = recvmsg(sioc->fd, &msg, sflags);
     if (ret < 0) {
         if (errno == EAGAIN) {
+            qio_channel_socket_reap_zero_copy(sioc);
             return QIO_CHANNEL_ERR_BLOCK;
         }
         if (errno == EINTR) {
@@ -607,10 +725,18 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     if (ret <= 0) {
         switch (errno) {
         case EAGAIN:
+            qio_channel_socket_reap_zero_copy(sioc);
             return QIO_CHANNEL_ERR_BLOCK;
         case EINTR:
             goto retry;
         case ENOBUFS:
+            if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK) {
+                /* Too much memory is pinned already, copy this write */
+                flags &= ~QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK &
+                         ~QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+                sflags = 0;
+                goto retry;
+            }
             if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
                 error_setg_errno(errp, errno,
                                  "Process can't lock enough memory for using MSG_ZEROCOPY");
@@ -729,77 +855,30 @@ static int qio_channel_socket_flush(QIOChannel *ioc,
                                     Error **errp)
 {
     QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
-    struct msghdr msg = {};
-    struct sock_extended_err *serr;
-    struct cmsghdr *cm;
-    char control[CMSG_SPACE(sizeof(*serr))];
-    int received;
     int ret;
 
-    if (sioc->zero_copy_queued == sioc->zero_copy_sent) {
-        return 0;
+    if (sioc->zero_copy_err) {
+        error_propagate(errp, sioc->zero_copy_err);
+        sioc->zero_copy_err = NULL;
+        return -1;
     }
 
-    msg.msg_control = control;
-    msg.msg_controllen = sizeof(control);
-    memset(control, 0, sizeof(control));
-
-    ret = 1;
-
-    while (sioc->zero_copy_sent < sioc->zero_copy_queued) {
-        received = recvmsg(sioc->fd, &msg, MSG_ERRQUEUE);
-        if (received < 0) {
-            switch (errno) {
-            case EAGAIN:
-                /* Nothing on errqueue, wait until something is available */
-                qio_channel_wait(ioc, G_IO_ERR);
-                continue;
-            case EINTR:
-                continue;
-            default:
-                error_setg_errno(errp, errno,
-                                 "Unable to read errqueue");
-                return -1;
-            }
-        }
-
-        cm = CMSG_FIRSTHDR(&msg);
-        if (cm->cmsg_level != SOL_IP   && cm->cmsg_type != IP_RECVERR &&
-            cm->cmsg_level != SOL_IPV6 && cm->cmsg_type != IPV6_RECVERR) {
-            error_setg_errno(errp, EPROTOTYPE,
-                             "Wrong cmsg in errqueue");
-            return -1;
-        }
-
-        serr = (void *) CMSG_DATA(cm);
-        if (serr->ee_errno != SO_EE_ORIGIN_NONE) {
-            error_setg_errno(errp, serr->ee_errno,
-                             "Error on socket");
-            return -1;
-        }
-        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
-            error_setg_errno(errp, serr->ee_origin,
-                             "Error not from zero copy");
-            return -1;
-        }
-        if (serr->ee_data < serr->ee_info) {
-            error_setg_errno(errp, serr->ee_origin,
-                             "Wrong notification bounds");
-            return -1;
-        }
-
-        /* No errors, count successfully finished sendmsg()*/
-        sioc->zero_copy_sent += serr->ee_data - serr->ee_info + 1;
-
-        /* If any sendmsg() succeeded using zero copy, return 0 at the end */
-        if (serr->ee_code != SO_EE_CODE_ZEROCOPY_COPIED) {
-            ret = 0;
-        }
+    if (qio_channel_socket_read_errqueue(sioc, true, errp) < 0) {
+        return -1;
     }
 
+    /*
+     * Completions may have been processed already while reads or writes
+     * would block, so look at everything since the previous flush.  If any
+     * sendmsg() succeeded using zero copy, return 0.
+     */
+    ret = sioc->zero_copy_sent != sioc->zero_copy_flushed &&
+          sioc->zero_copy_copied;
+    sioc->zero_copy_flushed = sioc->zero_copy_sent;
+    sioc->zero_copy_copied = true;
+
     return ret;
 }
-
 #endif /* QEMU_MSG_ZEROCOPY */
 
 static int
@@ -582,15 +582,19 @@ static void qio_channel_restart_read(void *opaque)
 {
     QIOChannel *ioc = opaque;
     Coroutine *co = qatomic_xchg(&ioc->read_coroutine, NULL);
+    Coroutine *err_co = qatomic_xchg(&ioc->err_coroutine, NULL);
 
-    if (!co) {
-        return;
+    /* Assert that aio_co_wake() reenters the coroutines directly */
+    if (co) {
+        assert(qemu_get_current_aio_context() ==
+               qemu_coroutine_get_aio_context(co));
+        aio_co_wake(co);
+    }
+    if (err_co) {
+        assert(qemu_get_current_aio_context() ==
+               qemu_coroutine_get_aio_context(err_co));
+        aio_co_wake(err_co);
     }
-
-    /* Assert that aio_co_wake() reenters the coroutine directly */
-    assert(qemu_get_current_aio_context() ==
-           qemu_coroutine_get_aio_context(co));
-    aio_co_wake(co);
 }
 
 static void qio_channel_restart_write(void *opaque)
@@ -608,6 +612,13 @@ static void qio_channel_restart_write(void *opaque)
     aio_co_wake(co);
 }
 
+/* Whether a coroutine waits for G_IO_IN or G_IO_ERR in @ctx */
+static bool qio_channel_has_reader(QIOChannel *ioc, AioContext *ctx)
+{
+    return (ioc->read_coroutine && ioc->read_ctx == ctx) ||
+           (ioc->err_coroutine && ioc->err_ctx == ctx);
+}
+
 static void coroutine_fn
 qio_channel_set_fd_handlers(QIOChannel *ioc, GIOCondition condition)
 {
@@ -619,9 +630,17 @@ qio_channel_set_fd_handlers(QIOChannel *ioc, GIOCondition condition)
     AioContext *write_ctx = NULL;
     IOHandler *io_write = NULL;
 
-    if (condition == G_IO_IN) {
-        ioc->read_coroutine = qemu_coroutine_self();
-        ioc->read_ctx = ctx;
+    if (condition == G_IO_IN || condition == G_IO_ERR) {
+        /* Both share the read handler, so they must share the AioContext */
+        if (condition == G_IO_IN) {
+            assert(!ioc->err_coroutine || ioc->err_ctx == ctx);
+            ioc->read_coroutine = qemu_coroutine_self();
+            ioc->read_ctx = ctx;
+        } else {
+            assert(!ioc->read_coroutine || ioc->read_ctx == ctx);
+            ioc->err_coroutine = qemu_coroutine_self();
+            ioc->err_ctx = ctx;
+        }
         read_ctx = ctx;
         io_read = qio_channel_restart_read;
 
@@ -642,7 +661,7 @@ qio_channel_set_fd_handlers(QIOChannel *ioc, GIOCondition condition)
         ioc->write_ctx = ctx;
         write_ctx = ctx;
         io_write = qio_channel_restart_write;
-        if (ioc->read_coroutine && ioc->read_ctx == ctx) {
+        if (qio_channel_has_reader(ioc, ctx)) {
             read_ctx = ctx;
             io_read = qio_channel_restart_read;
         }
@@ -663,10 +682,13 @@ qio_channel_clear_fd_handlers(QIOChannel *ioc, GIOCondition condition)
     IOHandler *io_write = NULL;
     AioContext *ctx;
 
-    if (condition == G_IO_IN) {
-        ctx = ioc->read_ctx;
+    if (condition == G_IO_IN || condition == G_IO_ERR) {
+        ctx = condition == G_IO_IN ? ioc->read_ctx : ioc->err_ctx;
         read_ctx = ctx;
         io_read = NULL;
+        if (qio_channel_has_reader(ioc, ctx)) {
+            io_read = qio_channel_restart_read;
+        }
         if (ioc->write_coroutine && ioc->write_ctx == ctx) {
             write_ctx = ctx;
             io_write = qio_channel_restart_write;
@@ -675,7 +697,7 @@ qio_channel_clear_fd_handlers(QIOChannel *ioc, GIOCondition condition)
         ctx = ioc->write_ctx;
         write_ctx = ctx;
         io_write = NULL;
-        if (ioc->read_coroutine && ioc->read_ctx == ctx) {
+        if (qio_channel_has_reader(ioc, ctx)) {
             read_ctx = ctx;
             io_read = qio_channel_restart_read;
         }
@@ -699,6 +721,8 @@ void coroutine_fn qio_channel_yield(QIOChannel *ioc,
         assert(!ioc->read_coroutine);
     } else if (condition == G_IO_OUT) {
         assert(!ioc->write_coroutine);
+    } else if (condition == G_IO_ERR) {
+        assert(!ioc->err_coroutine);
     } else {
         abort();
     }
@@ -712,6 +736,8 @@ void coroutine_fn qio_channel_yield(QIOChannel *ioc,
         assert(ioc->read_coroutine == NULL);
     } else if (condition == G_IO_OUT) {
         assert(ioc->write_coroutine == NULL);
+    } else if (condition == G_IO_ERR) {
+        ioc->err_coroutine = NULL;
     }
     qio_channel_clear_fd_handlers(ioc, condition);
 }
@@ -766,6 +792,7 @@ static void qio_channel_finalize(Object *obj)
     /* Must not have coroutines in qio_channel_yield() */
     assert(!ioc->read_coroutine);
     assert(!ioc->write_coroutine);
+    assert(!ioc->err_coroutine);
 
     g_free(ioc->name);
 
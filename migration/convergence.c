@@ -0,0 +1,297 @@
+/*
+ * Migration convergence prediction and automatic strategy selection
+ *
+ * After each dirty bitmap sync, the migration thread predicts when the
+ * migration converges.  Every pass over guest RAM sends the pages that
+ * were dirty at its start, while the guest keeps dirtying pages at the
+ * measured rate.  With bandwidth B and dirty page rate D, the amount of
+ * data left therefore shrinks by r = D / B with every pass, and the
+ * migration converges once it fits into the downtime limit.  If r >= 1, or
+ * if that takes too many passes, it does not converge.
+ *
+ * With the auto-strategy capability, the migration escalates to a stronger
+ * strategy whenever the prediction fails twice in a row: first limit the
+ * dirty page rate of the vCPUs that dirty more memory than the average
+ * (this needs the KVM dirty ring, which counts dirty pages per vCPU;
+ * otherwise throttle all vCPUs as auto-converge does), then limit all
+ * vCPUs or increase the throttling up to max-cpu-throttle, and finally
+ * start postcopy if it is enabled.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <math.h>
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/timer.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-migration.h"
+#include "exec/target_page.h"
+#include "sysemu/cpu-throttle.h"
+#include "sysemu/dirtyrate.h"
+#include "sysemu/kvm.h"
+#include "convergence.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "options.h"
+#include "ram.h"
+#include "trace.h"
+
+/* A migration that needs more passes than this is not converging */
+#define CONVERGENCE_MAX_PASSES      30
+
+/* Number of failed predictions in a row that trigger an escalation */
+#define CONVERGENCE_ESCALATE_COUNT  2
+
+static struct {
+    MigrationConvergenceStrategy strategy;
+    /* dirty_sync_count of the last prediction */
+    uint64_t sync_count;
+    /* failed predictions in a row */
+    unsigned int fail_count;
+    bool predicted;
+    /* vCPU dirty limits were set by the auto strategy */
+    bool dirty_limited;
+    bool dirty_limited_all;
+    double dirty_ratio;
+    int64_t predicted_time;
+    int64_t first_predicted_time;
+    /* -1 until the migration converged */
+    int64_t convergence_time;
+    VcpuDirtySampler sampler;
+    VcpuStat vcpus;
+} convergence;
+
+/*
+ * Returns the predicted time in milliseconds until @remaining bytes shrink
+ * below @threshold, or -1 if they don't.
+ */
+static int64_t convergence_predict(double remaining, double threshold,
+                                   double bandwidth, double ratio)
+{
+    double passes;
+
+    if (remaining <= threshold) {
+        return 0;
+    }
+    if (threshold <= 0 || ratio >= 1) {
+        return -1;
+    }
+    if (ratio <= 0) {
+        return remaining / bandwidth;
+    }
+
+    passes = ceil(log(threshold / remaining) / log(ratio));
+    if (passes > CONVERGENCE_MAX_PASSES) {
+        return -1;
+    }
+
+    /* Each pass takes r times as long as the previous one */
+    return remaining / bandwidth * (1 - pow(ratio, passes)) / (1 - ratio);
+}
+
+static bool convergence_use_dirty_ring(void)
+{
+    return kvm_enabled() && kvm_dirty_ring_enabled();
+}
+
+static void convergence_set_strategy(MigrationConvergenceStrategy strategy)
+{
+    trace_migration_convergence_strategy(
+        MigrationConvergenceStrategy_str(strategy));
+    convergence.strategy = strategy;
+}
+
+/* Limit vCPU @cpu_index, or all vCPUs if it is -1 */
+static bool convergence_dirty_limit(int cpu_index, int64_t dirty_rate,
+                                    uint64_t quota)
+{
+    Error *local_err = NULL;
+
+    trace_migration_convergence_dirty_limit(cpu_index, dirty_rate, quota);
+    qmp_set_vcpu_dirty_limit(cpu_index >= 0, cpu_index, quota, &local_err);
+    if (local_err) {
+        error_report_err(local_err);
+        return false;
+    }
+
+    convergence.dirty_limited = true;
+    return true;
+}
+
+/*
+ * Limit the vCPUs that dirtied more memory than the average since the
+ * last sync.  Returns false if there are none above @quota.
+ */
+static bool convergence_limit_top_dirtiers(uint64_t quota)
+{
+    VcpuStat *stat = &convergence.vcpus;
+    int64_t total = 0;
+    bool limited = false;
+    int i;
+
+    for (i = 0; i < stat->nvcpu; i++) {
+        total += stat->rates[i].dirty_rate;
+    }
+
+    for (i = 0; i < stat->nvcpu; i++) {
+        int64_t dirty_rate = stat->rates[i].dirty_rate;
+
+        if (dirty_rate > quota && dirty_rate * stat->nvcpu >= total) {
+            if (!convergence_dirty_limit(i, dirty_rate, quota)) {
+                break;
+            }
+            limited = true;
+        }
+    }
+
+    return limited;
+}
+
+static void convergence_escalate(MigrationState *s)
+{
+    uint64_t quota = s->parameters.vcpu_dirty_limit;
+    int max_pct = migrate_max_cpu_throttle();
+    int pct;
+
+    switch (convergence.strategy) {
+    case MIGRATION_CONVERGENCE_STRATEGY_PRECOPY:
+        if (convergence_use_dirty_ring() &&
+            convergence_limit_top_dirtiers(quota)) {
+            convergence_set_strategy(
+                MIGRATION_CONVERGENCE_STRATEGY_DIRTY_LIMIT);
+        } else {
+            cpu_throttle_set(migrate_cpu_throttle_initial());
+            convergence_set_strategy(
+                MIGRATION_CONVERGENCE_STRATEGY_CPU_THROTTLE);
+        }
+        return;
+    case MIGRATION_CONVERGENCE_STRATEGY_DIRTY_LIMIT:
+        if (!convergence.dirty_limited_all &&
+            convergence_dirty_limit(-1, 0, quota)) {
+            convergence.dirty_limited_all = true;
+            return;
+        }
+        break;
+    case MIGRATION_CONVERGENCE_STRATEGY_CPU_THROTTLE:
+        pct = cpu_throttle_get_percentage();
+        if (pct < max_pct) {
+            cpu_throttle_set(MIN(pct + migrate_cpu_throttle_increment(),
+                                 max_pct));
+            return;
+        }
+        break;
+    default:
+        return;
+    }
+
+    if (migrate_postcopy_ram()) {
+        convergence_set_strategy(MIGRATION_CONVERGENCE_STRATEGY_POSTCOPY);
+        qatomic_set(&s->start_postcopy, true);
+    }
+}
+
+void migration_convergence_update(MigrationState *s, double bandwidth)
+{
+    uint64_t sync_count = stat64_get(&mig_stats.dirty_sync_count);
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    double remaining = ram_bytes_remaining();
+    double dirty_rate;
+    int64_t remaining_time;
+
+    /* The first sync happens before anything was sent */
+    if (sync_count < 2 || sync_count == convergence.sync_count ||
+        bandwidth <= 0 || convergence.convergence_time >= 0 ||
+        migration_in_postcopy()) {
+        return;
+    }
+    convergence.sync_count = sync_count;
+
+    if (migrate_auto_strategy() && convergence_use_dirty_ring()) {
+        vcpu_dirty_stat_sample(&convergence.sampler, &convergence.vcpus);
+    }
+
+    /* In bytes per millisecond, like the bandwidth */
+    dirty_rate = stat64_get(&mig_stats.dirty_pages_rate) *
+                 qemu_target_page_size() / 1000.0;
+    convergence.dirty_ratio = dirty_rate / bandwidth;
+
+    remaining_time = convergence_predict(remaining, s->threshold_size,
+                                         bandwidth, convergence.dirty_ratio);
+    convergence.predicted_time = remaining_time < 0 ? -1 :
+                                 now - s->start_time + remaining_time;
+    if (!convergence.predicted) {
+        convergence.first_predicted_time = convergence.predicted_time;
+        convergence.predicted = true;
+    }
+    trace_migration_convergence_predict(remaining, s->threshold_size,
+                                        convergence.dirty_ratio * 100,
+                                        convergence.predicted_time);
+
+    if (!migrate_auto_strategy()) {
+        return;
+    }
+
+    if (remaining_time >= 0) {
+        convergence.fail_count = 0;
+    } else if (++convergence.fail_count >= CONVERGENCE_ESCALATE_COUNT) {
+        convergence.fail_count = 0;
+        convergence_escalate(s);
+    }
+}
+
+void migration_convergence_reached(MigrationState *s)
+{
+    if (convergence.convergence_time < 0) {
+        convergence.convergence_time =
+            qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - s->start_time;
+        trace_migration_convergence_reached(convergence.convergence_time,
+                                            convergence.predicted_time);
+    }
+}
+
+void migration_convergence_cleanup(void)
+{
+    if (convergence.dirty_limited) {
+        qmp_cancel_vcpu_dirty_limit(false, -1, NULL);
+        convergence.dirty_limited = false;
+    }
+
+    vcpu_dirty_sampler_reset(&convergence.sampler);
+    g_free(convergence.vcpus.rates);
+    convergence.vcpus.rates = NULL;
+    convergence.vcpus.nvcpu = 0;
+}
+
+void migration_convergence_init(void)
+{
+    migration_convergence_cleanup();
+    memset(&convergence, 0, sizeof(convergence));
+    convergence.strategy = MIGRATION_CONVERGENCE_STRATEGY_PRECOPY;
+    convergence.predicted_time = -1;
+    convergence.first_predicted_time = -1;
+    convergence.convergence_time = -1;
+}
+
+MigrationConvergenceInfo *migration_convergence_info(void)
+{
+    MigrationConvergenceInfo *info;
+
+    if (!convergence.predicted) {
+        return NULL;
+    }
+
+    info = g_new0(MigrationConvergenceInfo, 1);
+    info->strategy = convergence.strategy;
+    info->dirty_ratio = convergence.dirty_ratio;
+    info->predicted_time = convergence.predicted_time;
+    info->first_predicted_time = convergence.first_predicted_time;
+    if (convergence.convergence_time >= 0) {
+        info->has_convergence_time = true;
+        info->convergence_time = convergence.convergence_time;
+    }
+
+    return info;
+}
@@ -0,0 +1,37 @@
+/*
+ * Migration convergence prediction and automatic strategy selection
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_CONVERGENCE_H
+#define QEMU_MIGRATION_CONVERGENCE_H
+
+#include "qapi/qapi-types-migration.h"
+#include "migration.h"
+
+/* Called by migrate_init() to forget about the previous migration */
+void migration_convergence_init(void);
+
+/*
+ * Called by the migration thread with the measured bandwidth, in bytes per
+ * millisecond.  After each dirty bitmap sync, updates the prediction and,
+ * with the auto-strategy capability, escalates the strategy if the
+ * migration is not predicted to converge.
+ */
+void migration_convergence_update(MigrationState *s, double bandwidth);
+
+/*
+ * Called by the migration thread when precopy is done, either because the
+ * remaining data fits into the downtime limit or because postcopy starts.
+ */
+void migration_convergence_reached(MigrationState *s);
+
+/* Called by the migration thread to lift the dirty limits it has set */
+void migration_convergence_cleanup(void);
+
+/* Returns NULL before the first prediction */
+MigrationConvergenceInfo *migration_convergence_info(void);
+
+#endif
@@ -193,6 +193,62 @@ retry:
     return duration;
 }
 
+/*
+ * Compute the dirty page rate of each vCPU since the previous call, from
+ * the pages that were reaped from its dirty ring meanwhile.  Unlike
+ * vcpu_calculate_dirtyrate(), this neither waits nor syncs the dirty log.
+ * Returns false, with all rates zero, on the first call and after vCPUs
+ * were hot-plugged or unplugged.
+ */
+bool vcpu_dirty_stat_sample(VcpuDirtySampler *sampler, VcpuStat *stat)
+{
+    int64_t now = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int64_t duration = now - sampler->time_ms;
+    DirtyPageRecord *records;
+    bool valid;
+    CPUState *cpu;
+    int i;
+
+    g_free(stat->rates);
+
+    WITH_QEMU_LOCK_GUARD(&qemu_cpu_list_lock) {
+        unsigned int gen_id = cpu_list_generation_id_get();
+
+        valid = sampler->pages && sampler->gen_id == gen_id && duration > 0;
+        records = vcpu_dirty_stat_alloc(stat);
+        if (!valid) {
+            g_free(sampler->pages);
+            sampler->pages = g_new0(uint64_t, stat->nvcpu);
+            sampler->gen_id = gen_id;
+        }
+        CPU_FOREACH(cpu) {
+            records[cpu->cpu_index].start_pages =
+                sampler->pages[cpu->cpu_index];
+            records[cpu->cpu_index].end_pages = cpu->dirty_pages;
+            sampler->pages[cpu->cpu_index] = cpu->dirty_pages;
+        }
+    }
+
+    for (i = 0; i < stat->nvcpu; i++) {
+        stat->rates[i].id = i;
+        if (valid) {
+            stat->rates[i].dirty_rate =
+                do_calculate_dirtyrate(records[i], duration);
+        }
+    }
+
+    g_free(records);
+    sampler->time_ms = now;
+
+    return valid;
+}
+
+void vcpu_dirty_sampler_reset(VcpuDirtySampler *sampler)
+{
+    g_free(sampler->pages);
+    memset(sampler, 0, sizeof(*sampler));
+}
+
 static bool is_calc_time_valid(int64_t msec)
 {
     if ((msec < MIN_CALC_TIME_MS) || (msec > MAX_CALC_TIME_MS)) {
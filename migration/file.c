@@ -50,6 +50,12 @@ void file_cleanup_outgoing_migration(void)
     outgoing_args.fname = NULL;
 }
 
+/* Returns the file of the outgoing migration, NULL if it wasn't named */
+const char *file_outgoing_filename(void)
+{
+    return outgoing_args.fname;
+}
+
 static void file_enable_direct_io(int *flags)
 {
 #ifdef O_DIRECT
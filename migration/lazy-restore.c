@@ -0,0 +1,494 @@
+/*
+ * Lazy restore of guest RAM from a mapped-ram migration file
+ *
+ * With mapped-ram, every page of guest RAM is stored at a fixed offset in
+ * the migration file, so the guest doesn't need to wait until all of RAM has
+ * been read.  With the lazy-restore capability, loading a RAM block only
+ * records where its pages are.  Guest RAM is then armed with userfaultfd by
+ * the postcopy code, whose fault thread hands missing pages to
+ * lazy_restore_request_page() instead of requesting them from a source.  The
+ * page is read directly from the file and placed atomically.  Meanwhile,
+ * prefetch threads load all remaining pages in the background, and the
+ * incoming migration completes when they are done.
+ *
+ * Each host page is placed by exactly one thread: whoever sets its bit in the
+ * claimed bitmap first.  Other threads faulting on the page are woken up by
+ * the UFFDIO_COPY that places it.  Pages that are not in the file are zero;
+ * they are only placed if the guest touches them before userfaultfd is
+ * disarmed, afterwards the kernel provides zero pages.
+ *
+ * Like the background transfer of postcopy, the prefetch threads are
+ * limited to max-postcopy-bandwidth, so that they leave enough I/O
+ * bandwidth for the pages that the guest is waiting for.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/error-report.h"
+#include "qemu/memalign.h"
+#include "qemu/ratelimit.h"
+#include "qemu/stats64.h"
+#include "qemu/thread.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+#include "qom/object.h"
+#include "io/channel.h"
+#include "exec/target_page.h"
+#include "lazy-restore.h"
+#include "migration.h"
+#include "options.h"
+#include "postcopy-ram.h"
+#include "qemu-file.h"
+#include "ram.h"
+#include "trace.h"
+
+/* Amount of RAM a prefetch thread reads at once */
+#define LAZY_RESTORE_CHUNK_SIZE (2 * MiB)
+
+typedef struct LazyRestoreBlock {
+    RAMBlock *rb;
+    uint64_t pages_offset;
+    size_t page_size;
+
+    /* Target pages that are present in the migration file */
+    unsigned long *bitmap;
+    long num_pages;
+
+    /* Host pages that are being placed or have been placed */
+    unsigned long *claimed;
+    unsigned long nb_host_pages;
+} LazyRestoreBlock;
+
+typedef struct LazyRestoreThread {
+    QemuThread thread;
+    unsigned idx;
+} LazyRestoreThread;
+
+typedef struct LazyRestoreState {
+    QIOChannel *ioc;
+    GPtrArray *blocks;
+
+    /* Page buffer of the postcopy fault thread */
+    void *fault_buf;
+
+    LazyRestoreThread *threads;
+    unsigned nb_threads;
+    unsigned nb_threads_done;
+    bool quit;
+    RateLimit limit;
+
+    /* The incoming migration is only waiting for the pages */
+    bool vm_started;
+} LazyRestoreState;
+
+static LazyRestoreState *lazy_restore;
+
+/* Host pages placed by the fault thread and by the prefetch threads */
+static struct {
+    Stat64 fault_pages;
+    Stat64 prefetch_pages;
+} lazy_restore_stats;
+
+bool lazy_restore_active(void)
+{
+    return lazy_restore;
+}
+
+static void lazy_restore_block_free(gpointer opaque)
+{
+    LazyRestoreBlock *b = opaque;
+
+    g_free(b->bitmap);
+    g_free(b->claimed);
+    g_free(b);
+}
+
+bool lazy_restore_add_block(QEMUFile *f, RAMBlock *rb, uint64_t pages_offset,
+                            unsigned long *bitmap, long num_pages,
+                            Error **errp)
+{
+    ram_addr_t used_length = qemu_ram_get_used_length(rb);
+    LazyRestoreBlock *b;
+
+    if ((ram_addr_t)num_pages << qemu_target_page_bits() > used_length) {
+        error_setg(errp, "RAM block %s is larger in the migration file than "
+                   "in the guest", qemu_ram_get_idstr(rb));
+        g_free(bitmap);
+        return false;
+    }
+
+    if (!lazy_restore) {
+        lazy_restore = g_new0(LazyRestoreState, 1);
+        lazy_restore->ioc = qemu_file_get_ioc(f);
+        object_ref(OBJECT(lazy_restore->ioc));
+        lazy_restore->blocks =
+            g_ptr_array_new_with_free_func(lazy_restore_block_free);
+        ratelimit_init(&lazy_restore->limit);
+        stat64_set(&lazy_restore_stats.fault_pages, 0);
+        stat64_set(&lazy_restore_stats.prefetch_pages, 0);
+    }
+
+    b = g_new0(LazyRestoreBlock, 1);
+    b->rb = rb;
+    b->pages_offset = pages_offset;
+    b->page_size = qemu_ram_pagesize(rb);
+    b->bitmap = bitmap;
+    b->num_pages = num_pages;
+    b->nb_host_pages = DIV_ROUND_UP(used_length, b->page_size);
+    b->claimed = bitmap_new(b->nb_host_pages);
+    g_ptr_array_add(lazy_restore->blocks, b);
+
+    trace_lazy_restore_add_block(qemu_ram_get_idstr(rb), num_pages);
+    return true;
+}
+
+static LazyRestoreBlock *lazy_restore_find_block(RAMBlock *rb)
+{
+    unsigned i;
+
+    for (i = 0; i < lazy_restore->blocks->len; i++) {
+        LazyRestoreBlock *b = g_ptr_array_index(lazy_restore->blocks, i);
+
+        if (b->rb == rb) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+/* Returns true if the caller must place host page @idx */
+static bool lazy_restore_claim(LazyRestoreBlock *b, unsigned long idx)
+{
+    unsigned long mask = BIT_MASK(idx);
+
+    return !(qatomic_fetch_or(&b->claimed[BIT_WORD(idx)], mask) & mask);
+}
+
+/* Returns true if any part of host page @idx is stored in the file */
+static bool lazy_restore_has_data(LazyRestoreBlock *b, unsigned long idx)
+{
+    unsigned long first = idx * (b->page_size >> qemu_target_page_bits());
+    unsigned long end = first + (b->page_size >> qemu_target_page_bits());
+
+    if (first >= b->num_pages) {
+        return false;
+    }
+    end = MIN(end, b->num_pages);
+    return find_next_bit(b->bitmap, end, first) < end;
+}
+
+/*
+ * Reads @nr host pages starting at host page @idx into @buf.  Target pages
+ * that are not in the file are zeroed.
+ */
+static int lazy_restore_read(LazyRestoreBlock *b, unsigned long idx,
+                             unsigned long nr, uint8_t *buf, Error **errp)
+{
+    size_t tps = qemu_target_page_size();
+    unsigned long first = idx * (b->page_size / tps);
+    unsigned long count = nr * (b->page_size / tps);
+    unsigned long i;
+    size_t len, done = 0;
+
+    len = first < b->num_pages ? MIN(count, b->num_pages - first) * tps : 0;
+    while (done < len) {
+        ssize_t ret = qio_channel_pread(lazy_restore->ioc, (char *)buf + done,
+                                        len - done,
+                                        b->pages_offset + first * tps + done,
+                                        errp);
+        if (ret < 0) {
+            return -EIO;
+        } else if (ret == 0) {
+            error_setg(errp, "Unexpected end of the migration file");
+            return -EIO;
+        }
+        done += ret;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (first + i >= b->num_pages || !test_bit(first + i, b->bitmap)) {
+            memset(buf + i * tps, 0, tps);
+        }
+    }
+    return 0;
+}
+
+/* Places @nr host pages starting at host page @idx, claimed by the caller */
+static int lazy_restore_load(MigrationIncomingState *mis, LazyRestoreBlock *b,
+                             unsigned long idx, unsigned long nr, uint8_t *buf,
+                             Error **errp)
+{
+    uint8_t *host = (uint8_t *)qemu_ram_get_host_addr(b->rb) +
+                    idx * b->page_size;
+    unsigned long i;
+    int ret;
+
+    if (nr == 1 && !lazy_restore_has_data(b, idx)) {
+        ret = postcopy_place_page_zero(mis, host, b->rb);
+    } else {
+        ret = lazy_restore_read(b, idx, nr, buf, errp);
+        if (ret < 0) {
+            error_prepend(errp, "Failed to read RAM block %s: ",
+                          qemu_ram_get_idstr(b->rb));
+            return ret;
+        }
+
+        for (i = 0; i < nr && !ret; i++) {
+            ret = postcopy_place_page(mis, host + i * b->page_size,
+                                      buf + i * b->page_size, b->rb);
+        }
+    }
+
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Failed to place page of RAM block %s",
+                         qemu_ram_get_idstr(b->rb));
+    }
+    return ret;
+}
+
+/*
+ * The guest can't run without its RAM, and the pages can't be requested from
+ * anywhere else, so this is fatal (like a failing postcopy migration).
+ */
+static void G_NORETURN lazy_restore_fail(Error *err)
+{
+    error_report_err(err);
+    error_report("Lazy restore of guest RAM failed");
+    exit(EXIT_FAILURE);
+}
+
+int lazy_restore_request_page(MigrationIncomingState *mis, RAMBlock *rb,
+                              ram_addr_t offset)
+{
+    LazyRestoreBlock *b = lazy_restore_find_block(rb);
+    Error *local_err = NULL;
+    unsigned long idx;
+
+    if (!b) {
+        /* Not in the migration file, so the page is zero */
+        if (ramblock_recv_bitmap_test_byte_offset(rb, offset)) {
+            return 0;
+        }
+        return postcopy_place_page_zero(mis,
+                                        qemu_ram_get_host_addr(rb) + offset,
+                                        rb);
+    }
+
+    idx = offset / b->page_size;
+    if (!lazy_restore_claim(b, idx)) {
+        /* Another thread places the page, which wakes up the guest */
+        trace_lazy_restore_fault(qemu_ram_get_idstr(rb), offset, false);
+        return 0;
+    }
+
+    trace_lazy_restore_fault(qemu_ram_get_idstr(rb), offset, true);
+    if (lazy_restore_load(mis, b, idx, 1, lazy_restore->fault_buf,
+                          &local_err) < 0) {
+        lazy_restore_fail(local_err);
+    }
+    stat64_add(&lazy_restore_stats.fault_pages, 1);
+    return 0;
+}
+
+/*
+ * Loads the pages of the chunks of @b that belong to prefetch thread @idx.
+ * Contiguous pages that still need to be loaded are read at once.
+ */
+static int lazy_restore_prefetch_block(MigrationIncomingState *mis,
+                                       LazyRestoreBlock *b, unsigned idx,
+                                       uint8_t *buf, size_t buf_size,
+                                       Error **errp)
+{
+    unsigned long pages_per_chunk = buf_size / b->page_size;
+    unsigned long chunk, start, end, i, run_start = 0, run_len;
+    int64_t delay_ns;
+    int ret;
+
+    for (chunk = idx; chunk * pages_per_chunk < b->nb_host_pages;
+         chunk += lazy_restore->nb_threads)
+    {
+        if (qatomic_read(&lazy_restore->quit)) {
+            return 0;
+        }
+
+        start = chunk * pages_per_chunk;
+        end = MIN(start + pages_per_chunk, b->nb_host_pages);
+        run_len = 0;
+
+        for (i = start; i <= end; i++) {
+            if (i < end && lazy_restore_has_data(b, i) &&
+                lazy_restore_claim(b, i))
+            {
+                if (!run_len) {
+                    run_start = i;
+                }
+                run_len++;
+                continue;
+            }
+
+            if (run_len) {
+                ret = lazy_restore_load(mis, b, run_start, run_len, buf, errp);
+                if (ret < 0) {
+                    return ret;
+                }
+                stat64_add(&lazy_restore_stats.prefetch_pages, run_len);
+
+                delay_ns = ratelimit_calculate_delay(&lazy_restore->limit,
+                                                     run_len * b->page_size);
+                if (delay_ns > 0) {
+                    g_usleep(delay_ns / SCALE_US);
+                }
+                run_len = 0;
+            }
+        }
+    }
+
+    return 0;
+}
+
+static void lazy_restore_prefetch_done_bh(void *opaque);
+
+static void *lazy_restore_prefetch_thread(void *opaque)
+{
+    LazyRestoreThread *t = opaque;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    size_t buf_size = MAX(LAZY_RESTORE_CHUNK_SIZE, mis->largest_page_size);
+    uint8_t *buf = qemu_memalign(qemu_real_host_page_size(), buf_size);
+    Error *local_err = NULL;
+    unsigned i;
+
+    for (i = 0; i < lazy_restore->blocks->len; i++) {
+        LazyRestoreBlock *b = g_ptr_array_index(lazy_restore->blocks, i);
+
+        if (lazy_restore_prefetch_block(mis, b, t->idx, buf, buf_size,
+                                        &local_err) < 0) {
+            lazy_restore_fail(local_err);
+        }
+    }
+
+    qemu_vfree(buf);
+
+    if (qatomic_fetch_inc(&lazy_restore->nb_threads_done) + 1 ==
+        lazy_restore->nb_threads) {
+        migration_bh_schedule(lazy_restore_prefetch_done_bh, mis);
+    }
+    return NULL;
+}
+
+int lazy_restore_start(MigrationIncomingState *mis, Error **errp)
+{
+    LazyRestoreState *s = lazy_restore;
+    unsigned i;
+
+    if (!s) {
+        /* No RAM in the migration file */
+        return 0;
+    }
+
+    /* Used by the fault thread, which postcopy_ram_incoming_setup() starts */
+    s->fault_buf = qemu_memalign(qemu_real_host_page_size(),
+                                 mis->largest_page_size);
+
+    if (postcopy_ram_incoming_init(mis)) {
+        error_setg(errp, "Failed to discard guest RAM");
+        return -1;
+    }
+    if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_ADVISE, errp)) {
+        return -1;
+    }
+    if (postcopy_ram_incoming_setup(mis)) {
+        error_setg(errp, "Failed to register guest RAM with userfaultfd");
+        return -1;
+    }
+    if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_LISTEN, errp)) {
+        return -1;
+    }
+
+    ratelimit_set_speed(&s->limit, migrate_max_postcopy_bandwidth(),
+                        100 * SCALE_MS);
+    s->nb_threads = migrate_multifd() ? migrate_multifd_channels() : 1;
+    s->threads = g_new0(LazyRestoreThread, s->nb_threads);
+    for (i = 0; i < s->nb_threads; i++) {
+        s->threads[i].idx = i;
+        qemu_thread_create(&s->threads[i].thread, "mig/dst/lazy",
+                           lazy_restore_prefetch_thread, &s->threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    trace_lazy_restore_start(s->blocks->len, s->nb_threads);
+    return 0;
+}
+
+static void lazy_restore_cleanup(MigrationIncomingState *mis)
+{
+    LazyRestoreState *s = lazy_restore;
+    unsigned i;
+
+    for (i = 0; s->threads && i < s->nb_threads; i++) {
+        qemu_thread_join(&s->threads[i].thread);
+    }
+
+    /* Disarms userfaultfd, missing pages are zero from now on */
+    postcopy_ram_incoming_cleanup(mis);
+
+    lazy_restore = NULL;
+    ram_load_cleanup_blocks();
+
+    object_unref(OBJECT(s->ioc));
+    ratelimit_destroy(&s->limit);
+    g_ptr_array_free(s->blocks, true);
+    qemu_vfree(s->fault_buf);
+    g_free(s->threads);
+    g_free(s);
+}
+
+static void lazy_restore_complete(MigrationIncomingState *mis)
+{
+    lazy_restore_cleanup(mis);
+    trace_lazy_restore_complete();
+
+    migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
+                      MIGRATION_STATUS_COMPLETED);
+    migration_incoming_state_destroy();
+}
+
+static void lazy_restore_prefetch_done_bh(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+
+    /* lazy_restore_vm_started() may have completed the migration already */
+    if (lazy_restore && lazy_restore->vm_started) {
+        lazy_restore_complete(mis);
+    }
+}
+
+void lazy_restore_vm_started(MigrationIncomingState *mis)
+{
+    lazy_restore->vm_started = true;
+    if (qatomic_read(&lazy_restore->nb_threads_done) ==
+        lazy_restore->nb_threads) {
+        lazy_restore_complete(mis);
+    }
+}
+
+LazyRestoreStats *lazy_restore_get_stats(void)
+{
+    LazyRestoreStats *stats = g_new0(LazyRestoreStats, 1);
+
+    stats->fault_pages = stat64_get(&lazy_restore_stats.fault_pages);
+    stats->prefetch_pages = stat64_get(&lazy_restore_stats.prefetch_pages);
+    return stats;
+}
+
+void lazy_restore_cancel(MigrationIncomingState *mis)
+{
+    if (!lazy_restore) {
+        return;
+    }
+
+    qatomic_set(&lazy_restore->quit, true);
+    lazy_restore_cleanup(mis);
+}
@@ -0,0 +1,51 @@
+/*
+ * Lazy restore of guest RAM from a mapped-ram migration file
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_LAZY_RESTORE_H
+#define QEMU_MIGRATION_LAZY_RESTORE_H
+
+#include "exec/cpu-common.h"
+#include "qapi/qapi-types-migration.h"
+#include "migration.h"
+
+/* Returns true while guest RAM is still being loaded in the background */
+bool lazy_restore_active(void);
+
+/*
+ * Registers a RAM block whose pages are stored in the mapped-ram migration
+ * file @f at @pages_offset.  @bitmap tells which target pages are present in
+ * the file (the others are zero) and is owned by the lazy restore code
+ * afterwards.
+ */
+bool lazy_restore_add_block(QEMUFile *f, RAMBlock *rb, uint64_t pages_offset,
+                            unsigned long *bitmap, long num_pages,
+                            Error **errp);
+
+/*
+ * Arms userfaultfd on guest RAM and starts loading the registered RAM blocks
+ * in the background.  Must be called after all RAM blocks were registered
+ * and before any device state is loaded.
+ */
+int lazy_restore_start(MigrationIncomingState *mis, Error **errp);
+
+/* Called by the postcopy fault thread for a missing page */
+int lazy_restore_request_page(MigrationIncomingState *mis, RAMBlock *rb,
+                              ram_addr_t offset);
+
+/*
+ * Called when the incoming migration would complete.  Completes it as soon
+ * as all pages are loaded.
+ */
+void lazy_restore_vm_started(MigrationIncomingState *mis);
+
+/* Returns the statistics of the last lazy restore */
+LazyRestoreStats *lazy_restore_get_stats(void);
+
+/* Stops loading pages after the incoming migration failed */
+void lazy_restore_cancel(MigrationIncomingState *mis);
+
+#endif
@@ -141,6 +141,18 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                            "Zero-copy-send fallbacks happened: %" PRIu64 " times\n",
                            info->ram->dirty_sync_missed_zero_copy);
         }
+        if (info->ram->dirty_sync_count) {
+            uint64List *bucket;
+
+            monitor_printf(mon, "dirty sync time: %" PRIu64 " us\n",
+                           info->ram->dirty_sync_time);
+            monitor_printf(mon, "dirty sync time histogram (log2 us):");
+            for (bucket = info->ram->dirty_sync_time_histogram; bucket;
+                 bucket = bucket->next) {
+                monitor_printf(mon, " %" PRIu64, bucket->value);
+            }
+            monitor_printf(mon, "\n");
+        }
     }
 
     if (info->xbzrle_cache) {
@@ -160,11 +172,45 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->multifd_dedup) {
+        monitor_printf(mon, "dedup transferred: %" PRIu64 " kbytes\n",
+                       info->multifd_dedup->bytes >> 10);
+        monitor_printf(mon, "dedup template pages: %" PRIu64 " pages\n",
+                       info->multifd_dedup->template_pages);
+        monitor_printf(mon, "dedup cache pages: %" PRIu64 " pages\n",
+                       info->multifd_dedup->cache_pages);
+        monitor_printf(mon, "dedup full pages: %" PRIu64 " pages\n",
+                       info->multifd_dedup->full_pages);
+    }
+
+    if (info->lazy_restore) {
+        monitor_printf(mon, "lazy restore fault pages: %" PRIu64 " pages\n",
+                       info->lazy_restore->fault_pages);
+        monitor_printf(mon, "lazy restore prefetch pages: %" PRIu64
+                       " pages\n", info->lazy_restore->prefetch_pages);
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
     }
 
+    if (info->convergence) {
+        monitor_printf(mon, "convergence strategy: %s\n",
+                       MigrationConvergenceStrategy_str(
+                           info->convergence->strategy));
+        monitor_printf(mon, "convergence dirty ratio: %0.2f\n",
+                       info->convergence->dirty_ratio);
+        monitor_printf(mon, "convergence predicted time: %" PRId64
+                       " ms (first prediction: %" PRId64 " ms)\n",
+                       info->convergence->predicted_time,
+                       info->convergence->first_predicted_time);
+        if (info->convergence->has_convergence_time) {
+            monitor_printf(mon, "convergence time: %" PRId64 " ms\n",
+                           info->convergence->convergence_time);
+        }
+    }
+
     if (info->has_dirty_limit_throttle_time_per_round) {
         monitor_printf(mon, "dirty-limit throttle time: %" PRIu64 " us\n",
                        info->dirty_limit_throttle_time_per_round);
@@ -191,6 +237,16 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+    if (info->has_postcopy_fault_latency_histogram) {
+        uint64List *bucket;
+
+        monitor_printf(mon, "postcopy fault latency histogram (log2 us):");
+        for (bucket = info->postcopy_fault_latency_histogram; bucket;
+             bucket = bucket->next) {
+            monitor_printf(mon, " %" PRIu64, bucket->value);
+        }
+        monitor_printf(mon, "\n");
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -209,6 +265,34 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->vfio->transferred >> 10);
     }
 
+    if (info->device_downtime) {
+        DeviceDowntimeList *dt;
+
+        monitor_printf(mon, "device downtime: [\n");
+        for (dt = info->device_downtime; dt; dt = dt->next) {
+            monitor_printf(mon, "\t%s/%" PRIu32 ": %" PRId64 " us, %" PRIu64
+                           " bytes%s\n", dt->value->id,
+                           dt->value->instance_id, dt->value->time,
+                           dt->value->bytes,
+                           dt->value->parallel ? " (parallel)" : "");
+        }
+        monitor_printf(mon, "]\n");
+    }
+
+    if (info->has_multifd_recv_channels) {
+        MultiFDRecvChannelInfoList *ch;
+
+        monitor_printf(mon, "multifd receive channels: [\n");
+        for (ch = info->multifd_recv_channels; ch; ch = ch->next) {
+            monitor_printf(mon, "\t%u: %" PRIu64 " packets, %" PRIu64
+                           " kbytes, %" PRIu64 " prefetched headers, "
+                           "%0.2f mbps\n", ch->value->id,
+                           ch->value->packets, ch->value->bytes >> 10,
+                           ch->value->prefetched_headers, ch->value->mbps);
+        }
+        monitor_printf(mon, "]\n");
+    }
+
     qapi_free_MigrationInfo(info);
 }
 
@@ -352,6 +436,26 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
             MigrationParameter_str(MIGRATION_PARAMETER_MODE),
             qapi_enum_lookup(&MigMode_lookup, params->mode));
 
+        assert(params->has_dirty_sync_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DIRTY_SYNC_THREADS),
+            params->dirty_sync_threads);
+
+        assert(params->has_postcopy_fault_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_FAULT_THREADS),
+            params->postcopy_fault_threads);
+
+        monitor_printf(mon, "%s: '%s'\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_MULTIFD_DEDUP_TEMPLATE),
+            params->multifd_dedup_template);
+
+        assert(params->has_multifd_dedup_cache_size);
+        monitor_printf(mon, "%s: %" PRIu64 " bytes\n",
+            MigrationParameter_str(
+                MIGRATION_PARAMETER_MULTIFD_DEDUP_CACHE_SIZE),
+            params->multifd_dedup_cache_size);
+
         if (params->has_direct_io) {
             monitor_printf(mon, "%s: %s\n",
                            MigrationParameter_str(
@@ -635,6 +739,21 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_direct_io = true;
         visit_type_bool(v, param, &p->direct_io, &err);
         break;
+    case MIGRATION_PARAMETER_DIRTY_SYNC_THREADS:
+        p->has_dirty_sync_threads = true;
+        visit_type_uint8(v, param, &p->dirty_sync_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_FAULT_THREADS:
+        p->has_postcopy_fault_threads = true;
+        visit_type_uint8(v, param, &p->postcopy_fault_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_DEDUP_TEMPLATE:
+        visit_type_str(v, param, &p->multifd_dedup_template, &err);
+        break;
+    case MIGRATION_PARAMETER_MULTIFD_DEDUP_CACHE_SIZE:
+        p->has_multifd_dedup_cache_size = true;
+        visit_type_size(v, param, &p->multifd_dedup_cache_size, &err);
+        break;
     default:
         assert(0);
     }
@@ -27,6 +27,12 @@
  */
 #define RATE_LIMIT_DISABLED 0
 
+/*
+ * Number of buckets of the histogram of the dirty bitmap synchronization
+ * durations.
+ */
+#define MIGRATION_DIRTY_SYNC_TIME_BUCKETS 24
+
 /*
  * These are the ram migration statistic counters.  It is loosely
  * based on MigrationStats.  We change to Stat64 any counter that
@@ -55,6 +61,17 @@ typedef struct {
      * copy.
      */
     Stat64 dirty_sync_missed_zero_copy;
+    /*
+     * Duration of the last dirty bitmap synchronization, in microseconds.
+     */
+    Stat64 dirty_sync_time;
+    /*
+     * Histogram of the dirty bitmap synchronization durations.  Bucket 0
+     * counts the synchronizations that took less than a microsecond,
+     * bucket i those that took 2^(i-1) to 2^i - 1 microseconds.  The
+     * last bucket also counts the slower ones.
+     */
+    Stat64 dirty_sync_time_histogram[MIGRATION_DIRTY_SYNC_TIME_BUCKETS];
     /*
      * Number of bytes sent at migration completion stage while the
      * guest is stopped.
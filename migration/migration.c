@@ -27,6 +27,8 @@
 #include "sysemu/cpu-throttle.h"
 #include "rdma.h"
 #include "ram.h"
+#include "lazy-restore.h"
+#include "convergence.h"
 #include "migration/global_state.h"
 #include "migration/misc.h"
 #include "migration.h"
@@ -257,6 +259,9 @@ void migration_object_init(void)
     qemu_cond_init(&current_incoming->page_request_cond);
     current_incoming->page_requested = g_tree_new(page_request_addr_cmp);
 
+    qemu_mutex_init(&current_incoming->device_state_mutex);
+    qemu_cond_init(&current_incoming->device_state_cond);
+
     current_incoming->exit_on_error = INMIGRATE_DEFAULT_EXIT_ON_ERROR;
 
     migration_object_check(current_migration, &error_fatal);
@@ -422,16 +427,15 @@ static void migrate_generate_event(MigrationStatus new_state)
 
 /*
  * Send a message on the return channel back to the source
- * of the migration.
+ * of the migration.  Must be called with rp_mutex held.
  */
-static int migrate_send_rp_message(MigrationIncomingState *mis,
-                                   enum mig_rp_message_type message_type,
-                                   uint16_t len, void *data)
+static int migrate_send_rp_message_locked(MigrationIncomingState *mis,
+                                          enum mig_rp_message_type message_type,
+                                          uint16_t len, void *data)
 {
     int ret = 0;
 
     trace_migrate_send_rp_message((int)message_type, len);
-    QEMU_LOCK_GUARD(&mis->rp_mutex);
 
     /*
      * It's possible that the file handle got lost due to network
@@ -448,6 +452,18 @@ static int migrate_send_rp_message(MigrationIncomingState *mis,
     return qemu_fflush(mis->to_src_file);
 }
 
+/*
+ * Send a message on the return channel back to the source
+ * of the migration.
+ */
+static int migrate_send_rp_message(MigrationIncomingState *mis,
+                                   enum mig_rp_message_type message_type,
+                                   uint16_t len, void *data)
+{
+    QEMU_LOCK_GUARD(&mis->rp_mutex);
+    return migrate_send_rp_message_locked(mis, message_type, len, data);
+}
+
 /* Request one page from the source VM at the given start address.
  *   rb: the RAMBlock to request the page in
  *   Start: Address offset within the RB
@@ -467,10 +483,11 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
     *(uint32_t *)(bufc + 8) = cpu_to_be32((uint32_t)len);
 
     /*
-     * We maintain the last ramblock that we requested for page.  Note that we
-     * don't need locking because this function will only be called within the
-     * postcopy ram fault thread.
+     * We maintain the last ramblock that we requested for page.  With more
+     * than one postcopy fault thread, rp_mutex keeps the choice of the
+     * message type in the same order as the messages on the wire.
      */
+    QEMU_LOCK_GUARD(&mis->rp_mutex);
     if (rb != mis->last_rb) {
         mis->last_rb = rb;
 
@@ -487,7 +504,7 @@ int migrate_send_rp_message_req_pages(MigrationIncomingState *mis,
         msg_type = MIG_RP_MSG_REQ_PAGES;
     }
 
-    return migrate_send_rp_message(mis, msg_type, msglen, bufc);
+    return migrate_send_rp_message_locked(mis, msg_type, msglen, bufc);
 }
 
 int migrate_send_rp_req_pages(MigrationIncomingState *mis,
@@ -501,10 +518,14 @@ int migrate_send_rp_req_pages(MigrationIncomingState *mis,
         if (!received && !g_tree_lookup(mis->page_requested, aligned)) {
             /*
              * The page has not been received, and it's not yet in the page
-             * request list.  Queue it.  Set the value of element to 1, so that
-             * things like g_tree_lookup() will return TRUE (1) when found.
+             * request list.  Queue it.  The value of the element is the
+             * time of the request, used for the fault latency statistics.
+             * Its lowest bit is always set, so that things like
+             * g_tree_lookup() will return TRUE when found.
              */
-            g_tree_insert(mis->page_requested, aligned, (gpointer)1);
+            g_tree_insert(mis->page_requested, aligned,
+                          (gpointer)(uintptr_t)
+                          (qemu_clock_get_us(QEMU_CLOCK_REALTIME) | 1));
             qatomic_inc(&mis->page_requested_count);
             trace_postcopy_page_req_add(aligned, mis->page_requested_count);
         }
@@ -765,6 +786,13 @@ static void process_incoming_migration_bh(void *opaque)
         runstate_set(global_state_get_runstate());
     }
     trace_vmstate_downtime_checkpoint("dst-precopy-bh-vm-started");
+
+    if (lazy_restore_active()) {
+        /* Completes once the remaining guest RAM has been loaded */
+        lazy_restore_vm_started(mis);
+        return;
+    }
+
     /*
      * This must happen after any state changes since as soon as an external
      * observer sees this event they might start to prod at the VM assuming
@@ -831,6 +859,7 @@ process_incoming_migration_co(void *opaque)
     migration_bh_schedule(process_incoming_migration_bh, mis);
     return;
 fail:
+    lazy_restore_cancel(mis);
     migrate_set_state(&mis->state, MIGRATION_STATUS_ACTIVE,
                       MIGRATION_STATUS_FAILED);
     migrate_set_error(s, local_err);
@@ -1178,6 +1207,8 @@ static void populate_time_info(MigrationInfo *info, MigrationState *s)
     if (migrate_show_downtime(s)) {
         info->has_downtime = true;
         info->downtime = s->downtime;
+        info->device_downtime = qemu_savevm_device_downtime();
+        info->has_device_downtime = !!info->device_downtime;
     } else {
         info->has_expected_downtime = true;
         info->expected_downtime = s->expected_downtime;
@@ -1187,6 +1218,8 @@ static void populate_time_info(MigrationInfo *info, MigrationState *s)
 static void populate_ram_info(MigrationInfo *info, MigrationState *s)
 {
     size_t page_size = qemu_target_page_size();
+    uint64List **tail;
+    int i;
 
     info->ram = g_malloc0(sizeof(*info->ram));
     info->ram->transferred = migration_transferred_bytes();
@@ -1199,6 +1232,12 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         stat64_get(&mig_stats.dirty_sync_count);
     info->ram->dirty_sync_missed_zero_copy =
         stat64_get(&mig_stats.dirty_sync_missed_zero_copy);
+    info->ram->dirty_sync_time = stat64_get(&mig_stats.dirty_sync_time);
+    tail = &info->ram->dirty_sync_time_histogram;
+    for (i = 0; i < MIGRATION_DIRTY_SYNC_TIME_BUCKETS; i++) {
+        QAPI_LIST_APPEND(tail,
+                         stat64_get(&mig_stats.dirty_sync_time_histogram[i]));
+    }
     info->ram->postcopy_requests =
         stat64_get(&mig_stats.postcopy_requests);
     info->ram->page_size = page_size;
@@ -1217,6 +1256,12 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
         info->xbzrle_cache->encoding_rate = xbzrle_counters.encoding_rate;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
+    } else if (migrate_multifd() &&
+               migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE) {
+        info->xbzrle_cache = multifd_xbzrle_get_stats();
+    } else if (migrate_multifd() &&
+               migrate_multifd_compression() == MULTIFD_COMPRESSION_DEDUP) {
+        info->multifd_dedup = multifd_dedup_get_stats();
     }
 
     if (cpu_throttle_active()) {
@@ -1230,6 +1275,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
            stat64_get(&mig_stats.dirty_pages_rate);
     }
 
+    info->convergence = migration_convergence_info();
+
     if (migrate_dirty_limit() && dirtylimit_in_service()) {
         info->has_dirty_limit_throttle_time_per_round = true;
         info->dirty_limit_throttle_time_per_round =
@@ -1343,6 +1390,15 @@ static void fill_destination_migration_info(MigrationInfo *info)
     }
     info->status = mis->state;
 
+    if (migrate_multifd()) {
+        info->multifd_recv_channels = multifd_recv_channels_info();
+        info->has_multifd_recv_channels = !!info->multifd_recv_channels;
+    }
+
+    if (migrate_lazy_restore()) {
+        info->lazy_restore = lazy_restore_get_stats();
+    }
+
     if (!info->error_desc) {
         MigrationState *s = migrate_get_current();
         QEMU_LOCK_GUARD(&s->error_mutex);
@@ -1731,6 +1787,7 @@ int migrate_init(MigrationState *s, Error **errp)
     s->threshold_size = 0;
     s->switchover_acked = false;
     s->rdma_migration = false;
+    migration_convergence_init();
     /*
      * set mig_stats memory to zero for a new migration
      */
@@ -3189,6 +3246,7 @@ static void migration_update_counters(MigrationState *s,
     }
 
     s->threshold_size = expected_bw_per_ms * migrate_downtime_limit();
+    migration_convergence_update(s, expected_bw_per_ms);
 
     s->mbps = (((double) transferred * 8.0) /
                ((double) time_spent / 1000.0)) / 1000.0 / 1000.0;
@@ -3262,6 +3320,7 @@ static MigIterateState migration_iteration_run(MigrationState *s)
 
     if ((!pending_size || pending_size < s->threshold_size) && can_switchover) {
         trace_migration_thread_low_pending(pending_size);
+        migration_convergence_reached(s);
         migration_completion(s);
         return MIG_ITERATE_BREAK;
     }
@@ -3269,6 +3328,7 @@ static MigIterateState migration_iteration_run(MigrationState *s)
     /* Still a significant amount to transfer */
     if (!in_postcopy && must_precopy <= s->threshold_size && can_switchover &&
         qatomic_read(&s->start_postcopy)) {
+        migration_convergence_reached(s);
         if (postcopy_start(s, &local_err)) {
             migrate_set_error(s, local_err);
             error_report_err(local_err);
@@ -3285,6 +3345,7 @@ static void migration_iteration_finish(MigrationState *s)
 {
     /* If we enabled cpu throttling for auto-converge, turn it off. */
     cpu_throttle_stop();
+    migration_convergence_cleanup();
 
     bql_lock();
     switch (s->state) {
@@ -20,6 +20,7 @@
 #include "qapi/qmp/json-writer.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/stats64.h"
 #include "io/channel.h"
 #include "io/channel-buffer.h"
 #include "net/announce.h"
@@ -98,6 +99,9 @@ struct MigrationIncomingState {
     size_t         largest_page_size;
     bool           have_fault_thread;
     QemuThread     fault_thread;
+    /* Additional fault threads, see the postcopy-fault-threads parameter */
+    QemuThread     *fault_helper_threads;
+    unsigned int   fault_helper_count;
     /* Set this when we want the fault thread to quit */
     bool           fault_thread_quit;
 
@@ -108,6 +112,8 @@ struct MigrationIncomingState {
     int       userfault_fd;
     /* To notify the fault_thread to wake, e.g., when need to quit */
     int       userfault_event_fd;
+    /* Features enabled on userfault_fd */
+    uint64_t  userfault_features;
     QEMUFile *to_src_file;
     QemuMutex rp_mutex;    /* We send replies from multiple threads */
     /* RAMBlock of last request sent to source */
@@ -178,6 +184,13 @@ struct MigrationIncomingState {
      * live migration, to calculate vCPU block time
      * */
     struct PostcopyBlocktimeContext *blocktime_ctx;
+    /*
+     * Histogram of the time between a page request and the placement of
+     * the page.  Bucket 0 counts the requests that took less than a
+     * microsecond, bucket i those that took 2^(i-1) to 2^i - 1
+     * microseconds.  The last bucket also counts the slower ones.
+     */
+    Stat64 postcopy_fault_latency[POSTCOPY_FAULT_LATENCY_BUCKETS];
 
     /* notify PAUSED postcopy incoming migrations to try to continue */
     QemuSemaphore postcopy_pause_sem_dst;
@@ -228,6 +241,18 @@ struct MigrationIncomingState {
      */
     unsigned int switchover_ack_pending_num;
 
+    /*
+     * Protects the device state buffers that the multifd receive threads
+     * pass to qemu_loadvm_load_state_buffer(), and the fields below.
+     */
+    QemuMutex device_state_mutex;
+    /* Signalled whenever a device state buffer was loaded */
+    QemuCond device_state_cond;
+    /* Device state buffers may be loaded, see MIG_CMD_DEVICE_STATE_START */
+    bool device_state_started;
+    /* Loading device state was cancelled, stop waiting for it */
+    bool device_state_cancelled;
+
     /* Do exit on incoming migration failure */
     bool exit_on_error;
 };
@@ -0,0 +1,652 @@
+/*
+ * Multifd content-hash deduplication
+ *
+ * Pages are identified by their SHA-256 hash.  The destination gets the
+ * contents of a page without receiving it if the page is in the template
+ * file, for example the memory of a VM booted from the same image, or if
+ * the channel received the same contents recently.  Multifd channels only
+ * go from the source to the destination, so the source has to know in
+ * advance which pages the destination can resolve:
+ *
+ * - The template must be available on both sides.  Both hash all of its
+ *   pages in a thread that is started when the channels are set up, and
+ *   the channels wait for it before they handle their first page, so that
+ *   the hashing does not hold the BQL.  The file is mapped, not copied,
+ *   so the destination hashes every page again after copying it, in case
+ *   the file was changed in the meantime.
+ *
+ * - Each channel has a cache of the pages that it transferred.  Both ends
+ *   of a channel see the same pages in the same order, so they keep the
+ *   same cache without talking to each other.  The source only keeps the
+ *   hashes, the destination keeps the pages.  The cache is direct mapped:
+ *   a transferred page replaces the one in the slot selected by its hash.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/stats64.h"
+#include "qemu/thread.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "crypto/hash.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+
+#define DEDUP_HASH_LEN 32
+
+/*
+ * Each page of a packet is a one byte type followed by the hash of the
+ * page.  Only DEDUP_PAGE_FULL is followed by the page itself.
+ */
+enum {
+    DEDUP_PAGE_FULL,
+    DEDUP_PAGE_TEMPLATE,
+    DEDUP_PAGE_CACHE,
+};
+
+#define DEDUP_HEADER_SIZE (1 + DEDUP_HASH_LEN)
+
+static struct {
+    /* Number of channels that use the template */
+    unsigned users;
+    char *path;
+    uint8_t *data;
+    size_t size;
+    uint8_t *hashes;
+    /* Maps a hash to the number of a page of the template */
+    GHashTable *index;
+    /* Builds the index, which can be used once @ready is set */
+    QemuThread thread;
+    QemuEvent ready;
+    bool quit;
+    Error *err;
+
+    Stat64 template_pages;
+    Stat64 cache_pages;
+    Stat64 full_pages;
+    Stat64 bytes;
+} multifd_dedup;
+
+struct dedup_data {
+    /* copy of the page that is being hashed */
+    uint8_t *page;
+    /* encoded pages of a packet */
+    uint8_t *buf;
+    /* hash of a page copied from the template, only on the destination */
+    uint8_t hash[DEDUP_HASH_LEN];
+    uint64_t nb_slots;
+    /* hash of each cache slot */
+    uint8_t *slot_hashes;
+    /* page of each cache slot, only on the destination */
+    uint8_t *slot_pages;
+    unsigned long *slot_valid;
+};
+
+static guint dedup_hash_hash(gconstpointer key)
+{
+    return ldl_le_p(key);
+}
+
+static gboolean dedup_hash_equal(gconstpointer a, gconstpointer b)
+{
+    return !memcmp(a, b, DEDUP_HASH_LEN);
+}
+
+static int dedup_hash_page(const uint8_t *page, size_t page_size,
+                           uint8_t *hash, Error **errp)
+{
+    size_t hash_len = DEDUP_HASH_LEN;
+
+    return qcrypto_hash_bytes(QCRYPTO_HASH_ALG_SHA256, (const char *)page,
+                              page_size, &hash, &hash_len, errp);
+}
+
+/* Waits until the template is hashed, returns -1 if that failed */
+static int dedup_template_wait(Error **errp)
+{
+    if (!multifd_dedup.data) {
+        return 0;
+    }
+
+    qemu_event_wait(&multifd_dedup.ready);
+    if (multifd_dedup.err) {
+        error_propagate(errp, error_copy(multifd_dedup.err));
+        return -1;
+    }
+    return 0;
+}
+
+static bool dedup_template_lookup(const uint8_t *hash, size_t *page)
+{
+    gpointer value;
+
+    if (!multifd_dedup.index ||
+        !g_hash_table_lookup_extended(multifd_dedup.index, hash, NULL,
+                                      &value)) {
+        return false;
+    }
+
+    *page = GPOINTER_TO_SIZE(value);
+    return true;
+}
+
+static void dedup_template_cleanup(void)
+{
+    if (multifd_dedup.data) {
+        qatomic_set(&multifd_dedup.quit, true);
+        qemu_thread_join(&multifd_dedup.thread);
+        qemu_event_destroy(&multifd_dedup.ready);
+        error_free(multifd_dedup.err);
+        multifd_dedup.err = NULL;
+    }
+    if (multifd_dedup.index) {
+        g_hash_table_destroy(multifd_dedup.index);
+        multifd_dedup.index = NULL;
+    }
+    g_free(multifd_dedup.hashes);
+    multifd_dedup.hashes = NULL;
+    if (multifd_dedup.data) {
+        munmap(multifd_dedup.data, multifd_dedup.size);
+        multifd_dedup.data = NULL;
+    }
+    multifd_dedup.size = 0;
+    g_free(multifd_dedup.path);
+    multifd_dedup.path = NULL;
+}
+
+static void *dedup_template_hash_thread(void *opaque)
+{
+    size_t page_size = qemu_target_page_size();
+    size_t nb_pages = multifd_dedup.size / page_size;
+    size_t i;
+
+    for (i = 0; i < nb_pages; i++) {
+        uint8_t *page = multifd_dedup.data + i * page_size;
+        uint8_t *hash = multifd_dedup.hashes + i * DEDUP_HASH_LEN;
+
+        if (qatomic_read(&multifd_dedup.quit)) {
+            error_setg(&multifd_dedup.err,
+                       "multifd dedup: hashing of the template cancelled");
+            goto out;
+        }
+        /* Zero pages are left to zero page detection */
+        if (buffer_is_zero(page, page_size)) {
+            continue;
+        }
+        if (dedup_hash_page(page, page_size, hash, &multifd_dedup.err) < 0) {
+            goto out;
+        }
+        if (!g_hash_table_contains(multifd_dedup.index, hash)) {
+            g_hash_table_insert(multifd_dedup.index, hash,
+                                GSIZE_TO_POINTER(i));
+        }
+    }
+
+    trace_multifd_dedup_template(multifd_dedup.path, nb_pages,
+                                 g_hash_table_size(multifd_dedup.index));
+out:
+    qemu_event_set(&multifd_dedup.ready);
+    return NULL;
+}
+
+static int dedup_template_init(Error **errp)
+{
+    const char *path = migrate_multifd_dedup_template();
+    size_t page_size = qemu_target_page_size();
+    size_t nb_pages;
+    struct stat st;
+    int fd;
+
+    stat64_set(&multifd_dedup.template_pages, 0);
+    stat64_set(&multifd_dedup.cache_pages, 0);
+    stat64_set(&multifd_dedup.full_pages, 0);
+    stat64_set(&multifd_dedup.bytes, 0);
+
+    if (!path || !*path) {
+        return 0;
+    }
+
+    fd = qemu_open(path, O_RDONLY, errp);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0) {
+        error_setg_errno(errp, errno, "multifd dedup: cannot stat %s", path);
+        qemu_close(fd);
+        return -1;
+    }
+
+    /* A partial page at the end is ignored */
+    nb_pages = st.st_size / page_size;
+    if (!nb_pages) {
+        qemu_close(fd);
+        return 0;
+    }
+
+    multifd_dedup.size = nb_pages * page_size;
+    multifd_dedup.data = mmap(NULL, multifd_dedup.size, PROT_READ,
+                              MAP_SHARED, fd, 0);
+    qemu_close(fd);
+    if (multifd_dedup.data == MAP_FAILED) {
+        error_setg_errno(errp, errno, "multifd dedup: cannot map %s", path);
+        multifd_dedup.data = NULL;
+        multifd_dedup.size = 0;
+        return -1;
+    }
+
+    multifd_dedup.path = g_strdup(path);
+    multifd_dedup.hashes = g_malloc(nb_pages * DEDUP_HASH_LEN);
+    multifd_dedup.index = g_hash_table_new(dedup_hash_hash, dedup_hash_equal);
+    multifd_dedup.quit = false;
+    qemu_event_init(&multifd_dedup.ready, false);
+    qemu_thread_create(&multifd_dedup.thread, "mig/dedup",
+                       dedup_template_hash_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    return 0;
+}
+
+static int dedup_setup(void **compress_data, uint32_t page_size,
+                       bool recv, Error **errp)
+{
+    struct dedup_data *x = g_new0(struct dedup_data, 1);
+
+    x->nb_slots = migrate_multifd_dedup_cache_size() /
+                  migrate_multifd_channels() / page_size;
+    if (x->nb_slots) {
+        x->slot_hashes = g_malloc(x->nb_slots * DEDUP_HASH_LEN);
+        x->slot_valid = bitmap_new(x->nb_slots);
+        if (recv) {
+            x->slot_pages = g_try_malloc(x->nb_slots * page_size);
+            if (!x->slot_pages) {
+                error_setg(errp, "multifd dedup: cannot allocate a cache of "
+                           "%" PRIu64 " pages", x->nb_slots);
+                g_free(x->slot_hashes);
+                g_free(x->slot_valid);
+                g_free(x);
+                return -1;
+            }
+        }
+    }
+    *compress_data = x;
+
+    if (!multifd_dedup.users++) {
+        return dedup_template_init(errp);
+    }
+    return 0;
+}
+
+static void dedup_cleanup(void **compress_data)
+{
+    struct dedup_data *x = *compress_data;
+
+    /* Channels that failed to connect were not set up */
+    if (!x) {
+        return;
+    }
+
+    g_free(x->page);
+    g_free(x->buf);
+    g_free(x->slot_hashes);
+    g_free(x->slot_pages);
+    g_free(x->slot_valid);
+    g_free(x);
+    *compress_data = NULL;
+
+    if (!--multifd_dedup.users) {
+        dedup_template_cleanup();
+    }
+}
+
+static uint64_t dedup_slot(struct dedup_data *x, const uint8_t *hash)
+{
+    return ldq_le_p(hash) % x->nb_slots;
+}
+
+MultiFDDedupStats *multifd_dedup_get_stats(void)
+{
+    MultiFDDedupStats *stats = g_new0(MultiFDDedupStats, 1);
+
+    stats->template_pages = stat64_get(&multifd_dedup.template_pages);
+    stats->cache_pages = stat64_get(&multifd_dedup.cache_pages);
+    stats->full_pages = stat64_get(&multifd_dedup.full_pages);
+    stats->bytes = stat64_get(&multifd_dedup.bytes);
+
+    return stats;
+}
+
+/* Multifd dedup compression */
+
+/**
+ * dedup_send_setup: setup send side
+ *
+ * The first channel maps the template and starts hashing it.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int dedup_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct dedup_data *x;
+
+    /* Needs 2 IOVs, one for packet header and one for encoded pages */
+    p->iov = g_new0(struct iovec, 2);
+
+    if (dedup_setup(&p->compress_data, p->page_size, false, errp) < 0) {
+        return -1;
+    }
+
+    x = p->compress_data;
+    x->page = g_malloc(p->page_size);
+    x->buf = g_malloc(p->page_count * (DEDUP_HEADER_SIZE + p->page_size));
+    return 0;
+}
+
+/**
+ * dedup_send_cleanup: cleanup send side
+ *
+ * The last channel unloads the template.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void dedup_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    g_free(p->iov);
+    p->iov = NULL;
+
+    dedup_cleanup(&p->compress_data);
+}
+
+/*
+ * Encodes the copy of a page to @out and returns the number of bytes that
+ * were written there, or 0 on error.
+ */
+static uint32_t dedup_encode_page(MultiFDSendParams *p, uint8_t *out,
+                                  Error **errp)
+{
+    struct dedup_data *x = p->compress_data;
+    uint8_t *hash = out + 1;
+    uint64_t slot;
+    size_t page;
+
+    if (dedup_hash_page(x->page, p->page_size, hash, errp) < 0) {
+        return 0;
+    }
+
+    if (dedup_template_lookup(hash, &page)) {
+        stat64_add(&multifd_dedup.template_pages, 1);
+        out[0] = DEDUP_PAGE_TEMPLATE;
+        return DEDUP_HEADER_SIZE;
+    }
+
+    if (x->nb_slots) {
+        uint8_t *slot_hash;
+
+        slot = dedup_slot(x, hash);
+        slot_hash = x->slot_hashes + slot * DEDUP_HASH_LEN;
+        if (test_bit(slot, x->slot_valid) &&
+            !memcmp(slot_hash, hash, DEDUP_HASH_LEN)) {
+            stat64_add(&multifd_dedup.cache_pages, 1);
+            out[0] = DEDUP_PAGE_CACHE;
+            return DEDUP_HEADER_SIZE;
+        }
+
+        /* The destination puts the page into the same slot */
+        memcpy(slot_hash, hash, DEDUP_HASH_LEN);
+        set_bit(slot, x->slot_valid);
+    }
+
+    stat64_add(&multifd_dedup.full_pages, 1);
+    out[0] = DEDUP_PAGE_FULL;
+    memcpy(out + DEDUP_HEADER_SIZE, x->page, p->page_size);
+    return DEDUP_HEADER_SIZE + p->page_size;
+}
+
+/**
+ * dedup_send_prepare: prepare data to be able to send
+ *
+ * Hash all the pages that we are going to send, and only include the
+ * ones that the destination can't find.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int dedup_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    struct dedup_data *x = p->compress_data;
+    uint32_t out_size = 0;
+    uint32_t i;
+
+    if (!multifd_send_prepare_common(p)) {
+        goto out;
+    }
+
+    if (dedup_template_wait(errp) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < pages->normal_num; i++) {
+        uint32_t len;
+
+        /*
+         * The page may change while we hash it.  The hash must match what
+         * the destination gets, so work on a copy.
+         */
+        memcpy(x->page, pages->block->host + pages->offset[i], p->page_size);
+        len = dedup_encode_page(p, x->buf + out_size, errp);
+        if (!len) {
+            return -1;
+        }
+        out_size += len;
+    }
+    stat64_add(&multifd_dedup.bytes, out_size);
+
+    p->iov[p->iovs_num].iov_base = x->buf;
+    p->iov[p->iovs_num].iov_len = out_size;
+    p->iovs_num++;
+    p->next_packet_size = out_size;
+
+out:
+    p->flags |= MULTIFD_FLAG_DEDUP;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+/**
+ * dedup_recv_setup: setup receive side
+ *
+ * The first channel maps the template and starts hashing it.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int dedup_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    struct dedup_data *x;
+
+    if (dedup_setup(&p->compress_data, p->page_size, true, errp) < 0) {
+        return -1;
+    }
+
+    x = p->compress_data;
+    x->buf = g_malloc(p->page_count * (DEDUP_HEADER_SIZE + p->page_size));
+    return 0;
+}
+
+/**
+ * dedup_recv_cleanup: cleanup receive side
+ *
+ * The last channel unloads the template.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void dedup_recv_cleanup(MultiFDRecvParams *p)
+{
+    dedup_cleanup(&p->compress_data);
+}
+
+/**
+ * dedup_recv: read the data from the channel into actual pages
+ *
+ * Read the pages that were sent, and copy the others from the template or
+ * the cache.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int dedup_recv(MultiFDRecvParams *p, Error **errp)
+{
+    struct dedup_data *x = p->compress_data;
+    uint8_t *buf = x->buf;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t pos = 0;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_DEDUP) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_DEDUP);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    if (in_size > p->normal_num * (DEDUP_HEADER_SIZE + p->page_size)) {
+        error_setg(errp, "multifd %u: packet size %u too large for %u pages",
+                   p->id, in_size, p->normal_num);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    if (dedup_template_wait(errp) < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *host = p->host + p->normal[i];
+        const uint8_t *hash;
+        uint64_t slot = 0;
+        size_t page;
+        uint8_t type;
+
+        if (in_size - pos < DEDUP_HEADER_SIZE) {
+            goto truncated;
+        }
+        type = buf[pos];
+        hash = buf + pos + 1;
+        pos += DEDUP_HEADER_SIZE;
+        if (x->nb_slots) {
+            slot = dedup_slot(x, hash);
+        }
+
+        switch (type) {
+        case DEDUP_PAGE_FULL:
+            if (in_size - pos < p->page_size) {
+                goto truncated;
+            }
+            memcpy(host, buf + pos, p->page_size);
+            if (x->nb_slots) {
+                memcpy(x->slot_hashes + slot * DEDUP_HASH_LEN, hash,
+                       DEDUP_HASH_LEN);
+                memcpy(x->slot_pages + slot * p->page_size, buf + pos,
+                       p->page_size);
+                set_bit(slot, x->slot_valid);
+            }
+            pos += p->page_size;
+            break;
+        case DEDUP_PAGE_TEMPLATE:
+            if (!dedup_template_lookup(hash, &page)) {
+                error_setg(errp, "multifd %u: page at offset 0x"
+                           RAM_ADDR_FMT " of %s not found in the template, "
+                           "is it the same on both sides?", p->id,
+                           p->normal[i], p->block->idstr);
+                return -1;
+            }
+            memcpy(host, multifd_dedup.data + page * p->page_size,
+                   p->page_size);
+            if (dedup_hash_page(host, p->page_size, x->hash, errp) < 0) {
+                return -1;
+            }
+            if (memcmp(x->hash, hash, DEDUP_HASH_LEN)) {
+                error_setg(errp, "multifd %u: page at offset 0x"
+                           RAM_ADDR_FMT " of %s does not match the "
+                           "template, was it changed during the migration?",
+                           p->id, p->normal[i], p->block->idstr);
+                return -1;
+            }
+            break;
+        case DEDUP_PAGE_CACHE:
+            if (!x->nb_slots || !test_bit(slot, x->slot_valid) ||
+                memcmp(x->slot_hashes + slot * DEDUP_HASH_LEN, hash,
+                       DEDUP_HASH_LEN)) {
+                error_setg(errp, "multifd %u: page at offset 0x"
+                           RAM_ADDR_FMT " of %s not found in the cache, "
+                           "is multifd-dedup-cache-size the same on both "
+                           "sides?", p->id, p->normal[i], p->block->idstr);
+                return -1;
+            }
+            memcpy(host, x->slot_pages + slot * p->page_size, p->page_size);
+            break;
+        default:
+            error_setg(errp, "multifd %u: unknown page type %u", p->id, type);
+            return -1;
+        }
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+    }
+
+    if (pos != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size used %u",
+                   p->id, in_size, pos);
+        return -1;
+    }
+
+    return 0;
+
+truncated:
+    error_setg(errp, "multifd %u: packet of %u bytes truncated at page %u",
+               p->id, in_size, i);
+    return -1;
+}
+
+static MultiFDMethods multifd_dedup_ops = {
+    .send_setup = dedup_send_setup,
+    .send_cleanup = dedup_send_cleanup,
+    .send_prepare = dedup_send_prepare,
+    .recv_setup = dedup_recv_setup,
+    .recv_cleanup = dedup_recv_cleanup,
+    .recv = dedup_recv
+};
+
+static void multifd_dedup_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_DEDUP, &multifd_dedup_ops);
+}
+
+migration_init(multifd_dedup_register);
@@ -0,0 +1,462 @@
+/*
+ * Multifd XBZRLE compression implementation
+ *
+ * Pages are delta encoded against the copy that was sent last time, like
+ * with the xbzrle capability.  The copies are kept in a page cache that is
+ * shared by all channels and split in shards with a lock each, so that the
+ * channels rarely contend for it.  The destination decodes the deltas
+ * against the pages that it already has in guest RAM and does not need a
+ * cache.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/stats64.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "qapi/error.h"
+#include "migration.h"
+#include "migration-stats.h"
+#include "trace.h"
+#include "options.h"
+#include "multifd.h"
+#include "page_cache.h"
+#include "xbzrle.h"
+
+/*
+ * Each page of a packet is preceded by a big endian 32 bit header.  If
+ * XBZRLE_PAGE_FULL is set, the full page follows.  Otherwise the header
+ * is the length of the delta that follows, and 0 means that the page did
+ * not change.
+ */
+#define XBZRLE_HEADER_SIZE sizeof(uint32_t)
+#define XBZRLE_PAGE_FULL (1U << 31)
+
+typedef struct {
+    QemuMutex lock;
+    PageCache *cache;
+} XbzrleShard;
+
+static struct {
+    XbzrleShard *shards;
+    unsigned nb_shards;
+    /* Number of channels that use the cache */
+    unsigned users;
+    uint8_t *zero_page;
+    uint64_t cache_size;
+
+    Stat64 bytes;
+    Stat64 pages;
+    Stat64 cache_miss;
+    Stat64 overflow;
+} multifd_xbzrle;
+
+struct xbzrle_data {
+    /* copy of the page that is being encoded */
+    uint8_t *page;
+    /* encoded pages of a packet */
+    uint8_t *buf;
+};
+
+static XbzrleShard *xbzrle_shard(uint64_t addr, uint64_t *shard_addr)
+{
+    size_t page_size = qemu_target_page_size();
+    uint64_t page = addr / page_size;
+
+    /*
+     * The cache of a shard indexes pages by their low bits, so remove the
+     * bits that select the shard.
+     */
+    *shard_addr = page / multifd_xbzrle.nb_shards * page_size;
+    return &multifd_xbzrle.shards[page % multifd_xbzrle.nb_shards];
+}
+
+static int xbzrle_cache_init(Error **errp)
+{
+    uint64_t cache_size = migrate_xbzrle_cache_size();
+    unsigned nb_shards = pow2floor(migrate_multifd_channels());
+    unsigned i;
+
+    while (nb_shards > 1 && cache_size / nb_shards < qemu_target_page_size()) {
+        nb_shards /= 2;
+    }
+
+    multifd_xbzrle.shards = g_new0(XbzrleShard, nb_shards);
+    multifd_xbzrle.nb_shards = nb_shards;
+    for (i = 0; i < nb_shards; i++) {
+        qemu_mutex_init(&multifd_xbzrle.shards[i].lock);
+    }
+    for (i = 0; i < nb_shards; i++) {
+        XbzrleShard *shard = &multifd_xbzrle.shards[i];
+
+        shard->cache = cache_init(cache_size / nb_shards,
+                                  qemu_target_page_size(), errp);
+        if (!shard->cache) {
+            return -1;
+        }
+    }
+    multifd_xbzrle.zero_page = g_malloc0(qemu_target_page_size());
+    multifd_xbzrle.cache_size = cache_size;
+
+    stat64_set(&multifd_xbzrle.bytes, 0);
+    stat64_set(&multifd_xbzrle.pages, 0);
+    stat64_set(&multifd_xbzrle.cache_miss, 0);
+    stat64_set(&multifd_xbzrle.overflow, 0);
+
+    trace_multifd_xbzrle_cache_init(cache_size, nb_shards);
+    return 0;
+}
+
+static void xbzrle_cache_cleanup(void)
+{
+    unsigned i;
+
+    for (i = 0; i < multifd_xbzrle.nb_shards; i++) {
+        XbzrleShard *shard = &multifd_xbzrle.shards[i];
+
+        if (shard->cache) {
+            cache_fini(shard->cache);
+        }
+        qemu_mutex_destroy(&shard->lock);
+    }
+    g_free(multifd_xbzrle.shards);
+    multifd_xbzrle.shards = NULL;
+    multifd_xbzrle.nb_shards = 0;
+    g_free(multifd_xbzrle.zero_page);
+    multifd_xbzrle.zero_page = NULL;
+}
+
+void multifd_xbzrle_cache_zero_page(uint64_t addr)
+{
+    XbzrleShard *shard;
+    uint64_t shard_addr;
+
+    if (!multifd_xbzrle.users) {
+        return;
+    }
+
+    /*
+     * The page could be cached with stale contents, and if it was not
+     * cached a small write to it can be delta encoded later.  Failing to
+     * insert it is fine, the cache then does not have the page at all.
+     */
+    shard = xbzrle_shard(addr, &shard_addr);
+    WITH_QEMU_LOCK_GUARD(&shard->lock) {
+        cache_insert(shard->cache, shard_addr, multifd_xbzrle.zero_page,
+                     stat64_get(&mig_stats.dirty_sync_count));
+    }
+}
+
+XBZRLECacheStats *multifd_xbzrle_get_stats(void)
+{
+    XBZRLECacheStats *stats = g_new0(XBZRLECacheStats, 1);
+    uint64_t encoded = stat64_get(&multifd_xbzrle.bytes);
+    uint64_t pages = stat64_get(&multifd_xbzrle.pages);
+    uint64_t cache_miss = stat64_get(&multifd_xbzrle.cache_miss);
+
+    stats->cache_size = multifd_xbzrle.cache_size;
+    stats->bytes = encoded;
+    stats->pages = pages;
+    stats->cache_miss = cache_miss;
+    stats->overflow = stat64_get(&multifd_xbzrle.overflow);
+    if (pages + cache_miss) {
+        stats->cache_miss_rate = (double)cache_miss / (pages + cache_miss);
+    }
+    if (encoded) {
+        stats->encoding_rate = (double)pages * qemu_target_page_size() /
+                               encoded;
+    }
+
+    return stats;
+}
+
+/* Multifd XBZRLE compression */
+
+/**
+ * xbzrle_send_setup: setup send side
+ *
+ * The first channel creates the cache.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_setup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *x = g_new0(struct xbzrle_data, 1);
+
+    x->page = g_malloc(p->page_size);
+    x->buf = g_malloc(p->page_count * (XBZRLE_HEADER_SIZE + p->page_size));
+    p->compress_data = x;
+
+    /* Needs 2 IOVs, one for packet header and one for encoded pages */
+    p->iov = g_new0(struct iovec, 2);
+
+    if (!multifd_xbzrle.users++) {
+        return xbzrle_cache_init(errp);
+    }
+    return 0;
+}
+
+/**
+ * xbzrle_send_cleanup: cleanup send side
+ *
+ * The last channel frees the cache.
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static void xbzrle_send_cleanup(MultiFDSendParams *p, Error **errp)
+{
+    struct xbzrle_data *x = p->compress_data;
+
+    g_free(p->iov);
+    p->iov = NULL;
+
+    /* Channels that failed to connect were not set up */
+    if (!x) {
+        return;
+    }
+
+    g_free(x->page);
+    g_free(x->buf);
+    g_free(x);
+    p->compress_data = NULL;
+
+    if (!--multifd_xbzrle.users) {
+        xbzrle_cache_cleanup();
+    }
+}
+
+/*
+ * Encodes the copy of the page at @addr to @out and returns the number of
+ * bytes that were written there.
+ */
+static uint32_t xbzrle_encode_page(MultiFDSendParams *p, uint8_t *out,
+                                   uint64_t addr)
+{
+    struct xbzrle_data *x = p->compress_data;
+    uint64_t age = stat64_get(&mig_stats.dirty_sync_count);
+    XbzrleShard *shard;
+    uint64_t shard_addr;
+    int len;
+
+    shard = xbzrle_shard(addr, &shard_addr);
+    qemu_mutex_lock(&shard->lock);
+
+    if (!cache_is_cached(shard->cache, shard_addr, age)) {
+        stat64_add(&multifd_xbzrle.cache_miss, 1);
+        cache_insert(shard->cache, shard_addr, x->page, age);
+        qemu_mutex_unlock(&shard->lock);
+        goto full;
+    }
+
+    /* Only worth it if the delta is smaller than the page */
+    len = xbzrle_encode_buffer(get_cached_data(shard->cache, shard_addr),
+                               x->page, p->page_size,
+                               out + XBZRLE_HEADER_SIZE,
+                               p->page_size - XBZRLE_HEADER_SIZE);
+    if (len < 0) {
+        /* The destination gets the full page, which is cached as well */
+        stat64_add(&multifd_xbzrle.overflow, 1);
+        memcpy(get_cached_data(shard->cache, shard_addr), x->page,
+               p->page_size);
+        qemu_mutex_unlock(&shard->lock);
+        goto full;
+    }
+    if (len) {
+        memcpy(get_cached_data(shard->cache, shard_addr), x->page,
+               p->page_size);
+    }
+    qemu_mutex_unlock(&shard->lock);
+
+    stat64_add(&multifd_xbzrle.pages, 1);
+    stat64_add(&multifd_xbzrle.bytes, XBZRLE_HEADER_SIZE + len);
+    stl_be_p(out, len);
+    return XBZRLE_HEADER_SIZE + len;
+
+full:
+    stl_be_p(out, XBZRLE_PAGE_FULL);
+    memcpy(out + XBZRLE_HEADER_SIZE, x->page, p->page_size);
+    return XBZRLE_HEADER_SIZE + p->page_size;
+}
+
+/**
+ * xbzrle_send_prepare: prepare data to be able to send
+ *
+ * Delta encode all the pages that we are going to send.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_send_prepare(MultiFDSendParams *p, Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    struct xbzrle_data *x = p->compress_data;
+    uint32_t out_size = 0;
+    uint32_t i;
+
+    if (!multifd_send_prepare_common(p)) {
+        goto out;
+    }
+
+    for (i = 0; i < pages->normal_num; i++) {
+        /*
+         * The page may change while we encode it.  The cache must hold
+         * exactly what the destination gets, so work on a copy.
+         */
+        memcpy(x->page, pages->block->host + pages->offset[i], p->page_size);
+        out_size += xbzrle_encode_page(p, x->buf + out_size,
+                                       pages->block->offset +
+                                       pages->offset[i]);
+    }
+    p->iov[p->iovs_num].iov_base = x->buf;
+    p->iov[p->iovs_num].iov_len = out_size;
+    p->iovs_num++;
+    p->next_packet_size = out_size;
+
+out:
+    for (i = pages->normal_num; i < pages->num; i++) {
+        multifd_xbzrle_cache_zero_page(pages->block->offset +
+                                       pages->offset[i]);
+    }
+
+    p->flags |= MULTIFD_FLAG_XBZRLE;
+    multifd_send_fill_packet(p);
+    return 0;
+}
+
+/**
+ * xbzrle_recv_setup: setup receive side
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv_setup(MultiFDRecvParams *p, Error **errp)
+{
+    p->compress_data = g_malloc(p->page_count *
+                                (XBZRLE_HEADER_SIZE + p->page_size));
+    return 0;
+}
+
+/**
+ * xbzrle_recv_cleanup: cleanup receive side
+ *
+ * @p: Params for the channel that we are using
+ */
+static void xbzrle_recv_cleanup(MultiFDRecvParams *p)
+{
+    g_free(p->compress_data);
+    p->compress_data = NULL;
+}
+
+/**
+ * xbzrle_recv: read the data from the channel into actual pages
+ *
+ * Read the encoded pages, and decode them against the pages in guest
+ * RAM.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int xbzrle_recv(MultiFDRecvParams *p, Error **errp)
+{
+    uint8_t *buf = p->compress_data;
+    uint32_t in_size = p->next_packet_size;
+    uint32_t flags = p->flags & MULTIFD_FLAG_COMPRESSION_MASK;
+    uint32_t pos = 0;
+    uint32_t i;
+    int ret;
+
+    if (flags != MULTIFD_FLAG_XBZRLE) {
+        error_setg(errp, "multifd %u: flags received %x flags expected %x",
+                   p->id, flags, MULTIFD_FLAG_XBZRLE);
+        return -1;
+    }
+
+    multifd_recv_zero_page_process(p);
+
+    if (!p->normal_num) {
+        assert(in_size == 0);
+        return 0;
+    }
+
+    if (in_size > p->normal_num * (XBZRLE_HEADER_SIZE + p->page_size)) {
+        error_setg(errp, "multifd %u: packet size %u too large for %u pages",
+                   p->id, in_size, p->normal_num);
+        return -1;
+    }
+
+    ret = qio_channel_read_all(p->c, (void *)buf, in_size, errp);
+    if (ret != 0) {
+        return ret;
+    }
+
+    for (i = 0; i < p->normal_num; i++) {
+        uint8_t *host = p->host + p->normal[i];
+        uint32_t header, len;
+
+        if (in_size - pos < XBZRLE_HEADER_SIZE) {
+            goto truncated;
+        }
+        header = ldl_be_p(buf + pos);
+        pos += XBZRLE_HEADER_SIZE;
+        len = header & XBZRLE_PAGE_FULL ? p->page_size : header;
+        if (in_size - pos < len) {
+            goto truncated;
+        }
+
+        ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
+        if (header & XBZRLE_PAGE_FULL) {
+            memcpy(host, buf + pos, p->page_size);
+        } else if (len &&
+                   xbzrle_decode_buffer(buf + pos, len, host,
+                                        p->page_size) < 0) {
+            error_setg(errp, "multifd %u: failed to decode page at "
+                       "offset 0x" RAM_ADDR_FMT " of %s", p->id,
+                       p->normal[i], p->block->idstr);
+            return -1;
+        }
+        pos += len;
+    }
+
+    if (pos != in_size) {
+        error_setg(errp, "multifd %u: packet size received %u size used %u",
+                   p->id, in_size, pos);
+        return -1;
+    }
+
+    return 0;
+
+truncated:
+    error_setg(errp, "multifd %u: packet of %u bytes truncated at page %u",
+               p->id, in_size, i);
+    return -1;
+}
+
+static MultiFDMethods multifd_xbzrle_ops = {
+    .send_setup = xbzrle_send_setup,
+    .send_cleanup = xbzrle_send_cleanup,
+    .send_prepare = xbzrle_send_prepare,
+    .recv_setup = xbzrle_recv_setup,
+    .recv_cleanup = xbzrle_recv_cleanup,
+    .recv = xbzrle_recv
+};
+
+static void multifd_xbzrle_register(void)
+{
+    multifd_register_ops(MULTIFD_COMPRESSION_XBZRLE, &multifd_xbzrle_ops);
+}
+
+migration_init(multifd_xbzrle_register);
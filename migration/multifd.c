@@ -13,11 +13,15 @@
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
 #include "qemu/rcu.h"
+#include "qemu/iov.h"
+#include "qemu/timer.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qapi-visit-migration.h"
 #include "file.h"
 #include "migration.h"
 #include "migration-stats.h"
@@ -26,6 +30,7 @@
 #include "qemu-file.h"
 #include "trace.h"
 #include "multifd.h"
+#include "savevm.h"
 #include "threadinfo.h"
 #include "options.h"
 #include "qemu/yank.h"
@@ -47,6 +52,16 @@ typedef struct {
     uint64_t unused2[4];    /* Reserved for future use */
 } __attribute__((packed)) MultiFDInit_t;
 
+/* A buffer of device state, see multifd_queue_device_state() */
+struct MultiFDDeviceState {
+    char idstr[256];
+    uint32_t instance_id;
+    uint64_t seq;
+    void *data;
+    size_t len;
+    QSIMPLEQ_ENTRY(MultiFDDeviceState) next;
+};
+
 struct {
     MultiFDSendParams *params;
     /* array of pages to sent */
@@ -79,6 +94,14 @@ struct {
     int exiting;
     /* multifd ops */
     MultiFDMethods *ops;
+    /* protects the device state queues of the channels and the below */
+    QemuMutex device_state_lock;
+    /* signalled when all queued device state buffers were sent */
+    QemuCond device_state_cond;
+    /* device state buffers queued and not sent yet */
+    unsigned int device_state_pending;
+    /* channel that gets the next device state buffer */
+    unsigned int device_state_channel;
 } *multifd_send_state;
 
 struct {
@@ -98,6 +121,9 @@ struct {
     MultiFDMethods *ops;
 } *multifd_recv_state;
 
+/* per-channel statistics of the last incoming migration */
+static MultiFDRecvChannelInfoList *multifd_recv_channels_last;
+
 static bool multifd_use_packets(void)
 {
     return !migrate_mapped_ram();
@@ -237,7 +263,8 @@ static int nocomp_send_prepare(MultiFDSendParams *p, Error **errp)
  */
 static int nocomp_recv_setup(MultiFDRecvParams *p, Error **errp)
 {
-    p->iov = g_new0(struct iovec, p->page_count);
+    /* one more iov to read ahead the header of the next packet */
+    p->iov = g_new0(struct iovec, p->page_count + 1);
     return 0;
 }
 
@@ -254,6 +281,60 @@ static void nocomp_recv_cleanup(MultiFDRecvParams *p)
     p->iov = NULL;
 }
 
+/**
+ * nocomp_recv_pages: read the pages of a packet from the channel
+ *
+ * Reads the pages and, in the same readv() calls, as much of the
+ * header of the next packet as is already available.  This saves one
+ * system call per packet when the channel is busy.  The amount of
+ * header read ahead is left in p->packet_prefetched for the receive
+ * thread.
+ *
+ * This is only valid because a packet with pages is always followed
+ * by another packet header (or the end of the stream).
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @p: Params for the channel that we are using
+ * @errp: pointer to an error
+ */
+static int nocomp_recv_pages(MultiFDRecvParams *p, Error **errp)
+{
+    struct iovec *iov = p->iov;
+    unsigned int niov = p->normal_num + 1;
+    size_t pages_len = (size_t)p->normal_num * p->page_size;
+    size_t done = 0;
+
+    p->iov[p->normal_num].iov_base = p->packet;
+    p->iov[p->normal_num].iov_len = p->packet_len;
+
+    while (done < pages_len) {
+        ssize_t len = qio_channel_readv(p->c, iov, niov, errp);
+
+        if (len == QIO_CHANNEL_ERR_BLOCK) {
+            qio_channel_wait(p->c, G_IO_IN);
+            continue;
+        }
+        if (len < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            error_setg(errp, "multifd %u: unexpected end-of-file "
+                       "before all pages were read", p->id);
+            return -1;
+        }
+        done += len;
+        iov_discard_front(&iov, &niov, len);
+    }
+
+    p->packet_prefetched = done - pages_len;
+    if (p->packet_prefetched) {
+        stat64_add(&p->stat_prefetched, 1);
+    }
+    trace_multifd_recv_prefetch(p->id, p->packet_prefetched);
+    return 0;
+}
+
 /**
  * nocomp_recv: read the data from the channel
  *
@@ -291,7 +372,7 @@ static int nocomp_recv(MultiFDRecvParams *p, Error **errp)
         p->iov[i].iov_len = p->page_size;
         ramblock_recv_bitmap_set_offset(p->block, p->normal[i]);
     }
-    return qio_channel_readv_all(p->c, p->iov, p->normal_num, errp);
+    return nocomp_recv_pages(p, errp);
 }
 
 static MultiFDMethods multifd_nocomp_ops = {
@@ -504,6 +585,22 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     trace_multifd_recv(p->id, p->packet_num, p->normal_num, p->zero_num,
                        p->flags, p->next_packet_size);
 
+    if (p->flags & MULTIFD_FLAG_DEVICE_STATE) {
+        if (p->normal_num || p->zero_num ||
+            p->next_packet_size > MULTIFD_DEVICE_STATE_MAX_SIZE) {
+            error_setg(errp, "multifd: received invalid device state packet "
+                       "with %u pages and size %u",
+                       p->normal_num + p->zero_num, p->next_packet_size);
+            return -1;
+        }
+
+        /* make sure that the section name is 0 terminated */
+        packet->ramblock[255] = 0;
+        p->instance_id = be32_to_cpu(packet->instance_id);
+        p->device_state_seq = be64_to_cpu(packet->device_state_seq);
+        return 0;
+    }
+
     if (p->normal_num == 0 && p->zero_num == 0) {
         return 0;
     }
@@ -565,6 +662,10 @@ static void multifd_send_kick_main(MultiFDSendParams *p)
 {
     qemu_sem_post(&p->sem_sync);
     qemu_sem_post(&multifd_send_state->channels_ready);
+
+    WITH_QEMU_LOCK_GUARD(&multifd_send_state->device_state_lock) {
+        qemu_cond_broadcast(&multifd_send_state->device_state_cond);
+    }
 }
 
 /*
@@ -689,6 +790,155 @@ retry:
     return true;
 }
 
+bool multifd_device_state_supported(void)
+{
+    return migrate_multifd_device_state() && multifd_send_state;
+}
+
+/*
+ * Queues a buffer of device state for the next multifd channel, taking
+ * ownership of @data.  Unlike pages, device state can be queued from any
+ * thread, and the channels send it as soon as they are done with their
+ * current job.
+ *
+ * Returns 0 for success or negative for error.
+ */
+int multifd_queue_device_state(const char *idstr, uint32_t instance_id,
+                               uint64_t seq, void *data, size_t len,
+                               Error **errp)
+{
+    MultiFDDeviceState *ds;
+    MultiFDSendParams *p;
+
+    if (len > MULTIFD_DEVICE_STATE_MAX_SIZE) {
+        error_setg(errp, "multifd: device state buffer of %zu bytes is "
+                   "too big", len);
+        g_free(data);
+        return -EINVAL;
+    }
+
+    if (multifd_send_should_exit()) {
+        error_setg(errp, "multifd: cannot send device state, "
+                   "migration is exiting");
+        g_free(data);
+        return -EIO;
+    }
+
+    ds = g_new0(MultiFDDeviceState, 1);
+    pstrcpy(ds->idstr, sizeof(ds->idstr), idstr);
+    ds->instance_id = instance_id;
+    ds->seq = seq;
+    ds->data = data;
+    ds->len = len;
+
+    WITH_QEMU_LOCK_GUARD(&multifd_send_state->device_state_lock) {
+        p = &multifd_send_state->params[multifd_send_state->device_state_channel
+                                        % migrate_multifd_channels()];
+        multifd_send_state->device_state_channel++;
+        multifd_send_state->device_state_pending++;
+        QSIMPLEQ_INSERT_TAIL(&p->device_state, ds, next);
+    }
+
+    trace_multifd_queue_device_state(p->id, idstr, instance_id, seq, len);
+    qemu_sem_post(&p->sem);
+
+    return 0;
+}
+
+/*
+ * Waits until the multifd channels sent all the device state buffers
+ * that were queued.
+ *
+ * Returns 0 for success or -1 for error.
+ */
+int multifd_device_state_flush(void)
+{
+    QEMU_LOCK_GUARD(&multifd_send_state->device_state_lock);
+
+    while (multifd_send_state->device_state_pending) {
+        if (multifd_send_should_exit()) {
+            return -1;
+        }
+        qemu_cond_wait(&multifd_send_state->device_state_cond,
+                       &multifd_send_state->device_state_lock);
+    }
+
+    return 0;
+}
+
+static MultiFDDeviceState *multifd_device_state_dequeue(MultiFDSendParams *p)
+{
+    MultiFDDeviceState *ds;
+
+    QEMU_LOCK_GUARD(&multifd_send_state->device_state_lock);
+
+    ds = QSIMPLEQ_FIRST(&p->device_state);
+    if (ds) {
+        QSIMPLEQ_REMOVE_HEAD(&p->device_state, next);
+    }
+
+    return ds;
+}
+
+static void multifd_device_state_free(MultiFDDeviceState *ds)
+{
+    g_free(ds->data);
+    g_free(ds);
+}
+
+/*
+ * Device state is sent with the usual packet header, which then carries
+ * the name and instance id of the section instead of pages, followed by
+ * the buffer itself.
+ */
+static int multifd_send_device_state(MultiFDSendParams *p,
+                                     MultiFDDeviceState *ds, Error **errp)
+{
+    MultiFDPacket_t *packet = p->packet;
+    struct iovec iov[] = {
+        { .iov_base = packet, .iov_len = p->packet_len },
+        { .iov_base = ds->data, .iov_len = ds->len },
+    };
+    uint64_t packet_num;
+    int ret;
+
+    packet->flags = cpu_to_be32(MULTIFD_FLAG_DEVICE_STATE);
+    packet->pages_alloc = 0;
+    packet->normal_pages = 0;
+    packet->zero_pages = 0;
+    packet->next_packet_size = cpu_to_be32(ds->len);
+    packet->instance_id = cpu_to_be32(ds->instance_id);
+    packet->device_state_seq = cpu_to_be64(ds->seq);
+    memcpy(packet->ramblock, ds->idstr, sizeof(packet->ramblock));
+
+    packet_num = qatomic_fetch_inc(&multifd_send_state->packet_num);
+    packet->packet_num = cpu_to_be64(packet_num);
+
+    trace_multifd_send_device_state(p->id, packet_num, ds->idstr,
+                                    ds->instance_id, ds->seq, ds->len);
+
+    ret = qio_channel_writev_all(p->c, iov, ARRAY_SIZE(iov), errp);
+
+    /* These fields are reserved in page packets */
+    packet->instance_id = 0;
+    packet->device_state_seq = 0;
+
+    if (ret != 0) {
+        return -1;
+    }
+
+    p->packets_sent++;
+    stat64_add(&mig_stats.multifd_bytes, p->packet_len + ds->len);
+
+    WITH_QEMU_LOCK_GUARD(&multifd_send_state->device_state_lock) {
+        if (!--multifd_send_state->device_state_pending) {
+            qemu_cond_broadcast(&multifd_send_state->device_state_cond);
+        }
+    }
+
+    return 0;
+}
+
 /* Multifd send side hit an error; remember it and prepare to quit */
 static void multifd_send_set_error(Error *err)
 {
@@ -740,6 +990,10 @@ static void multifd_send_terminate_threads(void)
         }
     }
 
+    WITH_QEMU_LOCK_GUARD(&multifd_send_state->device_state_lock) {
+        qemu_cond_broadcast(&multifd_send_state->device_state_cond);
+    }
+
     /*
      * Finally recycle all the threads.
      */
@@ -758,6 +1012,13 @@ static void multifd_send_terminate_threads(void)
 
 static bool multifd_send_cleanup_channel(MultiFDSendParams *p, Error **errp)
 {
+    MultiFDDeviceState *ds;
+
+    while ((ds = QSIMPLEQ_FIRST(&p->device_state))) {
+        QSIMPLEQ_REMOVE_HEAD(&p->device_state, next);
+        multifd_device_state_free(ds);
+    }
+
     if (p->c) {
         migration_ioc_unregister_yank(p->c);
         /*
@@ -806,6 +1067,8 @@ static void multifd_send_cleanup_state(void)
     socket_cleanup_outgoing_migration();
     qemu_sem_destroy(&multifd_send_state->channels_created);
     qemu_sem_destroy(&multifd_send_state->channels_ready);
+    qemu_mutex_destroy(&multifd_send_state->device_state_lock);
+    qemu_cond_destroy(&multifd_send_state->device_state_cond);
     g_free(multifd_send_state->params);
     multifd_send_state->params = NULL;
     multifd_pages_clear(multifd_send_state->pages);
@@ -915,6 +1178,7 @@ static void *multifd_send_thread(void *opaque)
     Error *local_err = NULL;
     int ret = 0;
     bool use_packets = multifd_use_packets();
+    bool ready = true;
 
     thread = migration_threads_add(p->name, qemu_get_thread_id());
 
@@ -929,7 +1193,13 @@ static void *multifd_send_thread(void *opaque)
     }
 
     while (true) {
-        qemu_sem_post(&multifd_send_state->channels_ready);
+        MultiFDDeviceState *ds;
+
+        /* The migration thread does not wait for device state jobs */
+        if (ready) {
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        }
+        ready = true;
         qemu_sem_wait(&p->sem);
 
         if (multifd_send_should_exit()) {
@@ -978,6 +1248,17 @@ static void *multifd_send_thread(void *opaque)
              * multifd_send_pages().
              */
             qatomic_store_release(&p->pending_job, false);
+        } else if ((ds = multifd_device_state_dequeue(p))) {
+            /*
+             * Device state queued before a sync request is sent before
+             * the SYNC packet.
+             */
+            ret = multifd_send_device_state(p, ds, &local_err);
+            multifd_device_state_free(ds);
+            if (ret != 0) {
+                break;
+            }
+            ready = false;
         } else {
             /*
              * If not a normal job, must be a sync request.  Note that
@@ -1174,6 +1455,8 @@ bool multifd_send_setup(void)
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
     qatomic_set(&multifd_send_state->exiting, 0);
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    qemu_mutex_init(&multifd_send_state->device_state_lock);
+    qemu_cond_init(&multifd_send_state->device_state_cond);
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -1182,6 +1465,7 @@ bool multifd_send_setup(void)
         qemu_sem_init(&p->sem_sync, 0);
         p->id = i;
         p->pages = multifd_pages_init(page_count);
+        QSIMPLEQ_INIT(&p->device_state);
 
         if (use_packets) {
             p->packet_len = sizeof(MultiFDPacket_t)
@@ -1290,6 +1574,9 @@ static void multifd_recv_terminate_threads(Error *err)
         return;
     }
 
+    /* Don't let anyone wait for device state that will not arrive */
+    qemu_loadvm_device_state_cancel();
+
     if (err) {
         MigrationState *s = migrate_get_current();
         migrate_set_error(s, err);
@@ -1376,6 +1663,51 @@ static void multifd_recv_cleanup_state(void)
     multifd_recv_state = NULL;
 }
 
+static MultiFDRecvChannelInfoList *multifd_recv_channels_collect(void)
+{
+    MultiFDRecvChannelInfoList *head = NULL, **tail = &head;
+
+    if (!multifd_use_packets()) {
+        return NULL;
+    }
+
+    for (int i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+        MultiFDRecvChannelInfo *info;
+        uint64_t first_us, last_us;
+
+        if (!p->c) {
+            continue;
+        }
+
+        info = g_new0(MultiFDRecvChannelInfo, 1);
+        info->id = p->id;
+        info->packets = stat64_get(&p->stat_packets);
+        info->bytes = stat64_get(&p->stat_bytes);
+        info->prefetched_headers = stat64_get(&p->stat_prefetched);
+        first_us = stat64_get(&p->stat_first_us);
+        last_us = stat64_get(&p->stat_last_us);
+        if (last_us > first_us) {
+            /* bits per microsecond is megabits per second */
+            info->mbps = (double)info->bytes * 8 / (last_us - first_us);
+        }
+        QAPI_LIST_APPEND(tail, info);
+    }
+
+    return head;
+}
+
+MultiFDRecvChannelInfoList *multifd_recv_channels_info(void)
+{
+    if (multifd_recv_state) {
+        return multifd_recv_channels_collect();
+    }
+    if (!multifd_recv_channels_last) {
+        return NULL;
+    }
+    return QAPI_CLONE(MultiFDRecvChannelInfoList, multifd_recv_channels_last);
+}
+
 void multifd_recv_cleanup(void)
 {
     int i;
@@ -1391,6 +1723,9 @@ void multifd_recv_cleanup(void)
             qemu_thread_join(&p->thread);
         }
     }
+    /* keep the statistics around for query-migrate */
+    qapi_free_MultiFDRecvChannelInfoList(multifd_recv_channels_last);
+    multifd_recv_channels_last = multifd_recv_channels_collect();
     for (i = 0; i < migrate_multifd_channels(); i++) {
         multifd_recv_cleanup_channel(&multifd_recv_state->params[i]);
     }
@@ -1459,6 +1794,28 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/*
+ * Reads the buffer of a device state packet and passes it on to the
+ * device, in this thread.
+ */
+static int multifd_recv_device_state(MultiFDRecvParams *p, Error **errp)
+{
+    g_autofree void *data = g_malloc(p->next_packet_size);
+
+    if (qio_channel_read_all(p->c, data, p->next_packet_size, errp)) {
+        return -1;
+    }
+
+    trace_multifd_recv_device_state(p->id, p->packet->ramblock,
+                                    p->instance_id, p->device_state_seq,
+                                    p->next_packet_size);
+
+    return qemu_loadvm_load_state_buffer(p->packet->ramblock, p->instance_id,
+                                         p->device_state_seq,
+                                         g_steal_pointer(&data),
+                                         p->next_packet_size, errp);
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -1479,10 +1836,28 @@ static void *multifd_recv_thread(void *opaque)
                 break;
             }
 
-            ret = qio_channel_read_all_eof(p->c, (void *)p->packet,
-                                           p->packet_len, &local_err);
-            if (ret == 0 || ret == -1) {   /* 0: EOF  -1: Error */
-                break;
+            /* part of the header may have been read with the last pages */
+            if (p->packet_prefetched < p->packet_len) {
+                ret = qio_channel_read_all_eof(p->c,
+                                               (uint8_t *)p->packet +
+                                               p->packet_prefetched,
+                                               p->packet_len -
+                                               p->packet_prefetched,
+                                               &local_err);
+                if (ret == 0 && p->packet_prefetched) {
+                    error_setg(&local_err, "multifd %u: unexpected "
+                               "end-of-file inside a packet header", p->id);
+                    break;
+                }
+                if (ret == 0 || ret == -1) {   /* 0: EOF  -1: Error */
+                    break;
+                }
+            }
+            p->packet_prefetched = 0;
+
+            if (!stat64_get(&p->stat_first_us)) {
+                stat64_set(&p->stat_first_us,
+                           qemu_clock_get_us(QEMU_CLOCK_REALTIME));
             }
 
             qemu_mutex_lock(&p->mutex);
@@ -1530,7 +1905,19 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        if (flags & MULTIFD_FLAG_DEVICE_STATE) {
+            ret = multifd_recv_device_state(p, &local_err);
+            if (ret != 0) {
+                break;
+            }
+        }
+
         if (use_packets) {
+            stat64_add(&p->stat_packets, 1);
+            stat64_add(&p->stat_bytes, p->packet_len + p->next_packet_size);
+            stat64_set(&p->stat_last_us,
+                       qemu_clock_get_us(QEMU_CLOCK_REALTIME));
+
             if (flags & MULTIFD_FLAG_SYNC) {
                 qemu_sem_post(&multifd_recv_state->sem_sync);
                 qemu_sem_wait(&p->sem_sync);
@@ -1575,6 +1962,9 @@ int multifd_recv_setup(Error **errp)
         return 0;
     }
 
+    qapi_free_MultiFDRecvChannelInfoList(multifd_recv_channels_last);
+    multifd_recv_channels_last = NULL;
+
     thread_count = migrate_multifd_channels();
     multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
     multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
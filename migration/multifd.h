@@ -13,6 +13,9 @@
 #ifndef QEMU_MIGRATION_MULTIFD_H
 #define QEMU_MIGRATION_MULTIFD_H
 
+#include "qemu/queue.h"
+#include "qemu/stats64.h"
+#include "qapi/qapi-types-migration.h"
 #include "ram.h"
 
 typedef struct MultiFDRecvData MultiFDRecvData;
@@ -28,8 +31,17 @@ void multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
 int multifd_send_sync_main(void);
 bool multifd_queue_page(RAMBlock *block, ram_addr_t offset);
+bool multifd_device_state_supported(void);
+int multifd_queue_device_state(const char *idstr, uint32_t instance_id,
+                               uint64_t seq, void *data, size_t len,
+                               Error **errp);
+int multifd_device_state_flush(void);
+void multifd_xbzrle_cache_zero_page(uint64_t addr);
+XBZRLECacheStats *multifd_xbzrle_get_stats(void);
+MultiFDDedupStats *multifd_dedup_get_stats(void);
 bool multifd_recv(void);
 MultiFDRecvData *multifd_get_recv_data(void);
+MultiFDRecvChannelInfoList *multifd_recv_channels_info(void);
 
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
@@ -42,10 +54,18 @@ MultiFDRecvData *multifd_get_recv_data(void);
 #define MULTIFD_FLAG_ZSTD (2 << 1)
 #define MULTIFD_FLAG_QPL (4 << 1)
 #define MULTIFD_FLAG_UADK (8 << 1)
+#define MULTIFD_FLAG_XBZRLE (3 << 1)
+#define MULTIFD_FLAG_DEDUP (5 << 1)
+
+/* The packet carries a buffer of device state instead of pages */
+#define MULTIFD_FLAG_DEVICE_STATE (1 << 5)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
 
+/* Maximum size of a buffer of device state */
+#define MULTIFD_DEVICE_STATE_MAX_SIZE (64 * 1024 * 1024)
+
 typedef struct {
     uint32_t magic;
     uint32_t version;
@@ -59,8 +79,12 @@ typedef struct {
     uint64_t packet_num;
     /* zero pages */
     uint32_t zero_pages;
-    uint32_t unused32[1];    /* Reserved for future use */
-    uint64_t unused64[3];    /* Reserved for future use */
+    /* instance id of the device state section */
+    uint32_t instance_id;
+    /* index of the buffer among the ones of the device state section */
+    uint64_t device_state_seq;
+    uint64_t unused64[2];    /* Reserved for future use */
+    /* RAM block name, or device state section name */
     char ramblock[256];
     /*
      * This array contains the pointers to:
@@ -70,6 +94,8 @@ typedef struct {
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
 
+typedef struct MultiFDDeviceState MultiFDDeviceState;
+
 typedef struct {
     /* number of used pages */
     uint32_t num;
@@ -137,6 +163,11 @@ typedef struct {
      * pending_job != 0 -> multifd_channel can use it.
      */
     MultiFDPages_t *pages;
+    /*
+     * Device state buffers to send, protected by the device state lock
+     * of the multifd send state.
+     */
+    QSIMPLEQ_HEAD(, MultiFDDeviceState) device_state;
 
     /* thread local variables. No locking required */
 
@@ -202,6 +233,8 @@ typedef struct {
     uint32_t next_packet_size;
     /* packets received through this channel */
     uint64_t packets_recved;
+    /* bytes of the next packet header that were read with the pages */
+    uint32_t packet_prefetched;
     /* ramblock */
     RAMBlock *block;
     /* ramblock host address */
@@ -220,8 +253,19 @@ typedef struct {
     ram_addr_t *zero;
     /* num of zero pages */
     uint32_t zero_num;
+    /* instance id and index of a device state buffer */
+    uint32_t instance_id;
+    uint64_t device_state_seq;
     /* used for de-compression methods */
     void *compress_data;
+
+    /* statistics for query-migrate, written by the channel thread */
+    Stat64 stat_packets;
+    Stat64 stat_bytes;
+    Stat64 stat_prefetched;
+    /* times of the first and last packet in microseconds */
+    Stat64 stat_first_us;
+    Stat64 stat_last_us;
 } MultiFDRecvParams;
 
 typedef struct {
@@ -49,9 +49,14 @@
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_XBZRLE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Multifd dedup default cache size */
+#define DEFAULT_MIGRATE_MULTIFD_DEDUP_CACHE_SIZE (64 * 1024 * 1024)
+
 /* The delay time (in ms) between two COLO checkpoints */
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY (200 * 100)
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define DEFAULT_MIGRATE_DIRTY_SYNC_THREADS 1
+#define DEFAULT_MIGRATE_POSTCOPY_FAULT_THREADS 1
 #define DEFAULT_MIGRATE_MULTIFD_COMPRESSION MULTIFD_COMPRESSION_NONE
 /* 0: means nocompress, 1: best speed, ... 9: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
@@ -162,6 +167,17 @@ Property migration_properties[] = {
     DEFINE_PROP_ZERO_PAGE_DETECTION("zero-page-detection", MigrationState,
                        parameters.zero_page_detection,
                        ZERO_PAGE_DETECTION_MULTIFD),
+    DEFINE_PROP_UINT8("dirty-sync-threads", MigrationState,
+                      parameters.dirty_sync_threads,
+                      DEFAULT_MIGRATE_DIRTY_SYNC_THREADS),
+    DEFINE_PROP_UINT8("postcopy-fault-threads", MigrationState,
+                      parameters.postcopy_fault_threads,
+                      DEFAULT_MIGRATE_POSTCOPY_FAULT_THREADS),
+    DEFINE_PROP_STRING("multifd-dedup-template", MigrationState,
+                       parameters.multifd_dedup_template),
+    DEFINE_PROP_SIZE("multifd-dedup-cache-size", MigrationState,
+                     parameters.multifd_dedup_cache_size,
+                     DEFAULT_MIGRATE_MULTIFD_DEDUP_CACHE_SIZE),
 
     /* Migration capabilities */
     DEFINE_PROP_MIG_CAP("x-xbzrle", MIGRATION_CAPABILITY_XBZRLE),
@@ -186,6 +202,12 @@ Property migration_properties[] = {
                         MIGRATION_CAPABILITY_SWITCHOVER_ACK),
     DEFINE_PROP_MIG_CAP("x-dirty-limit", MIGRATION_CAPABILITY_DIRTY_LIMIT),
     DEFINE_PROP_MIG_CAP("mapped-ram", MIGRATION_CAPABILITY_MAPPED_RAM),
+    DEFINE_PROP_MIG_CAP("lazy-restore", MIGRATION_CAPABILITY_LAZY_RESTORE),
+    DEFINE_PROP_MIG_CAP("incremental-checkpoint",
+                        MIGRATION_CAPABILITY_INCREMENTAL_CHECKPOINT),
+    DEFINE_PROP_MIG_CAP("multifd-device-state",
+                        MIGRATION_CAPABILITY_MULTIFD_DEVICE_STATE),
+    DEFINE_PROP_MIG_CAP("auto-strategy", MIGRATION_CAPABILITY_AUTO_STRATEGY),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -196,6 +218,13 @@ bool migrate_auto_converge(void)
     return s->capabilities[MIGRATION_CAPABILITY_AUTO_CONVERGE];
 }
 
+bool migrate_auto_strategy(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_AUTO_STRATEGY];
+}
+
 bool migrate_background_snapshot(void)
 {
     MigrationState *s = migrate_get_current();
@@ -231,6 +260,20 @@ bool migrate_events(void)
     return s->capabilities[MIGRATION_CAPABILITY_EVENTS];
 }
 
+bool migrate_incremental_checkpoint(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_INCREMENTAL_CHECKPOINT];
+}
+
+bool migrate_lazy_restore(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_LAZY_RESTORE];
+}
+
 bool migrate_mapped_ram(void)
 {
     MigrationState *s = migrate_get_current();
@@ -259,6 +302,13 @@ bool migrate_multifd(void)
     return s->capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_multifd_device_state(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->capabilities[MIGRATION_CAPABILITY_MULTIFD_DEVICE_STATE];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s = migrate_get_current();
@@ -571,6 +621,15 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_AUTO_STRATEGY]) {
+        if (new_caps[MIGRATION_CAPABILITY_AUTO_CONVERGE] ||
+            new_caps[MIGRATION_CAPABILITY_DIRTY_LIMIT]) {
+            error_setg(errp, "auto-strategy conflicts with auto-converge"
+                       " and dirty-limit");
+            return false;
+        }
+    }
+
     if (new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
         if (new_caps[MIGRATION_CAPABILITY_XBZRLE]) {
             error_setg(errp, "Multifd is not compatible with xbzrle");
@@ -592,6 +651,64 @@ bool migrate_caps_check(bool *old_caps, bool *new_caps, Error **errp)
         }
     }
 
+    if (new_caps[MIGRATION_CAPABILITY_MULTIFD_DEVICE_STATE]) {
+        if (!new_caps[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "Multifd device state requires multifd");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "Multifd device state is not compatible "
+                       "with mapped-ram");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "Multifd device state is not compatible "
+                       "with postcopy");
+            return false;
+        }
+    }
+
+    if (new_caps[MIGRATION_CAPABILITY_INCREMENTAL_CHECKPOINT]) {
+        if (!new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "Incremental checkpoints require mapped-ram");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
+            error_setg(errp, "Incremental checkpoints are not compatible "
+                       "with background-snapshot");
+            return false;
+        }
+    }
+
+    if (new_caps[MIGRATION_CAPABILITY_LAZY_RESTORE]) {
+        if (!new_caps[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "Lazy restore requires mapped-ram");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_X_COLO]) {
+            error_setg(errp, "Lazy restore is not compatible with x-colo");
+            return false;
+        }
+
+        if (new_caps[MIGRATION_CAPABILITY_X_IGNORE_SHARED]) {
+            error_setg(errp,
+                       "Lazy restore is not compatible with ignore-shared");
+            return false;
+        }
+
+        /* Like postcopy, this needs userfaultfd on the destination */
+        if (!old_caps[MIGRATION_CAPABILITY_LAZY_RESTORE] &&
+            runstate_check(RUN_STATE_INMIGRATE) &&
+            !postcopy_ram_supported_by_host(mis, errp)) {
+            error_prepend(errp, "Lazy restore is not supported: ");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -765,6 +882,13 @@ MigMode migrate_mode(void)
     return mode;
 }
 
+int migrate_dirty_sync_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.dirty_sync_threads;
+}
+
 int migrate_multifd_channels(void)
 {
     MigrationState *s = migrate_get_current();
@@ -780,6 +904,20 @@ MultiFDCompression migrate_multifd_compression(void)
     return s->parameters.multifd_compression;
 }
 
+uint64_t migrate_multifd_dedup_cache_size(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.multifd_dedup_cache_size;
+}
+
+const char *migrate_multifd_dedup_template(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.multifd_dedup_template;
+}
+
 int migrate_multifd_zlib_level(void)
 {
     MigrationState *s = migrate_get_current();
@@ -794,6 +932,13 @@ int migrate_multifd_zstd_level(void)
     return s->parameters.multifd_zstd_level;
 }
 
+int migrate_postcopy_fault_threads(void)
+{
+    MigrationState *s = migrate_get_current();
+
+    return s->parameters.postcopy_fault_threads;
+}
+
 uint8_t migrate_throttle_trigger_threshold(void)
 {
     MigrationState *s = migrate_get_current();
@@ -926,6 +1071,15 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->zero_page_detection = s->parameters.zero_page_detection;
     params->has_direct_io = true;
     params->direct_io = s->parameters.direct_io;
+    params->has_dirty_sync_threads = true;
+    params->dirty_sync_threads = s->parameters.dirty_sync_threads;
+    params->has_postcopy_fault_threads = true;
+    params->postcopy_fault_threads = s->parameters.postcopy_fault_threads;
+    params->multifd_dedup_template =
+        g_strdup(s->parameters.multifd_dedup_template ?
+                 s->parameters.multifd_dedup_template : "");
+    params->has_multifd_dedup_cache_size = true;
+    params->multifd_dedup_cache_size = s->parameters.multifd_dedup_cache_size;
 
     return params;
 }
@@ -959,6 +1113,9 @@ void migrate_params_init(MigrationParameters *params)
     params->has_mode = true;
     params->has_zero_page_detection = true;
     params->has_direct_io = true;
+    params->has_dirty_sync_threads = true;
+    params->has_postcopy_fault_threads = true;
+    params->has_multifd_dedup_cache_size = true;
 }
 
 /*
@@ -1137,6 +1294,21 @@ bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_dirty_sync_threads && (params->dirty_sync_threads < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "dirty_sync_threads",
+                   "a value between 1 and 255");
+        return false;
+    }
+
+    if (params->has_postcopy_fault_threads &&
+        (params->postcopy_fault_threads < 1)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_fault_threads",
+                   "a value between 1 and 255");
+        return false;
+    }
+
     return true;
 }
 
@@ -1247,6 +1419,22 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_direct_io) {
         dest->direct_io = params->direct_io;
     }
+
+    if (params->has_dirty_sync_threads) {
+        dest->dirty_sync_threads = params->dirty_sync_threads;
+    }
+
+    if (params->has_postcopy_fault_threads) {
+        dest->postcopy_fault_threads = params->postcopy_fault_threads;
+    }
+
+    if (params->multifd_dedup_template) {
+        dest->multifd_dedup_template = params->multifd_dedup_template;
+    }
+
+    if (params->has_multifd_dedup_cache_size) {
+        dest->multifd_dedup_cache_size = params->multifd_dedup_cache_size;
+    }
 }
 
 static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
@@ -1376,6 +1564,25 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_direct_io) {
         s->parameters.direct_io = params->direct_io;
     }
+
+    if (params->has_dirty_sync_threads) {
+        s->parameters.dirty_sync_threads = params->dirty_sync_threads;
+    }
+
+    if (params->has_postcopy_fault_threads) {
+        s->parameters.postcopy_fault_threads = params->postcopy_fault_threads;
+    }
+
+    if (params->multifd_dedup_template) {
+        g_free(s->parameters.multifd_dedup_template);
+        s->parameters.multifd_dedup_template =
+            g_strdup(params->multifd_dedup_template);
+    }
+
+    if (params->has_multifd_dedup_cache_size) {
+        s->parameters.multifd_dedup_cache_size =
+            params->multifd_dedup_cache_size;
+    }
 }
 
 void qmp_migrate_set_parameters(MigrateSetParameters *params, Error **errp)
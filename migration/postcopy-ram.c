@@ -17,6 +17,7 @@
  */
 
 #include "qemu/osdep.h"
+#include "qemu/host-utils.h"
 #include "qemu/madvise.h"
 #include "exec/target_page.h"
 #include "migration.h"
@@ -38,6 +39,7 @@
 #include "qemu/userfaultfd.h"
 #include "qemu/mmap-alloc.h"
 #include "options.h"
+#include "lazy-restore.h"
 
 /* Arbitrary limit on size of each discard command,
  * keeps them around ~200 bytes
@@ -174,10 +176,31 @@ static uint32List *get_vcpu_blocktime_list(PostcopyBlocktimeContext *ctx)
     return list;
 }
 
+static void fill_postcopy_fault_latency(MigrationInfo *info)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    uint64List **tail = &info->postcopy_fault_latency_histogram;
+    uint64_t counts[POSTCOPY_FAULT_LATENCY_BUCKETS];
+    uint64_t requests = 0;
+
+    for (int i = 0; i < POSTCOPY_FAULT_LATENCY_BUCKETS; i++) {
+        counts[i] = stat64_get(&mis->postcopy_fault_latency[i]);
+        requests += counts[i];
+    }
+    if (!requests) {
+        return;
+    }
+
+    info->has_postcopy_fault_latency_histogram = true;
+    for (int i = 0; i < POSTCOPY_FAULT_LATENCY_BUCKETS; i++) {
+        QAPI_LIST_APPEND(tail, counts[i]);
+    }
+}
+
 /*
  * This function just populates MigrationInfo from postcopy's
- * blocktime context. It will not populate MigrationInfo,
- * unless postcopy-blocktime capability was set.
+ * blocktime context and page request latencies.  The blocktime
+ * is only populated if the postcopy-blocktime capability was set.
  *
  * @info: pointer to MigrationInfo to populate
  */
@@ -186,6 +209,8 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
     MigrationIncomingState *mis = migration_incoming_get_current();
     PostcopyBlocktimeContext *bc = mis->blocktime_ctx;
 
+    fill_postcopy_fault_latency(info);
+
     if (!bc) {
         return;
     }
@@ -310,6 +335,12 @@ static bool ufd_check_and_apply(int ufd, MigrationIncomingState *mis,
     }
 #endif
 
+#ifdef UFFD_FEATURE_MINOR_SHMEM
+    /* Allows placing pages of shared memory with UFFDIO_CONTINUE */
+    asked_features |= supported_features & (UFFD_FEATURE_MINOR_HUGETLBFS |
+                                            UFFD_FEATURE_MINOR_SHMEM);
+#endif
+
     /*
      * request features, even if asked_features is 0, due to
      * kernel expects UFFD_API before UFFDIO_REGISTER, per
@@ -319,6 +350,7 @@ static bool ufd_check_and_apply(int ufd, MigrationIncomingState *mis,
         error_setg(errp, "Failed features %" PRIu64, asked_features);
         return false;
     }
+    mis->userfault_features = asked_features;
 
     if (qemu_real_host_page_size() != ram_pagesize_summary()) {
         bool have_hp = false;
@@ -547,6 +579,11 @@ static int cleanup_range(RAMBlock *rb, void *opaque)
         return -1;
     }
 
+    if (rb->postcopy_alias) {
+        munmap(rb->postcopy_alias, ROUND_UP(length, rb->page_size));
+        rb->postcopy_alias = NULL;
+    }
+
     return 0;
 }
 
@@ -635,6 +672,12 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         postcopy_fault_thread_notify(mis);
         trace_postcopy_ram_incoming_cleanup_join();
         qemu_thread_join(&mis->fault_thread);
+        for (unsigned int i = 0; i < mis->fault_helper_count; i++) {
+            qemu_thread_join(&mis->fault_helper_threads[i]);
+        }
+        g_free(mis->fault_helper_threads);
+        mis->fault_helper_threads = NULL;
+        mis->fault_helper_count = 0;
 
         if (postcopy_notify(POSTCOPY_NOTIFY_INBOUND_END, &local_err)) {
             error_report_err(local_err);
@@ -707,6 +750,30 @@ int postcopy_ram_prepare_discard(MigrationIncomingState *mis)
     return 0;
 }
 
+/*
+ * Whether the pages of @rb can be written to its backing file before they
+ * are mapped into the guest with UFFDIO_CONTINUE.  This avoids assembling
+ * huge pages in a temporary buffer and copying them again with UFFDIO_COPY,
+ * and the target pages of a huge page land in place as they arrive.
+ */
+static bool ram_block_can_stream(MigrationIncomingState *mis, RAMBlock *rb)
+{
+#ifdef UFFD_FEATURE_MINOR_SHMEM
+    uint64_t feature;
+
+    /* lazy-restore places the pages from its own buffers */
+    if (migrate_lazy_restore() || rb->fd < 0 || !qemu_ram_is_shared(rb)) {
+        return false;
+    }
+
+    feature = rb->page_size > qemu_real_host_page_size() ?
+              UFFD_FEATURE_MINOR_HUGETLBFS : UFFD_FEATURE_MINOR_SHMEM;
+    return mis->userfault_features & feature;
+#else
+    return false;
+#endif
+}
+
 /*
  * Mark the given area of RAM as requiring notification to unwritten areas
  * Used as a  callback on foreach_not_ignored_block.
@@ -720,13 +787,28 @@ static int ram_block_enable_notify(RAMBlock *rb, void *opaque)
 {
     MigrationIncomingState *mis = opaque;
     struct uffdio_register reg_struct;
+    bool stream = ram_block_can_stream(mis, rb);
 
     reg_struct.range.start = (uintptr_t)qemu_ram_get_host_addr(rb);
     reg_struct.range.len = rb->postcopy_length;
     reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
 
+    /*
+     * Also catch the accesses to pages that are in the page cache but not
+     * mapped yet, i.e. partially received through the alias mapping.
+     * Fall back to UFFDIO_COPY if the backing file doesn't support it.
+     */
+    if (stream) {
+        reg_struct.mode |= UFFDIO_REGISTER_MODE_MINOR;
+        if (ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg_struct) ||
+            !(reg_struct.ioctls & (1ULL << _UFFDIO_CONTINUE))) {
+            stream = false;
+            reg_struct.mode = UFFDIO_REGISTER_MODE_MISSING;
+        }
+    }
+
     /* Now tell our userfault_fd that it's responsible for this area */
-    if (ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
+    if (!stream && ioctl(mis->userfault_fd, UFFDIO_REGISTER, &reg_struct)) {
         error_report("%s userfault register: %s", __func__, strerror(errno));
         return -1;
     }
@@ -738,6 +820,19 @@ static int ram_block_enable_notify(RAMBlock *rb, void *opaque)
         qemu_ram_set_uf_zeroable(rb);
     }
 
+    if (stream) {
+        void *alias = mmap(NULL, ROUND_UP(rb->postcopy_length, rb->page_size),
+                           PROT_READ | PROT_WRITE, MAP_SHARED, rb->fd,
+                           rb->fd_offset);
+
+        /* Minor faults can't happen unless pages are written to the alias */
+        if (alias != MAP_FAILED) {
+            rb->postcopy_alias = alias;
+        }
+        trace_postcopy_ram_enable_stream(qemu_ram_get_idstr(rb),
+                                         alias != MAP_FAILED);
+    }
+
     return 0;
 }
 
@@ -780,6 +875,11 @@ static int postcopy_request_page(MigrationIncomingState *mis, RAMBlock *rb,
         return received ? 0 : postcopy_place_page_zero(mis, aligned, rb);
     }
 
+    if (migrate_lazy_restore()) {
+        /* The page is loaded from the migration file instead */
+        return lazy_restore_request_page(mis, rb, start);
+    }
+
     return migrate_send_rp_req_pages(mis, rb, start, haddr);
 }
 
@@ -958,6 +1058,116 @@ static void postcopy_pause_fault_thread(MigrationIncomingState *mis)
     trace_postcopy_pause_fault_thread_continued();
 }
 
+/*
+ * Consume a wakeup of the fault threads
+ * Returns true if the fault thread should quit
+ */
+static bool postcopy_ram_fault_event(MigrationIncomingState *mis)
+{
+    uint64_t tmp64 = 0;
+
+    /* Consume the signal */
+    if (read(mis->userfault_event_fd, &tmp64, 8) != 8) {
+        /* Nothing obviously nicer than posting this error. */
+        error_report("%s: read() failed", __func__);
+    }
+
+    if (qatomic_read(&mis->fault_thread_quit)) {
+        trace_postcopy_ram_fault_thread_quit();
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Read a fault from the userfaultfd and request the page.  The userfaultfd
+ * is non-blocking and shared by all the fault threads.
+ * Returns 0 on success, -1 if the fault thread should quit
+ */
+static int postcopy_ram_fault_read(MigrationIncomingState *mis)
+{
+    struct uffd_msg msg;
+    ram_addr_t rb_offset;
+    RAMBlock *rb;
+    int ret;
+
+    ret = read(mis->userfault_fd, &msg, sizeof(msg));
+    if (ret != sizeof(msg)) {
+        if (errno == EAGAIN) {
+            /*
+             * if a wake up happens on the other thread just after
+             * the poll, there is nothing to read.
+             */
+            return 0;
+        }
+        if (ret < 0) {
+            error_report("%s: Failed to read full userfault "
+                         "message: %s",
+                         __func__, strerror(errno));
+            return -1;
+        } else {
+            error_report("%s: Read %d bytes from userfaultfd "
+                         "expected %zd",
+                         __func__, ret, sizeof(msg));
+            return -1; /* Lost alignment, don't know what we'd read next */
+        }
+    }
+    if (msg.event != UFFD_EVENT_PAGEFAULT) {
+        error_report("%s: Read unexpected event %ud from userfaultfd",
+                     __func__, msg.event);
+        return 0; /* It's not a page fault, shouldn't happen */
+    }
+
+    rb = qemu_ram_block_from_host(
+             (void *)(uintptr_t)msg.arg.pagefault.address,
+             true, &rb_offset);
+    if (!rb) {
+        error_report("postcopy_ram_fault_thread: Fault outside guest: %"
+                     PRIx64, (uint64_t)msg.arg.pagefault.address);
+        return -1;
+    }
+
+    rb_offset = ROUND_DOWN(rb_offset, qemu_ram_pagesize(rb));
+    trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
+                                        qemu_ram_get_idstr(rb),
+                                        rb_offset,
+                                        msg.arg.pagefault.feat.ptid);
+    mark_postcopy_blocktime_begin(
+            (uintptr_t)(msg.arg.pagefault.address),
+                        msg.arg.pagefault.feat.ptid, rb);
+
+    if ((msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_MINOR) &&
+        ramblock_recv_bitmap_test_byte_offset(rb, rb_offset)) {
+        /*
+         * The page was placed with UFFDIO_CONTINUE, but isn't mapped: the
+         * fault raced with the placement, or the kernel has dropped the page
+         * table entry since.  Nothing more will arrive for it, so map it
+         * again instead of asking the source.
+         */
+        trace_postcopy_ram_fault_thread_continue(msg.arg.pagefault.address,
+                                                 qemu_ram_get_idstr(rb),
+                                                 rb_offset);
+        uffd_continue_page(mis->userfault_fd,
+                           (uint8_t *)qemu_ram_get_host_addr(rb) + rb_offset,
+                           qemu_ram_pagesize(rb));
+        return 0;
+    }
+
+retry:
+    /*
+     * Send the request to the source - we want to request one
+     * of our host page sizes (which is >= TPS)
+     */
+    ret = postcopy_request_page(mis, rb, rb_offset,
+                                msg.arg.pagefault.address);
+    if (ret) {
+        /* May be network failure, try to wait for recovery */
+        postcopy_pause_fault_thread(mis);
+        goto retry;
+    }
+    return 0;
+}
+
 /*
  * Handle faults detected by the USERFAULT markings
  */
@@ -967,7 +1177,6 @@ static void *postcopy_ram_fault_thread(void *opaque)
     struct uffd_msg msg;
     int ret;
     size_t index;
-    RAMBlock *rb = NULL;
 
     trace_postcopy_ram_fault_thread_entry();
     rcu_register_thread();
@@ -994,7 +1203,6 @@ static void *postcopy_ram_fault_thread(void *opaque)
     }
 
     while (true) {
-        ram_addr_t rb_offset;
         int poll_result;
 
         /*
@@ -1009,7 +1217,7 @@ static void *postcopy_ram_fault_thread(void *opaque)
             break;
         }
 
-        if (!mis->to_src_file) {
+        if (!mis->to_src_file && !migrate_lazy_restore()) {
             /*
              * Possibly someone tells us that the return path is
              * broken already using the event. We should hold until
@@ -1018,80 +1226,15 @@ static void *postcopy_ram_fault_thread(void *opaque)
             postcopy_pause_fault_thread(mis);
         }
 
-        if (pfd[1].revents) {
-            uint64_t tmp64 = 0;
-
-            /* Consume the signal */
-            if (read(mis->userfault_event_fd, &tmp64, 8) != 8) {
-                /* Nothing obviously nicer than posting this error. */
-                error_report("%s: read() failed", __func__);
-            }
-
-            if (qatomic_read(&mis->fault_thread_quit)) {
-                trace_postcopy_ram_fault_thread_quit();
-                break;
-            }
+        if (pfd[1].revents && postcopy_ram_fault_event(mis)) {
+            break;
         }
 
         if (pfd[0].revents) {
             poll_result--;
-            ret = read(mis->userfault_fd, &msg, sizeof(msg));
-            if (ret != sizeof(msg)) {
-                if (errno == EAGAIN) {
-                    /*
-                     * if a wake up happens on the other thread just after
-                     * the poll, there is nothing to read.
-                     */
-                    continue;
-                }
-                if (ret < 0) {
-                    error_report("%s: Failed to read full userfault "
-                                 "message: %s",
-                                 __func__, strerror(errno));
-                    break;
-                } else {
-                    error_report("%s: Read %d bytes from userfaultfd "
-                                 "expected %zd",
-                                 __func__, ret, sizeof(msg));
-                    break; /* Lost alignment, don't know what we'd read next */
-                }
-            }
-            if (msg.event != UFFD_EVENT_PAGEFAULT) {
-                error_report("%s: Read unexpected event %ud from userfaultfd",
-                             __func__, msg.event);
-                continue; /* It's not a page fault, shouldn't happen */
-            }
-
-            rb = qemu_ram_block_from_host(
-                     (void *)(uintptr_t)msg.arg.pagefault.address,
-                     true, &rb_offset);
-            if (!rb) {
-                error_report("postcopy_ram_fault_thread: Fault outside guest: %"
-                             PRIx64, (uint64_t)msg.arg.pagefault.address);
+            if (postcopy_ram_fault_read(mis)) {
                 break;
             }
-
-            rb_offset = ROUND_DOWN(rb_offset, qemu_ram_pagesize(rb));
-            trace_postcopy_ram_fault_thread_request(msg.arg.pagefault.address,
-                                                qemu_ram_get_idstr(rb),
-                                                rb_offset,
-                                                msg.arg.pagefault.feat.ptid);
-            mark_postcopy_blocktime_begin(
-                    (uintptr_t)(msg.arg.pagefault.address),
-                                msg.arg.pagefault.feat.ptid, rb);
-
-retry:
-            /*
-             * Send the request to the source - we want to request one
-             * of our host page sizes (which is >= TPS)
-             */
-            ret = postcopy_request_page(mis, rb, rb_offset,
-                                        msg.arg.pagefault.address);
-            if (ret) {
-                /* May be network failure, try to wait for recovery */
-                postcopy_pause_fault_thread(mis);
-                goto retry;
-            }
         }
 
         /* Now handle any requests from external processes on shared memory */
@@ -1156,6 +1299,67 @@ retry:
     return NULL;
 }
 
+/*
+ * Additional thread handling faults on the guest RAM, see the
+ * postcopy-fault-threads parameter.  Faults from other processes
+ * sharing the memory are left to postcopy_ram_fault_thread().
+ */
+static void *postcopy_ram_fault_helper_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    struct pollfd pfd[2] = {
+        { .fd = mis->userfault_fd, .events = POLLIN },
+        { .fd = mis->userfault_event_fd, .events = POLLIN },
+    };
+
+    trace_postcopy_ram_fault_helper_thread_entry();
+    rcu_register_thread();
+    qemu_sem_post(&mis->thread_sync_sem);
+
+    while (true) {
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) == -1) {
+            error_report("%s: userfault poll: %s", __func__, strerror(errno));
+            break;
+        }
+
+        if (!mis->to_src_file) {
+            postcopy_pause_fault_thread(mis);
+        }
+
+        if (pfd[1].revents && postcopy_ram_fault_event(mis)) {
+            break;
+        }
+
+        if (pfd[0].revents && postcopy_ram_fault_read(mis)) {
+            break;
+        }
+    }
+
+    rcu_unregister_thread();
+    trace_postcopy_ram_fault_helper_thread_exit();
+    return NULL;
+}
+
+static void postcopy_fault_helpers_create(MigrationIncomingState *mis)
+{
+    unsigned int count = migrate_postcopy_fault_threads() - 1;
+
+    /* lazy-restore reads the faulting pages into a single buffer */
+    if (migrate_lazy_restore()) {
+        count = 0;
+    }
+
+    mis->fault_helper_threads = g_new0(QemuThread, count);
+    for (unsigned int i = 0; i < count; i++) {
+        g_autofree char *name = g_strdup_printf("mig/dst/fault%u", i + 1);
+
+        postcopy_thread_create(mis, &mis->fault_helper_threads[i], name,
+                               postcopy_ram_fault_helper_thread,
+                               QEMU_THREAD_JOINABLE);
+        mis->fault_helper_count++;
+    }
+}
+
 static int postcopy_temp_pages_setup(MigrationIncomingState *mis)
 {
     PostcopyTmpPage *tmp_page;
@@ -1229,8 +1433,11 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
-    /* Now an eventfd we use to tell the fault-thread to quit */
-    mis->userfault_event_fd = eventfd(0, EFD_CLOEXEC);
+    /*
+     * Now an eventfd we use to tell the fault-threads to quit, each of
+     * them consumes one count
+     */
+    mis->userfault_event_fd = eventfd(0, EFD_CLOEXEC | EFD_SEMAPHORE);
     if (mis->userfault_event_fd == -1) {
         error_report("%s: Opening userfault_event_fd: %s", __func__,
                      strerror(errno));
@@ -1238,9 +1445,14 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
         return -1;
     }
 
+    for (int i = 0; i < POSTCOPY_FAULT_LATENCY_BUCKETS; i++) {
+        stat64_set(&mis->postcopy_fault_latency[i], 0);
+    }
+
     postcopy_thread_create(mis, &mis->fault_thread, "mig/dst/fault",
                            postcopy_ram_fault_thread, QEMU_THREAD_JOINABLE);
     mis->have_fault_thread = true;
+    postcopy_fault_helpers_create(mis);
 
     /* Mark so that we get notified of accesses to unwritten areas */
     if (foreach_not_ignored_block(ram_block_enable_notify, mis)) {
@@ -1268,6 +1480,60 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     return 0;
 }
 
+static void postcopy_fault_latency_update(MigrationIncomingState *mis,
+                                          uintptr_t request_us)
+{
+    /*
+     * The request time lost its upper bits on 32-bit hosts, and the lowest
+     * one is always set; see migrate_send_rp_req_pages().
+     */
+    uintptr_t latency_us = (uintptr_t)qemu_clock_get_us(QEMU_CLOCK_REALTIME) -
+                           (request_us & ~(uintptr_t)1);
+    unsigned bucket = MIN(64 - clz64(latency_us),
+                          POSTCOPY_FAULT_LATENCY_BUCKETS - 1);
+
+    stat64_add(&mis->postcopy_fault_latency[bucket], 1);
+}
+
+/*
+ * Book-keeping after the host page at (host_addr) has been placed and
+ * the threads that faulted on it have been woken up.
+ */
+static void postcopy_page_placed(MigrationIncomingState *mis, void *host_addr,
+                                 uint64_t pagesize, RAMBlock *rb)
+{
+    gpointer request_us;
+
+    qemu_mutex_lock(&mis->page_request_mutex);
+    ramblock_recv_bitmap_set_range(rb, host_addr,
+                                   pagesize / qemu_target_page_size());
+    /*
+     * If this page resolves a page fault for a previous recorded faulted
+     * address, take a special note to maintain the requested page list.
+     */
+    request_us = g_tree_lookup(mis->page_requested, host_addr);
+    if (request_us) {
+        postcopy_fault_latency_update(mis, (uintptr_t)request_us);
+        g_tree_remove(mis->page_requested, host_addr);
+        int left_pages = qatomic_dec_fetch(&mis->page_requested_count);
+
+        trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
+        /* Order the update of count and read of preempt status */
+        smp_mb();
+        if (mis->preempt_thread_status == PREEMPT_THREAD_QUIT &&
+            left_pages == 0) {
+            /*
+             * This probably means the main thread is waiting for us.
+             * Notify that we've finished receiving the last requested
+             * page.
+             */
+            qemu_cond_signal(&mis->page_request_cond);
+        }
+    }
+    qemu_mutex_unlock(&mis->page_request_mutex);
+    mark_postcopy_blocktime_end((uintptr_t)host_addr);
+}
+
 static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
                                void *from_addr, uint64_t pagesize, RAMBlock *rb)
 {
@@ -1289,32 +1555,7 @@ static int qemu_ufd_copy_ioctl(MigrationIncomingState *mis, void *host_addr,
         ret = ioctl(userfault_fd, UFFDIO_ZEROPAGE, &zero_struct);
     }
     if (!ret) {
-        qemu_mutex_lock(&mis->page_request_mutex);
-        ramblock_recv_bitmap_set_range(rb, host_addr,
-                                       pagesize / qemu_target_page_size());
-        /*
-         * If this page resolves a page fault for a previous recorded faulted
-         * address, take a special note to maintain the requested page list.
-         */
-        if (g_tree_lookup(mis->page_requested, host_addr)) {
-            g_tree_remove(mis->page_requested, host_addr);
-            int left_pages = qatomic_dec_fetch(&mis->page_requested_count);
-
-            trace_postcopy_page_req_del(host_addr, mis->page_requested_count);
-            /* Order the update of count and read of preempt status */
-            smp_mb();
-            if (mis->preempt_thread_status == PREEMPT_THREAD_QUIT &&
-                left_pages == 0) {
-                /*
-                 * This probably means the main thread is waiting for us.
-                 * Notify that we've finished receiving the last requested
-                 * page.
-                 */
-                qemu_cond_signal(&mis->page_request_cond);
-            }
-        }
-        qemu_mutex_unlock(&mis->page_request_mutex);
-        mark_postcopy_blocktime_end((uintptr_t)host_addr);
+        postcopy_page_placed(mis, host_addr, pagesize, rb);
     }
     return ret;
 }
@@ -1391,6 +1632,47 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     }
 }
 
+void *postcopy_ram_stream_host(MigrationIncomingState *mis, RAMBlock *rb)
+{
+    /*
+     * The userfaultfds of other processes sharing the memory only catch
+     * missing pages, so they would see partially received host pages.
+     */
+    if (mis->postcopy_remote_fds->len) {
+        return NULL;
+    }
+    return rb->postcopy_alias;
+}
+
+/*
+ * Map the host page at (host), whose content was written through the
+ * alias mapping of the RAM block, atomically
+ * returns 0 on success
+ */
+int postcopy_place_page_continue(MigrationIncomingState *mis, void *host,
+                                 RAMBlock *rb)
+{
+    size_t pagesize = qemu_ram_pagesize(rb);
+    struct uffdio_continue cont_struct = {
+        .range.start = (uint64_t)(uintptr_t)host,
+        .range.len = pagesize,
+        .mode = 0,
+    };
+
+    if (ioctl(mis->userfault_fd, UFFDIO_CONTINUE, &cont_struct)) {
+        int e = errno;
+        error_report("%s: %s continue host: %p (size: %zd)",
+                     __func__, strerror(e), host, pagesize);
+
+        return -e;
+    }
+    postcopy_page_placed(mis, host, pagesize, rb);
+
+    trace_postcopy_place_page_continue(host);
+    return postcopy_notify_shared_wake(rb,
+                                       qemu_ram_block_host_offset(rb, host));
+}
+
 #else
 /* No target OS support, stubs just fail */
 void fill_destination_postcopy_migration_info(MigrationInfo *info)
@@ -1448,6 +1730,18 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     return -1;
 }
 
+void *postcopy_ram_stream_host(MigrationIncomingState *mis, RAMBlock *rb)
+{
+    return NULL;
+}
+
+int postcopy_place_page_continue(MigrationIncomingState *mis, void *host,
+                                 RAMBlock *rb)
+{
+    assert(0);
+    return -1;
+}
+
 int postcopy_wake_shared(struct PostCopyFD *pcfd,
                          uint64_t client_addr,
                          RAMBlock *rb)
@@ -1471,11 +1765,11 @@ void postcopy_temp_page_reset(PostcopyTmpPage *tmp_page)
 
 void postcopy_fault_thread_notify(MigrationIncomingState *mis)
 {
-    uint64_t tmp64 = 1;
+    uint64_t tmp64 = 1 + mis->fault_helper_count;
 
     /*
-     * Wakeup the fault_thread.  It's an eventfd that should currently
-     * be at 0, we're going to increment it to 1
+     * Wakeup the fault threads.  It's a semaphore eventfd that should
+     * currently be at 0, we're going to increment it once per thread
      */
     if (write(mis->userfault_event_fd, &tmp64, 8) != 8) {
         /* Not much we can do here, but may as well report it */
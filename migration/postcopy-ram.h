@@ -15,6 +15,9 @@
 
 #include "qapi/qapi-types-migration.h"
 
+/* Number of buckets of the histogram of the page request latencies */
+#define POSTCOPY_FAULT_LATENCY_BUCKETS 24
+
 /* Return true if the host supports everything we need to do postcopy-ram */
 bool postcopy_ram_supported_by_host(MigrationIncomingState *mis,
                                     Error **errp);
@@ -81,6 +84,20 @@ int postcopy_place_page(MigrationIncomingState *mis, void *host, void *from,
 int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
                              RAMBlock *rb);
 
+/*
+ * Returns where the pages of @rb can be written before the host page is
+ * placed with postcopy_place_page_continue(), or NULL if the pages must
+ * be assembled in a temporary page and placed with postcopy_place_page().
+ */
+void *postcopy_ram_stream_host(MigrationIncomingState *mis, RAMBlock *rb);
+
+/*
+ * Map a host page written through postcopy_ram_stream_host() at (host)
+ * returns 0 on success
+ */
+int postcopy_place_page_continue(MigrationIncomingState *mis, void *host,
+                                 RAMBlock *rb);
+
 /* The current postcopy state is read/set by postcopy_state_get/set
  * which update it atomically.
  * The state is updated as postcopy messages are received, and
@@ -40,6 +40,8 @@
 #include "migration/misc.h"
 #include "qemu-file.h"
 #include "postcopy-ram.h"
+#include "lazy-restore.h"
+#include "file.h"
 #include "page_cache.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
@@ -66,6 +68,7 @@
 
 #if defined(__linux__)
 #include "qemu/userfaultfd.h"
+#include "io/channel-file.h"
 #endif /* defined(__linux__) */
 
 /***********************************************************/
@@ -351,6 +354,33 @@ struct RAMSrcPageRequest {
     QSIMPLEQ_ENTRY(RAMSrcPageRequest) next_req;
 };
 
+/* Size of the parts of a RAMBlock that are synchronized in parallel */
+#define DIRTY_SYNC_CHUNK_SIZE (1ULL << 30)
+
+/* A part of a RAMBlock whose dirty bitmap is synchronized by one thread */
+typedef struct {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+} DirtySyncChunk;
+
+/* Threads that help the migration thread to synchronize the dirty bitmap */
+typedef struct {
+    QemuThread *threads;
+    int nb_threads;
+    /* Posted once per thread for each synchronization */
+    QemuSemaphore sem;
+    /* Posted by each thread when it is done */
+    QemuSemaphore done_sem;
+    /* Chunks of the current synchronization */
+    GArray *chunks;
+    /* Index of the next chunk to synchronize */
+    unsigned next_chunk;
+    /* Pages that were newly dirtied, for all threads */
+    Stat64 new_dirty_pages;
+    bool quit;
+} DirtySyncThreads;
+
 /* State of RAM for migration */
 struct RAMState {
     /*
@@ -414,6 +444,8 @@ struct RAMState {
      * RAM migration.
      */
     unsigned int postcopy_bmap_sync_requested;
+    /* NULL unless the dirty-sync-threads parameter is larger than 1 */
+    DirtySyncThreads *dirty_sync;
 };
 typedef struct RAMState RAMState;
 
@@ -922,6 +954,158 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * Splits @rb into chunks.  Two chunks never share a word of the dirty
+ * bitmaps, so that they can be synchronized in parallel.
+ */
+static void dirty_sync_add_chunks(GArray *chunks, RAMBlock *rb)
+{
+    bool split = !((rb->offset >> TARGET_PAGE_BITS) % BITS_PER_LONG);
+    ram_addr_t start = 0;
+
+    while (start < rb->used_length) {
+        DirtySyncChunk chunk = {
+            .block = rb,
+            .start = start,
+            .length = rb->used_length - start,
+        };
+
+        if (split) {
+            chunk.length = MIN(chunk.length, DIRTY_SYNC_CHUNK_SIZE);
+        }
+        g_array_append_val(chunks, chunk);
+        start += chunk.length;
+    }
+}
+
+static void dirty_sync_run(DirtySyncThreads *ds)
+{
+    uint64_t new_dirty_pages = 0;
+    unsigned i;
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        while ((i = qatomic_fetch_inc(&ds->next_chunk)) < ds->chunks->len) {
+            DirtySyncChunk *chunk = &g_array_index(ds->chunks,
+                                                   DirtySyncChunk, i);
+
+            new_dirty_pages +=
+                cpu_physical_memory_sync_dirty_bitmap(chunk->block,
+                                                      chunk->start,
+                                                      chunk->length);
+        }
+    }
+
+    stat64_add(&ds->new_dirty_pages, new_dirty_pages);
+}
+
+static void *dirty_sync_thread(void *opaque)
+{
+    DirtySyncThreads *ds = opaque;
+
+    rcu_register_thread();
+
+    while (true) {
+        qemu_sem_wait(&ds->sem);
+        if (qatomic_read(&ds->quit)) {
+            break;
+        }
+        dirty_sync_run(ds);
+        qemu_sem_post(&ds->done_sem);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Called with RCU critical section and bitmap_mutex held */
+static void migration_bitmap_sync_parallel(RAMState *rs)
+{
+    DirtySyncThreads *ds = rs->dirty_sync;
+    uint64_t new_dirty_pages;
+    RAMBlock *block;
+    int i;
+
+    g_array_set_size(ds->chunks, 0);
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        dirty_sync_add_chunks(ds->chunks, block);
+    }
+    ds->next_chunk = 0;
+    stat64_set(&ds->new_dirty_pages, 0);
+
+    for (i = 0; i < ds->nb_threads; i++) {
+        qemu_sem_post(&ds->sem);
+    }
+    dirty_sync_run(ds);
+    for (i = 0; i < ds->nb_threads; i++) {
+        qemu_sem_wait(&ds->done_sem);
+    }
+
+    new_dirty_pages = stat64_get(&ds->new_dirty_pages);
+    rs->migration_dirty_pages += new_dirty_pages;
+    rs->num_dirty_pages_period += new_dirty_pages;
+    trace_migration_bitmap_sync_parallel(ds->chunks->len,
+                                         ds->nb_threads + 1);
+}
+
+static void dirty_sync_threads_init(RAMState *rs)
+{
+    int nb_threads = migrate_dirty_sync_threads() - 1;
+    DirtySyncThreads *ds;
+    int i;
+
+    if (nb_threads < 1) {
+        return;
+    }
+
+    ds = g_new0(DirtySyncThreads, 1);
+    ds->nb_threads = nb_threads;
+    ds->threads = g_new0(QemuThread, nb_threads);
+    ds->chunks = g_array_new(false, false, sizeof(DirtySyncChunk));
+    qemu_sem_init(&ds->sem, 0);
+    qemu_sem_init(&ds->done_sem, 0);
+
+    for (i = 0; i < nb_threads; i++) {
+        qemu_thread_create(&ds->threads[i], "mig/src/dsync",
+                           dirty_sync_thread, ds, QEMU_THREAD_JOINABLE);
+    }
+    rs->dirty_sync = ds;
+}
+
+static void dirty_sync_threads_cleanup(RAMState *rs)
+{
+    DirtySyncThreads *ds = rs->dirty_sync;
+    int i;
+
+    if (!ds) {
+        return;
+    }
+
+    qatomic_set(&ds->quit, true);
+    for (i = 0; i < ds->nb_threads; i++) {
+        qemu_sem_post(&ds->sem);
+    }
+    for (i = 0; i < ds->nb_threads; i++) {
+        qemu_thread_join(&ds->threads[i]);
+    }
+
+    qemu_sem_destroy(&ds->sem);
+    qemu_sem_destroy(&ds->done_sem);
+    g_array_free(ds->chunks, true);
+    g_free(ds->threads);
+    g_free(ds);
+    rs->dirty_sync = NULL;
+}
+
+/* Bucket i counts the synchronizations of 2^(i-1) to 2^i - 1 microseconds */
+static void migration_bitmap_sync_time_update(int64_t time_us)
+{
+    unsigned bucket = MIN(64 - clz64(MAX(time_us, 0)),
+                          MIGRATION_DIRTY_SYNC_TIME_BUCKETS - 1);
+
+    stat64_set(&mig_stats.dirty_sync_time, time_us);
+    stat64_add(&mig_stats.dirty_sync_time_histogram[bucket], 1);
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -1044,9 +1228,11 @@ static void migration_trigger_throttle(RAMState *rs)
 static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 {
     RAMBlock *block;
+    int64_t start_time_us, sync_time_us;
     int64_t end_time;
 
     stat64_add(&mig_stats.dirty_sync_count, 1);
+    start_time_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
 
     if (!rs->time_last_bitmap_sync) {
         rs->time_last_bitmap_sync = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
@@ -1057,15 +1243,21 @@ static void migration_bitmap_sync(RAMState *rs, bool last_stage)
 
     WITH_QEMU_LOCK_GUARD(&rs->bitmap_mutex) {
         WITH_RCU_READ_LOCK_GUARD() {
-            RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-                ramblock_sync_dirty_bitmap(rs, block);
+            if (rs->dirty_sync) {
+                migration_bitmap_sync_parallel(rs);
+            } else {
+                RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+                    ramblock_sync_dirty_bitmap(rs, block);
+                }
             }
             stat64_set(&mig_stats.dirty_bytes_last_sync, ram_bytes_remaining());
         }
     }
 
     memory_global_after_dirty_log_sync();
-    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    sync_time_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_time_us;
+    migration_bitmap_sync_time_update(sync_time_us);
+    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period, sync_time_us);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -1145,7 +1337,7 @@ static int save_zero_page(RAMState *rs, PageSearchStatus *pss,
 
     if (migrate_mapped_ram()) {
         /* zero pages are not transferred with mapped-ram */
-        clear_bit_atomic(offset >> TARGET_PAGE_BITS, pss->block->file_bmap);
+        ramblock_set_file_bmap_atomic(pss->block, offset, false);
         return 1;
     }
 
@@ -1164,6 +1356,10 @@ static int save_zero_page(RAMState *rs, PageSearchStatus *pss,
         xbzrle_cache_zero_page(pss->block->offset + offset);
         XBZRLE_cache_unlock();
     }
+    if (migrate_multifd() &&
+        migrate_multifd_compression() == MULTIFD_COMPRESSION_XBZRLE) {
+        multifd_xbzrle_cache_zero_page(pss->block->offset + offset);
+    }
 
     return len;
 }
@@ -2327,6 +2523,7 @@ static void xbzrle_load_cleanup(void)
 static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
+        dirty_sync_threads_cleanup(*rsp);
         migration_page_queue_free(*rsp);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
@@ -2351,6 +2548,133 @@ static void xbzrle_cleanup(void)
     XBZRLE_cache_unlock();
 }
 
+/*
+ * Incremental mapped-ram checkpoints
+ *
+ * After a successful migration to a file with the incremental-checkpoint
+ * capability, dirty logging stays enabled.  The next migration to another
+ * file then only writes the pages that were dirtied in the meantime, and the
+ * headers of its RAM blocks point to the previous file (its parent), which
+ * provides all other pages.  See MappedRamLayer.
+ */
+
+/* Parent files that an incremental checkpoint may depend on */
+#define MAPPED_RAM_MAX_PARENTS 64
+
+static struct {
+    /*
+     * Files of the last successful checkpoint (the parent of the next one)
+     * and of its ancestors, newest first
+     */
+    GSList *chain;
+    /* File of the checkpoint that is being written */
+    char *current;
+    /* Whether the current checkpoint only contains changes to the parent */
+    bool incremental;
+    /* RAM blocks must not have changed since the parent was written */
+    unsigned int ram_list_version;
+} ram_checkpoint;
+
+static void ram_checkpoint_reset(void)
+{
+    g_slist_free_full(ram_checkpoint.chain, g_free);
+    ram_checkpoint.chain = NULL;
+}
+
+static const char *ram_checkpoint_parent(void)
+{
+    return ram_checkpoint.chain ? ram_checkpoint.chain->data : NULL;
+}
+
+static gint ram_checkpoint_compare_file(gconstpointer a, gconstpointer b)
+{
+    g_autofree char *path_a = g_canonicalize_filename(a, NULL);
+    g_autofree char *path_b = g_canonicalize_filename(b, NULL);
+
+    return strcmp(path_a, path_b);
+}
+
+/* Whether RAM blocks were added, removed or resized since the parent */
+static bool ram_checkpoint_layout_changed(void)
+{
+    RAMBlock *block;
+
+    if (ram_checkpoint.ram_list_version != ram_list.version) {
+        return true;
+    }
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (block->checkpoint_used_length != block->used_length) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Called with the ramlist lock held when a migration starts */
+static void ram_checkpoint_begin(void)
+{
+    const char *filename = file_outgoing_filename();
+
+    g_free(ram_checkpoint.current);
+    ram_checkpoint.current = NULL;
+    ram_checkpoint.incremental = false;
+
+    if (!migrate_incremental_checkpoint() || !filename) {
+        return;
+    }
+
+    /*
+     * The file is not truncated, so overwriting any file of the chain
+     * would lose pages that later checkpoints depend on.
+     */
+    ram_checkpoint.current = g_strdup(filename);
+    ram_checkpoint.incremental =
+        ram_checkpoint.chain &&
+        g_slist_length(ram_checkpoint.chain) < MAPPED_RAM_MAX_PARENTS &&
+        !ram_checkpoint_layout_changed() &&
+        (global_dirty_tracking & GLOBAL_DIRTY_MIGRATION) &&
+        !g_slist_find_custom(ram_checkpoint.chain, filename,
+                             ram_checkpoint_compare_file);
+
+    trace_ram_checkpoint_begin(filename, ram_checkpoint.incremental ?
+                               ram_checkpoint_parent() : "");
+}
+
+/*
+ * Called when a migration ends.  Returns true if it wrote a checkpoint that
+ * the next one can be based on, which needs dirty logging to stay enabled.
+ */
+static bool ram_checkpoint_finish(void)
+{
+    MigrationState *s = migrate_get_current();
+    bool completed = s->state == MIGRATION_STATUS_COMPLETED;
+    RAMBlock *block;
+
+    if (!ram_checkpoint.current || !completed || !ram_checkpoint.incremental) {
+        ram_checkpoint_reset();
+    }
+    if (!ram_checkpoint.current) {
+        return false;
+    }
+
+    trace_ram_checkpoint_finish(ram_checkpoint.current, completed);
+    if (completed) {
+        ram_checkpoint.chain =
+            g_slist_prepend(ram_checkpoint.chain,
+                            g_steal_pointer(&ram_checkpoint.current));
+        ram_checkpoint.ram_list_version = ram_list.version;
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            block->checkpoint_used_length = block->used_length;
+        }
+    } else {
+        g_free(ram_checkpoint.current);
+        ram_checkpoint.current = NULL;
+    }
+    ram_checkpoint.incremental = false;
+
+    return completed;
+}
+
 static void ram_bitmaps_destroy(void)
 {
     RAMBlock *block;
@@ -2362,19 +2686,24 @@ static void ram_bitmaps_destroy(void)
         block->bmap = NULL;
         g_free(block->file_bmap);
         block->file_bmap = NULL;
+        g_free(block->file_zero_bmap);
+        block->file_zero_bmap = NULL;
     }
 }
 
 static void ram_save_cleanup(void *opaque)
 {
     RAMState **rsp = opaque;
+    /* The next incremental checkpoint needs the pages dirtied until then */
+    bool keep_dirty_log = ram_checkpoint_finish();
 
     /* We don't use dirty log with background snapshots */
     if (!migrate_background_snapshot()) {
         /* caller have hold BQL or is in a bh, so there is
          * no writing race against the migration bitmap
          */
-        if (global_dirty_tracking & GLOBAL_DIRTY_MIGRATION) {
+        if ((global_dirty_tracking & GLOBAL_DIRTY_MIGRATION) &&
+            !keep_dirty_log) {
             /*
              * do not stop dirty log without starting it, since
              * memory_global_dirty_log_stop will assert that
@@ -2746,10 +3075,19 @@ static void ram_list_init_bitmaps(void)
              * guest memory.
              */
             block->bmap = bitmap_new(pages);
-            bitmap_set(block->bmap, 0, pages);
+            /*
+             * Incremental checkpoints only contain the pages that dirty
+             * logging reports as changed since the parent checkpoint.
+             */
+            if (!ram_checkpoint.incremental) {
+                bitmap_set(block->bmap, 0, pages);
+            }
             if (migrate_mapped_ram()) {
                 block->file_bmap = bitmap_new(pages);
             }
+            if (ram_checkpoint.incremental) {
+                block->file_zero_bmap = bitmap_new(pages);
+            }
             block->clear_bmap_shift = shift;
             block->clear_bmap = bitmap_new(clear_bmap_size(pages, shift));
         }
@@ -2776,6 +3114,11 @@ static bool ram_init_bitmaps(RAMState *rs, Error **errp)
     qemu_mutex_lock_ramlist();
 
     WITH_RCU_READ_LOCK_GUARD() {
+        ram_checkpoint_begin();
+        if (ram_checkpoint.incremental) {
+            /* The bitmap starts empty, see ram_list_init_bitmaps() */
+            rs->migration_dirty_pages = 0;
+        }
         ram_list_init_bitmaps();
         /* We don't use dirty log with background snapshots */
         if (!migrate_background_snapshot()) {
@@ -2813,6 +3156,8 @@ static int ram_init_all(RAMState **rsp, Error **errp)
         return -1;
     }
 
+    dirty_sync_threads_init(*rsp);
+
     if (!ram_init_bitmaps(*rsp, errp)) {
         return -1;
     }
@@ -2901,6 +3246,8 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
 }
 
 #define MAPPED_RAM_HDR_VERSION 1
+/* Headers of this version are followed by a MappedRamLayer */
+#define MAPPED_RAM_HDR_VERSION_LAYER 2
 struct MappedRamHeader {
     uint32_t version;
     /*
@@ -2921,44 +3268,129 @@ struct MappedRamHeader {
 } QEMU_PACKED;
 typedef struct MappedRamHeader MappedRamHeader;
 
+/*
+ * In an incremental checkpoint, the pages bitmap only contains the pages
+ * written since the previous checkpoint (the parent).  The pages that were
+ * zeroed since are in a second bitmap, all others must be read from the
+ * parent file, which may itself be incremental.
+ */
+struct MappedRamLayer {
+    /*
+     * The offset in the migration file where the bitmap of zeroed pages
+     * is stored.
+     */
+    uint64_t zero_bitmap_offset;
+    /* The offset of the ramblock's header in the parent file */
+    uint64_t parent_header_offset;
+    /* The length of the parent's file name, which follows */
+    uint32_t parent_name_len;
+} QEMU_PACKED;
+typedef struct MappedRamLayer MappedRamLayer;
+
 static void mapped_ram_setup_ramblock(QEMUFile *file, RAMBlock *block)
 {
     g_autofree MappedRamHeader *header = NULL;
-    size_t header_size, bitmap_size;
+    const char *parent = ram_checkpoint.incremental ?
+                         ram_checkpoint_parent() : NULL;
+    size_t header_size, bitmap_size, bitmaps_size;
+    uint64_t header_offset;
     long num_pages;
 
     header = g_new0(MappedRamHeader, 1);
     header_size = sizeof(MappedRamHeader);
+    if (parent) {
+        header_size += sizeof(MappedRamLayer) + strlen(parent);
+    }
 
     num_pages = block->used_length >> TARGET_PAGE_BITS;
     bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+    bitmaps_size = parent ? 2 * bitmap_size : bitmap_size;
 
     /*
      * Save the file offsets of where the bitmap and the pages should
      * go as they are written at the end of migration and during the
      * iterative phase, respectively.
      */
-    block->bitmap_offset = qemu_get_offset(file) + header_size;
+    header_offset = qemu_get_offset(file);
+    block->bitmap_offset = header_offset + header_size;
     block->pages_offset = ROUND_UP(block->bitmap_offset +
-                                   bitmap_size,
+                                   bitmaps_size,
                                    MAPPED_RAM_FILE_OFFSET_ALIGNMENT);
 
-    header->version = cpu_to_be32(MAPPED_RAM_HDR_VERSION);
+    header->version = cpu_to_be32(parent ? MAPPED_RAM_HDR_VERSION_LAYER :
+                                           MAPPED_RAM_HDR_VERSION);
     header->page_size = cpu_to_be64(TARGET_PAGE_SIZE);
     header->bitmap_offset = cpu_to_be64(block->bitmap_offset);
     header->pages_offset = cpu_to_be64(block->pages_offset);
 
-    qemu_put_buffer(file, (uint8_t *) header, header_size);
+    qemu_put_buffer(file, (uint8_t *) header, sizeof(MappedRamHeader));
+
+    if (parent) {
+        MappedRamLayer layer = {
+            .zero_bitmap_offset = cpu_to_be64(block->bitmap_offset +
+                                              bitmap_size),
+            .parent_header_offset =
+                cpu_to_be64(block->checkpoint_header_offset),
+            .parent_name_len = cpu_to_be32(strlen(parent)),
+        };
+
+        qemu_put_buffer(file, (uint8_t *)&layer, sizeof(layer));
+        qemu_put_buffer(file, (const uint8_t *)parent, strlen(parent));
+    }
+
+    /* the next incremental checkpoint refers to this header */
+    block->checkpoint_header_offset = header_offset;
 
     /* prepare offset for next ramblock */
     qemu_set_offset(file, block->pages_offset + block->used_length, SEEK_SET);
 }
 
+static bool mapped_ram_header_to_cpu(MappedRamHeader *header, Error **errp)
+{
+    /* migration stream is big-endian */
+    header->version = be32_to_cpu(header->version);
+
+    if (header->version > MAPPED_RAM_HDR_VERSION_LAYER) {
+        error_setg(errp, "Migration mapped-ram capability version not "
+                   "supported (expected <= %d, got %d)",
+                   MAPPED_RAM_HDR_VERSION_LAYER, header->version);
+        return false;
+    }
+
+    header->page_size = be64_to_cpu(header->page_size);
+    header->bitmap_offset = be64_to_cpu(header->bitmap_offset);
+    header->pages_offset = be64_to_cpu(header->pages_offset);
+
+    return true;
+}
+
+static bool mapped_ram_layer_to_cpu(MappedRamLayer *layer, Error **errp)
+{
+    layer->zero_bitmap_offset = be64_to_cpu(layer->zero_bitmap_offset);
+    layer->parent_header_offset = be64_to_cpu(layer->parent_header_offset);
+    layer->parent_name_len = be32_to_cpu(layer->parent_name_len);
+
+    if (!layer->parent_name_len || layer->parent_name_len >= PATH_MAX) {
+        error_setg(errp, "Invalid mapped-ram parent file name length %u",
+                   layer->parent_name_len);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Reads the header of a ramblock from the migration stream.  @parent is set
+ * to the file name of the parent checkpoint if the header is followed by a
+ * MappedRamLayer, otherwise to NULL.
+ */
 static bool mapped_ram_read_header(QEMUFile *file, MappedRamHeader *header,
+                                   MappedRamLayer *layer, char **parent,
                                    Error **errp)
 {
     size_t ret, header_size = sizeof(MappedRamHeader);
 
+    *parent = NULL;
+
     ret = qemu_get_buffer(file, (uint8_t *)header, header_size);
     if (ret != header_size) {
         error_setg(errp, "Could not read whole mapped-ram migration header "
@@ -2966,20 +3398,81 @@ static bool mapped_ram_read_header(QEMUFile *file, MappedRamHeader *header,
         return false;
     }
 
-    /* migration stream is big-endian */
-    header->version = be32_to_cpu(header->version);
+    if (!mapped_ram_header_to_cpu(header, errp)) {
+        return false;
+    }
 
-    if (header->version > MAPPED_RAM_HDR_VERSION) {
-        error_setg(errp, "Migration mapped-ram capability version not "
-                   "supported (expected <= %d, got %d)", MAPPED_RAM_HDR_VERSION,
-                   header->version);
+    if (header->version < MAPPED_RAM_HDR_VERSION_LAYER) {
+        return true;
+    }
+
+    if (qemu_get_buffer(file, (uint8_t *)layer, sizeof(*layer)) !=
+        sizeof(*layer)) {
+        error_setg(errp, "Could not read mapped-ram layer header");
+        return false;
+    }
+    if (!mapped_ram_layer_to_cpu(layer, errp)) {
         return false;
     }
 
-    header->page_size = be64_to_cpu(header->page_size);
-    header->bitmap_offset = be64_to_cpu(header->bitmap_offset);
-    header->pages_offset = be64_to_cpu(header->pages_offset);
+    *parent = g_malloc0(layer->parent_name_len + 1);
+    if (qemu_get_buffer(file, (uint8_t *)*parent, layer->parent_name_len) !=
+        layer->parent_name_len) {
+        error_setg(errp, "Could not read mapped-ram parent file name");
+        g_free(*parent);
+        *parent = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* Like mapped_ram_read_header(), but reads the header at @offset in @file */
+static bool mapped_ram_read_header_at(QEMUFile *file, uint64_t offset,
+                                      MappedRamHeader *header,
+                                      MappedRamLayer *layer, char **parent,
+                                      Error **errp)
+{
+    size_t header_size = sizeof(MappedRamHeader);
+
+    *parent = NULL;
+
+    if (qemu_get_buffer_at(file, (uint8_t *)header, header_size,
+                           offset) != header_size) {
+        qemu_file_get_error_obj(file, errp);
+        error_prepend(errp, "Could not read mapped-ram header at offset %"
+                      PRIu64 ": ", offset);
+        return false;
+    }
+
+    if (!mapped_ram_header_to_cpu(header, errp)) {
+        return false;
+    }
+
+    if (header->version < MAPPED_RAM_HDR_VERSION_LAYER) {
+        return true;
+    }
 
+    offset += header_size;
+    if (qemu_get_buffer_at(file, (uint8_t *)layer, sizeof(*layer),
+                           offset) != sizeof(*layer)) {
+        qemu_file_get_error_obj(file, errp);
+        error_prepend(errp, "Could not read mapped-ram layer header: ");
+        return false;
+    }
+    if (!mapped_ram_layer_to_cpu(layer, errp)) {
+        return false;
+    }
+
+    *parent = g_malloc0(layer->parent_name_len + 1);
+    if (qemu_get_buffer_at(file, (uint8_t *)*parent, layer->parent_name_len,
+                           offset + sizeof(*layer)) !=
+        layer->parent_name_len) {
+        qemu_file_get_error_obj(file, errp);
+        error_prepend(errp, "Could not read mapped-ram parent file name: ");
+        g_free(*parent);
+        *parent = NULL;
+        return false;
+    }
     return true;
 }
 
@@ -3096,6 +3589,15 @@ static void ram_save_file_bmap(QEMUFile *f)
                            block->bitmap_offset);
         ram_transferred_add(bitmap_size);
 
+        /* see mapped_ram_setup_ramblock() */
+        if (block->file_zero_bmap) {
+            qemu_put_buffer_at(f, (uint8_t *)block->file_zero_bmap,
+                               bitmap_size, block->bitmap_offset + bitmap_size);
+            ram_transferred_add(bitmap_size);
+            g_free(block->file_zero_bmap);
+            block->file_zero_bmap = NULL;
+        }
+
         /*
          * Free the bitmap here to catch any synchronization issues
          * with multifd channels. No channels should be sending pages
@@ -3112,6 +3614,10 @@ void ramblock_set_file_bmap_atomic(RAMBlock *block, ram_addr_t offset, bool set)
         set_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_bmap);
     } else {
         clear_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        /* The page must not be read from the parent checkpoint */
+        if (block->file_zero_bmap) {
+            set_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_zero_bmap);
+        }
     }
 }
 
@@ -3626,7 +4132,13 @@ static int ram_load_setup(QEMUFile *f, void *opaque, Error **errp)
     return 0;
 }
 
-static int ram_load_cleanup(void *opaque)
+/**
+ * ram_load_cleanup_blocks: flush and release the incoming state of RAM blocks
+ *
+ * Called by lazy restore once all pages are loaded, which may be long
+ * after ram_load_cleanup().
+ */
+void ram_load_cleanup_blocks(void)
 {
     RAMBlock *rb;
 
@@ -3634,12 +4146,20 @@ static int ram_load_cleanup(void *opaque)
         qemu_ram_block_writeback(rb);
     }
 
-    xbzrle_load_cleanup();
-
     RAMBLOCK_FOREACH_NOT_IGNORED(rb) {
         g_free(rb->receivedmap);
         rb->receivedmap = NULL;
     }
+}
+
+static int ram_load_cleanup(void *opaque)
+{
+    xbzrle_load_cleanup();
+
+    /* Pages are still being placed, which needs the receivedmap */
+    if (!lazy_restore_active()) {
+        ram_load_cleanup_blocks();
+    }
 
     return 0;
 }
@@ -3683,6 +4203,7 @@ int ram_load_postcopy(QEMUFile *f, int channel)
         ram_addr_t addr;
         void *page_buffer = NULL;
         void *place_source = NULL;
+        uint8_t *stream_host = NULL;
         RAMBlock *block = NULL;
         uint8_t ch;
 
@@ -3730,9 +4251,18 @@ int ram_load_postcopy(QEMUFile *f, int channel)
              * The migration protocol uses,  possibly smaller, target-pages
              * however the source ensures it always sends all the components
              * of a host page in one chunk.
+             * For shared memory, the data can instead be written to the
+             * page cache through a second mapping, and the guest mapping
+             * is installed when the host page is complete.
              */
-            page_buffer = tmp_page->tmp_huge_page +
-                          host_page_offset_from_ram_block_offset(block, addr);
+            stream_host = postcopy_ram_stream_host(mis, block);
+            if (stream_host) {
+                page_buffer = stream_host + addr;
+            } else {
+                page_buffer = tmp_page->tmp_huge_page +
+                              host_page_offset_from_ram_block_offset(block,
+                                                                     addr);
+            }
             /* If all TP are zero then we can optimise the place */
             if (tmp_page->target_pages == 1) {
                 tmp_page->host_addr =
@@ -3771,17 +4301,21 @@ int ram_load_postcopy(QEMUFile *f, int channel)
             }
             /*
              * Can skip to set page_buffer when
-             * this is a zero page and (block->page_size == TARGET_PAGE_SIZE).
+             * this is a zero page and (block->page_size == TARGET_PAGE_SIZE),
+             * or when it is in the page cache, where missing pages are zero.
              */
-            if (!matches_target_page_size) {
+            if (!matches_target_page_size && !stream_host) {
                 memset(page_buffer, ch, TARGET_PAGE_SIZE);
             }
             break;
 
         case RAM_SAVE_FLAG_PAGE:
             tmp_page->all_zero = false;
-            if (!matches_target_page_size) {
-                /* For huge pages, we always use temporary buffer */
+            if (!matches_target_page_size || stream_host) {
+                /*
+                 * For huge pages, we always copy into the temporary buffer
+                 * or the page cache
+                 */
                 qemu_get_buffer(f, page_buffer, TARGET_PAGE_SIZE);
             } else {
                 /*
@@ -3821,6 +4355,9 @@ int ram_load_postcopy(QEMUFile *f, int channel)
         if (!ret && place_needed) {
             if (tmp_page->all_zero) {
                 ret = postcopy_place_page_zero(mis, tmp_page->host_addr, block);
+            } else if (stream_host) {
+                ret = postcopy_place_page_continue(mis, tmp_page->host_addr,
+                                                   block);
             } else {
                 ret = postcopy_place_page(mis, tmp_page->host_addr,
                                           place_source, block);
@@ -3906,8 +4443,14 @@ static size_t ram_load_multifd_pages(void *host_addr, size_t size,
     return size;
 }
 
+/*
+ * Reads the pages in @bitmap from @f, where the pages of @block start at
+ * @pages_offset.  Parent checkpoints are always read from the main thread,
+ * the multifd channels only read from the migration file itself.
+ */
 static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
-                                     long num_pages, unsigned long *bitmap,
+                                     uint64_t pages_offset, long num_pages,
+                                     unsigned long *bitmap, bool use_multifd,
                                      Error **errp)
 {
     ERRP_GUARD();
@@ -3935,12 +4478,12 @@ static bool read_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
 
             size = MIN(unread, MAPPED_RAM_LOAD_BUF_SIZE);
 
-            if (migrate_multifd()) {
+            if (use_multifd) {
                 read = ram_load_multifd_pages(host, size,
-                                              block->pages_offset + offset);
+                                              pages_offset + offset);
             } else {
                 read = qemu_get_buffer_at(f, host, size,
-                                          block->pages_offset + offset);
+                                          pages_offset + offset);
             }
 
             if (!read) {
@@ -3957,19 +4500,138 @@ err:
     qemu_file_get_error_obj(f, errp);
     error_prepend(errp, "(%s) failed to read page " RAM_ADDR_FMT
                   "from file offset %" PRIx64 ": ", block->idstr, offset,
-                  block->pages_offset + offset);
+                  pages_offset + offset);
     return false;
 }
 
+/*
+ * Reads the pages of an incremental checkpoint that are neither in the
+ * checkpoint itself (@bitmap) nor zeroed since its parent (see @layer) from
+ * the chain of parent checkpoints, starting with the file @parent.
+ */
+static bool read_ramblock_mapped_ram_parents(QEMUFile *f, RAMBlock *block,
+                                             long num_pages,
+                                             const unsigned long *bitmap,
+                                             const MappedRamLayer *layer,
+                                             const char *parent,
+                                             Error **errp)
+{
+    size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+    g_autofree unsigned long *missing = bitmap_new(num_pages);
+    g_autofree unsigned long *zero = g_malloc0(bitmap_size);
+    g_autofree unsigned long *pages = g_malloc0(bitmap_size);
+    g_autofree char *name = g_strdup(parent);
+    g_autoptr(GHashTable) visited = g_hash_table_new_full(g_str_hash,
+                                                          g_str_equal,
+                                                          g_free, NULL);
+    uint64_t header_offset = layer->parent_header_offset;
+    uint64_t zero_bitmap_offset = layer->zero_bitmap_offset;
+    QEMUFile *layer_file = f;
+    bool ret = false;
+
+    bitmap_fill(missing, num_pages);
+    bitmap_andnot(missing, missing, bitmap, num_pages);
+
+    while (true) {
+        MappedRamHeader header;
+        MappedRamLayer next_layer;
+        char *next = NULL;
+        QIOChannelFile *fioc;
+
+        /* Zeroed pages hide the parent's pages like written pages do */
+        if (qemu_get_buffer_at(layer_file, (uint8_t *)zero, bitmap_size,
+                               zero_bitmap_offset) != bitmap_size) {
+            qemu_file_get_error_obj(layer_file, errp);
+            error_prepend(errp, "Error reading zero page bitmap: ");
+            goto out;
+        }
+        bitmap_andnot(missing, missing, zero, num_pages);
+
+        if (layer_file != f) {
+            qemu_fclose(layer_file);
+        }
+        layer_file = NULL;
+
+        if (!name || bitmap_empty(missing, num_pages)) {
+            break;
+        }
+
+        if (g_hash_table_size(visited) >= MAPPED_RAM_MAX_PARENTS) {
+            error_setg(errp, "Chain of parent checkpoints of ramblock %s is "
+                       "longer than %d files", block->idstr,
+                       MAPPED_RAM_MAX_PARENTS);
+            goto out;
+        }
+        if (!g_hash_table_add(visited, g_canonicalize_filename(name, NULL))) {
+            error_setg(errp, "Chain of parent checkpoints of ramblock %s "
+                       "contains %s twice", block->idstr, name);
+            goto out;
+        }
+
+        trace_ram_load_mapped_ram_parent(block->idstr, name);
+        fioc = qio_channel_file_new_path(name, O_RDONLY, 0, errp);
+        if (!fioc) {
+            error_prepend(errp, "Could not open parent checkpoint of "
+                          "ramblock %s: ", block->idstr);
+            goto out;
+        }
+        layer_file = qemu_file_new_input(QIO_CHANNEL(fioc));
+        object_unref(OBJECT(fioc));
+
+        if (!mapped_ram_read_header_at(layer_file, header_offset, &header,
+                                       &next_layer, &next, errp)) {
+            goto out;
+        }
+        g_free(name);
+        name = next;
+
+        if (header.page_size != TARGET_PAGE_SIZE) {
+            error_setg(errp, "Parent checkpoint of ramblock %s has a "
+                       "different page size", block->idstr);
+            goto out;
+        }
+
+        if (qemu_get_buffer_at(layer_file, (uint8_t *)pages, bitmap_size,
+                               header.bitmap_offset) != bitmap_size) {
+            qemu_file_get_error_obj(layer_file, errp);
+            error_prepend(errp, "Error reading dirty bitmap: ");
+            goto out;
+        }
+
+        bitmap_and(pages, pages, missing, num_pages);
+        if (!read_ramblock_mapped_ram(layer_file, block, header.pages_offset,
+                                      num_pages, pages, false, errp)) {
+            goto out;
+        }
+        bitmap_andnot(missing, missing, pages, num_pages);
+
+        if (!name) {
+            /* A full checkpoint, whatever is still missing is zero */
+            break;
+        }
+        header_offset = next_layer.parent_header_offset;
+        zero_bitmap_offset = next_layer.zero_bitmap_offset;
+    }
+
+    ret = true;
+out:
+    if (layer_file && layer_file != f) {
+        qemu_fclose(layer_file);
+    }
+    return ret;
+}
+
 static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
                                       ram_addr_t length, Error **errp)
 {
     g_autofree unsigned long *bitmap = NULL;
+    g_autofree char *parent = NULL;
     MappedRamHeader header;
+    MappedRamLayer layer;
     size_t bitmap_size;
     long num_pages;
 
-    if (!mapped_ram_read_header(f, &header, errp)) {
+    if (!mapped_ram_read_header(f, &header, &layer, &parent, errp)) {
         return;
     }
 
@@ -3998,8 +4660,30 @@ static void parse_ramblock_mapped_ram(QEMUFile *f, RAMBlock *block,
         return;
     }
 
-    if (!read_ramblock_mapped_ram(f, block, num_pages, bitmap, errp)) {
-        return;
+    if (migrate_lazy_restore()) {
+        if (parent) {
+            error_setg(errp, "Lazy restore of incremental checkpoints is not "
+                       "supported");
+            return;
+        }
+
+        /* The pages are read once the guest runs */
+        if (!lazy_restore_add_block(f, block, block->pages_offset,
+                                    g_steal_pointer(&bitmap), num_pages,
+                                    errp)) {
+            return;
+        }
+    } else {
+        if (!read_ramblock_mapped_ram(f, block, block->pages_offset,
+                                      num_pages, bitmap, migrate_multifd(),
+                                      errp)) {
+            return;
+        }
+        if (parent &&
+            !read_ramblock_mapped_ram_parents(f, block, num_pages, bitmap,
+                                              &layer, parent, errp)) {
+            return;
+        }
     }
 
     /* Skip pages array */
@@ -4212,6 +4896,15 @@ static int ram_load_precopy(QEMUFile *f)
             if (migrate_mapped_ram()) {
                 multifd_recv_sync_main();
             }
+            if (!ret && migrate_lazy_restore()) {
+                Error *local_err = NULL;
+
+                ret = lazy_restore_start(migration_incoming_get_current(),
+                                         &local_err);
+                if (ret < 0) {
+                    error_report_err(local_err);
+                }
+            }
             break;
 
         case RAM_SAVE_FLAG_ZERO:
@@ -4498,6 +5191,9 @@ static void ram_mig_ram_block_resized(RAMBlockNotifier *n, void *host,
         return;
     }
 
+    /* The next checkpoint can't be based on one with a different layout */
+    ram_checkpoint_reset();
+
     if (!migration_is_idle()) {
         /*
          * Precopy code on the source cannot deal with the size of RAM blocks
@@ -59,6 +59,7 @@ void ram_postcopy_send_discard_bitmap(MigrationState *ms);
 int ram_discard_range(const char *block_name, uint64_t start, size_t length);
 int ram_postcopy_incoming_init(MigrationIncomingState *mis);
 int ram_load_postcopy(QEMUFile *f, int channel);
+void ram_load_cleanup_blocks(void);
 
 void ram_handle_zero(void *host, uint64_t size);
 
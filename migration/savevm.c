@@ -41,6 +41,7 @@
 #include "qemu-file.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
+#include "multifd.h"
 #include "qapi/error.h"
 #include "qapi/qapi-commands-migration.h"
 #include "qapi/clone-visitor.h"
@@ -90,6 +91,9 @@ enum qemu_vm_cmd {
     MIG_CMD_ENABLE_COLO,       /* Enable COLO */
     MIG_CMD_POSTCOPY_RESUME,   /* resume postcopy on dest */
     MIG_CMD_RECV_BITMAP,       /* Request for recved bitmap on dst */
+    MIG_CMD_DEVICE_STATE_START,    /* Device state buffers may be loaded */
+    MIG_CMD_DEVICE_STATE_COMPLETE, /* Load all device state buffers of a
+                                      section before its next section */
     MIG_CMD_MAX
 };
 
@@ -109,6 +113,9 @@ static struct mig_cmd_args {
     [MIG_CMD_POSTCOPY_RESUME]  = { .len =  0, .name = "POSTCOPY_RESUME" },
     [MIG_CMD_PACKAGED]         = { .len =  4, .name = "PACKAGED" },
     [MIG_CMD_RECV_BITMAP]      = { .len = -1, .name = "RECV_BITMAP" },
+    [MIG_CMD_DEVICE_STATE_START] = { .len = 0, .name = "DEVICE_STATE_START" },
+    [MIG_CMD_DEVICE_STATE_COMPLETE] = {
+                                   .len = -1, .name = "DEVICE_STATE_COMPLETE" },
     [MIG_CMD_MAX]              = { .len = -1, .name = "MAX" },
 };
 
@@ -216,8 +223,39 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /* Worker thread saving the final device state, if any */
+    SaveDeviceState *device_state;
+    /* Time spent and bytes saved while the guest was stopped */
+    int64_t downtime_us;
+    uint64_t downtime_bytes;
+    bool downtime_parallel;
+    /* Device state buffers received over multifd and not loaded yet */
+    GHashTable *load_buffers;
+    /* Index of the next device state buffer to load */
+    uint64_t load_buffers_next;
+    /* A multifd receive thread is loading the device state buffers */
+    bool load_buffers_busy;
 } SaveStateEntry;
 
+/* Final device state saved by save_live_complete_precopy_thread() */
+struct SaveDeviceState {
+    SaveStateEntry *se;
+    QemuThread thread;
+    /* Number and total size of the buffers sent */
+    uint64_t num_buffers;
+    uint64_t bytes;
+    int64_t time_us;
+    int ret;
+    Error *err;
+};
+
+/* Device state buffer received over multifd */
+typedef struct LoadStateBuffer {
+    uint64_t seq;
+    void *data;
+    size_t len;
+} LoadStateBuffer;
+
 typedef struct SaveState {
     QTAILQ_HEAD(, SaveStateEntry) handlers;
     SaveStateEntry *handler_pri_head[MIG_PRI_MAX + 1];
@@ -228,6 +266,8 @@ typedef struct SaveState {
     uint32_t caps_count;
     MigrationCapability *capabilities;
     QemuUUID uuid;
+    /* save_live_complete_precopy_thread() is used */
+    bool device_state_parallel;
 } SaveState;
 
 static SaveState savevm_state = {
@@ -945,6 +985,7 @@ void vmstate_unregister(VMStateIf *obj, const VMStateDescription *vmsd,
             g_free(se);
         }
     }
+    vmstate_forget_plan(vmsd);
 }
 
 static int vmstate_load(QEMUFile *f, SaveStateEntry *se)
@@ -1218,6 +1259,38 @@ void qemu_savevm_send_recv_bitmap(QEMUFile *f, char *block_name)
     qemu_savevm_command_send(f, MIG_CMD_RECV_BITMAP, len + 1, (uint8_t *)buf);
 }
 
+static void qemu_savevm_send_device_state_start(QEMUFile *f)
+{
+    trace_savevm_send_device_state_start();
+    qemu_savevm_command_send(f, MIG_CMD_DEVICE_STATE_START, 0, NULL);
+}
+
+/*
+ * Payload format:
+ *
+ * len (1 byte) + idstr (<256 bytes) + instance_id (4 bytes) +
+ * number of buffers (8 bytes)
+ */
+static void qemu_savevm_send_device_state_complete(QEMUFile *f,
+                                                   SaveStateEntry *se,
+                                                   uint64_t num_buffers)
+{
+    size_t len;
+    uint8_t buf[1 + 256 + sizeof(uint32_t) + sizeof(uint64_t)];
+
+    trace_savevm_send_device_state_complete(se->idstr, se->instance_id,
+                                            num_buffers);
+
+    buf[0] = len = strlen(se->idstr);
+    memcpy(buf + 1, se->idstr, len);
+    stl_be_p(buf + 1 + len, se->instance_id);
+    stq_be_p(buf + 1 + len + sizeof(uint32_t), num_buffers);
+
+    qemu_savevm_command_send(f, MIG_CMD_DEVICE_STATE_COMPLETE,
+                             1 + len + sizeof(uint32_t) + sizeof(uint64_t),
+                             buf);
+}
+
 bool qemu_savevm_state_blocked(Error **errp)
 {
     SaveStateEntry *se;
@@ -1321,6 +1394,10 @@ int qemu_savevm_state_setup(QEMUFile *f, Error **errp)
 
     trace_savevm_state_setup();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        se->downtime_us = 0;
+        se->downtime_bytes = 0;
+        se->downtime_parallel = false;
+
         if (se->vmsd && se->vmsd->early_setup) {
             ret = vmstate_save(f, se, ms->vmdesc, errp);
             if (ret) {
@@ -1448,6 +1525,191 @@ static bool should_send_vmdesc(void)
     return !machine->suppress_vmdesc && !in_postcopy;
 }
 
+bool qemu_savevm_device_state_parallel(void)
+{
+    return savevm_state.device_state_parallel;
+}
+
+int qemu_savevm_send_device_state(SaveDeviceState *ds, const void *data,
+                                  size_t len, Error **errp)
+{
+    int ret;
+
+    ret = multifd_queue_device_state(ds->se->idstr, ds->se->instance_id,
+                                     ds->num_buffers, g_memdup2(data, len),
+                                     len, errp);
+    if (ret) {
+        return ret;
+    }
+
+    ds->num_buffers++;
+    ds->bytes += len;
+    return 0;
+}
+
+static void *qemu_savevm_device_state_thread(void *opaque)
+{
+    SaveDeviceState *ds = opaque;
+    SaveStateEntry *se = ds->se;
+    int64_t start_ts = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+
+    trace_savevm_device_state_thread_start(se->idstr, se->instance_id);
+
+    ds->ret = se->ops->save_live_complete_precopy_thread(ds, se->opaque,
+                                                         &ds->err);
+    if (ds->ret && !ds->err) {
+        error_setg_errno(&ds->err, -ds->ret, "Saving state failed");
+    }
+
+    ds->time_us = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_ts;
+    trace_savevm_device_state_thread_end(se->idstr, se->instance_id,
+                                         ds->num_buffers, ds->bytes,
+                                         ds->time_us, ds->ret);
+
+    return NULL;
+}
+
+/*
+ * Starts a worker thread for each device that saves its final state
+ * with save_live_complete_precopy_thread(), so that the devices save
+ * their state in parallel with each other and with the sections that
+ * the migration thread still has to send.
+ *
+ * The SaveStateEntries do not declare an order for this.  The buffers of
+ * a device only carry the state of that device, so they can be loaded in
+ * any order relative to other devices.  What does depend on other devices
+ * goes into the sections of the device, which the destination still loads
+ * one by one in the order of savevm_state.handlers (that is, by priority),
+ * and only after all the buffers of the device were loaded.
+ */
+static void qemu_savevm_device_state_start(QEMUFile *f)
+{
+    SaveStateEntry *se;
+    bool started = false;
+
+    if (!multifd_device_state_supported()) {
+        return;
+    }
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        if (!se->ops || !se->ops->save_live_complete_precopy_thread) {
+            continue;
+        }
+        if (se->ops->is_active) {
+            if (!se->ops->is_active(se->opaque)) {
+                continue;
+            }
+        }
+
+        if (!started) {
+            qemu_savevm_send_device_state_start(f);
+            savevm_state.device_state_parallel = true;
+            started = true;
+        }
+
+        se->device_state = g_new0(SaveDeviceState, 1);
+        se->device_state->se = se;
+        qemu_thread_create(&se->device_state->thread, "mig/src/devstate",
+                           qemu_savevm_device_state_thread, se->device_state,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+/*
+ * Waits for the worker thread of @se, if any.  Unless @send is false,
+ * tells the destination how many buffers of @se it has to load before
+ * the next section of @se, which is the ordering point for the device.
+ */
+static int qemu_savevm_device_state_finish(QEMUFile *f, SaveStateEntry *se,
+                                           bool send)
+{
+    SaveDeviceState *ds = se->device_state;
+    MigrationState *ms = migrate_get_current();
+    int ret;
+
+    if (!ds) {
+        return 0;
+    }
+
+    qemu_thread_join(&ds->thread);
+    se->device_state = NULL;
+
+    ret = ds->ret;
+    if (ret) {
+        error_prepend(&ds->err, "Failed to save state of device %s: ",
+                      se->idstr);
+        migrate_set_error(ms, ds->err);
+        error_report_err(ds->err);
+        qemu_file_set_error(f, ret);
+    } else {
+        se->downtime_us += ds->time_us;
+        se->downtime_bytes += ds->bytes;
+        se->downtime_parallel = true;
+        if (send) {
+            qemu_savevm_send_device_state_complete(f, se, ds->num_buffers);
+        }
+    }
+
+    g_free(ds);
+    return ret;
+}
+
+/*
+ * Waits for the remaining worker threads and for multifd to send all
+ * the buffers.  Unless @send is false, the destination is told how many
+ * buffers to load, like in qemu_savevm_device_state_finish().
+ */
+static int qemu_savevm_device_state_finish_all(QEMUFile *f, bool send)
+{
+    SaveStateEntry *se;
+    int ret = 0;
+
+    if (!savevm_state.device_state_parallel) {
+        return 0;
+    }
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        int se_ret = qemu_savevm_device_state_finish(f, se, send && !ret);
+
+        ret = ret ?: se_ret;
+    }
+
+    savevm_state.device_state_parallel = false;
+
+    if (!ret && send) {
+        ret = multifd_device_state_flush();
+        if (ret) {
+            qemu_file_set_error(f, ret);
+        }
+    }
+
+    return ret;
+}
+
+DeviceDowntimeList *qemu_savevm_device_downtime(void)
+{
+    DeviceDowntimeList *list = NULL, **tail = &list;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        DeviceDowntime *dt;
+
+        if (!se->downtime_bytes && !se->downtime_parallel) {
+            continue;
+        }
+
+        dt = g_new0(DeviceDowntime, 1);
+        dt->id = g_strdup(se->idstr);
+        dt->instance_id = se->instance_id;
+        dt->time = se->downtime_us;
+        dt->bytes = se->downtime_bytes;
+        dt->parallel = se->downtime_parallel;
+        QAPI_LIST_APPEND(tail, dt);
+    }
+
+    return list;
+}
+
 /*
  * Calls the save_live_complete_postcopy methods
  * causing the last few pages to be sent immediately and doing any associated
@@ -1491,6 +1753,7 @@ static
 int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
 {
     int64_t start_ts_each, end_ts_each;
+    uint64_t start_bytes_each;
     SaveStateEntry *se;
     int ret;
 
@@ -1508,7 +1771,13 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
             }
         }
 
+        ret = qemu_savevm_device_state_finish(f, se, true);
+        if (ret) {
+            return -1;
+        }
+
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        start_bytes_each = qemu_file_transferred(f);
         trace_savevm_section_start(se->idstr, se->section_id);
 
         save_section_header(f, se, QEMU_VM_SECTION_END);
@@ -1521,6 +1790,8 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
             return -1;
         }
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        se->downtime_us += end_ts_each - start_ts_each;
+        se->downtime_bytes += qemu_file_transferred(f) - start_bytes_each;
         trace_vmstate_downtime_save("iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
     }
@@ -1536,6 +1807,7 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
 {
     MigrationState *ms = migrate_get_current();
     int64_t start_ts_each, end_ts_each;
+    uint64_t start_bytes_each;
     JSONWriter *vmdesc = ms->vmdesc;
     int vmdesc_len;
     SaveStateEntry *se;
@@ -1548,7 +1820,13 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
             continue;
         }
 
+        ret = qemu_savevm_device_state_finish(f, se, true);
+        if (ret) {
+            return ret;
+        }
+
         start_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        start_bytes_each = qemu_file_transferred(f);
 
         ret = vmstate_save(f, se, vmdesc, &local_err);
         if (ret) {
@@ -1559,10 +1837,18 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         }
 
         end_ts_each = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+        se->downtime_us += end_ts_each - start_ts_each;
+        se->downtime_bytes += qemu_file_transferred(f) - start_bytes_each;
         trace_vmstate_downtime_save("non-iterable", se->idstr, se->instance_id,
                                     end_ts_each - start_ts_each);
     }
 
+    /* Devices with only worker thread state, if any */
+    ret = qemu_savevm_device_state_finish_all(f, true);
+    if (ret) {
+        return ret;
+    }
+
     if (inactivate_disks) {
         /* Inactivate before sending QEMU_VM_EOF so that the
          * bdrv_activate_all() on the other end won't fail. */
@@ -1615,10 +1901,14 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
 
     cpu_synchronize_all_states();
 
+    if (!in_postcopy && !iterable_only) {
+        qemu_savevm_device_state_start(f);
+    }
+
     if (!in_postcopy || iterable_only) {
         ret = qemu_savevm_state_complete_precopy_iterable(f, in_postcopy);
         if (ret) {
-            return ret;
+            goto out;
         }
     }
 
@@ -1629,11 +1919,15 @@ int qemu_savevm_state_complete_precopy(QEMUFile *f, bool iterable_only,
     ret = qemu_savevm_state_complete_precopy_non_iterable(f, in_postcopy,
                                                           inactivate_disks);
     if (ret) {
-        return ret;
+        goto out;
     }
 
 flush:
-    return qemu_fflush(f);
+    ret = qemu_fflush(f);
+out:
+    /* Only left on errors */
+    qemu_savevm_device_state_finish_all(f, false);
+    return ret;
 }
 
 /* Give an estimate of the amount left to be transferred,
@@ -2283,12 +2577,14 @@ static int loadvm_postcopy_handle_resume(MigrationIncomingState *mis)
     migrate_send_rp_req_pages_pending(mis);
 
     /*
-     * It's time to switch state and release the fault thread to continue
+     * It's time to switch state and release the fault threads to continue
      * service page faults.  Note that this should be explicitly after the
      * above call to migrate_send_rp_req_pages_pending().  In short:
-     * migrate_send_rp_message_req_pages() is not thread safe, yet.
+     * it resets last_rb and walks page_requested without locking.
      */
-    qemu_sem_post(&mis->postcopy_pause_sem_fault);
+    for (unsigned int i = 0; i <= mis->fault_helper_count; i++) {
+        qemu_sem_post(&mis->postcopy_pause_sem_fault);
+    }
 
     if (migrate_postcopy_preempt()) {
         /*
@@ -2416,6 +2712,190 @@ static int loadvm_handle_recv_bitmap(MigrationIncomingState *mis,
     return 0;
 }
 
+static void load_state_buffer_free(gpointer opaque)
+{
+    LoadStateBuffer *buf = opaque;
+
+    g_free(buf->data);
+    g_free(buf);
+}
+
+/*
+ * Called by the multifd receive threads.  The buffers of a device are
+ * loaded one at a time and in order: the thread that finds the next
+ * buffer of the device also loads the ones that other threads received
+ * in the meantime, so the receive threads never wait for each other.
+ */
+int qemu_loadvm_load_state_buffer(const char *idstr, uint32_t instance_id,
+                                  uint64_t seq, void *data, size_t len,
+                                  Error **errp)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    LoadStateBuffer *buf;
+    SaveStateEntry *se;
+    int ret = 0;
+
+    se = find_se(idstr, instance_id);
+    if (!se || !se->ops || !se->ops->load_state_buffer) {
+        error_setg(errp, "Unknown device state buffer for section '%s' "
+                   "instance %" PRIu32, idstr, instance_id);
+        g_free(data);
+        return -EINVAL;
+    }
+
+    buf = g_new(LoadStateBuffer, 1);
+    buf->seq = seq;
+    buf->data = data;
+    buf->len = len;
+
+    qemu_mutex_lock(&mis->device_state_mutex);
+
+    while (!mis->device_state_started && !mis->device_state_cancelled) {
+        qemu_cond_wait(&mis->device_state_cond, &mis->device_state_mutex);
+    }
+
+    if (mis->device_state_cancelled) {
+        error_setg(errp, "Loading device state was cancelled");
+        ret = -ECANCELED;
+        goto out_free;
+    }
+
+    if (!se->load_buffers) {
+        se->load_buffers = g_hash_table_new_full(g_int64_hash, g_int64_equal,
+                                                 NULL, load_state_buffer_free);
+    }
+
+    if (seq < se->load_buffers_next ||
+        g_hash_table_contains(se->load_buffers, &seq)) {
+        error_setg(errp, "Duplicate device state buffer %" PRIu64
+                   " for section '%s'", seq, idstr);
+        ret = -EINVAL;
+        goto out_free;
+    }
+
+    g_hash_table_insert(se->load_buffers, &buf->seq, buf);
+    if (se->load_buffers_busy) {
+        goto out;
+    }
+
+    se->load_buffers_busy = true;
+    while (!mis->device_state_cancelled &&
+           g_hash_table_steal_extended(se->load_buffers,
+                                       &se->load_buffers_next,
+                                       NULL, (gpointer *)&buf)) {
+        qemu_mutex_unlock(&mis->device_state_mutex);
+
+        ret = se->ops->load_state_buffer(se->opaque, buf->data, buf->len,
+                                         errp);
+        trace_loadvm_load_state_buffer(se->idstr, se->instance_id, buf->seq,
+                                       buf->len, ret);
+        load_state_buffer_free(buf);
+
+        qemu_mutex_lock(&mis->device_state_mutex);
+        if (ret) {
+            error_prepend(errp, "Failed to load state of device %s: ",
+                          se->idstr);
+            break;
+        }
+        se->load_buffers_next++;
+    }
+    se->load_buffers_busy = false;
+    qemu_cond_broadcast(&mis->device_state_cond);
+    goto out;
+
+out_free:
+    load_state_buffer_free(buf);
+out:
+    qemu_mutex_unlock(&mis->device_state_mutex);
+    return ret;
+}
+
+/* Wakes up everything that waits for device state buffers */
+void qemu_loadvm_device_state_cancel(void)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+
+    WITH_QEMU_LOCK_GUARD(&mis->device_state_mutex) {
+        mis->device_state_cancelled = true;
+        qemu_cond_broadcast(&mis->device_state_cond);
+    }
+}
+
+static int loadvm_handle_device_state_start(MigrationIncomingState *mis)
+{
+    WITH_QEMU_LOCK_GUARD(&mis->device_state_mutex) {
+        mis->device_state_started = true;
+        qemu_cond_broadcast(&mis->device_state_cond);
+    }
+
+    trace_loadvm_handle_device_state_start();
+    return 0;
+}
+
+/*
+ * Waits until all the device state buffers of a section were loaded, so
+ * that the section can be loaded next.  Payload format:
+ *
+ * len (1 byte) + idstr (<256 bytes) + instance_id (4 bytes) +
+ * number of buffers (8 bytes)
+ */
+static int loadvm_handle_device_state_complete(MigrationIncomingState *mis,
+                                               uint16_t len)
+{
+    QEMUFile *file = mis->from_src_file;
+    char idstr[256];
+    uint32_t instance_id;
+    uint64_t num_buffers;
+    SaveStateEntry *se;
+    size_t cnt;
+    int ret = 0;
+
+    cnt = qemu_get_counted_string(file, idstr);
+    instance_id = qemu_get_be32(file);
+    num_buffers = qemu_get_be64(file);
+
+    /* Validate before using the data */
+    if (qemu_file_get_error(file)) {
+        return qemu_file_get_error(file);
+    }
+
+    if (!cnt || len != cnt + 1 + sizeof(uint32_t) + sizeof(uint64_t)) {
+        error_report("%s: invalid payload length (%d)", __func__, len);
+        return -EINVAL;
+    }
+
+    se = find_se(idstr, instance_id);
+    if (!se || !se->ops || !se->ops->load_state_buffer) {
+        error_report("%s: unknown section '%s' instance %" PRIu32,
+                     __func__, idstr, instance_id);
+        return -EINVAL;
+    }
+
+    trace_loadvm_handle_device_state_complete(idstr, instance_id, num_buffers);
+
+    WITH_QEMU_LOCK_GUARD(&mis->device_state_mutex) {
+        while (!mis->device_state_cancelled &&
+               (se->load_buffers_busy ||
+                se->load_buffers_next < num_buffers)) {
+            qemu_cond_wait(&mis->device_state_cond, &mis->device_state_mutex);
+        }
+
+        if (mis->device_state_cancelled) {
+            error_report("%s: loading device state of '%s' was cancelled",
+                         __func__, idstr);
+            ret = -ECANCELED;
+        } else if (se->load_buffers_next != num_buffers ||
+                   (se->load_buffers &&
+                    g_hash_table_size(se->load_buffers))) {
+            error_report("%s: received unexpected device state buffers "
+                         "for '%s'", __func__, idstr);
+            ret = -EINVAL;
+        }
+    }
+
+    return ret;
+}
+
 static int loadvm_process_enable_colo(MigrationIncomingState *mis)
 {
     int ret = migration_incoming_enable_colo();
@@ -2527,6 +3007,12 @@ static int loadvm_process_command(QEMUFile *f)
 
     case MIG_CMD_ENABLE_COLO:
         return loadvm_process_enable_colo(mis);
+
+    case MIG_CMD_DEVICE_STATE_START:
+        return loadvm_handle_device_state_start(mis);
+
+    case MIG_CMD_DEVICE_STATE_COMPLETE:
+        return loadvm_handle_device_state_complete(mis, len);
     }
 
     return 0;
@@ -2765,9 +3251,15 @@ static void qemu_loadvm_state_switchover_ack_needed(MigrationIncomingState *mis)
 static int qemu_loadvm_state_setup(QEMUFile *f, Error **errp)
 {
     ERRP_GUARD();
+    MigrationIncomingState *mis = migration_incoming_get_current();
     SaveStateEntry *se;
     int ret;
 
+    WITH_QEMU_LOCK_GUARD(&mis->device_state_mutex) {
+        mis->device_state_started = false;
+        mis->device_state_cancelled = false;
+    }
+
     trace_loadvm_state_setup();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (!se->ops || !se->ops->load_setup) {
@@ -2790,11 +3282,36 @@ static int qemu_loadvm_state_setup(QEMUFile *f, Error **errp)
     return 0;
 }
 
+/*
+ * Stops loading device state buffers and frees the ones that were not
+ * loaded.  The multifd receive threads can still be running here when
+ * the incoming migration failed.
+ */
+static void qemu_loadvm_device_state_cleanup(void)
+{
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    SaveStateEntry *se;
+
+    QEMU_LOCK_GUARD(&mis->device_state_mutex);
+
+    mis->device_state_cancelled = true;
+    qemu_cond_broadcast(&mis->device_state_cond);
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        while (se->load_buffers_busy) {
+            qemu_cond_wait(&mis->device_state_cond, &mis->device_state_mutex);
+        }
+        g_clear_pointer(&se->load_buffers, g_hash_table_destroy);
+        se->load_buffers_next = 0;
+    }
+}
+
 void qemu_loadvm_state_cleanup(void)
 {
     SaveStateEntry *se;
 
     trace_loadvm_state_cleanup();
+    qemu_loadvm_device_state_cleanup();
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
         if (se->ops && se->ops->load_cleanup) {
             se->ops->load_cleanup(se->opaque);
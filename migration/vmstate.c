@@ -18,7 +18,9 @@
 #include "qapi/qmp/json-writer.h"
 #include "qemu-file.h"
 #include "qemu/bitops.h"
+#include "qemu/bswap.h"
 #include "qemu/error-report.h"
+#include "qemu/lockable.h"
 #include "trace.h"
 
 static int vmstate_subsection_save(QEMUFile *f, const VMStateDescription *vmsd,
@@ -100,10 +102,283 @@ static void vmstate_handle_alloc(void *ptr, const VMStateField *field,
     }
 }
 
+/*
+ * Compiled VMStateDescriptions
+ *
+ * Most fields are integers or byte buffers that are stored in the stream
+ * as they are in memory, except for the byte order.  Booleans are not: any
+ * non-zero byte loads as true, so they are always interpreted.  The first time a
+ * VMStateDescription is used, consecutive fields of that kind are compiled
+ * into a run of segments, each one a contiguous range of memory that is
+ * copied in bulk and, if necessary, byte-swapped in place.  This avoids the
+ * per-field checks and the per-element calls of the interpreter, while the
+ * stream stays the same.  All other fields are interpreted.
+ */
+
+/* Bytes that are byte-swapped at a time when saving a run */
+#define VMSTATE_RUN_CHUNK 512
+
+typedef struct VMStateSegment {
+    size_t offset;
+    size_t len;
+    /* Width of the elements to byte-swap, or 0 */
+    unsigned int swap;
+} VMStateSegment;
+
+typedef struct VMStateRun {
+    const VMStateField *field;
+    unsigned int nfields;
+    /* All fields of the run exist from this version on */
+    int version_id;
+    unsigned int nsegs;
+    VMStateSegment segs[];
+} VMStateRun;
+
+static QemuMutex vmstate_plan_lock;
+/*
+ * Maps a VMStateDescription to an array of runs indexed by field, which is
+ * NULL for interpreted fields and inside runs.  Most VMStateDescriptions
+ * are static, the others must drop their plan with vmstate_forget_plan()
+ * before they are freed.
+ */
+static GHashTable *vmstate_plans;
+static bool vmstate_compiled = true;
+
+void vmstate_set_compiled(bool enabled)
+{
+    qatomic_set(&vmstate_compiled, enabled);
+}
+
+/* Returns the element width of a field that can be part of a run, or 0 */
+static unsigned int vmstate_field_width(const VMStateField *field)
+{
+    const VMStateInfo *info = field->info;
+    unsigned int width;
+
+    if (field->field_exists ||
+        (field->flags & ~(VMS_SINGLE | VMS_ARRAY | VMS_BUFFER |
+                          VMS_MUST_EXIST))) {
+        return 0;
+    }
+
+    if (info == &vmstate_info_buffer) {
+        return 1;
+    } else if (info == &vmstate_info_uint8 || info == &vmstate_info_int8) {
+        width = 1;
+    } else if (info == &vmstate_info_uint16 || info == &vmstate_info_int16) {
+        width = 2;
+    } else if (info == &vmstate_info_uint32 || info == &vmstate_info_int32) {
+        width = 4;
+    } else if (info == &vmstate_info_uint64 || info == &vmstate_info_int64) {
+        width = 8;
+    } else {
+        return 0;
+    }
+
+    return field->size == width ? width : 0;
+}
+
+static VMStateRun *vmstate_compile_run(const VMStateField *field)
+{
+    g_autoptr(GArray) segs = g_array_new(false, false,
+                                         sizeof(VMStateSegment));
+    unsigned int nfields = 0;
+    int version_id = 0;
+    VMStateRun *run;
+
+    for (; field[nfields].name; nfields++) {
+        const VMStateField *cur = &field[nfields];
+        unsigned int width = vmstate_field_width(cur);
+        VMStateSegment seg, *last;
+        int n_elems;
+
+        if (!width) {
+            break;
+        }
+
+        n_elems = cur->flags & VMS_ARRAY ? cur->num : 1;
+        assert(n_elems >= 0);
+        version_id = MAX(version_id, cur->version_id);
+
+        seg.offset = cur->offset;
+        seg.len = cur->size * n_elems;
+        seg.swap = width > 1 && !HOST_BIG_ENDIAN ? width : 0;
+        if (!seg.len) {
+            continue;
+        }
+
+        last = segs->len ? &g_array_index(segs, VMStateSegment,
+                                          segs->len - 1) : NULL;
+        if (last && last->swap == seg.swap &&
+            last->offset + last->len == seg.offset) {
+            last->len += seg.len;
+        } else {
+            g_array_append_val(segs, seg);
+        }
+    }
+
+    if (!nfields) {
+        return NULL;
+    }
+
+    run = g_malloc(sizeof(*run) + segs->len * sizeof(VMStateSegment));
+    run->field = field;
+    run->nfields = nfields;
+    run->version_id = version_id;
+    run->nsegs = segs->len;
+    memcpy(run->segs, segs->data, segs->len * sizeof(VMStateSegment));
+    return run;
+}
+
+static VMStateRun **vmstate_compile(const VMStateDescription *vmsd)
+{
+    unsigned int i, nfields = 0, nruns = 0;
+    VMStateRun **plan;
+
+    while (vmsd->fields[nfields].name) {
+        nfields++;
+    }
+
+    /* One more for the end of the list, so that the plan is never NULL */
+    plan = g_new0(VMStateRun *, nfields + 1);
+    for (i = 0; i < nfields; i++) {
+        plan[i] = vmstate_compile_run(&vmsd->fields[i]);
+        if (plan[i]) {
+            i += plan[i]->nfields - 1;
+            nruns++;
+        }
+    }
+
+    trace_vmstate_compile(vmsd->name, nfields, nruns);
+    return plan;
+}
+
+static void __attribute__((__constructor__)) vmstate_plan_init(void)
+{
+    qemu_mutex_init(&vmstate_plan_lock);
+}
+
+/* Returns NULL if VMStateDescriptions are interpreted */
+static VMStateRun * const *vmstate_get_plan(const VMStateDescription *vmsd)
+{
+    VMStateRun **plan;
+
+    if (!qatomic_read(&vmstate_compiled)) {
+        return NULL;
+    }
+
+    QEMU_LOCK_GUARD(&vmstate_plan_lock);
+    if (!vmstate_plans) {
+        vmstate_plans = g_hash_table_new(NULL, NULL);
+    }
+    plan = g_hash_table_lookup(vmstate_plans, vmsd);
+    if (!plan) {
+        plan = vmstate_compile(vmsd);
+        g_hash_table_insert(vmstate_plans, (gpointer)vmsd, plan);
+    }
+    return plan;
+}
+
+static void vmstate_free_plan(const VMStateDescription *vmsd,
+                              VMStateRun **plan)
+{
+    unsigned int i;
+
+    for (i = 0; vmsd->fields[i].name; i++) {
+        g_free(plan[i]);
+    }
+    g_free(plan);
+}
+
+void vmstate_forget_plan(const VMStateDescription *vmsd)
+{
+    const VMStateField *field;
+    const VMStateDescription * const *sub;
+    VMStateRun **plan;
+
+    WITH_QEMU_LOCK_GUARD(&vmstate_plan_lock) {
+        plan = vmstate_plans ? g_hash_table_lookup(vmstate_plans, vmsd) : NULL;
+        if (!plan) {
+            return;
+        }
+        g_hash_table_remove(vmstate_plans, vmsd);
+    }
+    vmstate_free_plan(vmsd, plan);
+
+    /* Nested descriptions may have been allocated together with @vmsd */
+    for (field = vmsd->fields; field->name; field++) {
+        if (field->vmsd) {
+            vmstate_forget_plan(field->vmsd);
+        }
+    }
+    for (sub = vmsd->subsections; sub && *sub; sub++) {
+        vmstate_forget_plan(*sub);
+    }
+}
+
+/* Byte-swaps @len bytes of @width wide elements, @dst may be @src */
+static void vmstate_bswap(void *dst, const void *src, size_t len,
+                          unsigned int width)
+{
+    size_t i;
+
+    switch (width) {
+    case 2:
+        for (i = 0; i < len; i += 2) {
+            stw_he_p(dst + i, bswap16(lduw_he_p(src + i)));
+        }
+        break;
+    case 4:
+        for (i = 0; i < len; i += 4) {
+            stl_he_p(dst + i, bswap32(ldl_he_p(src + i)));
+        }
+        break;
+    case 8:
+        for (i = 0; i < len; i += 8) {
+            stq_he_p(dst + i, bswap64(ldq_he_p(src + i)));
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+static int vmstate_load_run(QEMUFile *f, const VMStateDescription *vmsd,
+                            const VMStateRun *run, void *opaque)
+{
+    unsigned int i;
+    int ret = 0;
+
+    trace_vmstate_load_state_run(vmsd->name, run->field->name, run->nfields);
+    for (i = 0; i < run->nsegs; i++) {
+        const VMStateSegment *seg = &run->segs[i];
+        void *ptr = opaque + seg->offset;
+
+        if (qemu_get_buffer(f, ptr, seg->len) != seg->len) {
+            ret = qemu_file_get_error(f) ?: -EIO;
+            break;
+        }
+        if (seg->swap) {
+            vmstate_bswap(ptr, ptr, seg->len, seg->swap);
+        }
+    }
+    if (!ret) {
+        ret = qemu_file_get_error(f);
+    }
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        error_report("Failed to load %s:%s", vmsd->name, run->field->name);
+        trace_vmstate_load_field_error(run->field->name, ret);
+        return ret;
+    }
+    return 0;
+}
+
 int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
                        void *opaque, int version_id)
 {
     const VMStateField *field = vmsd->fields;
+    VMStateRun * const *plan = vmstate_get_plan(vmsd);
     int ret = 0;
 
     trace_vmstate_load_state(vmsd->name, version_id);
@@ -128,7 +403,19 @@ int vmstate_load_state(QEMUFile *f, const VMStateDescription *vmsd,
         }
     }
     while (field->name) {
-        bool exists = vmstate_field_exists(vmsd, field, opaque, version_id);
+        const VMStateRun *run = plan ? plan[field - vmsd->fields] : NULL;
+        bool exists;
+
+        if (run && version_id >= run->version_id) {
+            ret = vmstate_load_run(f, vmsd, run, opaque);
+            if (ret < 0) {
+                return ret;
+            }
+            field += run->nfields;
+            continue;
+        }
+
+        exists = vmstate_field_exists(vmsd, field, opaque, version_id);
         trace_vmstate_load_state_field(vmsd->name, field->name, exists);
         if (exists) {
             void *first_elem = opaque + field->offset;
@@ -325,6 +612,45 @@ static void vmsd_desc_field_end(const VMStateDescription *vmsd,
     json_writer_end_object(vmdesc);
 }
 
+static void vmstate_save_run(QEMUFile *f, const VMStateDescription *vmsd,
+                             const VMStateRun *run, void *opaque,
+                             JSONWriter *vmdesc)
+{
+    uint8_t buf[VMSTATE_RUN_CHUNK];
+    unsigned int i;
+
+    trace_vmstate_save_state_run(vmsd->name, run->field->name, run->nfields);
+    for (i = 0; i < run->nsegs; i++) {
+        const VMStateSegment *seg = &run->segs[i];
+        const void *ptr = opaque + seg->offset;
+        size_t done, len;
+
+        if (!seg->swap) {
+            qemu_put_buffer(f, ptr, seg->len);
+            continue;
+        }
+        for (done = 0; done < seg->len; done += len) {
+            len = MIN(seg->len - done, sizeof(buf));
+            vmstate_bswap(buf, ptr + done, len, seg->swap);
+            qemu_put_buffer(f, buf, len);
+        }
+    }
+
+    if (!vmdesc) {
+        return;
+    }
+
+    /* Describe the fields like the interpreter does for compressed arrays */
+    for (i = 0; i < run->nfields; i++) {
+        const VMStateField *field = &run->field[i];
+        int n_elems = field->flags & VMS_ARRAY ? field->num : 1;
+
+        if (n_elems) {
+            vmsd_desc_field_start(vmsd, vmdesc, field, 0, n_elems);
+            vmsd_desc_field_end(vmsd, vmdesc, field, field->size, 0);
+        }
+    }
+}
 
 bool vmstate_section_needed(const VMStateDescription *vmsd, void *opaque)
 {
@@ -353,6 +679,7 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
 {
     int ret = 0;
     const VMStateField *field = vmsd->fields;
+    VMStateRun * const *plan = vmstate_get_plan(vmsd);
 
     trace_vmstate_save_state_top(vmsd->name);
 
@@ -372,6 +699,14 @@ int vmstate_save_state_v(QEMUFile *f, const VMStateDescription *vmsd,
     }
 
     while (field->name) {
+        const VMStateRun *run = plan ? plan[field - vmsd->fields] : NULL;
+
+        if (run && version_id >= run->version_id) {
+            vmstate_save_run(f, vmsd, run, opaque, vmdesc);
+            field += run->nfields;
+            continue;
+        }
+
         if (vmstate_field_exists(vmsd, field, opaque, version_id)) {
             void *first_elem = opaque + field->offset;
             int i, n_elems = vmstate_n_elems(opaque, field);
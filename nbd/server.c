@@ -28,6 +28,7 @@
 #include "nbd-internal.h"
 #include "qemu/units.h"
 #include "qemu/memalign.h"
+#include "sysemu/iothread.h"
 
 #define NBD_META_ID_BASE_ALLOCATION 0
 #define NBD_META_ID_ALLOCATION_DEPTH 1
@@ -101,6 +102,13 @@ struct NBDExport {
     bool allocation_depth;
     BdrvDirtyBitmap **export_bitmaps;
     size_t nr_export_bitmaps;
+
+    /* IOThreads that clients are distributed across, main loop only */
+    IOThread **iothreads;
+    size_t nr_iothreads;
+    size_t next_iothread;
+
+    bool zero_copy;
 };
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
@@ -121,6 +129,15 @@ struct NBDMetaContexts {
                     */
 };
 
+/* A read buffer that may still be referenced by the kernel for zero copy */
+typedef struct NBDZeroCopyBuffer {
+    void *data;
+    uint64_t len;
+    /* Freed once this many zero copy writes on the socket have completed */
+    ssize_t seq;
+    QSIMPLEQ_ENTRY(NBDZeroCopyBuffer) next;
+} NBDZeroCopyBuffer;
+
 struct NBDClient {
     int refcount; /* atomic */
     void (*close_fn)(NBDClient *client, bool negotiated);
@@ -135,9 +152,24 @@ struct NBDClient {
 
     Coroutine *recv_coroutine; /* protected by lock */
 
+    /*
+     * AioContext the client's requests are processed in, or NULL if the
+     * client follows the export's AioContext
+     */
+    AioContext *ctx;
+
     CoMutex send_lock;
     Coroutine *send_coroutine;
 
+    /*
+     * Read buffers whose data was sent with MSG_ZEROCOPY and may still be
+     * referenced by the kernel, in the order they were sent.  Protected by
+     * send_lock.
+     */
+    bool zero_copy;
+    QSIMPLEQ_HEAD(, NBDZeroCopyBuffer) zero_copy_bufs;
+    uint64_t zero_copy_pending;
+
     bool read_yielding; /* protected by lock */
     bool quiescing; /* protected by lock */
 
@@ -472,6 +504,44 @@ nbd_check_meta_export(NBDClient *client, NBDExport *exp)
     }
 }
 
+/*
+ * Attach @client to @exp once negotiation has selected the export.  Clients
+ * are distributed round-robin across the export's IOThreads, if any.
+ * Runs in the main loop thread.
+ */
+static void nbd_export_add_client(NBDExport *exp, NBDClient *client)
+{
+    client->exp = exp;
+    QTAILQ_INSERT_TAIL(&exp->clients, client, next);
+    blk_exp_ref(&exp->common);
+
+    if (exp->nr_iothreads) {
+        IOThread *iothread = exp->iothreads[exp->next_iothread];
+
+        exp->next_iothread = (exp->next_iothread + 1) % exp->nr_iothreads;
+        client->ctx = iothread_get_aio_context(iothread);
+    }
+
+    /*
+     * With TLS, the data is encrypted into a separate buffer anyway, so
+     * zero copy is only useful for plain sockets.  Not all socket types
+     * support it either (e.g. UNIX domain sockets), just fall back to
+     * copying for those.
+     */
+    if (exp->zero_copy && client->ioc == QIO_CHANNEL(client->sioc)) {
+        client->zero_copy =
+            qio_channel_socket_enable_zero_copy(client->sioc, NULL) == 0;
+    }
+
+    trace_nbd_export_add_client(exp->name, client->ctx, client->zero_copy);
+}
+
+/* Runs in export AioContext and main loop thread */
+static AioContext *nbd_client_aio_context(NBDClient *client)
+{
+    return client->ctx ?: nbd_export_aio_context(client->exp);
+}
+
 /* Send a reply to NBD_OPT_EXPORT_NAME.
  * Return -errno on error, 0 on success. */
 static coroutine_fn int
@@ -534,8 +604,7 @@ nbd_negotiate_handle_export_name(NBDClient *client, bool no_zeroes,
         return ret;
     }
 
-    QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
-    blk_exp_ref(&client->exp->common);
+    nbd_export_add_client(client->exp, client);
 
     return 0;
 }
@@ -748,10 +817,8 @@ nbd_negotiate_handle_info(NBDClient *client, Error **errp)
     }
 
     if (client->opt == NBD_OPT_GO) {
-        client->exp = exp;
         client->check_align = check_align;
-        QTAILQ_INSERT_TAIL(&client->exp->clients, client, next);
-        blk_exp_ref(&client->exp->common);
+        nbd_export_add_client(exp, client);
         rc = 1;
     }
     return rc;
@@ -1544,6 +1611,33 @@ static int coroutine_fn nbd_receive_request(NBDClient *client, NBDRequest *reque
 
 #define MAX_NBD_REQUESTS 16
 
+/*
+ * Read payloads smaller than this are copied, MSG_ZEROCOPY only pays off for
+ * larger writes
+ */
+#define NBD_ZERO_COPY_MIN_SIZE (64 * KiB)
+
+/* Amount of read buffers that may be pinned for zero copy per client */
+#define NBD_ZERO_COPY_MAX_PENDING (64 * MiB)
+
+/*
+ * Free the zero copy buffers of @client whose writes are among the first
+ * @completed zero copy writes on the socket
+ */
+static void nbd_client_free_zero_copy_bufs(NBDClient *client,
+                                           ssize_t completed)
+{
+    NBDZeroCopyBuffer *buf;
+
+    while ((buf = QSIMPLEQ_FIRST(&client->zero_copy_bufs)) &&
+           buf->seq <= completed) {
+        QSIMPLEQ_REMOVE_HEAD(&client->zero_copy_bufs, next);
+        client->zero_copy_pending -= buf->len;
+        qemu_vfree(buf->data);
+        g_free(buf);
+    }
+}
+
 /* Runs in export AioContext and main loop thread */
 void nbd_client_get(NBDClient *client)
 {
@@ -1571,6 +1665,11 @@ void nbd_client_put(NBDClient *client)
             blk_exp_unref(&client->exp->common);
         }
         g_free(client->contexts.bitmaps);
+        /*
+         * client_close() has shut the socket down, so the data of buffers
+         * whose zero copy writes haven't completed doesn't matter any more.
+         */
+        nbd_client_free_zero_copy_bufs(client, SSIZE_MAX);
         qemu_mutex_destroy(&client->lock);
         g_free(client);
     }
@@ -1743,7 +1842,7 @@ static bool nbd_drained_poll(void *opaque)
                  * qio_channel_yield().
                  */
                 if (client->recv_coroutine != NULL && client->read_yielding) {
-                    aio_bh_schedule_oneshot(nbd_export_aio_context(client->exp),
+                    aio_bh_schedule_oneshot(nbd_client_aio_context(client),
                                             nbd_wake_read_bh, client);
                 }
 
@@ -1793,6 +1892,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
     uint64_t perm, shared_perm;
     bool readonly = !exp_args->writable;
     BlockDirtyBitmapOrStrList *bitmaps;
+    strList *iothreads;
     size_t i;
     int ret;
 
@@ -1915,12 +2015,31 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
         assert(strlen(bitmap) <= BDRV_BITMAP_MAX_NAME_SIZE);
     }
 
+    for (iothreads = arg->iothreads; iothreads; iothreads = iothreads->next) {
+        exp->nr_iothreads++;
+    }
+    exp->iothreads = g_new0(IOThread *, exp->nr_iothreads);
+    for (i = 0, iothreads = arg->iothreads; iothreads;
+         i++, iothreads = iothreads->next)
+    {
+        exp->iothreads[i] = iothread_by_id(iothreads->value);
+        if (!exp->iothreads[i]) {
+            ret = -ENOENT;
+            error_setg(errp, "iothread \"%s\" not found", iothreads->value);
+            goto fail;
+        }
+    }
+    for (i = 0; i < exp->nr_iothreads; i++) {
+        object_ref(OBJECT(exp->iothreads[i]));
+    }
+
     /* Mark bitmaps busy in a separate loop, to simplify roll-back concerns. */
     for (i = 0; i < exp->nr_export_bitmaps; i++) {
         bdrv_dirty_bitmap_set_busy(exp->export_bitmaps[i], true);
     }
 
     exp->allocation_depth = arg->allocation_depth;
+    exp->zero_copy = arg->has_zero_copy && arg->zero_copy;
 
     /*
      * We need to inhibit request queuing in the block layer to ensure we can
@@ -1941,6 +2060,7 @@ static int nbd_export_create(BlockExport *blk_exp, BlockExportOptions *exp_args,
 
 fail:
     bdrv_graph_rdunlock_main_loop();
+    g_free(exp->iothreads);
     g_free(exp->export_bitmaps);
     g_free(exp->name);
     g_free(exp->description);
@@ -2011,6 +2131,11 @@ static void nbd_export_delete(BlockExport *blk_exp)
     for (i = 0; i < exp->nr_export_bitmaps; i++) {
         bdrv_dirty_bitmap_set_busy(exp->export_bitmaps[i], false);
     }
+
+    for (i = 0; i < exp->nr_iothreads; i++) {
+        object_unref(OBJECT(exp->iothreads[i]));
+    }
+    g_free(exp->iothreads);
 }
 
 const BlockExportDriver blk_exp_nbd = {
@@ -2038,6 +2163,116 @@ static int coroutine_fn nbd_co_send_iov(NBDClient *client, struct iovec *iov,
     return ret;
 }
 
+/*
+ * Like nbd_co_send_iov(), but the last element of @iov is the payload of a
+ * read reply, which is sent with MSG_ZEROCOPY if the client uses zero copy.
+ * The headers are always copied because they live on the caller's stack.
+ * The payload buffer must then be passed to nbd_co_release_read_buffer()
+ * instead of being freed.
+ */
+static int coroutine_fn nbd_co_send_read_iov(NBDClient *client,
+                                             struct iovec *iov, unsigned niov,
+                                             Error **errp)
+{
+    struct iovec *payload = &iov[niov - 1];
+    int ret;
+
+    g_assert(qemu_in_coroutine());
+    qemu_co_mutex_lock(&client->send_lock);
+    client->send_coroutine = qemu_coroutine_self();
+
+    if (client->zero_copy && payload->iov_len >= NBD_ZERO_COPY_MIN_SIZE) {
+        ret = qio_channel_writev_all(client->ioc, iov, niov - 1, errp);
+        if (ret == 0) {
+            ret = qio_channel_writev_full_all(
+                client->ioc, payload, 1, NULL, 0,
+                QIO_CHANNEL_WRITE_FLAG_ZERO_COPY |
+                QIO_CHANNEL_WRITE_FLAG_ZERO_COPY_FALLBACK, errp);
+        }
+    } else {
+        ret = qio_channel_writev_all(client->ioc, iov, niov, errp);
+    }
+
+    client->send_coroutine = NULL;
+    qemu_co_mutex_unlock(&client->send_lock);
+
+    return ret < 0 ? -EIO : 0;
+}
+
+/*
+ * Free the read buffer @data of @len bytes after its reply was sent, or once
+ * the kernel has completed the zero copy writes that may reference it.
+ *
+ * With @wait, limit the memory that is pinned this way: the coroutine
+ * yields until the socket reports enough completions, holding send_lock so
+ * that no further replies are sent in the meantime.  Completions of the
+ * other zero copy writes are also collected while the client waits for the
+ * next request.
+ */
+static int coroutine_fn nbd_co_release_read_buffer(NBDClient *client,
+                                                   void *data, uint64_t len,
+                                                   bool wait, Error **errp)
+{
+    QIOChannelSocket *sioc = client->sioc;
+    NBDZeroCopyBuffer *buf;
+    int ret = 0;
+
+    qemu_co_mutex_lock(&client->send_lock);
+    qio_channel_socket_reap_zero_copy(sioc);
+    nbd_client_free_zero_copy_bufs(client, sioc->zero_copy_sent);
+
+    if (sioc->zero_copy_sent == sioc->zero_copy_queued) {
+        qemu_vfree(data);
+    } else {
+        buf = g_new(NBDZeroCopyBuffer, 1);
+        *buf = (NBDZeroCopyBuffer) {
+            .data = data,
+            .len = len,
+            .seq = sioc->zero_copy_queued,
+        };
+        QSIMPLEQ_INSERT_TAIL(&client->zero_copy_bufs, buf, next);
+        client->zero_copy_pending += len;
+    }
+
+    while (wait && client->zero_copy_pending >= NBD_ZERO_COPY_MAX_PENDING &&
+           !sioc->zero_copy_err) {
+        WITH_QEMU_LOCK_GUARD(&client->lock) {
+            if (client->closing) {
+                /* nbd_client_put() frees the buffers */
+                wait = false;
+            }
+        }
+        if (wait) {
+            /*
+             * Requests from the client wake us up as well.  At worst, this
+             * polls until the client has acknowledged enough data.
+             */
+            qio_channel_yield(client->ioc, G_IO_ERR);
+            qio_channel_socket_reap_zero_copy(sioc);
+            nbd_client_free_zero_copy_bufs(client, sioc->zero_copy_sent);
+        }
+    }
+
+    /*
+     * Once all writes have completed, this returns immediately and tells
+     * whether the kernel had to copy the data anyway (e.g. on loopback).
+     * It also reports errors of the completions reaped so far.
+     */
+    if ((sioc->zero_copy_sent == sioc->zero_copy_queued &&
+         sioc->zero_copy_sent != sioc->zero_copy_flushed) ||
+        sioc->zero_copy_err) {
+        ret = qio_channel_flush(client->ioc, wait ? errp : NULL);
+        trace_nbd_co_zero_copy_flush(client->zero_copy_pending, ret);
+        if (ret == 1) {
+            client->zero_copy = false;
+        }
+        ret = ret < 0 ? -EIO : 0;
+    }
+
+    qemu_co_mutex_unlock(&client->send_lock);
+    return ret;
+}
+
 static inline void set_be_simple_reply(NBDSimpleReply *reply, uint64_t error,
                                        uint64_t cookie)
 {
@@ -2069,7 +2304,7 @@ static int coroutine_fn nbd_co_send_simple_reply(NBDClient *client,
                                    nbd_err_lookup(nbd_err), len);
     set_be_simple_reply(&reply, nbd_err, request->cookie);
 
-    return nbd_co_send_iov(client, iov, 2, errp);
+    return nbd_co_send_read_iov(client, iov, 2, errp);
 }
 
 /*
@@ -2150,7 +2385,7 @@ static int coroutine_fn nbd_co_send_chunk_read(NBDClient *client,
                  NBD_REPLY_TYPE_OFFSET_DATA, request);
     stq_be_p(&chunk.offset, offset);
 
-    return nbd_co_send_iov(client, iov, 3, errp);
+    return nbd_co_send_read_iov(client, iov, 3, errp);
 }
 
 static int coroutine_fn nbd_co_send_chunk_error(NBDClient *client,
@@ -3119,6 +3354,23 @@ static coroutine_fn void nbd_trip(void *opaque)
         error_free(export_err);
     } else {
         ret = nbd_handle_request(client, &request, req->data, &local_err);
+        if (request.type == NBD_CMD_READ && req->data) {
+            /*
+             * Even if sending the reply failed, part of the payload may be
+             * referenced for zero copy.  Don't wait for completions then,
+             * the client is about to be disconnected.
+             */
+            bool sent = ret >= 0;
+            int release_ret;
+
+            release_ret = nbd_co_release_read_buffer(client, req->data,
+                                                     request.len, sent,
+                                                     sent ? &local_err : NULL);
+            req->data = NULL;
+            if (sent) {
+                ret = release_ret;
+            }
+        }
     }
     if (request.contexts && request.contexts != &client->contexts) {
         assert(request.type == NBD_CMD_BLOCK_STATUS);
@@ -3180,7 +3432,8 @@ static void nbd_client_receive_next_request(NBDClient *client)
         nbd_client_get(client);
         req = nbd_request_get(client);
         client->recv_coroutine = qemu_coroutine_create(nbd_trip, req);
-        aio_co_schedule(client->exp->common.ctx, client->recv_coroutine);
+        aio_co_schedule(nbd_client_aio_context(client),
+                        client->recv_coroutine);
     }
 }
 
@@ -3219,6 +3472,7 @@ void nbd_client_new(QIOChannelSocket *sioc,
 
     client = g_new0(NBDClient, 1);
     qemu_mutex_init(&client->lock);
+    QSIMPLEQ_INIT(&client->zero_copy_bufs);
     client->refcount = 1;
     client->tlscreds = tlscreds;
     if (tlscreds) {
@@ -86,6 +86,7 @@ enum {
     OPTION_BITMAPS = 275,
     OPTION_FORCE = 276,
     OPTION_SKIP_BROKEN = 277,
+    OPTION_DEDUP = 278,
 };
 
 typedef enum OutputFormat {
@@ -171,6 +172,7 @@ void help(void)
            "    is 'snapshot.id=[ID],snapshot.name=[NAME]', or\n"
            "    '[ID_OR_NAME]'\n"
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
+           "  '--dedup' stores identical compressed clusters only once (qcow2 only)\n"
            "  '-u' allows unsafe backing chains. For rebasing, it is assumed that old and\n"
            "       new backing file match exactly. The image doesn't need a working\n"
            "       backing file before rebasing in this case (useful for renaming the\n"
@@ -2253,6 +2255,7 @@ static int img_convert(int argc, char **argv)
     bool explict_min_sparse = false;
     bool bitmaps = false;
     bool skip_broken = false;
+    bool dedup = false;
     int64_t rate_limit = 0;
 
     ImgConvertState s = (ImgConvertState) {
@@ -2275,6 +2278,7 @@ static int img_convert(int argc, char **argv)
             {"target-is-zero", no_argument, 0, OPTION_TARGET_IS_ZERO},
             {"bitmaps", no_argument, 0, OPTION_BITMAPS},
             {"skip-broken-bitmaps", no_argument, 0, OPTION_SKIP_BROKEN},
+            {"dedup", no_argument, 0, OPTION_DEDUP},
             {0, 0, 0, 0}
         };
         c = getopt_long(argc, argv, ":hf:O:B:CcF:o:l:S:pt:T:qnm:WUr:",
@@ -2409,6 +2413,9 @@ static int img_convert(int argc, char **argv)
         case OPTION_SKIP_BROKEN:
             skip_broken = true;
             break;
+        case OPTION_DEDUP:
+            dedup = true;
+            break;
         }
     }
 
@@ -2426,6 +2433,17 @@ static int img_convert(int argc, char **argv)
         goto fail_getopt;
     }
 
+    if (dedup && !s.compressed) {
+        error_report("Use of --dedup requires -c");
+        goto fail_getopt;
+    }
+
+    if (dedup && skip_create) {
+        error_report("--dedup cannot be used with -n, use "
+                     "--target-image-opts with dedup=on instead");
+        goto fail_getopt;
+    }
+
     if (explict_min_sparse && s.copy_range) {
         error_report("Cannot enable copy offloading when -S is used");
         goto fail_getopt;
@@ -2666,6 +2684,9 @@ static int img_convert(int argc, char **argv)
     if (!skip_create) {
         open_opts = qdict_new();
         qemu_opt_foreach(opts, img_add_key_secrets, open_opts, &error_abort);
+        if (dedup) {
+            qdict_put_bool(open_opts, "dedup", true);
+        }
 
         /* Create the new image */
         ret = bdrv_create(drv, out_filename, opts, &local_err);
@@ -188,6 +188,7 @@ DEF("accel", HAS_ARG, QEMU_OPTION_accel,
     "                split-wx=on|off (enable TCG split w^x mapping)\n"
     "                tb-size=n (TCG translation block cache size)\n"
     "                dirty-ring-size=n (KVM dirty ring GFN count, default 0)\n"
+    "                dirty-ring-reap-threads=n (threads that collect the KVM dirty rings, default 1)\n"
     "                eager-split-size=n (KVM Eager Page Split chunk size, default 0, disabled. ARM only)\n"
     "                notify-vmexit=run|internal-error|disable,notify-window=n (enable notify VM exit and set notify window, x86 only)\n"
     "                thread=single|multi (enable multi-threaded TCG)\n"
@@ -248,6 +249,13 @@ SRST
         is disabled (dirty-ring-size=0).  When enabled, KVM will instead
         record dirty pages in a bitmap.
 
+    ``dirty-ring-reap-threads=n``
+        When the KVM dirty ring is used, it controls how many threads
+        collect the dirty pages from the rings of the different vCPUs in
+        parallel.  Guests with many vCPUs that dirty memory quickly can
+        use more threads to shorten each dirty bitmap synchronization.
+        The default is 1.
+
     ``eager-split-size=n``
         KVM implements dirty page logging at the PAGE_SIZE granularity and
         enabling dirty-logging on a huge-page requires breaking it into
@@ -1287,7 +1295,7 @@ DEF("blockdev", HAS_ARG, QEMU_OPTION_blockdev,
     "          [,cache.direct=on|off][,cache.no-flush=on|off]\n"
     "          [,read-only=on|off][,auto-read-only=on|off]\n"
     "          [,force-share=on|off][,detect-zeroes=on|off|unmap]\n"
-    "          [,driver specific parameters...]\n"
+    "          [,child-stats=on|off][,driver specific parameters...]\n"
     "                configure a block backend\n", QEMU_ARCH_ALL)
 SRST
 ``-blockdev option[,option[,option[,...]]]``
@@ -1347,6 +1355,13 @@ SRST
 
             Enabling ``force-share=on`` requires ``read-only=on``.
 
+        ``child-stats``
+            With ``child-stats=on``, the node collects statistics about
+            the requests that it sends to its children, which
+            ``query-stats`` returns for target ``block-node``. This is
+            off by default because it adds some overhead to every
+            request.
+
         ``cache.direct``
             The host page cache can be avoided with ``cache.direct=on``.
             This will attempt to do disk IO directly to the guest's
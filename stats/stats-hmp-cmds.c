@@ -92,6 +92,11 @@ static void print_stats_results(Monitor *mon, StatsTarget target,
                        StatsProvider_str(result->provider));
     }
 
+    if (result->node_name) {
+        monitor_printf(mon, "node: %s, child: %s\n", result->node_name,
+                       result->child);
+    }
+
     for (stats_list = result->stats; stats_list;
              stats_list = stats_list->next,
              schema_value_list = schema_value_list->next) {
@@ -229,6 +234,7 @@ void hmp_info_stats(Monitor *mon, const QDict *qdict)
         filter = stats_filter(target, names, cpu_index, provider);
         break;
     case STATS_TARGET_CRYPTODEV:
+    case STATS_TARGET_BLOCK_NODE:
         filter = stats_filter(target, names, -1, provider);
         break;
     default:
@@ -0,0 +1,100 @@
+/*
+ * QEMU HBitmap scan and merge speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/hbitmap.h"
+#include "qemu/units.h"
+
+/* A 4 TiB disk with 64 KiB granularity */
+#define BENCH_BITS  (64 * MiB)
+#define BENCH_BYTES (BENCH_BITS / 8)
+
+/* Sets bits in about @percent of all words */
+static HBitmap *bench_bitmap_new(GRand *rand, int percent)
+{
+    HBitmap *hb = hbitmap_alloc(BENCH_BITS, 0);
+    uint64_t i;
+
+    for (i = 0; i < BENCH_BITS; i += 64) {
+        if (g_rand_int_range(rand, 0, 100) < percent) {
+            hbitmap_set(hb, i + g_rand_int_range(rand, 0, 64),
+                        g_rand_int_range(rand, 1, 64));
+        }
+    }
+    return hb;
+}
+
+static void bench_report(const char *what, int accel_index, double total)
+{
+    total /= MiB;
+    g_test_message("%-16s #%d: %8.0f MB/sec", what, accel_index,
+                   total / g_test_timer_last());
+}
+
+static void test(const void *opaque)
+{
+    GRand *rand = g_rand_new_with_seed(42);
+    HBitmap *a = bench_bitmap_new(rand, 50);
+    HBitmap *b = bench_bitmap_new(rand, 50);
+    HBitmap *sparse = bench_bitmap_new(rand, 1);
+    HBitmap *full = hbitmap_alloc(BENCH_BITS, 0);
+    HBitmap *r = hbitmap_alloc(BENCH_BITS, 0);
+    int accel_index = 0;
+    double total;
+
+    hbitmap_set(full, 0, BENCH_BITS);
+
+    do {
+        if (accel_index != 0) {
+            g_test_message("%s", "");  /* gnu_printf Werror for simple "" */
+        }
+
+        /* Merging two bitmaps and recounting the result */
+        total = 0.0;
+        g_test_timer_start();
+        do {
+            hbitmap_merge(a, b, r);
+            total += BENCH_BYTES;
+        } while (g_test_timer_elapsed() < 0.5);
+        bench_report("merge", accel_index, total);
+
+        /* Looking for a clean area in a completely dirty bitmap */
+        total = 0.0;
+        g_test_timer_start();
+        do {
+            g_assert(hbitmap_next_zero(full, 0, INT64_MAX) == -1);
+            total += BENCH_BYTES;
+        } while (g_test_timer_elapsed() < 0.5);
+        bench_report("next_zero", accel_index, total);
+
+        /* Clearing a bitmap, which counts the bits that were set */
+        total = 0.0;
+        g_test_timer_start();
+        do {
+            hbitmap_merge(r, sparse, r);
+            hbitmap_reset(r, 0, BENCH_BITS);
+            total += BENCH_BYTES;
+        } while (g_test_timer_elapsed() < 0.5);
+        bench_report("merge+reset", accel_index, total);
+
+        accel_index++;
+    } while (test_hbitmap_next_accel());
+
+    hbitmap_free(a);
+    hbitmap_free(b);
+    hbitmap_free(sparse);
+    hbitmap_free(full);
+    hbitmap_free(r);
+    g_rand_free(rand);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/hbitmap/speed", NULL, test);
+    return g_test_run();
+}
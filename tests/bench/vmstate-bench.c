@@ -0,0 +1,284 @@
+/*
+ * VMState save/load speed benchmark
+ *
+ * Saves and loads the device state of a machine modelled on a heavily
+ * populated q35 guest: many vCPUs with their local APIC, e1000e-like NICs
+ * with a large register file and virtio devices with many queues, all of
+ * them with a PCI Express configuration space.  The benchmark runs with
+ * compiled VMStateDescriptions and with the interpreter.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/module.h"
+#include "qemu/units.h"
+#include "migration/vmstate.h"
+#include "io/channel-buffer.h"
+#include "../migration/qemu-file.h"
+
+#define BENCH_VCPUS             128
+#define BENCH_NICS              8
+#define BENCH_NIC_MAC_SIZE      0x8000
+#define BENCH_VIRTIO_DEVS       64
+#define BENCH_VIRTIO_QUEUES     32
+#define BENCH_PCIE_CONFIG_SIZE  4096
+
+typedef struct BenchLapic {
+    uint32_t apicbase;
+    uint8_t id, arb_id, tpr, log_dest, dest_mode;
+    uint32_t spurious_vec;
+    uint32_t isr[8], tmr[8], irr[8], lvt[7];
+    uint32_t esr, icr[2], divide_conf;
+    int32_t count_shift;
+    uint32_t initial_count;
+    int64_t initial_count_load_time, next_time, timer_expiry;
+} BenchLapic;
+
+static const VMStateDescription vmstate_bench_lapic = {
+    .name = "bench/apic",
+    .version_id = 3,
+    .minimum_version_id = 3,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(apicbase, BenchLapic),
+        VMSTATE_UINT8(id, BenchLapic),
+        VMSTATE_UINT8(arb_id, BenchLapic),
+        VMSTATE_UINT8(tpr, BenchLapic),
+        VMSTATE_UINT32(spurious_vec, BenchLapic),
+        VMSTATE_UINT8(log_dest, BenchLapic),
+        VMSTATE_UINT8(dest_mode, BenchLapic),
+        VMSTATE_UINT32_ARRAY(isr, BenchLapic, 8),
+        VMSTATE_UINT32_ARRAY(tmr, BenchLapic, 8),
+        VMSTATE_UINT32_ARRAY(irr, BenchLapic, 8),
+        VMSTATE_UINT32_ARRAY(lvt, BenchLapic, 7),
+        VMSTATE_UINT32(esr, BenchLapic),
+        VMSTATE_UINT32_ARRAY(icr, BenchLapic, 2),
+        VMSTATE_UINT32(divide_conf, BenchLapic),
+        VMSTATE_INT32(count_shift, BenchLapic),
+        VMSTATE_UINT32(initial_count, BenchLapic),
+        VMSTATE_INT64(initial_count_load_time, BenchLapic),
+        VMSTATE_INT64(next_time, BenchLapic),
+        VMSTATE_INT64(timer_expiry, BenchLapic),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+typedef struct BenchNic {
+    uint8_t config[BENCH_PCIE_CONFIG_SIZE];
+    uint32_t mac[BENCH_NIC_MAC_SIZE];
+    uint16_t phy[2][0x20];
+    uint16_t eeprom[64];
+    uint32_t rxbuf_size, rxbuf_min_shift;
+    uint32_t intr_state;
+    uint16_t subsys, subsys_ven;
+} BenchNic;
+
+static const VMStateDescription vmstate_bench_nic = {
+    .name = "bench/e1000e",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_BUFFER(config, BenchNic),
+        VMSTATE_UINT32(rxbuf_size, BenchNic),
+        VMSTATE_UINT32(rxbuf_min_shift, BenchNic),
+        VMSTATE_UINT16_2DARRAY(phy, BenchNic, 2, 0x20),
+        VMSTATE_UINT16_ARRAY(eeprom, BenchNic, 64),
+        VMSTATE_UINT32_ARRAY(mac, BenchNic, BENCH_NIC_MAC_SIZE),
+        VMSTATE_UINT32(intr_state, BenchNic),
+        VMSTATE_UINT16(subsys, BenchNic),
+        VMSTATE_UINT16(subsys_ven, BenchNic),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+typedef struct BenchVirtQueue {
+    uint32_t num;
+    uint64_t desc, avail, used;
+    uint16_t last_avail_idx, used_idx, signalled_used;
+    bool signalled_used_valid;
+    uint16_t vector;
+} BenchVirtQueue;
+
+static const VMStateDescription vmstate_bench_virtqueue = {
+    .name = "bench/virtqueue",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(num, BenchVirtQueue),
+        VMSTATE_UINT64(desc, BenchVirtQueue),
+        VMSTATE_UINT64(avail, BenchVirtQueue),
+        VMSTATE_UINT64(used, BenchVirtQueue),
+        VMSTATE_UINT16(last_avail_idx, BenchVirtQueue),
+        VMSTATE_UINT16(used_idx, BenchVirtQueue),
+        VMSTATE_UINT16(signalled_used, BenchVirtQueue),
+        VMSTATE_BOOL(signalled_used_valid, BenchVirtQueue),
+        VMSTATE_UINT16(vector, BenchVirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+typedef struct BenchVirtio {
+    uint8_t config[BENCH_PCIE_CONFIG_SIZE];
+    uint8_t status, isr;
+    uint16_t queue_sel;
+    uint32_t guest_features;
+    uint64_t host_features;
+    BenchVirtQueue vq[BENCH_VIRTIO_QUEUES];
+} BenchVirtio;
+
+static const VMStateDescription vmstate_bench_virtio = {
+    .name = "bench/virtio",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_BUFFER(config, BenchVirtio),
+        VMSTATE_UINT8(status, BenchVirtio),
+        VMSTATE_UINT8(isr, BenchVirtio),
+        VMSTATE_UINT16(queue_sel, BenchVirtio),
+        VMSTATE_UINT32(guest_features, BenchVirtio),
+        VMSTATE_UINT64(host_features, BenchVirtio),
+        VMSTATE_STRUCT_ARRAY(vq, BenchVirtio, BENCH_VIRTIO_QUEUES, 1,
+                             vmstate_bench_virtqueue, BenchVirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+typedef struct BenchDevice {
+    const VMStateDescription *vmsd;
+    void *opaque;
+} BenchDevice;
+
+static BenchLapic *lapics;
+static BenchNic *nics;
+static BenchVirtio *virtios;
+static GArray *devices;
+
+static void bench_add_device(const VMStateDescription *vmsd, void *opaque)
+{
+    BenchDevice dev = { .vmsd = vmsd, .opaque = opaque };
+
+    g_array_append_val(devices, dev);
+}
+
+static void bench_machine_init(void)
+{
+    int i, j;
+
+    lapics = g_new0(BenchLapic, BENCH_VCPUS);
+    nics = g_new0(BenchNic, BENCH_NICS);
+    virtios = g_new0(BenchVirtio, BENCH_VIRTIO_DEVS);
+    devices = g_array_new(false, false, sizeof(BenchDevice));
+
+    for (i = 0; i < BENCH_VCPUS; i++) {
+        lapics[i].id = i;
+        lapics[i].apicbase = 0xfee00000 | (i ? 0 : 0x100);
+        bench_add_device(&vmstate_bench_lapic, &lapics[i]);
+    }
+    for (i = 0; i < BENCH_NICS; i++) {
+        for (j = 0; j < BENCH_NIC_MAC_SIZE; j++) {
+            nics[i].mac[j] = j * 0x01010101;
+        }
+        memset(nics[i].config, i, sizeof(nics[i].config));
+        bench_add_device(&vmstate_bench_nic, &nics[i]);
+    }
+    for (i = 0; i < BENCH_VIRTIO_DEVS; i++) {
+        for (j = 0; j < BENCH_VIRTIO_QUEUES; j++) {
+            virtios[i].vq[j].num = 256;
+            virtios[i].vq[j].desc = 0x100000000ULL + j * 0x4000;
+            virtios[i].vq[j].vector = j;
+        }
+        memset(virtios[i].config, i, sizeof(virtios[i].config));
+        bench_add_device(&vmstate_bench_virtio, &virtios[i]);
+    }
+}
+
+/* Saves all devices and returns the stream, adding the time taken */
+static GByteArray *bench_save(int64_t *elapsed)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(4 * MiB);
+    QEMUFile *f = qemu_file_new_output(QIO_CHANNEL(bioc));
+    GByteArray *stream;
+    int64_t start;
+    guint i;
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < devices->len; i++) {
+        BenchDevice *dev = &g_array_index(devices, BenchDevice, i);
+
+        g_assert(!vmstate_save_state(f, dev->vmsd, dev->opaque, NULL));
+    }
+    g_assert(!qemu_fflush(f));
+    *elapsed += g_get_monotonic_time() - start;
+
+    stream = g_byte_array_new();
+    g_byte_array_append(stream, bioc->data, bioc->usage);
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+    return stream;
+}
+
+/* Loads all devices from @stream, adding the time taken */
+static void bench_load(GByteArray *stream, int64_t *elapsed)
+{
+    QIOChannelBuffer *bioc = qio_channel_buffer_new(stream->len);
+    QEMUFile *f;
+    int64_t start;
+    guint i;
+
+    memcpy(bioc->data, stream->data, stream->len);
+    bioc->usage = stream->len;
+    f = qemu_file_new_input(QIO_CHANNEL(bioc));
+
+    start = g_get_monotonic_time();
+    for (i = 0; i < devices->len; i++) {
+        BenchDevice *dev = &g_array_index(devices, BenchDevice, i);
+
+        g_assert(!vmstate_load_state(f, dev->vmsd, dev->opaque,
+                                     dev->vmsd->version_id));
+    }
+    *elapsed += g_get_monotonic_time() - start;
+
+    g_assert(!qemu_file_get_error(f));
+    qemu_fclose(f);
+    object_unref(OBJECT(bioc));
+}
+
+static void test(const void *opaque)
+{
+    bool compiled = GPOINTER_TO_INT(opaque);
+    int64_t save_time = 0, load_time = 0;
+    size_t bytes = 0;
+    int rounds = 0;
+
+    vmstate_set_compiled(compiled);
+
+    g_test_timer_start();
+    do {
+        g_autoptr(GByteArray) stream = bench_save(&save_time);
+
+        bench_load(stream, &load_time);
+        bytes = stream->len;
+        rounds++;
+    } while (g_test_timer_elapsed() < 2.0);
+
+    g_test_message("%s: %u devices, %zu KiB: save %.1f us, load %.1f us",
+                   compiled ? "compiled" : "interpreted", devices->len,
+                   bytes / (size_t)KiB, (double)save_time / rounds,
+                   (double)load_time / rounds);
+
+    vmstate_set_compiled(true);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    module_call_init(MODULE_INIT_QOM);
+    bench_machine_init();
+
+    g_test_add_data_func("/vmstate/q35/interpreted", GINT_TO_POINTER(false),
+                         test);
+    g_test_add_data_func("/vmstate/q35/compiled", GINT_TO_POINTER(true),
+                         test);
+    return g_test_run();
+}
@@ -683,7 +683,7 @@ def filter_img_info(output: str, filename: str,
                       'uuid: XXXXXXXX-XXXX-XXXX-XXXX-XXXXXXXXXXXX',
                       line)
         line = re.sub('cid: [0-9]+', 'cid: XXXXXXXXXX', line)
-        line = re.sub('(compression type: )(zlib|zstd)', r'\1COMPRESSION_TYPE',
+        line = re.sub('(compression type: )(zlib|zstd|lz4)', r'\1COMPRESSION_TYPE',
                       line)
         lines.append(line)
     return '\n'.join(lines)
@@ -1493,9 +1493,10 @@ def verify_working_luks():
     if not working:
         notrun(reason)
 
-def supports_qcow2_zstd_compression() -> bool:
-    img_file = f'{test_dir}/qcow2-zstd-test.qcow2'
-    res = qemu_img('create', '-f', 'qcow2', '-o', 'compression_type=zstd',
+def supports_qcow2_compression_type(compression_type: str) -> bool:
+    img_file = f'{test_dir}/qcow2-{compression_type}-test.qcow2'
+    res = qemu_img('create', '-f', 'qcow2',
+                   '-o', f'compression_type={compression_type}',
                    img_file, '0',
                    check=False)
     try:
@@ -1504,11 +1505,15 @@ def supports_qcow2_zstd_compression() -> bool:
         pass
 
     if res.returncode == 1 and \
-            "'compression-type' does not accept value 'zstd'" in res.stdout:
+            f"'compression-type' does not accept value '{compression_type}'" \
+            in res.stdout:
         return False
     else:
         return True
 
+def supports_qcow2_zstd_compression() -> bool:
+    return supports_qcow2_compression_type('zstd')
+
 def verify_qcow2_zstd_compression():
     if not supports_qcow2_zstd_compression():
         notrun('zstd compression not supported')
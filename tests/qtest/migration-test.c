@@ -14,6 +14,7 @@
 
 #include "libqtest.h"
 #include "qapi/qmp/qdict.h"
+#include "qemu/memfd.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -21,6 +22,7 @@
 #include "chardev/char.h"
 #include "crypto/tlscredspsk.h"
 #include "qapi/qmp/qlist.h"
+#include "qapi/qmp/qnum.h"
 #include "ppc-util.h"
 
 #include "migration-helpers.h"
@@ -598,6 +600,8 @@ typedef struct {
      */
     bool hide_stderr;
     bool use_shmem;
+    /* back the guest RAM with a shared memfd */
+    bool use_memfd;
     /* only launch the target process */
     bool only_target;
     /* Use dirty ring if true; dirty logging otherwise */
@@ -732,6 +736,11 @@ static int test_migrate_start(QTestState **from, QTestState **to,
         }
     }
 
+    if (args->use_memfd && !qemu_memfd_check(0)) {
+        g_test_skip("memfd is not supported");
+        return -1;
+    }
+
     dst_state = (QTestMigrationState) { };
     src_state = (QTestMigrationState) { };
     bootfile_create(tmpfs, args->suspend_me);
@@ -797,6 +806,10 @@ static int test_migrate_start(QTestState **from, QTestState **to,
             "-object memory-backend-file,id=mem0,size=%s"
             ",mem-path=%s,share=on -numa node,memdev=mem0",
             memory_size, shmem_path);
+    } else if (args->use_memfd) {
+        shmem_opts = g_strdup_printf(
+            "-object memory-backend-memfd,id=mem0,size=%s,share=on "
+            "-numa node,memdev=mem0", memory_size);
     }
 
     if (args->use_dirty_ring) {
@@ -1334,6 +1347,46 @@ static void test_postcopy(void)
     test_postcopy_common(&args);
 }
 
+static void *test_postcopy_fault_threads_start(QTestState *from,
+                                               QTestState *to)
+{
+    migrate_set_parameter_int(to, "postcopy-fault-threads", 4);
+    return NULL;
+}
+
+static void test_postcopy_fault_threads_finish(QTestState *from,
+                                               QTestState *to, void *opaque)
+{
+    QDict *rsp = migrate_query(to);
+    QList *histogram = qdict_get_qlist(rsp,
+                                       "postcopy-fault-latency-histogram");
+    const QListEntry *entry;
+    int64_t requests = 0;
+
+    /* The guest faulted on pages that the fault threads requested */
+    g_assert(histogram);
+    QLIST_FOREACH_ENTRY(histogram, entry) {
+        requests += qnum_get_int(qobject_to(QNum, qlist_entry_obj(entry)));
+    }
+    g_assert_cmpint(requests, >, 0);
+    qobject_unref(rsp);
+}
+
+/*
+ * Shared memfd RAM is placed with UFFDIO_CONTINUE after the page was
+ * written through the alias mapping, if the host supports minor faults.
+ */
+static void test_postcopy_fault_threads(void)
+{
+    MigrateCommon args = {
+        .start.use_memfd = true,
+        .start_hook = test_postcopy_fault_threads_start,
+        .finish_hook = test_postcopy_fault_threads_finish,
+    };
+
+    test_postcopy_common(&args);
+}
+
 static void test_postcopy_suspend(void)
 {
     MigrateCommon args = {
@@ -1993,6 +2046,46 @@ static void test_precopy_unix_plain(void)
     test_precopy_common(&args);
 }
 
+static void *test_migrate_dirty_sync_threads_start(QTestState *from,
+                                                   QTestState *to)
+{
+    migrate_set_parameter_int(from, "dirty-sync-threads", 4);
+    return NULL;
+}
+
+static void test_migrate_dirty_sync_threads_finish(QTestState *from,
+                                                   QTestState *to,
+                                                   void *opaque)
+{
+    QDict *rsp = migrate_query(from);
+    QDict *ram = qdict_get_qdict(rsp, "ram");
+    QList *histogram = qdict_get_qlist(ram, "dirty-sync-time-histogram");
+    const QListEntry *entry;
+    int64_t syncs = 0;
+
+    /* Every synchronization is counted in the histogram */
+    QLIST_FOREACH_ENTRY(histogram, entry) {
+        syncs += qnum_get_int(qobject_to(QNum, qlist_entry_obj(entry)));
+    }
+    g_assert_cmpint(syncs, ==, qdict_get_int(ram, "dirty-sync-count"));
+    g_assert_cmpint(syncs, >, 0);
+    qobject_unref(rsp);
+}
+
+static void test_precopy_unix_dirty_sync_threads(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateCommon args = {
+        .listen_uri = uri,
+        .connect_uri = uri,
+        .start_hook = test_migrate_dirty_sync_threads_start,
+        .finish_hook = test_migrate_dirty_sync_threads_finish,
+        .live = true,
+    };
+
+    test_precopy_common(&args);
+}
+
 static void test_precopy_unix_suspend_live(void)
 {
     g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -2301,6 +2394,51 @@ static void test_precopy_file_mapped_ram(void)
     test_file_common(&args, true);
 }
 
+static void *migrate_lazy_restore_start(QTestState *from, QTestState *to)
+{
+    migrate_mapped_ram_start(from, to);
+    migrate_set_capability(to, "lazy-restore", true);
+
+    /*
+     * Slow down the prefetch threads, so that the guest accesses pages
+     * that are not loaded yet after it was started.
+     */
+    migrate_set_parameter_int(to, "max-postcopy-bandwidth",
+                              64 * 1024 * 1024);
+
+    return NULL;
+}
+
+static void migrate_lazy_restore_end(QTestState *from, QTestState *to,
+                                     void *opaque)
+{
+    QDict *rsp = migrate_query(to);
+    QDict *stats = qdict_get_qdict(rsp, "lazy-restore");
+
+    g_assert(stats);
+    g_assert_cmpint(qdict_get_int(stats, "fault-pages"), >, 0);
+    g_assert_cmpint(qdict_get_int(stats, "prefetch-pages"), >, 0);
+    qobject_unref(rsp);
+}
+
+static void test_precopy_file_mapped_ram_lazy_restore(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = migrate_lazy_restore_start,
+        .finish_hook = migrate_lazy_restore_end,
+    };
+
+    /*
+     * The destination starts the guest by itself and only completes the
+     * incoming migration once all pages are loaded.
+     */
+    test_file_common(&args, false);
+}
+
 static void *migrate_multifd_mapped_ram_start(QTestState *from, QTestState *to)
 {
     migrate_mapped_ram_start(from, to);
@@ -2453,6 +2591,92 @@ static void test_multifd_file_mapped_ram_fdset_dio(void)
 }
 #endif /* !_WIN32 */
 
+#define FILE_TEST_BASE_FILENAME "migfile-base"
+
+static void *multifd_mapped_ram_incremental_start(QTestState *from,
+                                                  QTestState *to)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_BASE_FILENAME);
+
+    migrate_multifd_mapped_ram_start(from, to);
+    migrate_set_capability(from, "incremental-checkpoint", true);
+
+    /*
+     * Write a full checkpoint first, the test then writes an incremental
+     * one on top of it while the guest keeps dirtying memory.
+     */
+    migrate_ensure_converge(from);
+    wait_for_serial("src_serial");
+    migrate_qmp(from, to, uri, NULL, "{}");
+    wait_for_migration_complete(from);
+    qtest_qmp_assert_success(from, "{ 'execute' : 'cont'}");
+
+    return NULL;
+}
+
+static void multifd_mapped_ram_incremental_end(QTestState *from,
+                                               QTestState *to, void *opaque)
+{
+    cleanup(FILE_TEST_BASE_FILENAME);
+}
+
+static void test_multifd_file_mapped_ram_incremental(void)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = multifd_mapped_ram_incremental_start,
+        .finish_hook = multifd_mapped_ram_incremental_end,
+    };
+
+    test_file_common(&args, false);
+}
+
+#define FILE_TEST_ROTATE_FILENAME "migfile-rotate"
+
+static void *multifd_mapped_ram_rotate_start(QTestState *from, QTestState *to)
+{
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_ROTATE_FILENAME);
+
+    /* Write a full checkpoint A, then an incremental one B based on it */
+    multifd_mapped_ram_incremental_start(from, to);
+
+    migrate_qmp(from, to, uri, NULL, "{}");
+    wait_for_migration_complete(from);
+    qtest_qmp_assert_success(from, "{ 'execute' : 'cont'}");
+
+    return NULL;
+}
+
+static void multifd_mapped_ram_rotate_end(QTestState *from, QTestState *to,
+                                          void *opaque)
+{
+    cleanup(FILE_TEST_BASE_FILENAME);
+    cleanup(FILE_TEST_ROTATE_FILENAME);
+}
+
+static void test_multifd_file_mapped_ram_incremental_rotate(void)
+{
+    /*
+     * Writing A again must not be based on B, which is based on the old
+     * contents of A.
+     */
+    g_autofree char *uri = g_strdup_printf("file:%s/%s", tmpfs,
+                                           FILE_TEST_BASE_FILENAME);
+    MigrateCommon args = {
+        .connect_uri = uri,
+        .listen_uri = "defer",
+        .start_hook = multifd_mapped_ram_rotate_start,
+        .finish_hook = multifd_mapped_ram_rotate_end,
+    };
+
+    test_file_common(&args, false);
+}
+
 static void test_precopy_tcp_plain(void)
 {
     MigrateCommon args = {
@@ -2921,6 +3145,67 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
+/*
+ * Like auto_converge, this needs a few passes at 3MB/s: the first
+ * prediction is made after the first pass, and the source escalates
+ * after two failed predictions.  Without the KVM dirty ring, the first
+ * escalation throttles the guest.
+ */
+static void test_migrate_auto_strategy(void)
+{
+    g_autofree char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart args = {};
+    QTestState *from, *to;
+    QDict *rsp, *convergence;
+
+    if (test_migrate_start(&from, &to, uri, &args)) {
+        return;
+    }
+
+    migrate_set_capability(from, "auto-strategy", true);
+    migrate_ensure_non_converge(from);
+
+    /* To check the convergence time before completion */
+    migrate_set_capability(from, "pause-before-switchover", true);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, to, uri, NULL, "{}");
+
+    /* Wait for throttling begins */
+    while (!read_migrate_property_int(from, "cpu-throttle-percentage")) {
+        usleep(20);
+        g_assert_false(src_state.stop_seen);
+    }
+
+    rsp = migrate_query(from);
+    convergence = qdict_get_qdict(rsp, "convergence");
+    g_assert(convergence);
+    g_assert_cmpstr(qdict_get_str(convergence, "strategy"), ==,
+                    "cpu-throttle");
+    g_assert_cmpint(qdict_get_int(convergence, "first-predicted-time"), ==,
+                    -1);
+    g_assert_false(qdict_haskey(convergence, "convergence-time"));
+    qobject_unref(rsp);
+
+    migrate_ensure_converge(from);
+    wait_for_migration_status(from, "pre-switchover", NULL);
+
+    rsp = migrate_query(from);
+    convergence = qdict_get_qdict(rsp, "convergence");
+    g_assert_cmpint(qdict_get_int(convergence, "convergence-time"), >, 0);
+    qobject_unref(rsp);
+    migrate_continue(from, "pre-switchover");
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+}
+
 static void *
 test_migrate_precopy_tcp_multifd_start_common(QTestState *from,
                                               QTestState *to,
@@ -2966,6 +3251,91 @@ test_migration_precopy_tcp_multifd_start_no_zero_page(QTestState *from,
     return NULL;
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_start_device_state(QTestState *from,
+                                                    QTestState *to)
+{
+    test_migrate_precopy_tcp_multifd_start_common(from, to, "none");
+    migrate_set_capability(from, "multifd-device-state", true);
+    migrate_set_capability(to, "multifd-device-state", true);
+    return NULL;
+}
+
+/* Whether the guests have a migration-testdev with id "devstate" */
+static bool device_state_testdev;
+
+#define DEVICE_STATE_TESTDEV_SEED 0x5eed1234
+#define DEVICE_STATE_TESTDEV_SIZE (1024 * 1024)
+
+static void
+test_migrate_precopy_tcp_multifd_finish_device_state(QTestState *from,
+                                                     QTestState *to,
+                                                     void *opaque)
+{
+    QDict *rsp = migrate_query(from);
+    const QListEntry *entry;
+    QList *list;
+    bool found = false;
+
+    /* Every device reports its share of the downtime */
+    g_assert(qdict_haskey(rsp, "device-downtime"));
+    list = qdict_get_qlist(rsp, "device-downtime");
+    g_assert(!qlist_empty(list));
+    QLIST_FOREACH_ENTRY(list, entry) {
+        QDict *dev = qobject_to(QDict, qlist_entry_obj(entry));
+
+        g_assert(dev);
+        if (!strcmp(qdict_get_str(dev, "id"), "migration-testdev")) {
+            g_assert(qdict_get_bool(dev, "parallel"));
+            g_assert_cmpint(qdict_get_int(dev, "bytes"), >=,
+                            DEVICE_STATE_TESTDEV_SIZE);
+            found = true;
+        }
+    }
+    g_assert(found == device_state_testdev);
+    qobject_unref(rsp);
+
+    if (!device_state_testdev) {
+        return;
+    }
+
+    /*
+     * The destination checked the state against the seed when it loaded
+     * it, and took the seed from the source.
+     */
+    rsp = qtest_qmp_assert_success_ref(to,
+            "{ 'execute': 'qom-get',"
+            "  'arguments': { 'path': '/machine/peripheral/devstate',"
+            "                 'property': 'seed' } }");
+    g_assert_cmpint(qdict_get_int(rsp, "return"), ==,
+                    DEVICE_STATE_TESTDEV_SEED);
+    qobject_unref(rsp);
+}
+
+static void
+test_migrate_precopy_tcp_multifd_finish_recv_channels(QTestState *from,
+                                                      QTestState *to,
+                                                      void *opaque)
+{
+    QDict *rsp = migrate_query(to);
+    const QListEntry *entry;
+    QList *list;
+    uint64_t packets = 0;
+
+    /* The destination reports what each channel received */
+    g_assert(qdict_haskey(rsp, "multifd-recv-channels"));
+    list = qdict_get_qlist(rsp, "multifd-recv-channels");
+    g_assert(!qlist_empty(list));
+    QLIST_FOREACH_ENTRY(list, entry) {
+        QDict *ch = qobject_to(QDict, qlist_entry_obj(entry));
+
+        g_assert(ch);
+        packets += qdict_get_int(ch, "packets");
+    }
+    g_assert_cmpint(packets, >, 0);
+    qobject_unref(rsp);
+}
+
 static void *
 test_migrate_precopy_tcp_multifd_zlib_start(QTestState *from,
                                             QTestState *to)
@@ -2980,6 +3350,58 @@ test_migrate_precopy_tcp_multifd_zlib_start(QTestState *from,
     return test_migrate_precopy_tcp_multifd_start_common(from, to, "zlib");
 }
 
+static void *
+test_migrate_precopy_tcp_multifd_xbzrle_start(QTestState *from,
+                                              QTestState *to)
+{
+    migrate_set_parameter_int(from, "xbzrle-cache-size", 33554432);
+
+    return test_migrate_precopy_tcp_multifd_start_common(from, to, "xbzrle");
+}
+
+static void *
+test_migrate_precopy_tcp_multifd_dedup_start(QTestState *from,
+                                             QTestState *to)
+{
+    g_autofree uint8_t *template = g_malloc0(256 * TEST_MEM_PAGE_SIZE);
+    char *path = g_strdup_printf("%s/dedup-template", tmpfs);
+    int i;
+
+    /* The test guest increments the first byte of each page */
+    for (i = 0; i < 256; i++) {
+        template[i * TEST_MEM_PAGE_SIZE] = i;
+    }
+    g_assert(g_file_set_contents(path, (char *)template,
+                                 256 * TEST_MEM_PAGE_SIZE, NULL));
+
+    migrate_set_parameter_str(from, "multifd-dedup-template", path);
+    migrate_set_parameter_str(to, "multifd-dedup-template", path);
+    migrate_set_parameter_int(from, "multifd-dedup-cache-size", 16777216);
+    migrate_set_parameter_int(to, "multifd-dedup-cache-size", 16777216);
+
+    test_migrate_precopy_tcp_multifd_start_common(from, to, "dedup");
+    return path;
+}
+
+static void
+test_migrate_precopy_tcp_multifd_dedup_finish(QTestState *from,
+                                              QTestState *to,
+                                              void *opaque)
+{
+    g_autofree char *path = opaque;
+    QDict *rsp = migrate_query(from);
+    QDict *dedup = qdict_get_qdict(rsp, "multifd-dedup");
+
+    /* Most pages of the test guest have the same contents */
+    g_assert(dedup);
+    g_assert_cmpint(qdict_get_int(dedup, "full-pages"), >, 0);
+    g_assert_cmpint(qdict_get_int(dedup, "template-pages") +
+                    qdict_get_int(dedup, "cache-pages"), >, 0);
+    qobject_unref(rsp);
+
+    unlink(path);
+}
+
 #ifdef CONFIG_ZSTD
 static void *
 test_migrate_precopy_tcp_multifd_zstd_start(QTestState *from,
@@ -3054,6 +3476,43 @@ static void test_multifd_tcp_no_zero_page(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_device_state(void)
+{
+    g_autofree char *opts_source = NULL;
+    g_autofree char *opts_target = NULL;
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start_device_state,
+        .finish_hook = test_migrate_precopy_tcp_multifd_finish_device_state,
+        .live = true,
+    };
+
+    /* Check that the state of a device arrives intact, if there is one */
+    device_state_testdev = qtest_has_device("migration-testdev");
+    if (device_state_testdev) {
+        opts_source = g_strdup_printf("-device migration-testdev,id=devstate,"
+                                      "size=%u,seed=%u",
+                                      DEVICE_STATE_TESTDEV_SIZE,
+                                      DEVICE_STATE_TESTDEV_SEED);
+        opts_target = g_strdup_printf("-device migration-testdev,id=devstate,"
+                                      "size=%u", DEVICE_STATE_TESTDEV_SIZE);
+        args.start.opts_source = opts_source;
+        args.start.opts_target = opts_target;
+    }
+    test_precopy_common(&args);
+}
+
+static void test_multifd_tcp_recv_channels(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_start,
+        .finish_hook = test_migrate_precopy_tcp_multifd_finish_recv_channels,
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 static void test_multifd_tcp_channels_none(void)
 {
     MigrateCommon args = {
@@ -3078,6 +3537,28 @@ static void test_multifd_tcp_zlib(void)
     test_precopy_common(&args);
 }
 
+static void test_multifd_tcp_xbzrle(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_xbzrle_start,
+        /* Pages that the guest changes are delta encoded when resent */
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
+static void test_multifd_tcp_dedup(void)
+{
+    MigrateCommon args = {
+        .listen_uri = "defer",
+        .start_hook = test_migrate_precopy_tcp_multifd_dedup_start,
+        .finish_hook = test_migrate_precopy_tcp_multifd_dedup_finish,
+        .live = true,
+    };
+    test_precopy_common(&args);
+}
+
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
@@ -3832,6 +4313,10 @@ int main(int argc, char **argv)
 
     if (has_uffd) {
         migration_test_add("/migration/postcopy/plain", test_postcopy);
+        migration_test_add("/migration/postcopy/fault-threads",
+                           test_postcopy_fault_threads);
+        migration_test_add("/migration/precopy/file/mapped-ram/lazy-restore",
+                           test_precopy_file_mapped_ram_lazy_restore);
         migration_test_add("/migration/postcopy/recovery/plain",
                            test_postcopy_recovery);
         migration_test_add("/migration/postcopy/preempt/plain",
@@ -3850,6 +4335,8 @@ int main(int argc, char **argv)
 
     migration_test_add("/migration/precopy/unix/plain",
                        test_precopy_unix_plain);
+    migration_test_add("/migration/precopy/unix/dirty-sync-threads",
+                       test_precopy_unix_dirty_sync_threads);
     migration_test_add("/migration/precopy/unix/xbzrle",
                        test_precopy_unix_xbzrle);
     migration_test_add("/migration/precopy/file",
@@ -3891,6 +4378,11 @@ int main(int argc, char **argv)
                        test_multifd_file_mapped_ram_fdset_dio);
 #endif
 
+    migration_test_add("/migration/multifd/file/mapped-ram/incremental",
+                       test_multifd_file_mapped_ram_incremental);
+    migration_test_add("/migration/multifd/file/mapped-ram/incremental/rotate",
+                       test_multifd_file_mapped_ram_incremental_rotate);
+
 #ifdef CONFIG_GNUTLS
     migration_test_add("/migration/precopy/unix/tls/psk",
                        test_precopy_unix_tls_psk);
@@ -3970,6 +4462,8 @@ int main(int argc, char **argv)
     if (g_test_slow()) {
         migration_test_add("/migration/auto_converge",
                            test_migrate_auto_converge);
+        migration_test_add("/migration/auto_strategy",
+                           test_migrate_auto_strategy);
         if (g_str_equal(arch, "x86_64") &&
             has_kvm && kvm_dirty_ring_supported()) {
             migration_test_add("/migration/dirty_limit",
@@ -3984,10 +4478,18 @@ int main(int argc, char **argv)
                        test_multifd_tcp_zero_page_legacy);
     migration_test_add("/migration/multifd/tcp/plain/zero-page/none",
                        test_multifd_tcp_no_zero_page);
+    migration_test_add("/migration/multifd/tcp/plain/device-state",
+                       test_multifd_tcp_device_state);
+    migration_test_add("/migration/multifd/tcp/plain/recv-channels",
+                       test_multifd_tcp_recv_channels);
     migration_test_add("/migration/multifd/tcp/plain/cancel",
                        test_multifd_tcp_cancel);
     migration_test_add("/migration/multifd/tcp/plain/zlib",
                        test_multifd_tcp_zlib);
+    migration_test_add("/migration/multifd/tcp/plain/xbzrle",
+                       test_multifd_tcp_xbzrle);
+    migration_test_add("/migration/multifd/tcp/plain/dedup",
+                       test_multifd_tcp_dedup);
 #ifdef CONFIG_ZSTD
     migration_test_add("/migration/multifd/tcp/plain/zstd",
                        test_multifd_tcp_zstd);
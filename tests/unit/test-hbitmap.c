@@ -1042,6 +1042,80 @@ static void test_hbitmap_next_dirty_area_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_dirty_area_check(data, 0, INT64_MAX);
 }
 
+static uint64_t hbitmap_test_ref_count(const unsigned long *bits,
+                                       uint64_t start, uint64_t end)
+{
+    uint64_t count = 0;
+    uint64_t i;
+
+    for (i = start; i < end; i++) {
+        count += test_bit(i, bits);
+    }
+    return count;
+}
+
+static void hbitmap_test_accel_one(void)
+{
+    /* Large enough for the vectorized loops, unaligned tails on both ends */
+    const uint64_t size = L2 * 3 + 77;
+    g_autofree unsigned long *a_bits = bitmap_new(size);
+    g_autofree unsigned long *b_bits = bitmap_new(size);
+    HBitmap *a = hbitmap_alloc(size, 0);
+    HBitmap *b = hbitmap_alloc(size, 0);
+    HBitmap *r = hbitmap_alloc(size, 0);
+    uint64_t i;
+    GRand *rand = g_rand_new_with_seed(42);
+
+    /* Dense in the first part, sparse in the second, empty in the third */
+    for (i = 0; i < size; i++) {
+        if ((i < L2 && g_rand_int_range(rand, 0, 2)) ||
+            (i >= L2 && i < 2 * L2 && !g_rand_int_range(rand, 0, 97))) {
+            set_bit(i, a_bits);
+            hbitmap_set(a, i, 1);
+        }
+        if (i % 3 == 0 && i < L2 * 2) {
+            set_bit(i, b_bits);
+            hbitmap_set(b, i, 1);
+        }
+    }
+
+    g_assert_cmpint(hbitmap_count(a), ==,
+                    hbitmap_test_ref_count(a_bits, 0, size));
+    hbitmap_reset(a, 13, L2 + 2 * L1 + 5);
+    bitmap_clear(a_bits, 13, L2 + 2 * L1 + 5);
+    g_assert_cmpint(hbitmap_count(a), ==,
+                    hbitmap_test_ref_count(a_bits, 0, size));
+
+    hbitmap_merge(a, b, r);
+    bitmap_or(a_bits, a_bits, b_bits, size);
+    g_assert_cmpint(hbitmap_count(r), ==,
+                    hbitmap_test_ref_count(a_bits, 0, size));
+    for (i = 0; i < size; i++) {
+        g_assert_cmpint(hbitmap_get(r, i), ==, test_bit(i, a_bits));
+    }
+
+    /* A long run of ones followed by a single zero */
+    hbitmap_set(r, 0, size);
+    hbitmap_reset(r, size - 3, 1);
+    g_assert_cmpint(hbitmap_next_zero(r, 5, INT64_MAX), ==, size - 3);
+    hbitmap_reset(r, L2 + 3, 1);
+    g_assert_cmpint(hbitmap_next_zero(r, 5, INT64_MAX), ==, L2 + 3);
+    g_assert_cmpint(hbitmap_next_zero(r, L2 + 4, INT64_MAX), ==, size - 3);
+    g_assert_cmpint(hbitmap_count(r), ==, size - 2);
+
+    g_rand_free(rand);
+    hbitmap_free(a);
+    hbitmap_free(b);
+    hbitmap_free(r);
+}
+
+static void test_hbitmap_accel(void)
+{
+    do {
+        hbitmap_test_accel_one();
+    } while (test_hbitmap_next_accel());
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -1113,6 +1187,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    g_test_add_func("/hbitmap/accel", test_hbitmap_accel);
+
     g_test_run();
 
     return 0;
@@ -0,0 +1,118 @@
+/*
+ * Test userfaultfd helpers
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/memfd.h"
+#include "qemu/thread.h"
+#include "qemu/userfaultfd.h"
+
+typedef struct MinorFaultTest {
+    int uffd;
+    uint8_t *guest;     /* registered for minor faults */
+    uint8_t *alias;     /* second mapping of the same memfd */
+    size_t pagesize;
+} MinorFaultTest;
+
+static void *read_guest_page(void *opaque)
+{
+    MinorFaultTest *t = opaque;
+
+    return GUINT_TO_POINTER(qatomic_read(&t->guest[t->pagesize - 1]));
+}
+
+static bool minor_fault_test_init(MinorFaultTest *t)
+{
+    uint64_t features;
+    int mfd;
+
+    if (uffd_query_features(&features) ||
+        !(features & UFFD_FEATURE_MINOR_SHMEM)) {
+        return false;
+    }
+
+    t->uffd = uffd_create_fd(UFFD_FEATURE_MINOR_SHMEM, false);
+    if (t->uffd < 0) {
+        return false;
+    }
+
+    t->pagesize = qemu_real_host_page_size();
+    mfd = qemu_memfd_create("test-userfaultfd", t->pagesize, false, 0, 0,
+                            NULL);
+    g_assert(mfd >= 0);
+    t->guest = mmap(NULL, t->pagesize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    mfd, 0);
+    g_assert(t->guest != MAP_FAILED);
+    t->alias = mmap(NULL, t->pagesize, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    mfd, 0);
+    g_assert(t->alias != MAP_FAILED);
+    close(mfd);
+
+    g_assert_cmpint(uffd_register_memory(t->uffd, t->guest, t->pagesize,
+                                         UFFDIO_REGISTER_MODE_MINOR, NULL),
+                    ==, 0);
+    return true;
+}
+
+static void minor_fault_test_cleanup(MinorFaultTest *t)
+{
+    uffd_unregister_memory(t->uffd, t->guest, t->pagesize);
+    munmap(t->guest, t->pagesize);
+    munmap(t->alias, t->pagesize);
+    uffd_close_fd(t->uffd);
+}
+
+/*
+ * A page whose content is complete in the page cache, but whose page table
+ * entry in the registered mapping is gone, raises a minor fault.  This is
+ * what the postcopy fault threads see for pages that were placed already;
+ * uffd_continue_page() must map the page and wake the faulting thread.
+ */
+static void test_continue_received_page(void)
+{
+    MinorFaultTest t;
+    QemuThread thread;
+    struct uffd_msg msg;
+
+    if (!minor_fault_test_init(&t)) {
+        g_test_skip("userfaultfd minor faults on shmem are not supported");
+        return;
+    }
+
+    /* Receive the page and place it */
+    memset(t.alias, 0x5a, t.pagesize);
+    qemu_thread_create(&thread, "reader", read_guest_page, &t,
+                       QEMU_THREAD_JOINABLE);
+    g_assert_cmpint(uffd_read_events(t.uffd, &msg, 1), ==, 1);
+    g_assert_cmpint(msg.event, ==, UFFD_EVENT_PAGEFAULT);
+    g_assert(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_MINOR);
+    g_assert_cmpint(uffd_continue_page(t.uffd, t.guest, t.pagesize), ==, 0);
+    g_assert_cmpuint(GPOINTER_TO_UINT(qemu_thread_join(&thread)), ==, 0x5a);
+
+    /* Drop the page table entry, but keep the page in the page cache */
+    g_assert_cmpint(madvise(t.guest, t.pagesize, MADV_DONTNEED), ==, 0);
+
+    qemu_thread_create(&thread, "reader", read_guest_page, &t,
+                       QEMU_THREAD_JOINABLE);
+    g_assert_cmpint(uffd_read_events(t.uffd, &msg, 1), ==, 1);
+    g_assert_cmpint(msg.event, ==, UFFD_EVENT_PAGEFAULT);
+    g_assert(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_MINOR);
+    g_assert_cmpint(uffd_continue_page(t.uffd, t.guest, t.pagesize), ==, 0);
+    g_assert_cmpuint(GPOINTER_TO_UINT(qemu_thread_join(&thread)), ==, 0x5a);
+
+    /* A stale fault on a mapped page only wakes up the waiters */
+    g_assert_cmpint(uffd_continue_page(t.uffd, t.guest, t.pagesize), ==, 0);
+
+    minor_fault_test_cleanup(&t);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/userfaultfd/continue-received-page",
+                    test_continue_received_page);
+    return g_test_run();
+}
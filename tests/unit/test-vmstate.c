@@ -330,6 +330,124 @@ static void test_simple_array(void)
                          sizeof(wire_simple_arr)));
 }
 
+/* The interpreter must produce and accept the same stream */
+static void test_simple_interpreted(void)
+{
+    vmstate_set_compiled(false);
+    test_simple_primitive();
+    test_simple_array();
+    vmstate_set_compiled(true);
+}
+
+typedef struct TestMixed {
+    uint8_t  u8;
+    bool     b[3];
+    uint16_t u16[2];
+    uint32_t magic;
+    uint32_t u32;
+    bool     b_1;
+    uint64_t u64;
+} TestMixed;
+
+/* Runs that are split by booleans and by fields that are interpreted */
+static const VMStateDescription vmstate_mixed = {
+    .name = "test/mixed",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT8(u8, TestMixed),
+        VMSTATE_BOOL_ARRAY(b, TestMixed, 3),
+        VMSTATE_UINT16_ARRAY(u16, TestMixed, 2),
+        VMSTATE_UINT32_EQUAL(magic, TestMixed, NULL),
+        VMSTATE_UINT32(u32, TestMixed),
+        VMSTATE_BOOL(b_1, TestMixed),
+        VMSTATE_UINT64(u64, TestMixed),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const TestMixed obj_mixed = {
+    .u8 = 0x81,
+    .b = { true, false, true },
+    .u16 = { 0x1234, 0xfedc },
+    .magic = 0xcafe,
+    .u32 = 70000,
+    .b_1 = true,
+    .u64 = 12121212,
+};
+
+static const uint8_t wire_mixed[] = {
+    /* u8 */    0x81,
+    /* b */     0x01, 0x00, 0x01,
+    /* u16 */   0x12, 0x34, 0xfe, 0xdc,
+    /* magic */ 0x00, 0x00, 0xca, 0xfe,
+    /* u32 */   0x00, 0x01, 0x11, 0x70,
+    /* b_1 */   0x01,
+    /* u64 */   0x00, 0x00, 0x00, 0x00, 0x00, 0xb8, 0xf4, 0x7c,
+    QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+};
+
+/* Other writers may store true as any non-zero byte */
+static const uint8_t wire_mixed_bool[] = {
+    /* u8 */    0x81,
+    /* b */     0x02, 0x00, 0xff,
+    /* u16 */   0x12, 0x34, 0xfe, 0xdc,
+    /* magic */ 0x00, 0x00, 0xca, 0xfe,
+    /* u32 */   0x00, 0x01, 0x11, 0x70,
+    /* b_1 */   0x80,
+    /* u64 */   0x00, 0x00, 0x00, 0x00, 0x00, 0xb8, 0xf4, 0x7c,
+    QEMU_VM_EOF, /* just to ensure we won't get EOF reported prematurely */
+};
+
+static void test_mixed_one(bool compiled, TestMixed *obj,
+                           const uint8_t *wire, size_t size)
+{
+    vmstate_set_compiled(compiled);
+
+    save_vmstate(&vmstate_mixed, (void *)&obj_mixed);
+    compare_vmstate(wire_mixed, sizeof(wire_mixed));
+
+    memset(obj, 0, sizeof(*obj));
+    obj->magic = obj_mixed.magic;
+    SUCCESS(load_vmstate_one(&vmstate_mixed, obj, 1, wire, size));
+
+    vmstate_set_compiled(true);
+}
+
+static void test_mixed_check(const TestMixed *obj)
+{
+    int i;
+
+    g_assert_cmpint(obj->u8, ==, obj_mixed.u8);
+    for (i = 0; i < ARRAY_SIZE(obj->b); i++) {
+        /* Booleans are normalized, whatever non-zero byte was on the wire */
+        g_assert_cmpint(*(const uint8_t *)&obj->b[i], ==, obj_mixed.b[i]);
+    }
+    g_assert_cmpint(obj->u16[0], ==, obj_mixed.u16[0]);
+    g_assert_cmpint(obj->u16[1], ==, obj_mixed.u16[1]);
+    g_assert_cmpint(obj->magic, ==, obj_mixed.magic);
+    g_assert_cmpint(obj->u32, ==, obj_mixed.u32);
+    g_assert_cmpint(*(const uint8_t *)&obj->b_1, ==, obj_mixed.b_1);
+    g_assert_cmpint(obj->u64, ==, obj_mixed.u64);
+}
+
+/* The compiled and the interpreted paths must agree, booleans included */
+static void test_mixed(void)
+{
+    TestMixed compiled, interpreted;
+
+    test_mixed_one(true, &compiled, wire_mixed, sizeof(wire_mixed));
+    test_mixed_one(false, &interpreted, wire_mixed, sizeof(wire_mixed));
+    SUCCESS(memcmp(&compiled, &interpreted, sizeof(compiled)));
+    test_mixed_check(&compiled);
+
+    test_mixed_one(true, &compiled, wire_mixed_bool, sizeof(wire_mixed_bool));
+    test_mixed_one(false, &interpreted, wire_mixed_bool,
+                   sizeof(wire_mixed_bool));
+    SUCCESS(memcmp(&compiled, &interpreted, sizeof(compiled)));
+    test_mixed_check(&compiled);
+}
+
 typedef struct TestStruct {
     uint32_t a, b, c, e;
     uint64_t d, f;
@@ -1492,6 +1610,8 @@ int main(int argc, char **argv)
     g_test_init(&argc, &argv, NULL);
     g_test_add_func("/vmstate/simple/primitive", test_simple_primitive);
     g_test_add_func("/vmstate/simple/array", test_simple_array);
+    g_test_add_func("/vmstate/simple/interpreted", test_simple_interpreted);
+    g_test_add_func("/vmstate/mixed", test_mixed);
     g_test_add_func("/vmstate/versioned/load/v1", test_load_v1);
     g_test_add_func("/vmstate/versioned/load/v2", test_load_v2);
     g_test_add_func("/vmstate/field_exists/load/noskip", test_load_noskip);
@@ -14,6 +14,7 @@
 #include "qemu/host-utils.h"
 #include "trace.h"
 #include "crypto/hash.h"
+#include "host/cpuinfo.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
  * array of unsigned longs, but HBitmap is also optimized to provide fast
@@ -101,6 +102,83 @@ struct HBitmap {
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+/*
+ * Kernels for the linear scans over whole arrays of words, which dominate
+ * when working with large, densely populated bitmaps.  The host specific
+ * versions are picked at startup like in util/bufferiszero.c.
+ */
+typedef struct HBitmapAccel {
+    /* Returns the number of set bits in @p[0..n-1] */
+    uint64_t (*count)(const unsigned long *p, size_t n);
+
+    /*
+     * Returns the index of the first word in @p[0..n-1] that is not all
+     * ones, or @n
+     */
+    size_t (*find_not_ones)(const unsigned long *p, size_t n);
+
+    /*
+     * Sets @dst[i] = @a[i] | @b[i] and returns the number of set bits in
+     * @dst[0..n-1]; @dst may alias @a or @b
+     */
+    uint64_t (*or_count)(unsigned long *dst, const unsigned long *a,
+                         const unsigned long *b, size_t n);
+} HBitmapAccel;
+
+static uint64_t hb_count_words_int(const unsigned long *p, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        count += ctpopl(p[i]);
+    }
+    return count;
+}
+
+static size_t hb_find_not_ones_int(const unsigned long *p, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n && p[i] == (unsigned long)-1; i++) {
+        /* continue */
+    }
+    return i;
+}
+
+static uint64_t hb_or_count_int(unsigned long *dst, const unsigned long *a,
+                                const unsigned long *b, size_t n)
+{
+    uint64_t count = 0;
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] | b[i];
+        count += ctpopl(dst[i]);
+    }
+    return count;
+}
+
+#include "host/hbitmap.c.inc"
+
+static const HBitmapAccel *hb_accel;
+static unsigned accel_index;
+
+bool test_hbitmap_next_accel(void)
+{
+    if (accel_index != 0) {
+        hb_accel = &accel_table[--accel_index];
+        return true;
+    }
+    return false;
+}
+
+static void __attribute__((constructor)) init_accel(void)
+{
+    accel_index = best_accel();
+    hb_accel = &accel_table[accel_index];
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -245,9 +323,10 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        pos++;
+        if (pos < sz) {
+            pos += hb_accel->find_not_ones(&last_lev[pos], sz - pos);
+        }
 
         if (pos >= sz) {
             return -1;
@@ -349,60 +428,44 @@ uint64_t hbitmap_count(const HBitmap *hb)
     return hb->count << hb->granularity;
 }
 
-/**
- * hbitmap_iter_next_word:
- * @hbi: HBitmapIter to operate on.
- * @p_cur: Location where to store the next non-zero word.
- *
- * Return the index of the next nonzero word that is set in @hbi's
- * associated HBitmap, and set *p_cur to the content of that word
- * (bits before the index that was passed to hbitmap_iter_init are
- * trimmed on the first call).  Return -1, and set *p_cur to zero,
- * if all remaining words are zero.
- */
-static size_t hbitmap_iter_next_word(HBitmapIter *hbi, unsigned long *p_cur)
-{
-    unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1];
-
-    if (cur == 0) {
-        cur = hbitmap_iter_skip_words(hbi);
-        if (cur == 0) {
-            *p_cur = 0;
-            return -1;
-        }
-    }
-
-    /* The next call will resume work from the next word.  */
-    hbi->cur[HBITMAP_LEVELS - 1] = 0;
-    *p_cur = cur;
-    return hbi->pos;
-}
-
 /* Count the number of set bits between start and end, not accounting for
- * the granularity.  Also an example of how to use hbitmap_iter_next_word.
+ * the granularity.
+ *
+ * Blocks of BITS_PER_LONG words that are all zero are skipped with the help
+ * of the next higher level, the others are counted as a whole, which is
+ * faster than visiting one word after the other for all but very sparse
+ * bitmaps.
  */
 static uint64_t hb_count_between(HBitmap *hb, uint64_t start, uint64_t last)
 {
-    HBitmapIter hbi;
-    uint64_t count = 0;
+    const unsigned long *bits = hb->levels[HBITMAP_LEVELS - 1];
+    const unsigned long *parent = hb->levels[HBITMAP_LEVELS - 2];
     uint64_t end = last + 1;
+    size_t pos = start >> BITS_PER_LEVEL;
+    size_t end_pos = end >> BITS_PER_LEVEL;
+    unsigned long end_mask = (1UL << (end & (BITS_PER_LONG - 1))) - 1;
     unsigned long cur;
-    size_t pos;
+    uint64_t count;
 
-    hbitmap_iter_init(&hbi, hb, start << hb->granularity);
-    for (;;) {
-        pos = hbitmap_iter_next_word(&hbi, &cur);
-        if (pos >= (end >> BITS_PER_LEVEL)) {
-            break;
+    /* Drop bits representing items before START.  */
+    cur = bits[pos] & ~((1UL << (start & (BITS_PER_LONG - 1))) - 1);
+    if (pos == end_pos) {
+        return ctpopl(cur & end_mask);
+    }
+    count = ctpopl(cur);
+
+    for (pos++; pos < end_pos; ) {
+        size_t block_end = MIN(ROUND_UP(pos + 1, BITS_PER_LONG), end_pos);
+
+        if (parent[pos >> BITS_PER_LEVEL]) {
+            count += hb_accel->count(&bits[pos], block_end - pos);
         }
-        count += ctpopl(cur);
+        pos = block_end;
     }
 
-    if (pos == (end >> BITS_PER_LEVEL)) {
+    if (end_mask) {
         /* Drop bits representing the END-th and subsequent items.  */
-        int bit = end & (BITS_PER_LONG - 1);
-        cur &= (1UL << bit) - 1;
-        count += ctpopl(cur);
+        count += ctpopl(bits[end_pos] & end_mask);
     }
 
     return count;
@@ -932,16 +995,18 @@ void hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
     /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
      * It may be possible to improve running times for sparsely populated maps
      * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+     * The dirty count is recomputed on the fly.
      */
     assert(a->size == b->size);
-    for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
+    result->count = hb_accel->or_count(result->levels[HBITMAP_LEVELS - 1],
+                                       a->levels[HBITMAP_LEVELS - 1],
+                                       b->levels[HBITMAP_LEVELS - 1],
+                                       a->sizes[HBITMAP_LEVELS - 1]);
+    for (i = HBITMAP_LEVELS - 2; i >= 0; i--) {
         for (j = 0; j < a->sizes[i]; j++) {
             result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
         }
     }
-
-    /* Recompute the dirty count */
-    result->count = hb_count_between(result, 0, result->size - 1);
 }
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
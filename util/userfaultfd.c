@@ -298,6 +298,40 @@ int uffd_zero_page(int uffd_fd, void *addr, uint64_t length, bool dont_wake)
     return 0;
 }
 
+/**
+ * uffd_continue_page: map range of pages present in the page cache via UFFD-IO
+ *
+ * Map the pages of a shmem or hugetlbfs file that are present in its page
+ * cache to resolve minor page faults within the range.  If the range is
+ * mapped already, e.g. because the fault was resolved concurrently, only
+ * wake up the threads waiting on it.
+ *
+ * Returns 0 on success, negative value in case of an error
+ *
+ * @uffd_fd: UFFD file descriptor
+ * @addr: base address
+ * @length: length of the range to map
+ */
+int uffd_continue_page(int uffd_fd, void *addr, uint64_t length)
+{
+    struct uffdio_continue uffd_continue;
+
+    uffd_continue.range.start = (uintptr_t) addr;
+    uffd_continue.range.len = length;
+    uffd_continue.mode = 0;
+
+    if (ioctl(uffd_fd, UFFDIO_CONTINUE, &uffd_continue)) {
+        if (errno == EEXIST) {
+            return uffd_wakeup(uffd_fd, addr, length);
+        }
+        error_report("uffd_continue_page() failed: addr=%p length=%" PRIu64
+                " errno=%i", addr, length, errno);
+        return -1;
+    }
+
+    return 0;
+}
+
 /**
  * uffd_wakeup: wake up threads waiting on page UFFD-managed page fault resolution
  *
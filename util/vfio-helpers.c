@@ -22,6 +22,7 @@
 #include "standard-headers/linux/pci_regs.h"
 #include "qemu/event_notifier.h"
 #include "qemu/vfio-helpers.h"
+#include "qemu/interval-tree.h"
 #include "qemu/lockable.h"
 #include "trace.h"
 
@@ -46,6 +47,15 @@ struct IOVARange {
     uint64_t end;
 };
 
+typedef struct {
+    /* IOVA range of the mapping, always in QEMUVFIOState.temp_iova */
+    IntervalTreeNode iova_node;
+    /* Host range of the mapping, in QEMUVFIOState.temp_host while in use */
+    IntervalTreeNode host_node;
+    /* Number of qemu_vfio_dma_map() calls not yet released */
+    unsigned refcnt;
+} IOVATempMapping;
+
 struct QEMUVFIOState {
     QemuMutex lock;
 
@@ -90,14 +100,25 @@ struct QEMUVFIOState {
      * - IOVAs in range [low_water_mark, high_water_mark) are free;
      *
      * - IOVAs in range [high_water_mark, QEMU_VFIO_IOVA_MAX) are volatile
-     *   mappings. At each qemu_vfio_dma_reset_temporary() call, the whole area
-     *   is recycled. The caller should make sure I/O's depending on these
-     *   mappings are completed before calling.
+     *   mappings.  They are reference counted and dropped with
+     *   qemu_vfio_dma_release_temporary().  Concurrent users of the same host
+     *   buffer share a mapping.  Released mappings stay mapped (unmapping
+     *   each of them would cost an ioctl per request) until IOVA space or
+     *   DMA mappings run out; then all released mappings are unmapped, with
+     *   one ioctl per run of IOVAs that doesn't contain a mapping in use, and
+     *   their IOVAs are reused.
      **/
     uint64_t low_water_mark;
     uint64_t high_water_mark;
     IOVAMapping *mappings;
     int nr_mappings;
+
+    /* IOVATempMapping.iova_node of all temporary mappings */
+    IntervalTreeRoot temp_iova;
+    /* IOVATempMapping.host_node of temporary mappings in use */
+    IntervalTreeRoot temp_host;
+    /* Number of temporary mappings that are released but still mapped */
+    unsigned nr_released_temp;
 };
 
 /**
@@ -191,14 +212,10 @@ void qemu_vfio_pci_unmap_bar(QEMUVFIOState *s, int index, void *bar,
 }
 
 /**
- * Initialize device IRQ with @irq_type and register an event notifier.
+ * Return the number of vectors that the device supports for @irq_type.
  */
-int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
-                           int irq_type, Error **errp)
+int qemu_vfio_pci_get_irq_count(QEMUVFIOState *s, int irq_type, Error **errp)
 {
-    int r;
-    struct vfio_irq_set *irq_set;
-    size_t irq_set_size;
     struct vfio_irq_info irq_info = { .argsz = sizeof(irq_info) };
 
     irq_info.index = irq_type;
@@ -210,27 +227,97 @@ int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
         error_setg(errp, "Device interrupt doesn't support eventfd");
         return -EINVAL;
     }
+    return irq_info.count;
+}
 
-    irq_set_size = sizeof(*irq_set) + sizeof(int);
-    irq_set = g_malloc0(irq_set_size);
+static int qemu_vfio_pci_set_irq_fds(QEMUVFIOState *s, int irq_type,
+                                     unsigned start, unsigned count,
+                                     const int32_t *fds)
+{
+    g_autofree struct vfio_irq_set *irq_set = NULL;
+    size_t irq_set_size;
 
-    /* Get to a known IRQ state */
+    irq_set_size = sizeof(*irq_set) + count * sizeof(int32_t);
+    irq_set = g_malloc0(irq_set_size);
     *irq_set = (struct vfio_irq_set) {
         .argsz = irq_set_size,
-        .flags = VFIO_IRQ_SET_DATA_EVENTFD | VFIO_IRQ_SET_ACTION_TRIGGER,
-        .index = irq_info.index,
-        .start = 0,
-        .count = 1,
+        .flags = count ? VFIO_IRQ_SET_DATA_EVENTFD : VFIO_IRQ_SET_DATA_NONE,
+        .index = irq_type,
+        .start = start,
+        .count = count,
     };
+    irq_set->flags |= VFIO_IRQ_SET_ACTION_TRIGGER;
+    if (count) {
+        memcpy(&irq_set->data, fds, count * sizeof(int32_t));
+    }
 
-    *(int *)&irq_set->data = event_notifier_get_fd(e);
-    r = ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set);
-    g_free(irq_set);
+    return ioctl(s->device, VFIO_DEVICE_SET_IRQS, irq_set) ? -errno : 0;
+}
+
+/**
+ * Initialize @nr_irqs vectors of the device IRQ with @irq_type and register
+ * an event notifier for the first one.  The other vectors stay unassigned
+ * until qemu_vfio_pci_set_irq() is called for them.
+ */
+int qemu_vfio_pci_init_irqs(QEMUVFIOState *s, EventNotifier *e,
+                            int irq_type, unsigned nr_irqs, Error **errp)
+{
+    g_autofree int32_t *fds = NULL;
+    unsigned i;
+    int r;
+
+    r = qemu_vfio_pci_get_irq_count(s, irq_type, errp);
+    if (r < 0) {
+        return r;
+    }
+    if (nr_irqs < 1 || nr_irqs > r) {
+        error_setg(errp, "Device supports %d interrupt vectors, %u requested",
+                   r, nr_irqs);
+        return -EINVAL;
+    }
+
+    /* Get to a known IRQ state, the vector count can't change while enabled */
+    qemu_vfio_pci_set_irq_fds(s, irq_type, 0, 0, NULL);
+
+    fds = g_new(int32_t, nr_irqs);
+    fds[0] = event_notifier_get_fd(e);
+    for (i = 1; i < nr_irqs; i++) {
+        fds[i] = -1;
+    }
+
+    r = qemu_vfio_pci_set_irq_fds(s, irq_type, 0, nr_irqs, fds);
     if (r) {
-        error_setg_errno(errp, errno, "Failed to setup device interrupt");
-        return -errno;
+        error_setg_errno(errp, -r, "Failed to setup device interrupt");
     }
-    return 0;
+    return r;
+}
+
+/**
+ * Initialize device IRQ with @irq_type and register an event notifier.
+ */
+int qemu_vfio_pci_init_irq(QEMUVFIOState *s, EventNotifier *e,
+                           int irq_type, Error **errp)
+{
+    return qemu_vfio_pci_init_irqs(s, e, irq_type, 1, errp);
+}
+
+/**
+ * Register @e for vector @vector of the device IRQ with @irq_type, which
+ * must have been set up with qemu_vfio_pci_init_irqs().  If @e is NULL, the
+ * vector is unassigned.
+ */
+int qemu_vfio_pci_set_irq(QEMUVFIOState *s, int irq_type, unsigned vector,
+                          EventNotifier *e, Error **errp)
+{
+    int32_t fd = e ? event_notifier_get_fd(e) : -1;
+    int r;
+
+    r = qemu_vfio_pci_set_irq_fds(s, irq_type, vector, 1, &fd);
+    if (r) {
+        error_setg_errno(errp, -r, "Failed to setup device interrupt %u",
+                         vector);
+    }
+    return r;
 }
 
 static int qemu_vfio_pci_read_config(QEMUVFIOState *s, void *buf,
@@ -742,10 +829,188 @@ static bool qemu_vfio_water_mark_reached(QEMUVFIOState *s, size_t size,
     return false;
 }
 
+static bool qemu_vfio_iova_usable(QEMUVFIOState *s, uint64_t start,
+                                  size_t size, uint64_t *iova)
+{
+    int i;
+
+    for (i = 0; i < s->nb_iova_ranges; i++) {
+        uint64_t lo = MAX(start, s->usable_iova_ranges[i].start);
+
+        if (lo <= s->usable_iova_ranges[i].end &&
+            s->usable_iova_ranges[i].end - lo + 1 >= size) {
+            *iova = lo;
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Find @size bytes of IOVA space between the temporary mappings that are
+ * still mapped.  Called with s->lock held.
+ */
+static bool qemu_vfio_find_temp_hole(QEMUVFIOState *s, size_t size,
+                                     uint64_t *iova)
+{
+    uint64_t start = s->high_water_mark;
+    IntervalTreeNode *node;
+
+    node = interval_tree_iter_first(&s->temp_iova, start,
+                                    QEMU_VFIO_IOVA_MAX - 1);
+    for (; node; node = interval_tree_iter_next(node, start,
+                                                QEMU_VFIO_IOVA_MAX - 1)) {
+        if (node->start > start &&
+            qemu_vfio_iova_usable(s, start, size, iova) &&
+            *iova + size <= node->start) {
+            return true;
+        }
+        start = MAX(start, node->last + 1);
+    }
+    return QEMU_VFIO_IOVA_MAX - start >= size &&
+           qemu_vfio_iova_usable(s, start, size, iova) &&
+           *iova + size <= QEMU_VFIO_IOVA_MAX;
+}
+
+static int qemu_vfio_do_unmapping(QEMUVFIOState *s, uint64_t iova,
+                                  uint64_t size)
+{
+    struct vfio_iommu_type1_dma_unmap unmap = {
+        .argsz = sizeof(unmap),
+        .flags = 0,
+        .iova = iova,
+        .size = size,
+    };
+
+    if (ioctl(s->container, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
+        error_report("VFIO_UNMAP_DMA failed: %s", strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+/*
+ * Unmap all released temporary mappings.  A single VFIO_IOMMU_UNMAP_DMA covers
+ * each run of released mappings that is not interrupted by a mapping in use.
+ * Called with s->lock held.
+ */
+static int qemu_vfio_reclaim_temp(QEMUVFIOState *s)
+{
+    IntervalTreeNode *node, *next;
+    uint64_t run_start = 0, run_last = 0;
+    bool in_run = false;
+    int ret = 0;
+
+    if (!s->nr_released_temp) {
+        return 0;
+    }
+    trace_qemu_vfio_reclaim_temp(s, s->nr_released_temp);
+
+    node = interval_tree_iter_first(&s->temp_iova, 0, UINT64_MAX);
+    for (; node; node = next) {
+        IOVATempMapping *m = container_of(node, IOVATempMapping, iova_node);
+
+        next = interval_tree_iter_next(node, 0, UINT64_MAX);
+        if (m->refcnt) {
+            if (in_run) {
+                ret = ret ?: qemu_vfio_do_unmapping(s, run_start,
+                                                    run_last - run_start + 1);
+                in_run = false;
+            }
+            continue;
+        }
+
+        if (!in_run) {
+            run_start = node->start;
+            in_run = true;
+        }
+        run_last = node->last;
+        interval_tree_remove(node, &s->temp_iova);
+        s->nr_released_temp--;
+        g_free(m);
+    }
+    if (in_run) {
+        ret = ret ?: qemu_vfio_do_unmapping(s, run_start,
+                                            run_last - run_start + 1);
+    }
+    assert(s->nr_released_temp == 0);
+
+    /* Give back the IOVA space below the lowest remaining mapping */
+    node = interval_tree_iter_first(&s->temp_iova, 0, UINT64_MAX);
+    s->high_water_mark = node ? node->start : QEMU_VFIO_IOVA_MAX;
+    return ret;
+}
+
+/* Called with s->lock held */
+static int qemu_vfio_dma_map_temp(QEMUVFIOState *s, void *host, size_t size,
+                                  uint64_t *iova, Error **errp)
+{
+    uintptr_t start = (uintptr_t)host;
+    IntervalTreeNode *node;
+    IOVATempMapping *m;
+    bool reclaimed = false;
+    Error *local_err = NULL;
+    int ret;
+
+    /* Share a mapping of the same buffer that is still in use */
+    node = interval_tree_iter_first(&s->temp_host, start, start + size - 1);
+    for (; node; node = interval_tree_iter_next(node, start,
+                                                start + size - 1)) {
+        if (node->start <= start && start + size - 1 <= node->last) {
+            m = container_of(node, IOVATempMapping, host_node);
+            m->refcnt++;
+            *iova = m->iova_node.start + (start - node->start);
+            trace_qemu_vfio_dma_map_temp_hit(s, host, *iova);
+            return 0;
+        }
+    }
+
+retry:
+    if (!qemu_vfio_find_temp_hole(s, size, iova) &&
+        (qemu_vfio_water_mark_reached(s, size, NULL) ||
+         !qemu_vfio_find_temp_iova(s, size, iova, NULL))) {
+        if (!reclaimed && s->nr_released_temp) {
+            reclaimed = true;
+            qemu_vfio_reclaim_temp(s);
+            goto retry;
+        }
+        error_setg(errp, "temporary iova range not found");
+        return -ENOMEM;
+    }
+
+    ret = qemu_vfio_do_mapping(s, host, size, *iova, &local_err);
+    if ((ret == -ENOMEM || ret == -ENOSPC) &&
+        !reclaimed && s->nr_released_temp) {
+        /* Too many DMA mappings in the container */
+        error_free(local_err);
+        local_err = NULL;
+        reclaimed = true;
+        qemu_vfio_reclaim_temp(s);
+        goto retry;
+    }
+    if (ret < 0) {
+        error_propagate(errp, local_err);
+        return ret;
+    }
+
+    m = g_new0(IOVATempMapping, 1);
+    m->refcnt = 1;
+    m->iova_node.start = *iova;
+    m->iova_node.last = *iova + size - 1;
+    m->host_node.start = start;
+    m->host_node.last = start + size - 1;
+    interval_tree_insert(&m->iova_node, &s->temp_iova);
+    interval_tree_insert(&m->host_node, &s->temp_host);
+    return 0;
+}
+
 /* Map [host, host + size) area into a contiguous IOVA address space, and store
  * the result in @iova if not NULL. The caller need to make sure the area is
  * aligned to page size, and mustn't overlap with existing mapping areas (split
  * mapping status within this area is not allowed).
+ *
+ * A @temporary mapping must be released with qemu_vfio_dma_release_temporary()
+ * once the device doesn't access it any more.  @iova must not be NULL then.
  */
 int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
                       bool temporary, uint64_t *iova, Error **errp)
@@ -764,10 +1029,10 @@ int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
     } else {
         int ret;
 
-        if (qemu_vfio_water_mark_reached(s, size, errp)) {
-            return -ENOMEM;
-        }
         if (!temporary) {
+            if (qemu_vfio_water_mark_reached(s, size, errp)) {
+                return -ENOMEM;
+            }
             if (!qemu_vfio_find_fixed_iova(s, size, &iova0, errp)) {
                 return -ENOMEM;
             }
@@ -781,10 +1046,8 @@ int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
             }
             qemu_vfio_dump_mappings(s);
         } else {
-            if (!qemu_vfio_find_temp_iova(s, size, &iova0, errp)) {
-                return -ENOMEM;
-            }
-            ret = qemu_vfio_do_mapping(s, host, size, iova0, errp);
+            assert(iova);
+            ret = qemu_vfio_dma_map_temp(s, host, size, &iova0, errp);
             if (ret < 0) {
                 return ret;
             }
@@ -797,23 +1060,39 @@ int qemu_vfio_dma_map(QEMUVFIOState *s, void *host, size_t size,
     return 0;
 }
 
-/* Reset the high watermark and free all "temporary" mappings. */
+/*
+ * Release a temporary mapping that qemu_vfio_dma_map() returned @iova for.
+ * Does nothing if @iova belongs to a fixed mapping.
+ */
+void qemu_vfio_dma_release_temporary(QEMUVFIOState *s, uint64_t iova)
+{
+    IntervalTreeNode *node;
+    IOVATempMapping *m;
+
+    QEMU_LOCK_GUARD(&s->lock);
+    node = interval_tree_iter_first(&s->temp_iova, iova, iova);
+    if (!node) {
+        return;
+    }
+
+    m = container_of(node, IOVATempMapping, iova_node);
+    assert(m->refcnt > 0);
+    if (--m->refcnt == 0) {
+        /*
+         * The buffer may be freed now and its address reused for different
+         * pages, so the mapping must not be shared with later users.
+         */
+        interval_tree_remove(&m->host_node, &s->temp_host);
+        s->nr_released_temp++;
+    }
+}
+
+/* Unmap all released temporary mappings and reuse their IOVAs. */
 int qemu_vfio_dma_reset_temporary(QEMUVFIOState *s)
 {
-    struct vfio_iommu_type1_dma_unmap unmap = {
-        .argsz = sizeof(unmap),
-        .flags = 0,
-        .iova = s->high_water_mark,
-        .size = QEMU_VFIO_IOVA_MAX - s->high_water_mark,
-    };
     trace_qemu_vfio_dma_reset_temporary(s);
     QEMU_LOCK_GUARD(&s->lock);
-    if (ioctl(s->container, VFIO_IOMMU_UNMAP_DMA, &unmap)) {
-        error_report("VFIO_UNMAP_DMA failed: %s", strerror(errno));
-        return -errno;
-    }
-    s->high_water_mark = QEMU_VFIO_IOVA_MAX;
-    return 0;
+    return qemu_vfio_reclaim_temp(s);
 }
 
 /* Unmapping the whole area that was previously mapped with
@@ -856,6 +1135,19 @@ void qemu_vfio_close(QEMUVFIOState *s)
         qemu_vfio_undo_mapping(s, &s->mappings[i], NULL);
     }
 
+    /* Closing the container drops the temporary mappings */
+    while (!interval_tree_is_empty(&s->temp_iova)) {
+        IntervalTreeNode *node =
+            interval_tree_iter_first(&s->temp_iova, 0, UINT64_MAX);
+        IOVATempMapping *m = container_of(node, IOVATempMapping, iova_node);
+
+        interval_tree_remove(node, &s->temp_iova);
+        if (m->refcnt) {
+            interval_tree_remove(&m->host_node, &s->temp_host);
+        }
+        g_free(m);
+    }
+
     g_free(s->usable_iova_ranges);
     s->nb_iova_ranges = 0;
     qemu_vfio_reset(s);